@@ -0,0 +1,59 @@
+precision highp float;
+
+// EffectsChain: sharpen, LUT grade, overlay. EffectsChain::applyCpu() is the
+// reference for this shader, keep the two in step.
+
+uniform sampler2D src_tex_unit0;
+uniform sampler2D lut;				// lutSize slices of lutSize x lutSize side by side, blue picks the slice
+uniform sampler2D overlay;
+
+uniform vec2 texelSize;
+uniform float lutSize;
+uniform float lutStrength;
+uniform float sharpenAmount;
+uniform float overlayOpacity;
+
+varying vec2 texCoordVarying;
+
+vec3 applyLut(vec3 c)
+{
+	float slice = c.b * (lutSize - 1.0);
+	float slice0 = floor(slice);
+	float slice1 = min(slice0 + 1.0, lutSize - 1.0);
+	vec2 rg = (c.rg * (lutSize - 1.0) + 0.5) / vec2(lutSize * lutSize, lutSize);
+	vec3 c0 = texture2D(lut, rg + vec2(slice0 / lutSize, 0.0)).rgb;
+	vec3 c1 = texture2D(lut, rg + vec2(slice1 / lutSize, 0.0)).rgb;
+	return mix(c0, c1, slice - slice0);
+}
+
+void main()
+{
+	vec2 uv = texCoordVarying;
+	vec3 c = texture2D(src_tex_unit0, uv).rgb;
+
+	if (sharpenAmount > 0.0)
+	{
+		// Unsharp mask against a 1 2 1 binomial blur
+		vec2 dx = vec2(texelSize.x, 0.0);
+		vec2 dy = vec2(0.0, texelSize.y);
+		vec3 edges = texture2D(src_tex_unit0, uv - dx).rgb + texture2D(src_tex_unit0, uv + dx).rgb
+				   + texture2D(src_tex_unit0, uv - dy).rgb + texture2D(src_tex_unit0, uv + dy).rgb;
+		vec3 corners = texture2D(src_tex_unit0, uv - dx - dy).rgb + texture2D(src_tex_unit0, uv + dx - dy).rgb
+					 + texture2D(src_tex_unit0, uv - dx + dy).rgb + texture2D(src_tex_unit0, uv + dx + dy).rgb;
+		vec3 blur = (c * 4.0 + edges * 2.0 + corners) / 16.0;
+		c = clamp(c + sharpenAmount * (c - blur), 0.0, 1.0);
+	}
+
+	if (lutStrength > 0.0)
+	{
+		c = mix(c, applyLut(c), lutStrength);
+	}
+
+	if (overlayOpacity > 0.0)
+	{
+		vec4 o = texture2D(overlay, uv);
+		c = mix(c, o.rgb, o.a * overlayOpacity);
+	}
+
+	gl_FragColor = vec4(c, 1.0);
+}
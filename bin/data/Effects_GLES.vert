@@ -0,0 +1,16 @@
+attribute vec4 position;
+attribute vec4 color;
+attribute vec4 normal;
+attribute vec2 texcoord;
+
+uniform mat4 modelViewMatrix;
+uniform mat4 projectionMatrix;
+
+varying vec2 texCoordVarying;
+
+
+void main()
+{
+	gl_Position = projectionMatrix * modelViewMatrix * position;
+	texCoordVarying = texcoord;
+}
@@ -0,0 +1,109 @@
+/*
+ *  AtomicFile.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "AtomicFile.h"
+#include "TimelineTrace.h"
+
+#include <fcntl.h>
+
+string atomicFileTempPath(const string& path)
+{
+	return path + ATOMIC_FILE_SUFFIX;
+}
+
+/**
+ * Open the temp file that will become path
+ *
+ * @param path Final path
+ * @return File open for writing, NULL on failure
+ */
+FILE* atomicFileOpen(const string& path)
+{
+	return fopen(atomicFileTempPath(path).c_str(), "wb");
+}
+
+/**
+ * Make the temp file durable and move it to path
+ *
+ * @param file From atomicFileOpen(), always closed
+ * @param path Final path
+ * @param size Bytes of real data; anything past it (preallocation) is trimmed
+ * @return true if path now holds the complete file
+ */
+bool atomicFileCommit(FILE* file, const string& path, uint64_t size)
+{
+	TIMELINE_SCOPE("atomicFileCommit");
+	string tempPath = atomicFileTempPath(path);
+	int fd = fileno(file);
+
+	bool success = fflush(file) == 0;
+	success = success && ftruncate(fd, size) == 0;
+	{
+		TIMELINE_SCOPE("fsync");
+		success = success && fdatasync(fd) == 0;
+	}
+	success = (fclose(file) == 0) && success;
+	if (!success)
+	{
+		int error = errno;
+		ofLogError() << "Could not flush " << tempPath << " (errno " << error << ")";
+		unlink(tempPath.c_str());
+		return false;
+	}
+
+	if (rename(tempPath.c_str(), path.c_str()) != 0)
+	{
+		int error = errno;
+		ofLogError() << "Could not rename " << tempPath << " (errno " << error << ")";
+		unlink(tempPath.c_str());
+		return false;
+	}
+
+	// The rename itself lives in the directory
+	string directory = path.substr(0, path.rfind('/'));
+	int directoryFd = open(directory.empty() ? "/" : directory.c_str(), O_RDONLY | O_DIRECTORY);
+	if (directoryFd >= 0)
+	{
+		fsync(directoryFd);
+		::close(directoryFd);
+	}
+	return true;
+}
+
+/**
+ * Throw away a file from atomicFileOpen()
+ *
+ * @param file Closed here
+ * @param path Final path it would have had
+ */
+void atomicFileDiscard(FILE* file, const string& path)
+{
+	fclose(file);
+	unlink(atomicFileTempPath(path).c_str());
+}
+
+/**
+ * Write a whole buffer to path atomically
+ *
+ * @param path Final path
+ * @param data Contents
+ * @param size Bytes in data
+ * @return true if path now holds data
+ */
+bool atomicFileWrite(const string& path, const void* data, size_t size)
+{
+	FILE* file = atomicFileOpen(path);
+	if (!file)
+	{
+		return false;
+	}
+	if (fwrite(data, 1, size, file) != size)
+	{
+		atomicFileDiscard(file, path);
+		return false;
+	}
+	return atomicFileCommit(file, path, size);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Crash-safe file replacement. Data goes to "<path>.tmp"; commit flushes
+ it to the card, renames it over path and syncs the directory, so after
+ a power cut path either doesn't exist or is complete. Leftover .tmp
+ files are deleted by StorageManager::setup().
+ */
+
+#define ATOMIC_FILE_SUFFIX ".tmp"
+
+string atomicFileTempPath(const string& path);
+FILE* atomicFileOpen(const string& path);
+bool atomicFileCommit(FILE* file, const string& path, uint64_t size);
+void atomicFileDiscard(FILE* file, const string& path);
+bool atomicFileWrite(const string& path, const void* data, size_t size);
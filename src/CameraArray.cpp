@@ -0,0 +1,240 @@
+/*
+ *  CameraArray.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "CameraArray.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
+
+#include <sys/time.h>
+
+CameraArrayWorker::CameraArrayWorker()
+{
+	camera = NULL;
+	barrier = NULL;
+	groupId = 0;
+	succeeded = false;
+}
+
+void CameraArrayWorker::threadedFunction()
+{
+	TimelineTrace::getInstance().nameCurrentThread("CameraArray trigger");
+
+	// Everything slow (file open, EXIF, buffer submission) was done before the
+	// barrier, so the cameras are released within a scheduler wakeup of each other
+	pthread_barrier_wait(barrier);
+	bool triggered = camera->triggerCapture();
+	succeeded = camera->finishCapture(groupId) && triggered;
+}
+
+CameraArray::CameraArray()
+{
+	settleMillis = 5000;
+	storage = NULL;
+	metadataLog = NULL;
+	lastTriggerSkewMicros = 0;
+	lastCompletionSkewMicros = 0;
+	triggerSkew = NULL;
+	nextGroupId = 0;
+	setupMicros = 0;
+}
+
+CameraArray::~CameraArray()
+{
+	for (size_t i=0; i<workers.size(); i++)
+	{
+		delete workers[i];
+	}
+	for (size_t i=0; i<cameras.size(); i++)
+	{
+		delete cameras[i];
+	}
+	for (size_t i=0; i<publishers.size(); i++)
+	{
+		delete publishers[i];
+	}
+}
+
+void CameraArray::setup(int numCameras, string catalogPath)
+{
+	vector<int> cameraNums;
+	for (int i=0; i<numCameras; i++)
+	{
+		cameraNums.push_back(i);
+	}
+	setup(cameraNums, catalogPath);
+}
+
+/**
+ * Create and start every camera in parallel, returning once all are ready
+ *
+ * @param cameraNums MMAL camera indices to open
+ * @param catalogPath Catalog shared by all cameras
+ */
+void CameraArray::setup(vector<int> cameraNums, string catalogPath)
+{
+	catalog.setup(catalogPath);
+
+	for (size_t i=0; i<cameraNums.size(); i++)
+	{
+		ofxRaspicam* camera = new ofxRaspicam();
+		camera->cameraNum = cameraNums[i];
+		camera->fileSuffix = "-cam" + ofToString(cameraNums[i]);
+		camera->catalog = &catalog;
+		camera->storage = storage;
+		camera->metadataLog = metadataLog;
+		if (!publishPrefix.empty())
+		{
+			FramePublisher* publisher = new FramePublisher();
+			if (publisher->setup(publishPrefix + ofToString(cameraNums[i]), 4, 6*1024*1024, camera->metricsLabels()))
+			{
+				camera->publisher = publisher;
+			}
+			publishers.push_back(publisher);
+		}
+		// Nothing draws these cameras' lastImage, skip a full decode per camera and trigger
+		camera->loadLastImage = false;
+		camera->setupAsync();
+		cameras.push_back(camera);
+		workers.push_back(new CameraArrayWorker());
+
+		CameraThroughput stats;
+		stats.cameraNum = cameraNums[i];
+		stats.captures = 0;
+		stats.failures = 0;
+		stats.bytes = 0;
+		stats.meanLatencyMs = 0;
+		stats.capturesPerMinute = 0;
+		stats.megabytesPerMinute = 0;
+		throughput.push_back(stats);
+		latencySumMs.push_back(0);
+	}
+
+	for (size_t i=0; i<cameras.size(); i++)
+	{
+		cameras[i]->waitUntilReady();
+		if (!cameras[i]->isReady())
+		{
+			ofLogError() << "CameraArray: camera " << cameras[i]->cameraNum << " failed to start";
+		}
+	}
+
+	static const double skewBoundsMicros[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000};
+	triggerSkew = MetricsRegistry::getInstance().addHistogram("camera_array_trigger_skew_us", "Spread of synchronized capture triggers", skewBoundsMicros, sizeof(skewBoundsMicros)/sizeof(double));
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	nextGroupId = (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
+	setupMicros = ofGetElapsedTimeMicros();
+}
+
+/**
+ * Capture one frame from every ready camera at the same moment
+ *
+ * @return true if every camera wrote a complete frame
+ */
+bool CameraArray::captureSynchronized()
+{
+	TIMELINE_SCOPE("captureSynchronized");
+
+	// Cameras settle side by side, so one shared deadline bounds the whole wait
+	unsigned long long settleStart = ofGetElapsedTimeMicros();
+	for (size_t i=0; i<cameras.size(); i++)
+	{
+		if (cameras[i]->isReady())
+		{
+			int elapsedMillis = (ofGetElapsedTimeMicros() - settleStart) / 1000;
+			cameras[i]->settle(max(0, settleMillis - elapsedMillis));
+		}
+	}
+
+	vector<ofxRaspicam*> armed;
+	vector<CameraArrayWorker*> armedWorkers;
+	for (size_t i=0; i<cameras.size(); i++)
+	{
+		if (cameras[i]->isReady() && cameras[i]->prepareCapture())
+		{
+			armed.push_back(cameras[i]);
+			armedWorkers.push_back(workers[i]);
+		}
+		else
+		{
+			throughput[i].failures++;
+		}
+	}
+	if (armed.empty())
+	{
+		return false;
+	}
+
+	uint64_t groupId = nextGroupId++;
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, armed.size());
+
+	for (size_t i=0; i<armedWorkers.size(); i++)
+	{
+		armedWorkers[i]->camera = armed[i];
+		armedWorkers[i]->barrier = &barrier;
+		armedWorkers[i]->groupId = groupId;
+		armedWorkers[i]->succeeded = false;
+		armedWorkers[i]->startThread(false, false);
+	}
+	for (size_t i=0; i<armedWorkers.size(); i++)
+	{
+		armedWorkers[i]->waitForThread(false);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	unsigned long long minTrigger = ULLONG_MAX, maxTrigger = 0;
+	unsigned long long minComplete = ULLONG_MAX, maxComplete = 0;
+	bool allSucceeded = (armed.size() == cameras.size());
+
+	for (size_t i=0; i<cameras.size(); i++)
+	{
+		CameraArrayWorker* worker = workers[i];
+		if (find(armedWorkers.begin(), armedWorkers.end(), worker) == armedWorkers.end())
+		{
+			continue;
+		}
+		const CaptureInfo& info = cameras[i]->lastCapture;
+		if (!worker->succeeded)
+		{
+			throughput[i].failures++;
+			allSucceeded = false;
+			continue;
+		}
+		minTrigger = min(minTrigger, info.triggerMicros);
+		maxTrigger = max(maxTrigger, info.triggerMicros);
+		minComplete = min(minComplete, info.completeMicros);
+		maxComplete = max(maxComplete, info.completeMicros);
+
+		throughput[i].captures++;
+		throughput[i].bytes += info.bytes;
+		latencySumMs[i] += (info.completeMicros - info.triggerMicros) / 1000.0;
+	}
+
+	if (maxTrigger >= minTrigger && minTrigger != ULLONG_MAX)
+	{
+		lastTriggerSkewMicros = maxTrigger - minTrigger;
+		lastCompletionSkewMicros = maxComplete - minComplete;
+		triggerSkew->observe(lastTriggerSkewMicros);
+		TRACE_NOTICE("Synchronized capture %d cameras, trigger skew %dus, completion skew %dus",
+					 (int)armed.size(), (int)lastTriggerSkewMicros, (int)lastCompletionSkewMicros);
+	}
+	return allSucceeded;
+}
+
+vector<CameraThroughput> CameraArray::getThroughput()
+{
+	double minutes = (ofGetElapsedTimeMicros() - setupMicros) / 60000000.0;
+	for (size_t i=0; i<throughput.size(); i++)
+	{
+		CameraThroughput& stats = throughput[i];
+		stats.meanLatencyMs = stats.captures ? latencySumMs[i] / stats.captures : 0;
+		stats.capturesPerMinute = minutes > 0 ? stats.captures / minutes : 0;
+		stats.megabytesPerMinute = minutes > 0 ? (stats.bytes / (1024.0 * 1024.0)) / minutes : 0;
+	}
+	return throughput;
+}
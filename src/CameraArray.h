@@ -0,0 +1,65 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ofxRaspicam.h"
+#include "PhotoCatalog.h"
+
+/*
+ Owns one ofxRaspicam per camera port (compute module boards have two).
+ Each camera keeps its own encoder pool, callback data and output file;
+ they share one PhotoCatalog. captureSynchronized() releases every
+ camera's trigger from a barrier and reports the measured skew.
+ */
+
+class CameraArrayWorker : public ofThread
+{
+public:
+	CameraArrayWorker();
+	void threadedFunction();
+
+	ofxRaspicam* camera;
+	pthread_barrier_t* barrier;
+	uint64_t groupId;
+	bool succeeded;
+};
+
+struct CameraThroughput
+{
+	int cameraNum;
+	int captures;
+	int failures;
+	uint64_t bytes;
+	double meanLatencyMs;				// trigger to frame end
+	double capturesPerMinute;			// since setup
+	double megabytesPerMinute;
+};
+
+class CameraArray
+{
+public:
+	CameraArray();
+	~CameraArray();
+	void setup(int numCameras, string catalogPath);
+	void setup(vector<int> cameraNums, string catalogPath);
+	bool captureSynchronized();
+	vector<CameraThroughput> getThroughput();
+
+	vector<ofxRaspicam*> cameras;
+	PhotoCatalog catalog;
+	StorageManager* storage;			// optional, set before setup() to share one quota across cameras
+	FrameMetadataLog* metadataLog;		// optional, set before setup() to log every camera's frames together
+	string publishPrefix;				// optional, set before setup() and camera n publishes frames to <prefix>n
+	int settleMillis;					// longest AE/AWB wait before each synchronized capture, like Photo::timeout
+
+	double lastTriggerSkewMicros;		// spread of MMAL_PARAMETER_CAPTURE calls across cameras
+	double lastCompletionSkewMicros;	// spread of frame end across cameras
+
+private:
+	vector<CameraArrayWorker*> workers;
+	vector<FramePublisher*> publishers;
+	vector<CameraThroughput> throughput;
+	vector<double> latencySumMs;
+	MetricsHistogram* triggerSkew;
+	uint64_t nextGroupId;
+	unsigned long long setupMicros;
+};
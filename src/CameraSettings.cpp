@@ -8,6 +8,7 @@
  */
 
 #include "CameraSettings.h"
+#include "TraceLog.h"
 
 /**
  * Convert a MMAL status return value to a simple boolean of success
@@ -24,22 +25,22 @@ int mmal_status_to_int(MMAL_STATUS_T status)
 	{
 		switch (status)
 		{
-			case MMAL_ENOMEM :   ofLogVerbose() << "Out of memory"; break;
-			case MMAL_ENOSPC :   ofLogVerbose() << "Out of resources (other than memory)"; break;
-			case MMAL_EINVAL:    ofLogVerbose() << "Argument is invalid"; break;
-			case MMAL_ENOSYS :   ofLogVerbose() << "Function not implemented"; break;
-			case MMAL_ENOENT :   ofLogVerbose() << "No such file or directory"; break;
-			case MMAL_ENXIO :    ofLogVerbose() << "No such device or address"; break;
-			case MMAL_EIO :      ofLogVerbose() << "I/O error"; break;
-			case MMAL_ESPIPE :   ofLogVerbose() << "Illegal seek"; break;
-			case MMAL_ECORRUPT : ofLogVerbose() << "Data is corrupt \attention FIXME: not POSIX"; break;
-			case MMAL_ENOTREADY :ofLogVerbose() << "Component is not ready \attention FIXME: not POSIX"; break;
-			case MMAL_ECONFIG :  ofLogVerbose() << "Component is not configured \attention FIXME: not POSIX"; break;
-			case MMAL_EISCONN :  ofLogVerbose() << "Port is already connected "; break;
-			case MMAL_ENOTCONN : ofLogVerbose() << "Port is disconnected"; break;
-			case MMAL_EAGAIN :   ofLogVerbose() << "Resource temporarily unavailable. Try again later"; break;
-			case MMAL_EFAULT :   ofLogVerbose() << "Bad address"; break;
-			default :            ofLogVerbose() << "Unknown status error"; break;
+			case MMAL_ENOMEM :   TRACE_ERROR("MMAL status: Out of memory"); break;
+			case MMAL_ENOSPC :   TRACE_ERROR("MMAL status: Out of resources (other than memory)"); break;
+			case MMAL_EINVAL:    TRACE_ERROR("MMAL status: Argument is invalid"); break;
+			case MMAL_ENOSYS :   TRACE_ERROR("MMAL status: Function not implemented"); break;
+			case MMAL_ENOENT :   TRACE_ERROR("MMAL status: No such file or directory"); break;
+			case MMAL_ENXIO :    TRACE_ERROR("MMAL status: No such device or address"); break;
+			case MMAL_EIO :      TRACE_ERROR("MMAL status: I/O error"); break;
+			case MMAL_ESPIPE :   TRACE_ERROR("MMAL status: Illegal seek"); break;
+			case MMAL_ECORRUPT : TRACE_ERROR("MMAL status: Data is corrupt \attention FIXME: not POSIX"); break;
+			case MMAL_ENOTREADY :TRACE_ERROR("MMAL status: Component is not ready \attention FIXME: not POSIX"); break;
+			case MMAL_ECONFIG :  TRACE_ERROR("MMAL status: Component is not configured \attention FIXME: not POSIX"); break;
+			case MMAL_EISCONN :  TRACE_ERROR("MMAL status: Port is already connected "); break;
+			case MMAL_ENOTCONN : TRACE_ERROR("MMAL status: Port is disconnected"); break;
+			case MMAL_EAGAIN :   TRACE_ERROR("MMAL status: Resource temporarily unavailable. Try again later"); break;
+			case MMAL_EFAULT :   TRACE_ERROR("MMAL status: Bad address"); break;
+			default :            TRACE_ERROR("MMAL status: Unknown status error"); break;
 		}
 		
 		return 1;
@@ -111,7 +112,7 @@ void CameraSettings::set_saturation(int saturation)
 	}
 	else
 	{
-		ofLog(OF_LOG_ERROR, "Invalid saturation value");
+		TRACE_ERROR("Invalid saturation value");
 		
 	}
 	
@@ -136,7 +137,7 @@ void CameraSettings::set_sharpness(int sharpness)
 	}
 	else
 	{
-		ofLog(OF_LOG_ERROR, "Invalid sharpness value");
+		TRACE_ERROR("Invalid sharpness value");
 		
 	}
 	
@@ -162,7 +163,7 @@ void CameraSettings::set_contrast(int contrast)
 	}
 	else
 	{
-		ofLog(OF_LOG_ERROR, "Invalid contrast value");
+		TRACE_ERROR("Invalid contrast value");
 		
 	}
 	
@@ -188,7 +189,7 @@ void CameraSettings::set_brightness(int brightness)
 	}
 	else
 	{
-		ofLog(OF_LOG_ERROR, "Invalid brightness value");
+		TRACE_ERROR("Invalid brightness value");
 		
 	}
 	
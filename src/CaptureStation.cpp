@@ -0,0 +1,461 @@
+/*
+ *  CaptureStation.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "CaptureStation.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
+
+#include <signal.h>
+#include <sys/time.h>
+
+int CaptureStation::commandPipe[2] = {-1, -1};
+
+CaptureCommandThread::CaptureCommandThread()
+{
+	station = NULL;
+}
+
+void CaptureCommandThread::threadedFunction()
+{
+	TimelineTrace::getInstance().nameCurrentThread("commands");
+	station->processCommands();
+}
+
+CaptureStation::CaptureStation()
+{
+	cameraReady = false;
+	memset(&reportCounters, 0, sizeof(reportCounters));
+}
+
+static void onExitSignal(int signal)
+{
+	CaptureStation::requestExit();
+}
+
+/**
+ * Wire up the camera and its collaborators and start it in the background
+ *
+ * @param keyListener Receives console commands, e.g. to run GL ones itself and
+ * queueCommand() the rest; NULL queues them all for run()
+ */
+void CaptureStation::setup(SSHKeyListener* keyListener)
+{
+	bool headless = (keyListener == NULL);
+	if (commandPipe[0] < 0 && pipe(commandPipe) != 0)
+	{
+		ofLogError() << "Could not create the command pipe";
+	}
+	if (getenv("CAMERA_APP_TIMELINE"))
+	{
+		// Record from launch so setup() shows up in the timeline
+		TimelineTrace::getInstance().start();
+	}
+	processStats.setup();
+	reportCounters = processStats.startCounters;
+	
+	// Commands from the SSH console, or a FIFO when running as a service: echo e > /tmp/mmalCameraApp.cmd
+	consoleListener.setup(headless ? this : keyListener, getenv("CAMERA_APP_COMMAND_FIFO") ? getenv("CAMERA_APP_COMMAND_FIFO") : "");
+	consoleListener.startThread(false, false);
+	
+	catalog.setup(ofToDataPath("photos/catalog.tsv", true));
+	cameraController.catalog = &catalog;
+	// No quota by default. CAMERA_APP_MIN_FREE_MB rotates out the oldest photos to keep that much of the card free,
+	// uploaded or not. Photos stay flat in photos/, where SlideShow lists them, unless CAMERA_APP_DATE_SHARDS is set
+	if (getenv("CAMERA_APP_MIN_FREE_MB"))
+	{
+		storage.minFreeBytes = (uint64_t)ofToInt(getenv("CAMERA_APP_MIN_FREE_MB")) * 1024 * 1024;
+	}
+	storage.catalog = &catalog;
+	storage.setup(ofToDataPath("photos", true), 0, 0, getenv("CAMERA_APP_DATE_SHARDS") != NULL);
+	storage.discardIncomplete(catalog);
+	cameraController.storage = &storage;
+	// Exposure time, gains and frame timestamps of every photo, mmap with FrameMetadataReader
+	if (frameMetadata.open(ofToDataPath("photos/frames.meta", true)))
+	{
+		cameraController.metadataLog = &frameMetadata;
+	}
+	// Share every frame with local processes (see tools/frameSubscriber), e.g. CAMERA_APP_PUBLISH=/mmalCameraApp-cam0
+	if (getenv("CAMERA_APP_PUBLISH") && framePublisher.setup(getenv("CAMERA_APP_PUBLISH"), 4, 6*1024*1024, cameraController.metricsLabels()))
+	{
+		cameraController.publisher = &framePublisher;
+	}
+	// Hold JPEGs to an average size (bytes) or write rate (bytes/s) instead of a fixed Q factor
+	if (getenv("CAMERA_APP_JPEG_BUDGET") || getenv("CAMERA_APP_JPEG_BANDWIDTH"))
+	{
+		qualityController.setup(getenv("CAMERA_APP_JPEG_BUDGET") ? ofToInt(getenv("CAMERA_APP_JPEG_BUDGET")) : 0, 90, cameraController.metricsLabels());
+		if (getenv("CAMERA_APP_JPEG_BANDWIDTH"))
+		{
+			qualityController.setBandwidth(ofToInt(getenv("CAMERA_APP_JPEG_BANDWIDTH")));
+		}
+		cameraController.setQuality(qualityController.quality);
+		cameraController.qualityController = &qualityController;
+	}
+	// Laplacian focus score in the catalog and exposure statistics as metrics, nearly free when lastImage is decoded anyway.
+	// With CAMERA_APP_MIN_FOCUS blurred stills are retaken, headless runs then decode each still to score it
+	cameraController.scoreFocus = !headless;
+	cameraController.measureStatistics = !headless;
+	if (getenv("CAMERA_APP_MIN_FOCUS"))
+	{
+		cameraController.minFocusScore = ofToFloat(getenv("CAMERA_APP_MIN_FOCUS"));
+		cameraController.blurPolicy = ofxRaspicam::BLUR_RETAKE;
+	}
+	// Drop near identical photos of a static scene before they reach photos/: CAMERA_APP_DEDUP=keep (count only), drop or thin
+	// (keep one in 10, and one an hour). Kept hashes in the catalog carry over a restart
+	if (getenv("CAMERA_APP_DEDUP"))
+	{
+		string mode = getenv("CAMERA_APP_DEDUP");
+		PerceptualDedup& dedup = cameraController.dedup;
+		dedup.policy = (mode == "drop") ? DEDUP_DROP : (mode == "thin") ? DEDUP_THIN : DEDUP_KEEP;
+		dedup.thinSeconds = 3600;
+		if (getenv("CAMERA_APP_DEDUP_DISTANCE"))
+		{
+			dedup.maxDistance = ofToInt(getenv("CAMERA_APP_DEDUP_DISTANCE"));
+		}
+		vector<CatalogEntry> entries = catalog.getEntries(catalog.size() > dedup.windowSize * 4 ? catalog.size() - dedup.windowSize * 4 : 0);
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		uint64_t nowMicros = (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
+		for (size_t i=0; i<entries.size(); i++)
+		{
+			if (entries[i].perceptualHash && entries[i].cameraNum == cameraController.cameraNum)
+			{
+				dedup.seed(entries[i].perceptualHash, nowMicros > entries[i].captureTimeMicros ? (nowMicros - entries[i].captureTimeMicros) / 1000 : 0);
+			}
+		}
+	}
+	// Run processors on every video frame, not just on stills: CAMERA_APP_FRAME_GRAPH=stats,focus,publish. Each node leases
+	// the same buffer; publish streams I420 to the CAMERA_APP_PUBLISH ring name plus "-raw"
+	if (getenv("CAMERA_APP_FRAME_GRAPH"))
+	{
+		string labels = cameraController.metricsLabels();
+		frameGraph.metricsLabels = labels;
+		vector<string> nodes = ofSplitString(getenv("CAMERA_APP_FRAME_GRAPH"), ",", true, true);
+		for (size_t i=0; i<nodes.size(); i++)
+		{
+			if (nodes[i] == "stats")
+			{
+				streamStatistics.setup(labels + (labels.empty() ? "" : ",") + "stream=\"raw\"");
+				frameGraph.addNode("stats", &streamStatistics);
+			}else if (nodes[i] == "focus")
+			{
+				streamFocus.setup(labels);
+				frameGraph.addNode("focus", &streamFocus);
+			}else if (nodes[i] == "publish" && getenv("CAMERA_APP_PUBLISH"))
+			{
+				int rawBytes = ((cameraController.rawWidth + 31) & ~31) * ((cameraController.rawHeight + 15) & ~15) * 3 / 2;
+				if (rawPublisher.setup(string(getenv("CAMERA_APP_PUBLISH")) + "-raw", 4, rawBytes, labels))
+				{
+					streamPublish.publisher = &rawPublisher;
+					frameGraph.addNode("publish", &streamPublish);
+				}
+			}else
+			{
+				ofLogWarning() << "Unknown frame graph node " << nodes[i];
+			}
+		}
+		cameraController.frameGraph = &frameGraph;
+	}
+	// lastImage only ends up on screen with a window (ofApp uploads lastTexture)
+	cameraController.loadLastImage = !headless;
+	ofAddListener(cameraController.readyEvent, this, &CaptureStation::onCameraReady);
+	cameraController.setupAsync();
+	exposureBracket.setup(&cameraController);
+	timelapse.setup(&cameraController, getenv("CAMERA_APP_TIMELAPSE_MS") ? ofToInt(getenv("CAMERA_APP_TIMELAPSE_MS")) : 10000);
+	timelapseAssembler.setup(&catalog);
+	// Copy every photo to an S3 compatible store, e.g. CAMERA_APP_UPLOAD_ENDPOINT=http://nas.local:9000 CAMERA_APP_UPLOAD_BUCKET=photos,
+	// capped at CAMERA_APP_UPLOAD_BANDWIDTH bytes/s. Resumes from data/upload.state after a restart. tools/uploadServer stands in on a bench
+	if (getenv("CAMERA_APP_UPLOAD_ENDPOINT") &&
+		uploadQueue.setup(&catalog, getenv("CAMERA_APP_UPLOAD_ENDPOINT"), getenv("CAMERA_APP_UPLOAD_BUCKET") ? getenv("CAMERA_APP_UPLOAD_BUCKET") : "photos",
+						  ofToDataPath("photos", true), ofToDataPath("upload.state", true)))
+	{
+		uploadQueue.cameras.push_back(&cameraController);
+		uploadQueue.maxBytesPerSecond = getenv("CAMERA_APP_UPLOAD_BANDWIDTH") ? ofToInt(getenv("CAMERA_APP_UPLOAD_BANDWIDTH")) : 0;
+		uploadQueue.start();
+	}
+	
+	// Prometheus text for a node_exporter textfile collector, plus a local socket for ad-hoc scrapes
+	metricsExporter.setup(ofToDataPath("metrics.prom", true), "/tmp/mmalCameraApp-metrics.sock");
+	metricsExporter.processStats = &processStats;
+	metricsExporter.startThread(false, false);
+	
+	if (!headless && commandPipe[0] >= 0)
+	{
+		commandThread.station = this;
+		commandThread.startThread(false, false);
+	}
+}
+
+//--------------------------------------------------------------
+void CaptureStation::onCameraReady(CameraReadyEventData& e)
+{
+	// Called on the camera startup thread
+	cameraReady = e.success;
+	if (cameraReady && !frameGraph.empty() && !cameraController.startFrameGraph())
+	{
+		ofLogError() << "Frame graph failed to start";
+	}
+}
+
+//--------------------------------------------------------------
+void CaptureStation::onCharacterReceived(SSHKeyListenerEventData& e)
+{
+	queueCommand(e.character);
+}
+
+/**
+ * Queue a command for run(), or for commandThread with a window. Any thread.
+ *
+ * @param key Command character
+ */
+void CaptureStation::queueCommand(int key)
+{
+	char command = key;
+	if (commandPipe[1] < 0 || write(commandPipe[1], &command, 1) != 1)
+	{
+		ofLogWarning() << "Dropped command " << command;
+	}
+}
+
+/**
+ * Ask run() to shut down. Only writes to a pipe, so it is safe in a signal handler.
+ */
+void CaptureStation::requestExit()
+{
+	char command = 'q';
+	if (commandPipe[1] >= 0)
+	{
+		ssize_t written = write(commandPipe[1], &command, 1);
+		(void)written;
+	}
+}
+
+/**
+ * Run without a window until 'q', SIGINT or SIGTERM. The main thread only
+ * wakes for commands, everything else runs on the camera, scheduler and
+ * exporter threads.
+ *
+ * @return Process exit status
+ */
+int CaptureStation::run()
+{
+	if (commandPipe[0] < 0)
+	{
+		return 1;
+	}
+	signal(SIGINT, onExitSignal);
+	signal(SIGTERM, onExitSignal);
+	signal(SIGPIPE, SIG_IGN);
+	
+	cameraController.waitUntilReady();
+	if (!cameraReady)
+	{
+		ofLogError() << "Camera failed to start";
+	}else if (getenv("CAMERA_APP_TIMELAPSE_MS"))
+	{
+		timelapse.start();
+	}
+	ofLogNotice() << "Headless capture station running, " << ProcessStats::describe(ProcessStats::difference(processStats.startCounters, ProcessStats::read()));
+	
+	processCommands();
+	
+	ofLogNotice() << "Stopping, " << ProcessStats::describe(ProcessStats::difference(processStats.startCounters, ProcessStats::read()));
+	exit();
+	return 0;
+}
+
+/**
+ * Run queued commands until 'q' or the pipe closes: on the main thread in
+ * run(), on commandThread with a window
+ */
+void CaptureStation::processCommands()
+{
+	char command;
+	ssize_t result;
+	while ((result = read(commandPipe[0], &command, 1)) != 0)
+	{
+		if (result < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (command == 'q')
+		{
+			break;
+		}
+		if (command != '\n' && !handleCommand(command))
+		{
+			ofLogWarning() << "Unknown command " << command;
+		}
+	}
+}
+
+//--------------------------------------------------------------
+void CaptureStation::exit()
+{
+	if (commandThread.isThreadRunning())
+	{
+		// Lets a capture in progress finish, then ends processCommands()
+		requestExit();
+		commandThread.waitForThread(false);
+	}
+	cameraController.waitUntilReady();
+	timelapse.stop();
+	cameraController.stopFrameGraph();
+	uploadQueue.stop();
+	timelapseAssembler.waitForThread(true);
+	metricsExporter.waitForThread(true);
+	if (TimelineTrace::getInstance().isRecording())
+	{
+		TimelineTrace::getInstance().stop(ofToDataPath("timeline-" + ofGetTimestampString() + ".json", true));
+	}
+	TraceLog::getInstance().writeBinary(ofToDataPath("trace.bin", true));
+}
+
+/**
+ * Run one capture command. Captures block for as long as they take and
+ * never touch GL, so with a window queueCommand() them to commandThread
+ * rather than calling this on the GL thread.
+ *
+ * @param key Command character
+ * @return false if key isn't a capture command
+ */
+bool CaptureStation::handleCommand(int key)
+{
+	ofLogVerbose() << "command: " << key;
+	if (key == 't')
+	{
+		// Start or stop a timelapse, one photo every 10s (CAMERA_APP_TIMELAPSE_MS) on a fixed schedule
+		if (timelapse.isThreadRunning())
+		{
+			timelapse.stop();
+		}else
+		{
+			timelapse.start();
+		}
+		return true;
+	}
+	if (key == 'v')
+	{
+		// Assemble the last timelapse into data/timelapse-<timestamp>.avi in the background
+		if (timelapse.sequenceId)
+		{
+			timelapseAssembler.assembleAsync(timelapse.sequenceId, ofToDataPath("timelapse-" + ofGetTimestampString() + ".avi", true));
+		}
+		return true;
+	}
+	if (key > 0 && key < 128 && timelapse.isThreadRunning() && strchr("ehnmszix", key))
+	{
+		// The scheduler owns the camera until it is stopped with 't'
+		ofLogWarning() << "Timelapse running, ignoring key " << (char)key;
+		return true;
+	}
+	if (key == 'e') 
+	{
+		ofLogVerbose() << "e pressed!";
+		cameraController.takePhoto();
+		return true;
+	}
+	if (key == 'h')
+	{
+		// -2/0/+2 EV bracket fused into one photo
+		exposureBracket.capture();
+		return true;
+	}
+	if (key == 'n')
+	{
+		// Night: 8 aligned video frames averaged into one photo
+		cameraController.takeStackedPhoto(8);
+		return true;
+	}
+	if (key == 'm')
+	{
+		// As 'n' but median merged, for scenes with moving lights
+		cameraController.takeStackedPhoto(8, FrameStacker::STACK_MEDIAN);
+		return true;
+	}
+	if (key == 's')
+	{
+		// Cycle full resolution, binned and VGA output and print the latency seen in each mode
+		static int preset = 0;
+		const int presets[][3] = {{2592, 1944, 3}, {1296, 972, 15}, {640, 480, 30}};
+		preset = (preset + 1) % 3;
+		ofLogNotice() << "\n" << cameraController.sensorModeReport();
+		cameraController.setSensorMode(presets[preset][0], presets[preset][1], presets[preset][2]);
+		return true;
+	}
+	if (key == 'z')
+	{
+		// Toggle a 2x digital zoom on the centre of the frame, cropped by the ISP
+		ofRectangle region = cameraController.getRegionOfInterest();
+		if (region.width < 1)
+		{
+			cameraController.setRegionOfInterest(ofRectangle(0, 0, 1, 1));
+		}else
+		{
+			cameraController.setRegionOfInterest(ofRectangle(0.25, 0.25, 0.5, 0.5));
+		}
+		return true;
+	}
+	if (key == 'i')
+	{
+		// Inspection: the four quadrants of one raw frame as separate files
+		vector<ofRectangle> regions;
+		regions.push_back(ofRectangle(0, 0, 0.5, 0.5));
+		regions.push_back(ofRectangle(0.5, 0, 0.5, 0.5));
+		regions.push_back(ofRectangle(0, 0.5, 0.5, 0.5));
+		regions.push_back(ofRectangle(0.5, 0.5, 0.5, 0.5));
+		cameraController.takeRegionPhotos(regions);
+		return true;
+	}
+	if (key == 'x')
+	{
+		// What the sensor sees now, from one raw frame: mean, median and clipping
+		if (cameraController.measureExposure())
+		{
+			const FrameStats& stats = cameraController.statisticsNode.statistics.last;
+			ofLogNotice() << "Exposure: mean " << ofToString(stats.meanLuma, 1) << " median " << stats.lumaPercentile(0.5f)
+						  << " shadows " << ofToString(stats.shadowClipped * 100, 2) << "% highlights " << ofToString(stats.highlightClipped * 100, 2)
+						  << "% in " << ofToString(cameraController.statisticsNode.statistics.lastMillis, 1) << "ms";
+		}
+		return true;
+	}
+	if (key == 'p')
+	{
+		// CPU, wakeups and memory since the last 'p', to compare headless and windowed runs
+		ProcessCounters now = ProcessStats::read();
+		ofLogNotice() << ProcessStats::describe(ProcessStats::difference(reportCounters, now));
+		reportCounters = now;
+		return true;
+	}
+	if (key == 'u')
+	{
+		// Upload progress, also exported as upload_* metrics
+		UploadStats stats = uploadQueue.getStats();
+		ofLogNotice() << "Uploaded " << stats.uploadedFiles << " photos, " << stats.uploadedBytes / 1024 << "KB sent, "
+					  << stats.pendingFiles << " photos (" << stats.pendingBytes / 1024 << "KB) pending, " << stats.failures << " retries";
+		return true;
+	}
+	if (key == 'r')
+	{
+		// Toggle a Chrome trace recording, open the result in chrome://tracing or ui.perfetto.dev
+		if (TimelineTrace::getInstance().isRecording())
+		{
+			TimelineTrace::getInstance().stop(ofToDataPath("timeline-" + ofGetTimestampString() + ".json", true));
+		}else
+		{
+			TimelineTrace::getInstance().start();
+		}
+		return true;
+	}
+	if (key == 'd')
+	{
+		// Decode trace.bin with tools/traceDump
+		TraceLog::getInstance().writeText(ofToDataPath("trace.txt", true));
+		TraceLog::getInstance().writeBinary(ofToDataPath("trace.bin", true));
+		return true;
+	}
+	return false;
+}
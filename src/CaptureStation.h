@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ofxRaspicam.h"
+#include "ConsoleListener.h"
+#include "MetricsExporter.h"
+#include "ExposureBracket.h"
+#include "TimelapseScheduler.h"
+#include "TimelapseAssembler.h"
+#include "ProcessStats.h"
+#include "UploadQueue.h"
+#include "FrameProcessors.h"
+
+/*
+ Everything that takes, stores and shares photos, with no GL: the camera,
+ catalog, storage, capture modes and the command keys that drive them.
+ ofApp wraps it with the window, SlideShow and effects. run() drives it
+ headless instead: no GL context, no frame loop, the main thread sleeps in
+ read() until a command arrives from the console or command FIFO, and the
+ timelapse scheduler can be started from the environment. With a window,
+ commandThread runs the queued commands, so a capture never stalls the GL
+ thread.
+ */
+
+class CaptureStation;
+
+class CaptureCommandThread : public ofThread
+{
+public:
+	CaptureCommandThread();
+	void threadedFunction();
+	CaptureStation* station;
+};
+
+class CaptureStation : public SSHKeyListener
+{
+public:
+	CaptureStation();
+	void setup(SSHKeyListener* keyListener=NULL);
+	bool handleCommand(int key);
+	void queueCommand(int key);
+	void processCommands();
+	int run();
+	void exit();
+	void onCharacterReceived(SSHKeyListenerEventData& e);
+	static void requestExit();
+
+	ofxRaspicam cameraController;
+	ConsoleListener consoleListener;
+	MetricsExporter metricsExporter;
+	ProcessStats processStats;
+	PhotoCatalog catalog;
+	StorageManager storage;
+	FrameMetadataLog frameMetadata;
+	FramePublisher framePublisher;
+	ExposureBracket exposureBracket;
+	TimelapseScheduler timelapse;
+	TimelapseAssembler timelapseAssembler;
+	QualityController qualityController;
+	UploadQueue uploadQueue;
+	StatisticsProcessor streamStatistics;
+	FocusProcessor streamFocus;
+	PublishProcessor streamPublish;
+	FramePublisher rawPublisher;
+	FrameGraph frameGraph;
+	CaptureCommandThread commandThread;	// runs queued commands when there is a window
+	volatile bool cameraReady;
+
+private:
+	void onCameraReady(CameraReadyEventData& e);
+	ProcessCounters reportCounters;		// start of the interval the 'p' command reports
+	static int commandPipe[2];			// commands queued for run() or commandThread, written from signal handlers too
+};
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "ofMain.h"
+#include "TimelineTrace.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
 
 class SSHKeyListenerEventData
 {
@@ -22,25 +26,57 @@ class ConsoleListener: public ofThread
 {
 public:
 	SSHKeyListener* listener;
+	string commandPath;						// FIFO to read instead of stdin, created if missing
 	ConsoleListener()
 	{
 		listener = NULL;
 	}
-	void setup(SSHKeyListener* listener_)
+	void setup(SSHKeyListener* listener_, string commandPath_="")
 	{
 		listener = listener_;
+		commandPath = commandPath_;
+	}
+	FILE* openInput()
+	{
+		if (commandPath.empty())
+		{
+			return stdin;
+		}
+		if (mkfifo(commandPath.c_str(), 0660) != 0 && errno != EEXIST)
+		{
+			ofLogError() << "Could not create command FIFO " << commandPath;
+			return NULL;
+		}
+		// Opened for writing as well so the FIFO never reads EOF between clients
+		int fd = open(commandPath.c_str(), O_RDWR);
+		return fd < 0 ? NULL : fdopen(fd, "r");
 	}
 	void threadedFunction()
 	{
+		TimelineTrace::getInstance().nameCurrentThread("ConsoleListener");
+		FILE* input = openInput();
+		if (!input)
+		{
+			return;
+		}
 		while (isThreadRunning()) 
 		{
 			char buffer[10];
-			while(fgets(buffer, 10 , stdin) != NULL)
+			while(fgets(buffer, 10 , input) != NULL)
 			{
 				//ofLogVerbose() << buffer;
+				TimelineScope scope("console_command", "input");
+				scope.arg = buffer[0];
 				SSHKeyListenerEventData eventData(buffer[0]);
 				listener->onCharacterReceived(eventData);
 			}
+			if (!isatty(fileno(input)))
+			{
+				// stdin from /dev/null or a closed pipe stays at EOF, don't spin on it
+				ofLogNotice() << "Console input closed";
+				break;
+			}
+			clearerr(input);
 		}
 	}
 	
@@ -0,0 +1,135 @@
+/*
+ *  Crc32c.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "Crc32c.h"
+#include <string.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_USE_ARMV8 1
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define CRC32C_USE_SSE42 1
+#endif
+
+#if !defined(CRC32C_USE_ARMV8) && !defined(CRC32C_USE_SSE42)
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLYNOMIAL 0x82F63B78
+
+static uint32_t crcTable[8][256];
+static bool crcTableReady = false;
+
+static void buildTable()
+{
+	for (uint32_t i=0; i<256; i++)
+	{
+		uint32_t crc = i;
+		for (int bit=0; bit<8; bit++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+		}
+		crcTable[0][i] = crc;
+	}
+	for (uint32_t i=0; i<256; i++)
+	{
+		for (int slice=1; slice<8; slice++)
+		{
+			crcTable[slice][i] = (crcTable[slice-1][i] >> 8) ^ crcTable[0][crcTable[slice-1][i] & 0xff];
+		}
+	}
+	crcTableReady = true;
+}
+
+#endif
+
+/**
+ * Extend a CRC32C over more data
+ *
+ * @param crc 0 to start, or the result of the previous call
+ * @param data Bytes to add
+ * @param length Number of bytes
+ * @return The CRC32C of everything seen so far
+ */
+uint32_t crc32cUpdate(uint32_t crc, const void* data, size_t length)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	crc = ~crc;
+
+#if defined(CRC32C_USE_ARMV8)
+	while (length && ((uintptr_t)p & 7))
+	{
+		crc = __crc32cb(crc, *p++);
+		length--;
+	}
+	for (; length >= 8; length -= 8, p += 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, 8);
+		crc = __crc32cd(crc, word);
+	}
+	while (length--)
+	{
+		crc = __crc32cb(crc, *p++);
+	}
+#elif defined(CRC32C_USE_SSE42)
+	while (length && ((uintptr_t)p & 7))
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+		length--;
+	}
+#if defined(__x86_64__)
+	for (; length >= 8; length -= 8, p += 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, 8);
+		crc = (uint32_t)_mm_crc32_u64(crc, word);
+	}
+#endif
+	for (; length >= 4; length -= 4, p += 4)
+	{
+		uint32_t word;
+		memcpy(&word, p, 4);
+		crc = _mm_crc32_u32(crc, word);
+	}
+	while (length--)
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+#else
+	// Tables are built on first use; concurrent first calls just build them twice
+	if (!crcTableReady)
+	{
+		buildTable();
+	}
+	for (; length >= 8; length -= 8, p += 8)
+	{
+		// Little endian: the low word folds into the running CRC
+		uint32_t low = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+		crc = crcTable[7][low & 0xff] ^ crcTable[6][(low >> 8) & 0xff] ^
+			  crcTable[5][(low >> 16) & 0xff] ^ crcTable[4][low >> 24] ^
+			  crcTable[3][p[4]] ^ crcTable[2][p[5]] ^
+			  crcTable[1][p[6]] ^ crcTable[0][p[7]];
+	}
+	while (length--)
+	{
+		crc = (crc >> 8) ^ crcTable[0][(crc ^ *p++) & 0xff];
+	}
+#endif
+
+	return ~crc;
+}
+
+const char* crc32cImplementation()
+{
+#if defined(CRC32C_USE_ARMV8)
+	return "armv8";
+#elif defined(CRC32C_USE_SSE42)
+	return "sse4.2";
+#else
+	return "table";
+#endif
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ CRC32C (Castagnoli), the checksum stored with each photo in the catalog.
+ Uses the ARMv8 CRC instructions or SSE4.2 when the compiler targets them,
+ otherwise a slicing-by-8 table.
+
+	uint32_t crc = 0;
+	crc = crc32cUpdate(crc, first, firstLength);
+	crc = crc32cUpdate(crc, second, secondLength);	// same as one call over both
+ */
+
+uint32_t crc32cUpdate(uint32_t crc, const void* data, size_t length);
+const char* crc32cImplementation();		// "armv8", "sse4.2" or "table", for logs
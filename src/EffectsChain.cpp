@@ -0,0 +1,399 @@
+/*
+ *  EffectsChain.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "EffectsChain.h"
+#include "ParallelFor.h"
+#include "TimelineTrace.h"
+
+#define EFFECTS_MAX_LUT_SIZE 64
+
+EffectsChain::EffectsChain()
+{
+	sharpenAmount = 0;
+	lutStrength = 0;
+	overlayOpacity = 0;
+	lastApplyMillis = 0;
+	lastReadbackMillis = 0;
+	lastCpuMillis = 0;
+	maxTextureSize = 0;
+	lutDirty = false;
+	overlayDirty = false;
+	hasShader = false;
+	setIdentityLut();
+}
+
+/**
+ * Load the shader, must be called on the GL thread. applyCpu() works without it.
+ *
+ * @param shaderName Base name of the .vert/.frag pair in bin/data
+ * @return true if the shader compiled
+ */
+bool EffectsChain::setup(string shaderName)
+{
+	hasShader = shader.load(shaderName);
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	if (!hasShader)
+	{
+		ofLogError() << "EffectsChain could not load " << shaderName << ", only applyCpu() is available";
+	}
+	lutDirty = true;
+	overlayDirty = overlayPixels.isAllocated();
+	return hasShader;
+}
+
+void EffectsChain::setIdentityLut(int size)
+{
+	setGradeLut(0, 1, 1, size);
+}
+
+/**
+ * Build a simple grade: white balance shift, S-curve contrast and saturation
+ *
+ * @param warmth -1 cool to 1 warm
+ * @param contrast 1 unchanged
+ * @param saturation 1 unchanged, 0 grey
+ * @param size Points per axis
+ */
+void EffectsChain::setGradeLut(float warmth, float contrast, float saturation, int size)
+{
+	lutSize = ofClamp(size, 2, EFFECTS_MAX_LUT_SIZE);
+	lut.resize(lutSize * lutSize * lutSize * 3);
+	for (int b=0; b<lutSize; b++)
+	{
+		for (int g=0; g<lutSize; g++)
+		{
+			for (int r=0; r<lutSize; r++)
+			{
+				float rgb[3] = {r / (lutSize - 1.0f), g / (lutSize - 1.0f), b / (lutSize - 1.0f)};
+				rgb[0] *= 1 + 0.1f * warmth;
+				rgb[2] *= 1 - 0.1f * warmth;
+				float luma = 0.299f * rgb[0] + 0.587f * rgb[1] + 0.114f * rgb[2];
+				unsigned char* out = &lut[((g * lutSize * lutSize) + b * lutSize + r) * 3];
+				for (int c=0; c<3; c++)
+				{
+					float value = luma + (rgb[c] - luma) * saturation;
+					value = (value - 0.5f) * contrast + 0.5f;
+					out[c] = (unsigned char)(ofClamp(value, 0, 1) * 255 + 0.5f);
+				}
+			}
+		}
+	}
+	lutDirty = true;
+}
+
+/**
+ * Read a .cube 3D LUT (red varies fastest). DOMAIN_MIN/MAX other than 0-1 is not supported.
+ *
+ * @param path .cube file
+ * @return true if a complete table was read
+ */
+bool EffectsChain::loadCubeLut(string path)
+{
+	FILE* file = fopen(path.c_str(), "r");
+	if (!file)
+	{
+		ofLogError() << "Could not open LUT " << path;
+		return false;
+	}
+	int size = 0;
+	vector<float> values;
+	char line[256];
+	while (fgets(line, sizeof(line), file))
+	{
+		float r, g, b;
+		if (sscanf(line, "LUT_3D_SIZE %d", &size) == 1)
+		{
+			if (size < 2 || size > EFFECTS_MAX_LUT_SIZE)
+			{
+				break;
+			}
+			values.reserve(size * size * size * 3);
+		}else if (size && sscanf(line, "%f %f %f", &r, &g, &b) == 3)
+		{
+			values.push_back(r);
+			values.push_back(g);
+			values.push_back(b);
+		}
+	}
+	fclose(file);
+	if (size < 2 || size > EFFECTS_MAX_LUT_SIZE || values.size() != (size_t)size * size * size * 3)
+	{
+		ofLogError() << "Unsupported or incomplete LUT " << path;
+		return false;
+	}
+
+	lutSize = size;
+	lut.resize(values.size());
+	for (int i=0; i<size*size*size; i++)
+	{
+		int r = i % size;
+		int g = (i / size) % size;
+		int b = i / (size * size);
+		unsigned char* out = &lut[((g * size * size) + b * size + r) * 3];
+		for (int c=0; c<3; c++)
+		{
+			out[c] = (unsigned char)(ofClamp(values[i * 3 + c], 0, 1) * 255 + 0.5f);
+		}
+	}
+	lutDirty = true;
+	return true;
+}
+
+void EffectsChain::setOverlay(const ofPixels& rgba)
+{
+	overlayPixels = rgba;
+	overlayDirty = true;
+}
+
+void EffectsChain::clearOverlay()
+{
+	overlayPixels.clear();
+	overlayOpacity = 0;
+}
+
+void EffectsChain::uploadLut()
+{
+	if (lutDirty)
+	{
+		lutTexture.allocate(lutSize * lutSize, lutSize, GL_RGB);
+		lutTexture.loadData(&lut[0], lutSize * lutSize, lutSize, GL_RGB);
+		lutDirty = false;
+	}
+	if (overlayDirty && overlayPixels.isAllocated())
+	{
+		overlayTexture.allocate(overlayPixels.getWidth(), overlayPixels.getHeight(), GL_RGBA);
+		overlayTexture.loadData(overlayPixels);
+		overlayDirty = false;
+	}
+}
+
+/**
+ * Whether apply() can take a frame this size, otherwise use applyCpu()
+ */
+bool EffectsChain::canApply(int width, int height)
+{
+	return hasShader && width <= maxTextureSize && height <= maxTextureSize && lutSize * lutSize <= maxTextureSize;
+}
+
+/**
+ * Run the chain on the GPU into the internal fbo, sized to match source
+ *
+ * @param source Any texture, e.g. a preview fbo or ofImage::getTextureReference()
+ * @return false without the shader or if the frame or LUT strip is over GL_MAX_TEXTURE_SIZE
+ */
+bool EffectsChain::apply(ofTexture& source)
+{
+	int width = source.getWidth();
+	int height = source.getHeight();
+	if (!canApply(width, height))
+	{
+		return false;
+	}
+	TIMELINE_SCOPE("effects_apply");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	if (!fbo.isAllocated() || fbo.getWidth() != width || fbo.getHeight() != height)
+	{
+		// GLES 2 only guarantees RGBA colour attachments
+		fbo.allocate(width, height, GL_RGBA);
+	}
+	uploadLut();
+
+	bool useOverlay = overlayOpacity > 0 && overlayTexture.isAllocated();
+	fbo.begin();
+	shader.begin();
+	shader.setUniformTexture("lut", lutTexture, 1);
+	if (useOverlay)
+	{
+		shader.setUniformTexture("overlay", overlayTexture, 2);
+	}
+	shader.setUniform2f("texelSize", 1.0f / width, 1.0f / height);
+	shader.setUniform1f("lutSize", lutSize);
+	shader.setUniform1f("lutStrength", lutStrength);
+	shader.setUniform1f("sharpenAmount", sharpenAmount);
+	shader.setUniform1f("overlayOpacity", useOverlay ? overlayOpacity : 0);
+	source.draw(0, 0, width, height);
+	shader.end();
+	fbo.end();
+	lastApplyMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+	return true;
+}
+
+void EffectsChain::draw(float x, float y, float width, float height)
+{
+	if (fbo.isAllocated())
+	{
+		fbo.draw(x, y, width, height);
+	}
+}
+
+/**
+ * Read the last apply() result back, the only GPU to CPU copy in the chain
+ *
+ * @param rgb Receives the frame as 3 channel pixels
+ * @return false if nothing has been applied yet
+ */
+bool EffectsChain::readPixels(ofPixels& rgb)
+{
+	if (!fbo.isAllocated())
+	{
+		return false;
+	}
+	TIMELINE_SCOPE("effects_readback");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	ofPixels rgba;
+	fbo.readToPixels(rgba);
+	int width = rgba.getWidth();
+	int height = rgba.getHeight();
+	int channels = rgba.getNumChannels();
+	rgb.allocate(width, height, 3);
+	const unsigned char* in = rgba.getPixels();
+	unsigned char* out = rgb.getPixels();
+	for (size_t i=0; i<(size_t)width * height; i++)
+	{
+		out[i * 3] = in[i * channels];
+		out[i * 3 + 1] = in[i * channels + 1];
+		out[i * 3 + 2] = in[i * channels + 2];
+	}
+	lastReadbackMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+	return true;
+}
+
+// Bilinear fetch with texel centres at +0.5 and clamp to edge, as GL_LINEAR samples
+static void sampleBilinear(const ofPixels& pixels, float u, float v, float* out)
+{
+	int width = pixels.getWidth();
+	int height = pixels.getHeight();
+	int channels = pixels.getNumChannels();
+	float x = ofClamp(u * width - 0.5f, 0, width - 1);
+	float y = ofClamp(v * height - 0.5f, 0, height - 1);
+	int x0 = (int)x;
+	int y0 = (int)y;
+	int x1 = min(x0 + 1, width - 1);
+	int y1 = min(y0 + 1, height - 1);
+	float fx = x - x0;
+	float fy = y - y0;
+	const unsigned char* p = pixels.getPixels();
+	for (int c=0; c<channels; c++)
+	{
+		float top = p[(y0 * width + x0) * channels + c] * (1 - fx) + p[(y0 * width + x1) * channels + c] * fx;
+		float bottom = p[(y1 * width + x0) * channels + c] * (1 - fx) + p[(y1 * width + x1) * channels + c] * fx;
+		out[c] = (top * (1 - fy) + bottom * fy) / 255.0f;
+	}
+}
+
+class EffectsCpuTask : public ParallelTask
+{
+public:
+	const ofPixels* source;
+	ofPixels* target;
+	const EffectsChain* chain;
+
+	float fetch(int x, int y, int c)
+	{
+		int width = source->getWidth();
+		x = ofClamp(x, 0, width - 1);
+		y = ofClamp(y, 0, source->getHeight() - 1);
+		return source->getPixels()[(y * width + x) * source->getNumChannels() + c] / 255.0f;
+	}
+
+	// Trilinear lookup in the 8 bit strip, the same texels the shader's two bilinear fetches blend
+	float lutAt(int r, int g, int b, int c)
+	{
+		int size = chain->lutSize;
+		return chain->lut[((g * size * size) + b * size + r) * 3 + c] / 255.0f;
+	}
+
+	void lookup(const float* rgb, float* out)
+	{
+		int size = chain->lutSize;
+		float r = rgb[0] * (size - 1);
+		float g = rgb[1] * (size - 1);
+		float b = rgb[2] * (size - 1);
+		int r0 = (int)r, g0 = (int)g, b0 = (int)b;
+		int r1 = min(r0 + 1, size - 1), g1 = min(g0 + 1, size - 1), b1 = min(b0 + 1, size - 1);
+		float fr = r - r0, fg = g - g0, fb = b - b0;
+		for (int c=0; c<3; c++)
+		{
+			float slice0 = (lutAt(r0, g0, b0, c) * (1 - fr) + lutAt(r1, g0, b0, c) * fr) * (1 - fg)
+						 + (lutAt(r0, g1, b0, c) * (1 - fr) + lutAt(r1, g1, b0, c) * fr) * fg;
+			float slice1 = (lutAt(r0, g0, b1, c) * (1 - fr) + lutAt(r1, g0, b1, c) * fr) * (1 - fg)
+						 + (lutAt(r0, g1, b1, c) * (1 - fr) + lutAt(r1, g1, b1, c) * fr) * fg;
+			out[c] = slice0 * (1 - fb) + slice1 * fb;
+		}
+	}
+
+	void run(int begin, int end)
+	{
+		int width = source->getWidth();
+		int height = source->getHeight();
+		bool useOverlay = chain->overlayOpacity > 0 && chain->overlayPixels.isAllocated() && chain->overlayPixels.getNumChannels() == 4;
+		unsigned char* out = target->getPixels();
+		for (int y=begin; y<end; y++)
+		{
+			for (int x=0; x<width; x++)
+			{
+				float rgb[3];
+				for (int c=0; c<3; c++)
+				{
+					rgb[c] = fetch(x, y, c);
+				}
+				if (chain->sharpenAmount > 0)
+				{
+					for (int c=0; c<3; c++)
+					{
+						float edges = fetch(x - 1, y, c) + fetch(x + 1, y, c) + fetch(x, y - 1, c) + fetch(x, y + 1, c);
+						float corners = fetch(x - 1, y - 1, c) + fetch(x + 1, y - 1, c) + fetch(x - 1, y + 1, c) + fetch(x + 1, y + 1, c);
+						float blur = (rgb[c] * 4 + edges * 2 + corners) / 16;
+						rgb[c] = ofClamp(rgb[c] + chain->sharpenAmount * (rgb[c] - blur), 0, 1);
+					}
+				}
+				if (chain->lutStrength > 0)
+				{
+					float graded[3];
+					lookup(rgb, graded);
+					for (int c=0; c<3; c++)
+					{
+						rgb[c] += (graded[c] - rgb[c]) * chain->lutStrength;
+					}
+				}
+				if (useOverlay)
+				{
+					float overlay[4];
+					sampleBilinear(chain->overlayPixels, (x + 0.5f) / width, (y + 0.5f) / height, overlay);
+					float alpha = overlay[3] * chain->overlayOpacity;
+					for (int c=0; c<3; c++)
+					{
+						rgb[c] += (overlay[c] - rgb[c]) * alpha;
+					}
+				}
+				unsigned char* pixel = out + ((size_t)y * width + x) * 3;
+				for (int c=0; c<3; c++)
+				{
+					pixel[c] = (unsigned char)(ofClamp(rgb[c], 0, 1) * 255 + 0.5f);
+				}
+			}
+		}
+	}
+};
+
+/**
+ * Reference implementation of the shader on the CPU, rows split over ParallelFor
+ *
+ * @param source RGB or RGBA frame
+ * @param rgb Receives the processed frame, same size, 3 channels
+ */
+void EffectsChain::applyCpu(const ofPixels& source, ofPixels& rgb)
+{
+	TIMELINE_SCOPE("effects_apply_cpu");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	rgb.allocate(source.getWidth(), source.getHeight(), 3);
+	EffectsCpuTask task;
+	task.source = &source;
+	task.target = &rgb;
+	task.chain = this;
+	ParallelFor::getInstance().run(source.getHeight(), 16, task);
+	lastCpuMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+}
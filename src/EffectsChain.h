@@ -0,0 +1,62 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Post-processing on the GPU: unsharp mask, 3D LUT colour grade and an
+ alpha overlay, in that order, in one pass of bin/data/Effects_GLES into
+ an ofFbo. Frames stay on the GPU for preview; readPixels() only reads
+ back when something has to be encoded.
+
+ GLES 2 has no 3D textures, so the LUT is a lutSize^2 x lutSize strip of
+ 2D slices (blue picks the slice) with linear filtering inside a slice
+ and a mix between slices - trilinear interpolation in effect.
+
+ applyCpu() runs the same math on the CPU from the same 8 bit LUT and
+ overlay data. It is the reference for the shader (results should agree
+ to within a level or two per channel) and the fallback without a GL
+ context, or for frames bigger than GL_MAX_TEXTURE_SIZE: a full 2592x1944
+ capture doesn't fit in a VC4 texture.
+ */
+
+class EffectsChain
+{
+public:
+	EffectsChain();
+	bool setup(string shaderName="Effects_GLES");
+
+	void setIdentityLut(int size=17);
+	void setGradeLut(float warmth, float contrast, float saturation, int size=17);
+	bool loadCubeLut(string path);						// Adobe/Resolve .cube, LUT_3D_SIZE up to 64
+	void setOverlay(const ofPixels& rgba);
+	void clearOverlay();
+
+	bool canApply(int width, int height);				// the shader is loaded and the frame fits in a texture
+	bool apply(ofTexture& source);						// GPU, result stays in the fbo
+	void draw(float x, float y, float width, float height);
+	bool readPixels(ofPixels& rgb);						// read the last apply() back as RGB
+	void applyCpu(const ofPixels& source, ofPixels& rgb);
+
+	float sharpenAmount;								// 0 off, 1 doubles detail above the blur
+	float lutStrength;									// 0 off, 1 full grade
+	float overlayOpacity;								// 0 off
+	float lastApplyMillis;
+	float lastReadbackMillis;
+	float lastCpuMillis;
+	int maxTextureSize;									// GL_MAX_TEXTURE_SIZE, 2048 on the Pi
+
+	// LUT and overlay data shared by both paths
+	int lutSize;
+	vector<unsigned char> lut;							// RGB, lutSize * lutSize wide, lutSize high
+	ofPixels overlayPixels;
+
+private:
+	void uploadLut();
+	ofShader shader;
+	ofFbo fbo;
+	ofTexture lutTexture;
+	ofTexture overlayTexture;
+	bool lutDirty;
+	bool overlayDirty;
+	bool hasShader;
+};
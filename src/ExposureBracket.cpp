@@ -0,0 +1,219 @@
+/*
+ *  ExposureBracket.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "ExposureBracket.h"
+#include "ParallelFor.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
+
+// MMAL exposure compensation is in 1/6 stop steps, the firmware accepts +-4 EV
+#define EXPOSURE_COMP_STEPS_PER_EV 6
+#define EXPOSURE_COMP_LIMIT 24
+
+class BracketDecodeTask : public ParallelTask
+{
+public:
+	const vector<string>* paths;
+	vector<ofPixels>* frames;
+	vector<bool>* loaded;
+
+	// One file per item; FreeImage decodes separate bitmaps concurrently
+	void run(int begin, int end)
+	{
+		for (int i=begin; i<end; i++)
+		{
+			(*loaded)[i] = ofLoadImage((*frames)[i], (*paths)[i]);
+		}
+	}
+};
+
+ExposureBracket::ExposureBracket()
+{
+	camera = NULL;
+	totalTime = NULL;
+	evSteps.push_back(-2);
+	evSteps.push_back(0);
+	evSteps.push_back(2);
+	stepSettleMillis = 400;
+	initialSettleMillis = 5000;
+	keepFrames = true;
+}
+
+void ExposureBracket::setup(ofxRaspicam* camera_)
+{
+	camera = camera_;
+	static const double boundsMs[] = {500, 1000, 2000, 3000, 5000, 7500, 10000, 15000, 30000};
+	totalTime = MetricsRegistry::getInstance().addHistogram("camera_bracket_total_ms", "Exposure bracket capture plus merge time", boundsMs, sizeof(boundsMs)/sizeof(double), camera->metricsLabels());
+}
+
+/**
+ * Capture every EV step, fuse them and write <timestamp>-hdr.jpg next to the other photos
+ *
+ * @return Timings and paths for the bracket
+ */
+BracketReport ExposureBracket::capture()
+{
+	TIMELINE_SCOPE("exposure_bracket");
+
+	BracketReport report;
+	report.success = false;
+	report.settleMillis = report.captureMillis = report.decodeMillis = 0;
+	report.mergeMillis = report.saveMillis = report.totalMillis = 0;
+
+	if (!camera || evSteps.empty())
+	{
+		return report;
+	}
+	camera->waitUntilReady();
+	if (!camera->isReady())
+	{
+		ofLogError() << "ExposureBracket: camera not ready";
+		return report;
+	}
+
+	unsigned long long start = ofGetElapsedTimeMicros();
+	camera->settle(initialSettleMillis);
+	report.settleMillis = (ofGetElapsedTimeMicros() - start) / 1000.0f;
+
+	CameraSettings& settings = camera->getCameraSettings();
+	int baseCompensation = settings.exposureCompensation;
+	string baseSuffix = camera->fileSuffix;
+	bool baseLoadLastImage = camera->loadLastImage;
+	camera->loadLastImage = false;
+	// Under and over exposed frames score low by nature, the blur policy must not touch them
+	bool baseScoreFocus = camera->scoreFocus;
+	float baseMinFocusScore = camera->minFocusScore;
+	bool baseMeasureStatistics = camera->measureStatistics;
+	camera->scoreFocus = false;
+	camera->minFocusScore = 0;
+	camera->measureStatistics = false;
+	// dHash ignores exposure, so the EV frames are near duplicates of each other by design
+	DedupPolicy baseDedupPolicy = camera->dedup.policy;
+	camera->dedup.policy = DEDUP_OFF;
+
+	uint64_t groupId = ofGetElapsedTimeMicros();
+	unsigned long long captureStart = ofGetElapsedTimeMicros();
+	for (size_t i=0; i<evSteps.size(); i++)
+	{
+		int compensation = baseCompensation + (int)roundf(evSteps[i] * EXPOSURE_COMP_STEPS_PER_EV);
+		compensation = max(-EXPOSURE_COMP_LIMIT, min(EXPOSURE_COMP_LIMIT, compensation));
+		settings.set_exposure_compensation(compensation);
+		TRACE_VERBOSE("Bracket frame %d compensation %d/6 EV", (int)i, compensation);
+
+		// Only reports after the change count
+		camera->convergence.reset();
+		camera->settle(stepSettleMillis);
+
+		camera->fileSuffix = baseSuffix + "-ev" + ofToString(evSteps[i]);
+		bool captured = camera->prepareCapture() && camera->triggerCapture();
+		captured = camera->finishCapture(groupId) && captured;
+		if (!captured)
+		{
+			ofLogError() << "ExposureBracket: frame at " << evSteps[i] << "EV failed";
+			break;
+		}
+		report.framePaths.push_back(camera->lastCapture.path);
+	}
+	report.captureMillis = (ofGetElapsedTimeMicros() - captureStart) / 1000.0f;
+
+	settings.set_exposure_compensation(baseCompensation);
+	camera->fileSuffix = baseSuffix;
+	camera->loadLastImage = baseLoadLastImage;
+	camera->scoreFocus = baseScoreFocus;
+	camera->minFocusScore = baseMinFocusScore;
+	camera->measureStatistics = baseMeasureStatistics;
+	camera->dedup.policy = baseDedupPolicy;
+
+	if (report.framePaths.size() == evSteps.size())
+	{
+		unsigned long long decodeStart = ofGetElapsedTimeMicros();
+		vector<ofPixels> frames(report.framePaths.size());
+		vector<bool> loaded(report.framePaths.size(), false);
+		BracketDecodeTask decodeTask;
+		decodeTask.paths = &report.framePaths;
+		decodeTask.frames = &frames;
+		decodeTask.loaded = &loaded;
+		{
+			TIMELINE_SCOPE("bracket_decode");
+			ParallelFor::getInstance().run(frames.size(), 1, decodeTask);
+		}
+		report.decodeMillis = (ofGetElapsedTimeMicros() - decodeStart) / 1000.0f;
+
+		vector<ofPixels*> framePointers;
+		for (size_t i=0; i<frames.size(); i++)
+		{
+			if (loaded[i])
+			{
+				framePointers.push_back(&frames[i]);
+			}
+		}
+
+		ofPixels fused;
+		if (framePointers.size() == frames.size() && fusion.merge(framePointers, fused))
+		{
+			report.mergeMillis = fusion.lastMergeMillis;
+
+			unsigned long long saveStart = ofGetElapsedTimeMicros();
+			report.outputPath = camera->nextPhotoPath("-hdr");
+			ofBuffer jpeg;
+			{
+				TIMELINE_SCOPE("bracket_save");
+				ofSaveImage(fused, jpeg, OF_IMAGE_FORMAT_JPEG, OF_IMAGE_QUALITY_BEST);
+				report.success = atomicFileWrite(report.outputPath, jpeg.getBinaryBuffer(), jpeg.size());
+			}
+			if (report.success && camera->storage)
+			{
+				camera->storage->add(report.outputPath, jpeg.size());
+			}
+			report.saveMillis = (ofGetElapsedTimeMicros() - saveStart) / 1000.0f;
+
+			if (report.success && camera->catalog)
+			{
+				CatalogEntry entry;
+				entry.path = report.outputPath;
+				entry.cameraNum = camera->cameraNum;
+				entry.captureTimeMicros = camera->lastCapture.captureTimeMicros;
+				entry.bytes = jpeg.size();
+				entry.groupId = groupId;
+				entry.crc32c = crc32cUpdate(0, jpeg.getBinaryBuffer(), jpeg.size());
+				camera->catalog->add(entry);
+			}
+		}
+		else
+		{
+			ofLogError() << "ExposureBracket: could not decode or merge the bracket";
+		}
+	}
+
+	if (!keepFrames)
+	{
+		for (size_t i=0; i<report.framePaths.size(); i++)
+		{
+			if (camera->storage)
+			{
+				camera->storage->remove(report.framePaths[i]);
+			}else
+			{
+				ofFile::removeFile(report.framePaths[i], false);
+			}
+		}
+	}
+
+	report.totalMillis = (ofGetElapsedTimeMicros() - start) / 1000.0f;
+	if (totalTime)
+	{
+		totalTime->observe(report.totalMillis);
+	}
+	ofLogNotice() << "Bracket " << report.framePaths.size() << " frames"
+				<< " settle: " << report.settleMillis << "ms"
+				<< " capture: " << report.captureMillis << "ms"
+				<< " decode: " << report.decodeMillis << "ms"
+				<< " merge: " << report.mergeMillis << "ms"
+				<< " save: " << report.saveMillis << "ms"
+				<< " total: " << report.totalMillis << "ms";
+	lastReport = report;
+	return report;
+}
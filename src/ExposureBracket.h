@@ -0,0 +1,44 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ofxRaspicam.h"
+#include "ExposureFusion.h"
+
+/*
+ Captures an exposure bracket (default -2/0/+2 EV) through an already
+ running ofxRaspicam and fuses it into one JPEG. Only exposure
+ compensation changes between frames: the camera, encoder and pools stay
+ up and the initial AE/AWB settle is paid once, not per frame.
+ */
+
+struct BracketReport
+{
+	bool success;
+	string outputPath;
+	vector<string> framePaths;
+	float settleMillis;			// initial settle
+	float captureMillis;		// all bracket frames including per-step settles
+	float decodeMillis;
+	float mergeMillis;
+	float saveMillis;
+	float totalMillis;
+};
+
+class ExposureBracket
+{
+public:
+	ExposureBracket();
+	void setup(ofxRaspicam* camera_);
+	BracketReport capture();
+
+	vector<float> evSteps;			// EV offsets from the current compensation
+	int stepSettleMillis;			// longest wait for AE to apply the new compensation before each frame
+	int initialSettleMillis;		// longest wait for AE/AWB before the first frame
+	bool keepFrames;				// keep the individual exposures next to the fused image
+	ExposureFusion fusion;
+	BracketReport lastReport;
+
+private:
+	ofxRaspicam* camera;
+	MetricsHistogram* totalTime;
+};
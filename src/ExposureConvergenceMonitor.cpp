@@ -0,0 +1,134 @@
+/*
+ *  ExposureConvergenceMonitor.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "ExposureConvergenceMonitor.h"
+#include "TimelineTrace.h"
+
+#include <time.h>
+
+// Reports kept, only the newest stableSamples are compared
+#define CONVERGENCE_HISTORY 16
+
+static int64_t monotonicMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static bool withinTolerance(float low, float high, float tolerance)
+{
+	float middle = (low + high) * 0.5f;
+	return middle <= 0 || (high - low) <= middle * tolerance;
+}
+
+ExposureConvergenceMonitor::ExposureConvergenceMonitor()
+{
+	stableSamples = 3;
+	exposureTolerance = 0.03f;
+	gainTolerance = 0.03f;
+	awbTolerance = 0.02f;
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&changed, &attributes);
+	pthread_condattr_destroy(&attributes);
+}
+
+ExposureConvergenceMonitor::~ExposureConvergenceMonitor()
+{
+	pthread_cond_destroy(&changed);
+	pthread_mutex_destroy(&mutex);
+}
+
+/**
+ * Record one MMAL_PARAMETER_CAMERA_SETTINGS report and wake any waiter
+ *
+ * @param settings As decoded by the control callback
+ */
+void ExposureConvergenceMonitor::addSample(const CameraFrameSettings& settings)
+{
+	Sample sample;
+	sample.micros = monotonicMicros();
+	sample.exposure = settings.exposureMicros;
+	sample.gain = settings.analogGain * settings.digitalGain;
+	sample.awbRed = settings.awbRedGain;
+	sample.awbBlue = settings.awbBlueGain;
+
+	pthread_mutex_lock(&mutex);
+	samples.push_back(sample);
+	if (samples.size() > CONVERGENCE_HISTORY)
+	{
+		samples.pop_front();
+	}
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&mutex);
+}
+
+void ExposureConvergenceMonitor::reset()
+{
+	pthread_mutex_lock(&mutex);
+	samples.clear();
+	pthread_mutex_unlock(&mutex);
+}
+
+bool ExposureConvergenceMonitor::converged_locked(int64_t sinceMicros)
+{
+	if ((int)samples.size() < stableSamples || samples[samples.size()-stableSamples].micros < sinceMicros)
+	{
+		return false;
+	}
+
+	Sample low = samples.back();
+	Sample high = samples.back();
+	for (size_t i=samples.size()-stableSamples; i<samples.size(); i++)
+	{
+		const Sample& s = samples[i];
+		low.exposure = min(low.exposure, s.exposure);		high.exposure = max(high.exposure, s.exposure);
+		low.gain = min(low.gain, s.gain);					high.gain = max(high.gain, s.gain);
+		low.awbRed = min(low.awbRed, s.awbRed);				high.awbRed = max(high.awbRed, s.awbRed);
+		low.awbBlue = min(low.awbBlue, s.awbBlue);			high.awbBlue = max(high.awbBlue, s.awbBlue);
+	}
+	return withinTolerance(low.exposure, high.exposure, exposureTolerance) &&
+		   withinTolerance(low.gain, high.gain, gainTolerance) &&
+		   withinTolerance(low.awbRed, high.awbRed, awbTolerance) &&
+		   withinTolerance(low.awbBlue, high.awbBlue, awbTolerance);
+}
+
+/**
+ * Block until settled or maxMillis has passed
+ *
+ * @param maxMillis Upper bound on the wait, e.g. Photo::timeout
+ * @return How long it took and whether it converged
+ */
+SettleReport ExposureConvergenceMonitor::waitForConvergence(int maxMillis)
+{
+	TIMELINE_SCOPE("wait_convergence");
+	int64_t startMicros = monotonicMicros();
+	int64_t deadlineMicros = startMicros + (int64_t)maxMillis * 1000;
+
+	SettleReport report;
+	struct timespec wake;
+	wake.tv_sec = deadlineMicros / 1000000;
+	wake.tv_nsec = (deadlineMicros % 1000000) * 1000;
+	pthread_mutex_lock(&mutex);
+	// Woken by each new report, or the deadline
+	while (!(report.converged = converged_locked(startMicros)) && monotonicMicros() < deadlineMicros)
+	{
+		pthread_cond_timedwait(&changed, &mutex, &wake);
+	}
+	report.samples = 0;
+	for (size_t i=0; i<samples.size(); i++)
+	{
+		if (samples[i].micros >= startMicros)
+			report.samples++;
+	}
+	pthread_mutex_unlock(&mutex);
+	report.millis = (monotonicMicros() - startMicros) / 1000.0f;
+	return report;
+}
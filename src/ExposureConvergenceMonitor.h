@@ -0,0 +1,64 @@
+#pragma once
+
+#include "ofMain.h"
+
+// Exposure actually used, from MMAL_PARAMETER_CAMERA_SETTINGS change events
+struct CameraFrameSettings
+{
+	uint32_t exposureMicros;
+	float analogGain;
+	float digitalGain;
+	float awbRedGain;
+	float awbBlueGain;
+	uint64_t updates;						// events received, 0 if the firmware never sent one
+};
+
+/*
+ Decides when auto exposure and AWB have settled, from the settings the
+ camera reports on its control port, so a capture can fire as soon as the
+ image is stable instead of after a fixed Photo::timeout.
+
+ Settled means at least stableSamples reports arrived after the wait
+ started and the newest stableSamples of them agree within tolerance.
+ Older reports never count: the preview port isn't streamed, so reports
+ stop between captures and what was seen before may no longer hold. With
+ too few new reports the wait runs to its timeout, which is the old
+ fixed-sleep behaviour. reset() drops the history, e.g. after a sensor
+ mode change.
+ */
+
+struct SettleReport
+{
+	bool converged;							// false if the wait hit its timeout
+	float millis;
+	int samples;							// reports received during the wait
+};
+
+class ExposureConvergenceMonitor
+{
+public:
+	ExposureConvergenceMonitor();
+	~ExposureConvergenceMonitor();
+	void addSample(const CameraFrameSettings& settings);	// from the control callback
+	void reset();
+	SettleReport waitForConvergence(int maxMillis);
+
+	int stableSamples;
+	float exposureTolerance;				// relative spread allowed across stableSamples
+	float gainTolerance;					// applies to analog * digital gain
+	float awbTolerance;
+
+private:
+	struct Sample
+	{
+		int64_t micros;						// CLOCK_MONOTONIC
+		float exposure;
+		float gain;
+		float awbRed;
+		float awbBlue;
+	};
+	bool converged_locked(int64_t sinceMicros);
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+	deque<Sample> samples;
+};
@@ -0,0 +1,281 @@
+/*
+ *  ExposureFusion.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "ExposureFusion.h"
+#include "ParallelFor.h"
+#include "TimelineTrace.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FUSION_USE_NEON 1
+#endif
+
+// Integer Rec.601 luma, good enough for weighting
+static inline int fusionLuma(const unsigned char* rgb)
+{
+	return (rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> 8;
+}
+
+/**
+ * out[x] = sum over frames of weight[f][x] * in[f][x], for one row of RGB.
+ * Weights are already normalized to sum to 1 per pixel.
+ */
+static void blendRow(const unsigned char** rows, const float** weights, int numFrames, int width, float* accumulator, unsigned char* out, const unsigned char* toneCurve)
+{
+	int x = 0;
+	memset(accumulator, 0, sizeof(float) * width * 3);
+
+#ifdef FUSION_USE_NEON
+	for (; x + 8 <= width; x += 8)
+	{
+		float32x4_t sum[3][2];
+		for (int c=0; c<3; c++)
+		{
+			sum[c][0] = vdupq_n_f32(0);
+			sum[c][1] = vdupq_n_f32(0);
+		}
+		for (int f=0; f<numFrames; f++)
+		{
+			uint8x8x3_t rgb = vld3_u8(rows[f] + x * 3);
+			float32x4_t w0 = vld1q_f32(weights[f] + x);
+			float32x4_t w1 = vld1q_f32(weights[f] + x + 4);
+			for (int c=0; c<3; c++)
+			{
+				uint16x8_t wide = vmovl_u8(rgb.val[c]);
+				float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(wide)));
+				float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(wide)));
+				sum[c][0] = vmlaq_f32(sum[c][0], lo, w0);
+				sum[c][1] = vmlaq_f32(sum[c][1], hi, w1);
+			}
+		}
+		uint8x8x3_t result;
+		for (int c=0; c<3; c++)
+		{
+			// +0.5 rounds, vcvt truncates toward zero
+			uint32x4_t lo = vcvtq_u32_f32(vaddq_f32(sum[c][0], vdupq_n_f32(0.5f)));
+			uint32x4_t hi = vcvtq_u32_f32(vaddq_f32(sum[c][1], vdupq_n_f32(0.5f)));
+			uint16x8_t narrow = vcombine_u16(vqmovn_u32(lo), vqmovn_u32(hi));
+			result.val[c] = vqmovn_u16(narrow);
+		}
+		vst3_u8(out + x * 3, result);
+	}
+#endif
+
+	for (int f=0; f<numFrames; f++)
+	{
+		const unsigned char* row = rows[f];
+		const float* weight = weights[f];
+		for (int px = x; px < width; px++)
+		{
+			float w = weight[px];
+			accumulator[px*3]   += w * row[px*3];
+			accumulator[px*3+1] += w * row[px*3+1];
+			accumulator[px*3+2] += w * row[px*3+2];
+		}
+	}
+	for (int i = x*3; i < width*3; i++)
+	{
+		int value = (int)(accumulator[i] + 0.5f);
+		out[i] = value > 255 ? 255 : value;
+	}
+
+	for (int i=0; i<width*3; i++)
+	{
+		out[i] = toneCurve[out[i]];
+	}
+}
+
+class FusionBlockWeightTask : public ParallelTask
+{
+public:
+	const vector<ofPixels*>* frames;
+	vector< vector<float> >* blockWeights;
+	const float* pixelWeight;
+	int blocksX;
+
+	// Mean well-exposedness of each block, rows of blocks are the parallel items
+	void run(int begin, int end)
+	{
+		for (size_t f=0; f<frames->size(); f++)
+		{
+			const ofPixels& pixels = *(*frames)[f];
+			int width = pixels.getWidth();
+			int height = pixels.getHeight();
+			const unsigned char* data = pixels.getPixels();
+			for (int by=begin; by<end; by++)
+			{
+				for (int bx=0; bx<blocksX; bx++)
+				{
+					float sum = 0;
+					int count = 0;
+					// Sample every other pixel, the block mean doesn't need all of them
+					for (int y = by*FUSION_BLOCK_SIZE; y < min((by+1)*FUSION_BLOCK_SIZE, height); y += 2)
+					{
+						const unsigned char* row = data + (size_t)y * width * 3;
+						for (int x = bx*FUSION_BLOCK_SIZE; x < min((bx+1)*FUSION_BLOCK_SIZE, width); x += 2)
+						{
+							sum += pixelWeight[fusionLuma(row + x*3)];
+							count++;
+						}
+					}
+					(*blockWeights)[f][by * blocksX + bx] = count ? sum / count : 0;
+				}
+			}
+		}
+	}
+};
+
+class FusionBlendTask : public ParallelTask
+{
+public:
+	const vector<ofPixels*>* frames;
+	const vector< vector<float> >* blockWeights;
+	const float* pixelWeight;
+	const unsigned char* toneCurve;
+	unsigned char* output;
+	int width, height, blocksX, blocksY;
+
+	void run(int begin, int end)
+	{
+		int numFrames = frames->size();
+		vector< vector<float> > weights(numFrames, vector<float>(width + 8));
+		vector<float> accumulator(width * 3);
+		vector<const unsigned char*> rows(numFrames);
+		vector<const float*> weightRows(numFrames);
+
+		for (int y=begin; y<end; y++)
+		{
+			// Bilinear position between block centres
+			float fy = (y + 0.5f) / FUSION_BLOCK_SIZE - 0.5f;
+			int by0 = max(0, min(blocksY-1, (int)floorf(fy)));
+			int by1 = min(blocksY-1, by0+1);
+			float ty = ofClamp(fy - by0, 0, 1);
+
+			for (int f=0; f<numFrames; f++)
+			{
+				rows[f] = (*frames)[f]->getPixels() + (size_t)y * width * 3;
+			}
+
+			for (int x=0; x<width; x++)
+			{
+				float fx = (x + 0.5f) / FUSION_BLOCK_SIZE - 0.5f;
+				int bx0 = max(0, min(blocksX-1, (int)floorf(fx)));
+				int bx1 = min(blocksX-1, bx0+1);
+				float tx = ofClamp(fx - bx0, 0, 1);
+
+				float total = 0;
+				for (int f=0; f<numFrames; f++)
+				{
+					const vector<float>& block = (*blockWeights)[f];
+					float top = block[by0*blocksX+bx0] + (block[by0*blocksX+bx1] - block[by0*blocksX+bx0]) * tx;
+					float bottom = block[by1*blocksX+bx0] + (block[by1*blocksX+bx1] - block[by1*blocksX+bx0]) * tx;
+					float regional = top + (bottom - top) * ty;
+					float w = (regional + 1e-4f) * pixelWeight[fusionLuma(rows[f] + x*3)] + 1e-6f;
+					weights[f][x] = w;
+					total += w;
+				}
+				float inverse = 1.0f / total;
+				for (int f=0; f<numFrames; f++)
+				{
+					weights[f][x] *= inverse;
+				}
+			}
+
+			for (int f=0; f<numFrames; f++)
+			{
+				weightRows[f] = &weights[f][0];
+			}
+			blendRow(&rows[0], &weightRows[0], numFrames, width, &accumulator[0], output + (size_t)y * width * 3, toneCurve);
+		}
+	}
+};
+
+ExposureFusion::ExposureFusion()
+{
+	wellExposedSigma = 0.2;
+	toneStrength = 0.3;
+	lastMergeMillis = 0;
+	builtSigma = -1;
+	builtStrength = -1;
+}
+
+void ExposureFusion::buildLookupTables()
+{
+	if (builtSigma == wellExposedSigma && builtStrength == toneStrength)
+	{
+		return;
+	}
+	for (int i=0; i<256; i++)
+	{
+		float v = i / 255.0f - 0.5f;
+		pixelWeight[i] = expf(-(v * v) / (2 * wellExposedSigma * wellExposedSigma));
+
+		// Blend of identity and a smoothstep S-curve to restore contrast lost in fusion
+		float t = i / 255.0f;
+		float s = t * t * (3 - 2 * t);
+		float toned = t + (s - t) * toneStrength;
+		toneCurve[i] = (unsigned char)ofClamp(toned * 255.0f + 0.5f, 0, 255);
+	}
+	builtSigma = wellExposedSigma;
+	builtStrength = toneStrength;
+}
+
+/**
+ * Fuse the bracket into output, allocating it if needed
+ *
+ * @param frames RGB frames of identical size, any exposure order
+ * @param output Receives the fused RGB image
+ * @return false if the frames are missing or mismatched
+ */
+bool ExposureFusion::merge(const vector<ofPixels*>& frames, ofPixels& output)
+{
+	TIMELINE_SCOPE("exposure_fusion");
+	unsigned long long start = ofGetElapsedTimeMicros();
+
+	if (frames.empty())
+	{
+		return false;
+	}
+	int width = frames[0]->getWidth();
+	int height = frames[0]->getHeight();
+	for (size_t f=0; f<frames.size(); f++)
+	{
+		if (frames[f]->getWidth() != width || frames[f]->getHeight() != height || frames[f]->getNumChannels() != 3)
+		{
+			ofLogError() << "ExposureFusion: frame " << f << " does not match the first frame";
+			return false;
+		}
+	}
+
+	buildLookupTables();
+	output.allocate(width, height, 3);
+
+	int blocksX = (width + FUSION_BLOCK_SIZE - 1) / FUSION_BLOCK_SIZE;
+	int blocksY = (height + FUSION_BLOCK_SIZE - 1) / FUSION_BLOCK_SIZE;
+	vector< vector<float> > blockWeights(frames.size(), vector<float>(blocksX * blocksY));
+
+	FusionBlockWeightTask blockTask;
+	blockTask.frames = &frames;
+	blockTask.blockWeights = &blockWeights;
+	blockTask.pixelWeight = pixelWeight;
+	blockTask.blocksX = blocksX;
+	ParallelFor::getInstance().run(blocksY, 4, blockTask);
+
+	FusionBlendTask blendTask;
+	blendTask.frames = &frames;
+	blendTask.blockWeights = &blockWeights;
+	blendTask.pixelWeight = pixelWeight;
+	blendTask.toneCurve = toneCurve;
+	blendTask.output = output.getPixels();
+	blendTask.width = width;
+	blendTask.height = height;
+	blendTask.blocksX = blocksX;
+	blendTask.blocksY = blocksY;
+	ParallelFor::getInstance().run(height, 32, blendTask);
+
+	lastMergeMillis = (ofGetElapsedTimeMicros() - start) / 1000.0f;
+	return true;
+}
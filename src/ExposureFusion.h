@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Merges an exposure bracket (RGB, same size) into one image.
+
+ Each frame is weighted per pixel by how well exposed it is, modulated
+ by a smooth regional weight computed on 16x16 blocks so large areas don't
+ flip between exposures and leave seams. The weighted sum is passed through
+ a global tone curve. Rows are processed in tiles on ParallelFor and the
+ per-pixel blend uses NEON where available.
+ */
+
+#define FUSION_BLOCK_SIZE 16
+
+class ExposureFusion
+{
+public:
+	ExposureFusion();
+	bool merge(const vector<ofPixels*>& frames, ofPixels& output);
+
+	float wellExposedSigma;		// spread of the well-exposedness gaussian, in 0-1 luma
+	float toneStrength;			// 0 disables the tone curve, 1 is a full S-curve
+	float lastMergeMillis;
+
+private:
+	void buildLookupTables();
+	float pixelWeight[256];
+	unsigned char toneCurve[256];
+	float builtSigma;
+	float builtStrength;
+};
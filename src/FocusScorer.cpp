@@ -0,0 +1,237 @@
+/*
+ *  FocusScorer.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "FocusScorer.h"
+#include "ParallelFor.h"
+#include "TimelineTrace.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FOCUS_USE_NEON 1
+#endif
+
+// Lanes are flushed to 64 bits at least this often: 1020^2 * 2048 / 8 still fits 32 bits
+#define FOCUS_NEON_BLOCK 2048
+
+/**
+ * Sum and sum of squares of the 4-neighbour Laplacian along one row,
+ * skipping the first and last column
+ */
+static void laplacianRow(const unsigned char* up, const unsigned char* mid, const unsigned char* down, int width, int64_t& sum, uint64_t& squares)
+{
+	int x = 1;
+	sum = 0;
+	squares = 0;
+
+#ifdef FOCUS_USE_NEON
+	while (x + 8 <= width - 1)
+	{
+		int blockEnd = min(width - 1, x + FOCUS_NEON_BLOCK);
+		int32x4_t sumLanes = vdupq_n_s32(0);
+		int32x4_t squareLanesLow = vdupq_n_s32(0);
+		int32x4_t squareLanesHigh = vdupq_n_s32(0);
+		for (; x + 8 <= blockEnd; x += 8)
+		{
+			uint16x8_t neighbours = vaddl_u8(vld1_u8(mid + x - 1), vld1_u8(mid + x + 1));
+			neighbours = vaddw_u8(neighbours, vld1_u8(up + x));
+			neighbours = vaddw_u8(neighbours, vld1_u8(down + x));
+			int16x8_t centre = vreinterpretq_s16_u16(vshll_n_u8(vld1_u8(mid + x), 2));
+			int16x8_t laplacian = vsubq_s16(centre, vreinterpretq_s16_u16(neighbours));
+			sumLanes = vpadalq_s16(sumLanes, laplacian);
+			// |laplacian| <= 1020, so each square fits and the lanes hold a block's worth
+			squareLanesLow = vmlal_s16(squareLanesLow, vget_low_s16(laplacian), vget_low_s16(laplacian));
+			squareLanesHigh = vmlal_s16(squareLanesHigh, vget_high_s16(laplacian), vget_high_s16(laplacian));
+		}
+		int64x2_t sumPairs = vpaddlq_s32(sumLanes);
+		sum += vgetq_lane_s64(sumPairs, 0) + vgetq_lane_s64(sumPairs, 1);
+		uint64x2_t squarePairs = vaddq_u64(vpaddlq_u32(vreinterpretq_u32_s32(squareLanesLow)), vpaddlq_u32(vreinterpretq_u32_s32(squareLanesHigh)));
+		squares += vgetq_lane_u64(squarePairs, 0) + vgetq_lane_u64(squarePairs, 1);
+	}
+#endif
+
+	for (; x < width - 1; x++)
+	{
+		int laplacian = 4 * mid[x] - mid[x - 1] - mid[x + 1] - up[x] - down[x];
+		sum += laplacian;
+		squares += laplacian * laplacian;
+	}
+}
+
+class FocusLaplacianTask : public ParallelTask
+{
+public:
+	const unsigned char* luma;
+	int width;
+	int64_t* rowSums;
+	uint64_t* rowSquares;
+
+	// Items are interior rows, item i is row i+1
+	void run(int begin, int end)
+	{
+		for (int item=begin; item<end; item++)
+		{
+			const unsigned char* mid = luma + (size_t)(item + 1) * width;
+			laplacianRow(mid - width, mid, mid + width, width, rowSums[item], rowSquares[item]);
+		}
+	}
+};
+
+class FocusDownscaleTask : public ParallelTask
+{
+public:
+	const unsigned char* source;		// luma, or RGB when rgb is set
+	int sourceStride;
+	bool rgb;
+	int factor;
+	unsigned char* destination;
+	int destinationWidth;
+
+	void run(int begin, int end)
+	{
+		int area = factor * factor;
+		for (int y=begin; y<end; y++)
+		{
+			unsigned char* out = destination + (size_t)y * destinationWidth;
+			const unsigned char* top = source + (size_t)y * factor * sourceStride;
+			for (int x=0; x<destinationWidth; x++)
+			{
+				int total = 0;
+				for (int dy=0; dy<factor; dy++)
+				{
+					const unsigned char* p = top + (size_t)dy * sourceStride + (rgb ? x * factor * 3 : x * factor);
+					if (rgb)
+					{
+						for (int dx=0; dx<factor; dx++, p += 3)
+						{
+							// Integer Rec.601 luma
+							total += (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+						}
+					}else
+					{
+						for (int dx=0; dx<factor; dx++)
+						{
+							total += p[dx];
+						}
+					}
+				}
+				out[x] = (total + area / 2) / area;
+			}
+		}
+	}
+};
+
+FocusScorer::FocusScorer()
+{
+	downscale = 2;
+	lastScore = 0;
+	lastMillis = 0;
+	smallWidth = 0;
+	smallHeight = 0;
+}
+
+/**
+ * Score a luma plane, e.g. the Y plane of an I420 frame
+ *
+ * @param luma First row
+ * @param width Visible width
+ * @param height Visible height
+ * @param stride Bytes between rows
+ * @return Laplacian variance, higher is sharper; -1 if the frame is too small
+ */
+float FocusScorer::score(const unsigned char* luma, int width, int height, int stride)
+{
+	TIMELINE_SCOPE("FocusScorer::score");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	
+	int factor = max(downscale, 1);
+	smallWidth = width / factor;
+	smallHeight = height / factor;
+	small.resize((size_t)smallWidth * smallHeight);
+	
+	FocusDownscaleTask task;
+	task.source = luma;
+	task.sourceStride = stride;
+	task.rgb = false;
+	task.factor = factor;
+	task.destination = small.empty() ? NULL : &small[0];
+	task.destinationWidth = smallWidth;
+	if (!small.empty())
+	{
+		ParallelFor::getInstance().run(smallHeight, 16, task);
+	}
+	
+	lastScore = scoreDownscaled();
+	lastMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0;
+	return lastScore;
+}
+
+/**
+ * Score a decoded RGB image, e.g. a scaled libjpeg decode of a capture
+ *
+ * @param pixels 8 bit RGB pixels
+ * @param scaledBy The pixels are already a 1/scaledBy decode, only the rest of downscale is applied
+ * @return Laplacian variance, higher is sharper; -1 if the image is too small or not RGB
+ */
+float FocusScorer::score(const ofPixels& pixels, int scaledBy)
+{
+	TIMELINE_SCOPE("FocusScorer::score");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	
+	if (pixels.getNumChannels() != 3)
+	{
+		lastScore = -1;
+		return lastScore;
+	}
+	int factor = max(downscale / max(scaledBy, 1), 1);
+	smallWidth = pixels.getWidth() / factor;
+	smallHeight = pixels.getHeight() / factor;
+	small.resize((size_t)smallWidth * smallHeight);
+	
+	FocusDownscaleTask task;
+	task.source = pixels.getPixels();
+	task.sourceStride = pixels.getWidth() * 3;
+	task.rgb = true;
+	task.factor = factor;
+	task.destination = small.empty() ? NULL : &small[0];
+	task.destinationWidth = smallWidth;
+	if (!small.empty())
+	{
+		ParallelFor::getInstance().run(smallHeight, 16, task);
+	}
+	
+	lastScore = scoreDownscaled();
+	lastMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0;
+	return lastScore;
+}
+
+float FocusScorer::scoreDownscaled()
+{
+	if (smallWidth < 3 || smallHeight < 3)
+	{
+		return -1;
+	}
+	int numRows = smallHeight - 2;
+	rowSums.resize(numRows);
+	rowSquares.resize(numRows);
+	
+	FocusLaplacianTask task;
+	task.luma = &small[0];
+	task.width = smallWidth;
+	task.rowSums = &rowSums[0];
+	task.rowSquares = &rowSquares[0];
+	ParallelFor::getInstance().run(numRows, 16, task);
+	
+	int64_t sum = 0;
+	uint64_t squares = 0;
+	for (int i=0; i<numRows; i++)
+	{
+		sum += rowSums[i];
+		squares += rowSquares[i];
+	}
+	double count = (double)numRows * (smallWidth - 2);
+	double mean = sum / count;
+	return (float)(squares / count - mean * mean);
+}
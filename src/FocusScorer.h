@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Sharpness of a frame as the variance of the Laplacian of its luma.
+ Edges give large second derivatives, so a sharp frame scores high and
+ motion blur or missed focus flattens the response. The luma is box
+ downscaled first (downscale x downscale): that averages away sensor
+ noise, which would otherwise dominate the variance at high gain, and
+ cuts the work to a fraction of the frame.
+
+ Scores depend on the scene and the downscale, so a blur threshold is per
+ installation: watch lastScore (camera_focus_score) on known good shots
+ and set the threshold well below them.
+
+ Rows are split across ParallelFor; the Laplacian uses NEON where available.
+ */
+
+class FocusScorer
+{
+public:
+	FocusScorer();
+	float score(const unsigned char* luma, int width, int height, int stride);
+	float score(const ofPixels& pixels, int scaledBy=1);
+
+	int downscale;						// box filter size before the Laplacian, 1 disables
+	float lastScore;
+	float lastMillis;
+
+private:
+	float scoreDownscaled();
+
+	vector<unsigned char> small;		// downscaled luma, packed
+	int smallWidth;
+	int smallHeight;
+	vector<int64_t> rowSums;			// per row partial sums, reduced after the parallel pass
+	vector<uint64_t> rowSquares;
+};
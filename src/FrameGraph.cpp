@@ -0,0 +1,285 @@
+/*
+ *  FrameGraph.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "FrameGraph.h"
+#include "TimelineTrace.h"
+#include "TraceLog.h"
+
+FrameGraphWorker::FrameGraphWorker()
+{
+	graph = NULL;
+}
+
+void FrameGraphWorker::threadedFunction()
+{
+	TimelineTrace::getInstance().nameCurrentThread("FrameGraph worker");
+	graph->workerLoop();
+}
+
+FrameGraph::FrameGraph()
+{
+	numWorkers = 2;
+	nextNode = 0;
+	sequence = 0;
+	busyNodes = 0;
+	stopping = false;
+	leases = NULL;
+
+	pthread_mutex_init(&graphMutex, NULL);
+	pthread_cond_init(&workReady, NULL);
+	pthread_cond_init(&nodeDone, NULL);
+}
+
+FrameGraph::~FrameGraph()
+{
+	stop();
+	for (size_t i=0; i<nodes.size(); i++)
+	{
+		delete nodes[i];
+	}
+	pthread_cond_destroy(&nodeDone);
+	pthread_cond_destroy(&workReady);
+	pthread_mutex_destroy(&graphMutex);
+}
+
+/**
+ * Add a processor. Nodes are added before start() and stay for the life of the graph.
+ *
+ * @param name Used as the node label on the frame_graph_* metrics
+ * @param processor Not owned, must outlive the graph
+ * @param queueDepth Frames the node may have waiting
+ * @param policy What submit() does when the queue is full
+ */
+void FrameGraph::addNode(string name, FrameProcessor* processor, int queueDepth, FrameBackpressure policy)
+{
+	FrameNode* node = new FrameNode();
+	node->name = name;
+	node->processor = processor;
+	node->queueDepth = max(1, queueDepth);
+	node->policy = policy;
+	node->busy = false;
+
+	string labels = (metricsLabels.empty() ? "" : metricsLabels + ",") + "node=\"" + name + "\"";
+	MetricsRegistry& registry = MetricsRegistry::getInstance();
+	node->processed = registry.addCounter("frame_graph_frames_total", "Frames a graph node has processed", labels);
+	node->dropped = registry.addCounter("frame_graph_dropped_total", "Frames a graph node skipped because its queue was full", labels);
+	node->queued = registry.addGauge("frame_graph_queue_depth", "Frames waiting for a graph node", labels);
+	static const double millisBounds[] = {1, 2.5, 5, 10, 25, 50, 100, 250, 1000};
+	node->processMillis = registry.addHistogram("frame_graph_process_ms", "Time a graph node spends on one frame", millisBounds, sizeof(millisBounds)/sizeof(double), labels);
+	if (!leases)
+	{
+		leases = registry.addGauge("frame_graph_leases", "Frame buffer references held by graph nodes", metricsLabels);
+	}
+	nodes.push_back(node);
+}
+
+/**
+ * Most buffers the nodes can hold at once, every queue full and every
+ * node running. The port needs this many on top of its own.
+ */
+int FrameGraph::maxLeasedBuffers()
+{
+	int total = 0;
+	for (size_t i=0; i<nodes.size(); i++)
+	{
+		total += nodes[i]->queueDepth + 1;
+	}
+	return total;
+}
+
+void FrameGraph::start()
+{
+	if (!workers.empty() || nodes.empty())
+	{
+		return;
+	}
+	stopping = false;
+	for (int i=0; i<max(1, numWorkers); i++)
+	{
+		FrameGraphWorker* worker = new FrameGraphWorker();
+		worker->graph = this;
+		worker->startThread(false, false);
+		workers.push_back(worker);
+	}
+}
+
+/**
+ * Stop the workers after the frames they are on, and release everything queued
+ */
+void FrameGraph::stop()
+{
+	pthread_mutex_lock(&graphMutex);
+	stopping = true;
+	pthread_cond_broadcast(&workReady);
+	pthread_cond_broadcast(&nodeDone);
+	pthread_mutex_unlock(&graphMutex);
+
+	for (size_t i=0; i<workers.size(); i++)
+	{
+		workers[i]->waitForThread(true);
+		delete workers[i];
+	}
+	workers.clear();
+	drain();
+}
+
+// mmal_buffer_header_release() can call the pool callback and send to a port, so never under graphMutex
+void FrameGraph::release(vector<MMAL_BUFFER_HEADER_T*>& buffers)
+{
+	for (size_t i=0; i<buffers.size(); i++)
+	{
+		mmal_buffer_header_release(buffers[i]);
+	}
+	buffers.clear();
+}
+
+/**
+ * Lease a frame to every node. Called from the port's buffer callback,
+ * which keeps its own reference and releases it as usual.
+ *
+ * @param buffer Filled buffer header
+ * @param info Its layout, sequence is filled in here
+ */
+void FrameGraph::submit(MMAL_BUFFER_HEADER_T* buffer, const FrameInfo& info)
+{
+	vector<MMAL_BUFFER_HEADER_T*> released;
+	pthread_mutex_lock(&graphMutex);
+	if (stopping || workers.empty())
+	{
+		pthread_mutex_unlock(&graphMutex);
+		return;
+	}
+	FrameLease lease;
+	lease.buffer = buffer;
+	lease.info = info;
+	lease.info.sequence = ++sequence;
+
+	int leased = 0;
+	for (size_t i=0; i<nodes.size(); i++)
+	{
+		FrameNode* node = nodes[i];
+		if ((int)node->queue.size() >= node->queueDepth)
+		{
+			if (node->policy == FRAME_DROP_NEWEST)
+			{
+				node->dropped->increment();
+				continue;
+			}
+			if (node->policy == FRAME_DROP_OLDEST)
+			{
+				released.push_back(node->queue.front().buffer);
+				node->queue.pop_front();
+				node->dropped->increment();
+			}
+			while (node->policy == FRAME_BLOCK && (int)node->queue.size() >= node->queueDepth && !stopping)
+			{
+				pthread_cond_wait(&nodeDone, &graphMutex);
+			}
+			if (stopping)
+			{
+				break;
+			}
+		}
+		mmal_buffer_header_acquire(buffer);
+		node->queue.push_back(lease);
+		node->queued->set(node->queue.size());
+		leased++;
+	}
+	leases->add(leased - (int)released.size());
+	if (leased)
+	{
+		pthread_cond_broadcast(&workReady);
+	}
+	pthread_mutex_unlock(&graphMutex);
+	release(released);
+}
+
+void FrameGraph::workerLoop()
+{
+	vector<MMAL_BUFFER_HEADER_T*> released(1);
+	pthread_mutex_lock(&graphMutex);
+	while (!stopping)
+	{
+		// The next idle node with work, starting after the last one picked
+		FrameNode* node = NULL;
+		for (size_t i=0; i<nodes.size() && !node; i++)
+		{
+			FrameNode* candidate = nodes[(nextNode + i) % nodes.size()];
+			if (!candidate->busy && !candidate->queue.empty())
+			{
+				node = candidate;
+				nextNode = (nextNode + i + 1) % nodes.size();
+			}
+		}
+		if (!node)
+		{
+			pthread_cond_wait(&workReady, &graphMutex);
+			continue;
+		}
+
+		FrameLease lease = node->queue.front();
+		node->queue.pop_front();
+		node->queued->set(node->queue.size());
+		node->busy = true;
+		busyNodes++;
+		// A FRAME_BLOCK submit may be waiting for this slot
+		pthread_cond_broadcast(&nodeDone);
+		pthread_mutex_unlock(&graphMutex);
+
+		{
+			TimelineScope scope(node->name.c_str());
+			scope.arg = (int64_t)lease.info.sequence;
+			unsigned long long startMicros = ofGetElapsedTimeMicros();
+			mmal_buffer_header_mem_lock(lease.buffer);
+			node->processor->process(lease);
+			mmal_buffer_header_mem_unlock(lease.buffer);
+			node->processMillis->observe((ofGetElapsedTimeMicros() - startMicros) / 1000.0);
+			node->processed->increment();
+		}
+		released[0] = lease.buffer;
+		release(released);
+		released.resize(1);
+		leases->add(-1);
+
+		pthread_mutex_lock(&graphMutex);
+		node->busy = false;
+		busyNodes--;
+		pthread_cond_broadcast(&nodeDone);
+		// Another frame may have queued for this node while it was busy
+		pthread_cond_broadcast(&workReady);
+	}
+	pthread_mutex_unlock(&graphMutex);
+}
+
+/**
+ * Release every queued frame and wait for the nodes that are running.
+ * The port must already be disabled, so no more frames are submitted;
+ * after this the graph holds no buffers and the pool can be destroyed.
+ */
+void FrameGraph::drain()
+{
+	vector<MMAL_BUFFER_HEADER_T*> released;
+	pthread_mutex_lock(&graphMutex);
+	for (size_t i=0; i<nodes.size(); i++)
+	{
+		while (!nodes[i]->queue.empty())
+		{
+			released.push_back(nodes[i]->queue.front().buffer);
+			nodes[i]->queue.pop_front();
+		}
+		nodes[i]->queued->set(0);
+	}
+	while (busyNodes > 0)
+	{
+		pthread_cond_wait(&nodeDone, &graphMutex);
+	}
+	pthread_mutex_unlock(&graphMutex);
+	if (leases)
+	{
+		leases->add(-(int64_t)released.size());
+	}
+	release(released);
+}
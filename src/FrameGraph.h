@@ -0,0 +1,119 @@
+#pragma once
+
+#include "ofMain.h"
+#include "interface/mmal/mmal.h"
+#include "FrameRingFormat.h"
+#include "MetricsRegistry.h"
+
+/*
+ Fans the raw video stream out to processors (statistics, focus,
+ streaming...) without copying it. Each node gets a lease on the same
+ MMAL buffer header, which is just a reference from
+ mmal_buffer_header_acquire(). The header goes back to its pool, and so
+ to the port, only when the last lease is released. A slow node keeps
+ frames out of the camera for as long as it holds them, and nobody else.
+
+ Nodes have bounded queues with a policy for a full queue:
+	FRAME_DROP_OLDEST	the node always works on the newest frames (default)
+	FRAME_DROP_NEWEST	the node sees an unbroken run, then a gap
+	FRAME_BLOCK			submit() waits for room. It runs on the MMAL callback
+						thread, so the port runs out of buffers and the camera
+						drops frames instead. Only for nodes that must see
+						every frame they are given, like a recorder.
+
+ A pool of workers runs the nodes. A node only ever runs on one worker at
+ a time, in frame order, so processors need no locking of their own.
+ */
+
+enum FrameBackpressure
+{
+	FRAME_DROP_OLDEST,
+	FRAME_DROP_NEWEST,
+	FRAME_BLOCK
+};
+
+struct FrameInfo
+{
+	uint32_t fourcc;					// FRAME_RING_I420
+	int width;							// visible size
+	int height;
+	int stride;							// bytes per luma row
+	int alignedHeight;					// rows in the luma plane, the chroma planes follow
+	int cameraNum;
+	uint64_t sequence;					// numbered by the graph, gaps are frames nobody leased
+	int64_t ptsMicros;					// VideoCore STC, MMAL_TIME_UNKNOWN if none
+	int64_t monotonicMicros;			// CLOCK_MONOTONIC, 0 if unknown
+	int64_t realtimeMicros;				// CLOCK_REALTIME, 0 if unknown
+};
+
+struct FrameLease
+{
+	MMAL_BUFFER_HEADER_T* buffer;		// one reference held until the node returns
+	FrameInfo info;
+	const unsigned char* data() const	{ return buffer->data + buffer->offset; }
+	uint32_t length() const				{ return buffer->length; }
+};
+
+class FrameProcessor
+{
+public:
+	virtual ~FrameProcessor() {}
+	// Called on a graph worker with the buffer memory locked; copy anything needed after returning
+	virtual void process(const FrameLease& frame) = 0;
+};
+
+class FrameGraph;
+
+class FrameGraphWorker : public ofThread
+{
+public:
+	FrameGraphWorker();
+	void threadedFunction();
+	FrameGraph* graph;
+};
+
+class FrameGraph
+{
+public:
+	FrameGraph();
+	~FrameGraph();
+	void addNode(string name, FrameProcessor* processor, int queueDepth=2, FrameBackpressure policy=FRAME_DROP_OLDEST);
+	void start();
+	void stop();
+	void submit(MMAL_BUFFER_HEADER_T* buffer, const FrameInfo& info);
+	void drain();
+	bool empty()						{ return nodes.empty(); }
+	int maxLeasedBuffers();
+
+	int numWorkers;
+	string metricsLabels;				// added to each node's node="name" label, set before addNode()
+
+private:
+	friend class FrameGraphWorker;
+	struct FrameNode
+	{
+		string name;
+		FrameProcessor* processor;
+		int queueDepth;
+		FrameBackpressure policy;
+		deque<FrameLease> queue;
+		bool busy;						// a worker is running it
+		MetricsCounter* processed;
+		MetricsCounter* dropped;
+		MetricsGauge* queued;
+		MetricsHistogram* processMillis;
+	};
+	void workerLoop();
+	static void release(vector<MMAL_BUFFER_HEADER_T*>& buffers);
+
+	vector<FrameNode*> nodes;
+	vector<FrameGraphWorker*> workers;
+	pthread_mutex_t graphMutex;			// guards the queues, busy flags and everything below
+	pthread_cond_t workReady;
+	pthread_cond_t nodeDone;
+	size_t nextNode;					// round robin start, so no node starves the others
+	uint64_t sequence;
+	int busyNodes;
+	bool stopping;
+	MetricsGauge* leases;				// references held across all nodes
+};
@@ -0,0 +1,242 @@
+/*
+ *  FrameMetadataLog.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "FrameMetadataLog.h"
+#include "TraceLog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Catch layout changes, readers on other hosts rely on these sizes
+typedef char frameMetadataHeaderSize[sizeof(FRAME_METADATA_HEADER) == 32 ? 1 : -1];
+typedef char frameMetadataRecordSize[sizeof(FRAME_METADATA_RECORD) == 128 ? 1 : -1];
+
+FrameMetadataLog::FrameMetadataLog()
+{
+	fd = -1;
+}
+
+FrameMetadataLog::~FrameMetadataLog()
+{
+	close();
+}
+
+/**
+ * Open a log for appending, creating it if needed
+ *
+ * @param path_ Log file, e.g. photos/frames.meta
+ * @return false if the file can't be opened or belongs to another format or version
+ */
+bool FrameMetadataLog::open(string path_)
+{
+	ofScopedLock lock(logMutex);
+	path = path_;
+	if (fd >= 0)
+	{
+		::close(fd);
+	}
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+	{
+		ofLogError() << "Could not open frame metadata log " << path;
+		return false;
+	}
+
+	struct stat info;
+	fstat(fd, &info);
+	if (info.st_size == 0)
+	{
+		FRAME_METADATA_HEADER header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, FRAME_METADATA_MAGIC, 8);
+		header.version = FRAME_METADATA_VERSION;
+		header.recordSize = sizeof(FRAME_METADATA_RECORD);
+		if (write(fd, &header, sizeof(header)) != sizeof(header))
+		{
+			ofLogError() << "Could not write frame metadata header " << path;
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+		return true;
+	}
+
+	FRAME_METADATA_HEADER header;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, FRAME_METADATA_MAGIC, 8) != 0 ||
+		header.version != FRAME_METADATA_VERSION || header.recordSize != sizeof(FRAME_METADATA_RECORD))
+	{
+		ofLogError() << "Not a version " << FRAME_METADATA_VERSION << " frame metadata log: " << path;
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+
+	// Drop a record torn by a crash so appends stay aligned
+	off_t records = (info.st_size - sizeof(header)) / sizeof(FRAME_METADATA_RECORD);
+	off_t complete = sizeof(header) + records * sizeof(FRAME_METADATA_RECORD);
+	if (complete != info.st_size)
+	{
+		TRACE_WARNING("Frame metadata log: dropping %d bytes of a partial record", (int)(info.st_size - complete));
+		if (ftruncate(fd, complete) != 0)
+		{
+			TRACE_ERROR("Could not truncate frame metadata log");
+		}
+	}
+	return true;
+}
+
+/**
+ * Append one record. Not synced, a lost tail only costs the last few records.
+ *
+ * @param record Filled in by the camera
+ * @return true if the whole record was written
+ */
+bool FrameMetadataLog::append(const FRAME_METADATA_RECORD& record)
+{
+	ofScopedLock lock(logMutex);
+	if (fd < 0)
+	{
+		return false;
+	}
+	// O_APPEND makes each record a single atomic append
+	if (write(fd, &record, sizeof(record)) != sizeof(record))
+	{
+		TRACE_ERROR("Could not append to frame metadata log");
+		return false;
+	}
+	return true;
+}
+
+void FrameMetadataLog::close()
+{
+	ofScopedLock lock(logMutex);
+	if (fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+}
+
+FrameMetadataReader::FrameMetadataReader()
+{
+	data = NULL;
+	mappedBytes = 0;
+	numRecords = 0;
+}
+
+FrameMetadataReader::~FrameMetadataReader()
+{
+	unmap();
+}
+
+/**
+ * Map a log read-only. Records appended afterwards are not visible until it is mapped again.
+ *
+ * @param path Log file
+ * @return false if it isn't a readable log of this version
+ */
+bool FrameMetadataReader::map(string path)
+{
+	unmap();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(FRAME_METADATA_HEADER))
+	{
+		::close(fd);
+		return false;
+	}
+	void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		return false;
+	}
+
+	const FRAME_METADATA_HEADER* header = (const FRAME_METADATA_HEADER*)mapped;
+	if (memcmp(header->magic, FRAME_METADATA_MAGIC, 8) != 0 || header->version != FRAME_METADATA_VERSION ||
+		header->recordSize != sizeof(FRAME_METADATA_RECORD))
+	{
+		munmap(mapped, info.st_size);
+		return false;
+	}
+	data = (const unsigned char*)mapped;
+	mappedBytes = info.st_size;
+	numRecords = (mappedBytes - sizeof(FRAME_METADATA_HEADER)) / sizeof(FRAME_METADATA_RECORD);
+	return true;
+}
+
+void FrameMetadataReader::unmap()
+{
+	if (data)
+	{
+		munmap((void*)data, mappedBytes);
+	}
+	data = NULL;
+	mappedBytes = 0;
+	numRecords = 0;
+}
+
+size_t FrameMetadataReader::size()
+{
+	return numRecords;
+}
+
+const FRAME_METADATA_RECORD* FrameMetadataReader::at(size_t index)
+{
+	if (index >= numRecords)
+	{
+		return NULL;
+	}
+	return (const FRAME_METADATA_RECORD*)(data + sizeof(FRAME_METADATA_HEADER) + index * sizeof(FRAME_METADATA_RECORD));
+}
+
+/**
+ * Binary search on realtimeMicros. Records are in finish order, which is
+ * time order except between cameras fired together, so the result is exact
+ * to within one synchronized group.
+ *
+ * @param realtimeMicros Epoch microseconds
+ * @return The last frame at or before that time, NULL if there is none
+ */
+const FRAME_METADATA_RECORD* FrameMetadataReader::findByRealtime(int64_t realtimeMicros)
+{
+	size_t low = 0;
+	size_t high = numRecords;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		if (at(middle)->realtimeMicros <= realtimeMicros)
+		{
+			low = middle + 1;
+		}else
+		{
+			high = middle;
+		}
+	}
+	return low ? at(low - 1) : NULL;
+}
+
+/**
+ * @param fileName JPEG name without directory
+ * @return The newest record for that file, NULL if there is none
+ */
+const FRAME_METADATA_RECORD* FrameMetadataReader::findByFileName(string fileName)
+{
+	for (size_t i=numRecords; i>0; i--)
+	{
+		const FRAME_METADATA_RECORD* record = at(i - 1);
+		if (strncmp(record->fileName, fileName.c_str(), sizeof(record->fileName)) == 0)
+		{
+			return record;
+		}
+	}
+	return NULL;
+}
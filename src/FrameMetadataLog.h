@@ -0,0 +1,84 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Per-frame capture metadata as a flat binary file next to the photos:
+ a 32 byte header followed by fixed 128 byte records in the order the
+ captures finished. Fixed records mean a reader can mmap the file and
+ index or binary search it directly, without parsing and without
+ opening any JPEGs. A record torn by a power cut is dropped when the log
+ is reopened.
+
+ Layout is little endian, as written by the Pi.
+ */
+
+#define FRAME_METADATA_MAGIC		"MMFRMETA"
+#define FRAME_METADATA_VERSION		1
+
+#define FRAME_METADATA_PTS_VALID		0x1		// pts, monotonic and realtime come from the frame itself
+#define FRAME_METADATA_SETTINGS_VALID	0x2		// exposure, gains and AWB come from a CAMERA_SETTINGS event
+
+struct FRAME_METADATA_HEADER
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t reserved[2];
+};
+
+struct FRAME_METADATA_RECORD
+{
+	uint64_t sequence;				// per camera, counts every capture since startup
+	int64_t ptsMicros;				// VideoCore STC at the start of the frame
+	int64_t monotonicMicros;		// pts mapped to CLOCK_MONOTONIC
+	int64_t realtimeMicros;			// pts mapped to CLOCK_REALTIME
+	uint32_t exposureMicros;
+	float analogGain;
+	float digitalGain;
+	float awbRedGain;
+	float awbBlueGain;
+	uint32_t bytes;
+	uint32_t crc32c;
+	uint16_t cameraNum;
+	uint16_t sensorMode;
+	uint16_t quality;
+	uint16_t flags;					// FRAME_METADATA_*
+	char fileName[60];				// JPEG name without directory, NUL terminated
+};
+
+// Writer, shared by every camera
+class FrameMetadataLog
+{
+public:
+	FrameMetadataLog();
+	~FrameMetadataLog();
+	bool open(string path_);
+	bool append(const FRAME_METADATA_RECORD& record);
+	void close();
+
+	string path;
+
+private:
+	ofMutex logMutex;
+	int fd;
+};
+
+// Read-only view of a log, valid until unmap() or destruction
+class FrameMetadataReader
+{
+public:
+	FrameMetadataReader();
+	~FrameMetadataReader();
+	bool map(string path);
+	void unmap();
+	size_t size();
+	const FRAME_METADATA_RECORD* at(size_t index);
+	const FRAME_METADATA_RECORD* findByRealtime(int64_t realtimeMicros);	// last frame at or before the time
+	const FRAME_METADATA_RECORD* findByFileName(string fileName);
+
+private:
+	const unsigned char* data;
+	size_t mappedBytes;
+	size_t numRecords;
+};
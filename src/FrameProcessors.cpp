@@ -0,0 +1,108 @@
+/*
+ *  FrameProcessors.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "FrameProcessors.h"
+
+/**
+ * @param labels Metric labels, e.g. camera="0",stream="raw" to keep them apart from the stills' gauges
+ */
+void StatisticsProcessor::setup(string labels)
+{
+	statistics.setup(labels);
+}
+
+void StatisticsProcessor::process(const FrameLease& frame)
+{
+	if (frame.length() >= (uint32_t)(frame.info.stride * frame.info.height))
+	{
+		processLuma(frame.data(), frame.info.width, frame.info.height, frame.info.stride);
+	}
+}
+
+void StatisticsProcessor::processLuma(const unsigned char* luma, int width, int height, int stride)
+{
+	statistics.compute(luma, width, height, stride);
+}
+
+/**
+ * Stills arrive decoded rather than leased; the statistics are the same,
+ * measured on the RGB pixels.
+ */
+void StatisticsProcessor::processStill(const ofPixels& pixels)
+{
+	statistics.compute(pixels);
+}
+
+FocusProcessor::FocusProcessor()
+{
+	score = NULL;
+}
+
+void FocusProcessor::setup(string labels)
+{
+	score = MetricsRegistry::getInstance().addGauge("camera_stream_focus_score", "Laplacian variance of the newest scored video frame", labels);
+}
+
+void FocusProcessor::process(const FrameLease& frame)
+{
+	if (frame.length() < (uint32_t)(frame.info.stride * frame.info.height))
+	{
+		return;
+	}
+	processLuma(frame.data(), frame.info.width, frame.info.height, frame.info.stride);
+}
+
+float FocusProcessor::processLuma(const unsigned char* luma, int width, int height, int stride)
+{
+	float value = scorer.score(luma, width, height, stride);
+	publish(value);
+	return value;
+}
+
+/**
+ * @param scaledBy How much smaller than the capture the pixels were decoded, see FocusScorer::score()
+ * @return The Laplacian variance, -1 if the pixels can't be scored
+ */
+float FocusProcessor::processStill(const ofPixels& pixels, int scaledBy)
+{
+	float value = scorer.score(pixels, scaledBy);
+	publish(value);
+	return value;
+}
+
+void FocusProcessor::publish(float value)
+{
+	if (score && value >= 0)
+	{
+		score->set((int64_t)(value + 0.5f));
+	}
+}
+
+PublishProcessor::PublishProcessor()
+{
+	publisher = NULL;
+}
+
+void PublishProcessor::process(const FrameLease& frame)
+{
+	if (!publisher || !frame.length())
+	{
+		return;
+	}
+	FRAME_RING_SLOT slot;
+	memset(&slot, 0, sizeof(slot));
+	slot.frameSequence = frame.info.sequence;
+	slot.ptsMicros = frame.info.ptsMicros;
+	slot.monotonicMicros = frame.info.monotonicMicros;
+	slot.realtimeMicros = frame.info.realtimeMicros;
+	slot.fourcc = frame.info.fourcc;
+	slot.width = frame.info.width;
+	slot.height = frame.info.height;
+	slot.stride = frame.info.stride;
+	slot.alignedHeight = frame.info.alignedHeight;
+	slot.cameraNum = frame.info.cameraNum;
+	publisher->publish(frame.data(), frame.length(), slot);
+}
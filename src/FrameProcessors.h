@@ -0,0 +1,53 @@
+#pragma once
+
+#include "ofMain.h"
+#include "FrameGraph.h"
+#include "FrameStatistics.h"
+#include "FocusScorer.h"
+#include "FramePublisher.h"
+
+/*
+ The stock FrameGraph nodes, each wrapping a tool the capture path already
+ uses on stills so it runs on every streamed frame instead. All read the
+ luma plane of the leased buffer in place; only the publisher copies, into
+ its shared memory ring. ofxRaspicam keeps its own statistics and focus
+ nodes and feeds them stills (the scaled analysis decode) and stacked
+ luma directly, so both paths measure with the same code.
+
+ Statistics and focus both split their work over ParallelFor, which runs
+ one job at a time, so the two nodes take turns on the cores rather than
+ running side by side.
+ */
+
+class StatisticsProcessor : public FrameProcessor
+{
+public:
+	void setup(string labels);
+	void process(const FrameLease& frame);
+	void processLuma(const unsigned char* luma, int width, int height, int stride);
+	void processStill(const ofPixels& pixels);
+	FrameStatistics statistics;			// camera_frame_* gauges for the stream, last holds the newest frame
+};
+
+class FocusProcessor : public FrameProcessor
+{
+public:
+	FocusProcessor();
+	void setup(string labels);
+	void process(const FrameLease& frame);
+	float processLuma(const unsigned char* luma, int width, int height, int stride);
+	float processStill(const ofPixels& pixels, int scaledBy=1);
+	FocusScorer scorer;
+
+private:
+	void publish(float value);
+	MetricsGauge* score;				// NULL until setup(), the stills' node leaves it unset
+};
+
+class PublishProcessor : public FrameProcessor
+{
+public:
+	PublishProcessor();
+	void process(const FrameLease& frame);
+	FramePublisher* publisher;			// not owned, its own ring rather than the one the stills go to
+};
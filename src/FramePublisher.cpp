@@ -0,0 +1,238 @@
+/*
+ *  FramePublisher.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "FramePublisher.h"
+#include "TraceLog.h"
+
+FramePublisher::FramePublisher()
+{
+	header = NULL;
+	mappedBytes = 0;
+	writing = false;
+	overflowed = false;
+	writeBytes = 0;
+	publishedFrames = NULL;
+	droppedFrames = NULL;
+}
+
+FramePublisher::~FramePublisher()
+{
+	close();
+}
+
+/**
+ * Create the ring, replacing any left behind by an earlier run. Readers
+ * still mapping an old ring see it marked closed and reopen by name.
+ *
+ * @param name_ shm name starting with '/', shows up in /dev/shm
+ * @param numSlots Frames kept; a reader more than numSlots-1 frames behind skips ahead
+ * @param slotBytes Largest frame that can be published, bigger ones are dropped
+ * @param metricLabels Prometheus labels for the publish counters, e.g. camera="0"
+ * @return false if the shared memory can't be created
+ */
+bool FramePublisher::setup(string name_, int numSlots, uint32_t slotBytes, string metricLabels)
+{
+	close();
+	name = name_;
+	numSlots = max(numSlots, 2);
+	slotBytes = (slotBytes + 4095) / 4096 * 4096;
+
+	size_t dataOffset = frameRingDataOffset(numSlots);
+	size_t totalBytes = dataOffset + (size_t)numSlots * slotBytes;
+
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+	{
+		ofLogError() << "Could not create frame ring " << name << ": " << strerror(errno);
+		return false;
+	}
+	if (ftruncate(fd, totalBytes) != 0)
+	{
+		ofLogError() << "Could not size frame ring " << name << " to " << totalBytes << " bytes";
+		::close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+	void* mapped = mmap(NULL, totalBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		ofLogError() << "Could not map frame ring " << name;
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	// ftruncate leaves the object zeroed, so every slot starts abandoned (sequence 0)
+	header = (FRAME_RING_HEADER*)mapped;
+	mappedBytes = totalBytes;
+	header->version = FRAME_RING_VERSION;
+	header->numSlots = numSlots;
+	header->slotBytes = slotBytes;
+	header->dataOffset = dataOffset;
+	header->published = 0;
+	header->closed = 0;
+	header->writerPid = getpid();
+	__sync_synchronize();
+	memcpy(header->magic, FRAME_RING_MAGIC, 8);
+
+	if (!publishedFrames)
+	{
+		publishedFrames = MetricsRegistry::getInstance().addCounter("camera_frames_published_total", "Frames made visible in the shared memory ring", metricLabels);
+		droppedFrames = MetricsRegistry::getInstance().addCounter("camera_frames_publish_dropped_total", "Frames abandoned or too large for a ring slot", metricLabels);
+	}
+	ofLogNotice() << "frame ring " << name << ": " << numSlots << " slots of " << slotBytes << " bytes";
+	return true;
+}
+
+void FramePublisher::close()
+{
+	if (!header)
+	{
+		return;
+	}
+	abort();
+	header->closed = 1;
+	__sync_synchronize();
+	munmap(header, mappedBytes);
+	shm_unlink(name.c_str());
+	header = NULL;
+	mappedBytes = 0;
+}
+
+bool FramePublisher::isReady()
+{
+	return header != NULL;
+}
+
+FRAME_RING_SLOT* FramePublisher::slotAt(uint64_t frame)
+{
+	return (FRAME_RING_SLOT*)(header + 1) + frame % header->numSlots;
+}
+
+unsigned char* FramePublisher::dataAt(uint64_t frame)
+{
+	return (unsigned char*)header + header->dataOffset + (size_t)(frame % header->numSlots) * header->slotBytes;
+}
+
+/**
+ * Claim the slot for the next frame. Readers stop trusting whatever the
+ * slot held before as soon as this returns.
+ */
+void FramePublisher::begin()
+{
+	if (!header)
+	{
+		return;
+	}
+	if (writing)
+	{
+		abort();
+	}
+	uint64_t frame = header->published;
+	slotAt(frame)->sequence = 2 * frame + 1;
+	__sync_synchronize();
+	writing = true;
+	overflowed = false;
+	writeBytes = 0;
+}
+
+/**
+ * Copy the next piece of the current frame into its slot
+ *
+ * @param data Bytes to add, e.g. one encoder buffer
+ * @param size Length of data
+ * @return false if there is no frame in progress or it no longer fits
+ */
+bool FramePublisher::append(const void* data, uint32_t size)
+{
+	if (!writing || overflowed)
+	{
+		return false;
+	}
+	if (size > header->slotBytes - writeBytes)
+	{
+		overflowed = true;
+		return false;
+	}
+	memcpy(dataAt(header->published) + writeBytes, data, size);
+	writeBytes += size;
+	return true;
+}
+
+/**
+ * Publish the current frame
+ *
+ * @param info Frame description; sequence and bytes are filled in here
+ * @return false if nothing was in progress or the frame overflowed its slot
+ */
+bool FramePublisher::commit(const FRAME_RING_SLOT& info)
+{
+	if (!writing)
+	{
+		return false;
+	}
+	if (overflowed)
+	{
+		TRACE_WARNING("frame ring: frame %llu over %u bytes dropped", header->published, header->slotBytes);
+		abort();
+		return false;
+	}
+
+	uint64_t frame = header->published;
+	FRAME_RING_SLOT* slot = slotAt(frame);
+	slot->frameSequence = info.frameSequence;
+	slot->ptsMicros = info.ptsMicros;
+	slot->monotonicMicros = info.monotonicMicros;
+	slot->realtimeMicros = info.realtimeMicros;
+	slot->bytes = writeBytes;
+	slot->fourcc = info.fourcc;
+	slot->width = info.width;
+	slot->height = info.height;
+	slot->stride = info.stride;
+	slot->cameraNum = info.cameraNum;
+	slot->alignedHeight = info.alignedHeight;
+
+	// Data and description must land before the slot reads as complete,
+	// and the slot before the header points readers at it
+	__sync_synchronize();
+	slot->sequence = 2 * frame + 2;
+	__sync_synchronize();
+	header->published = frame + 1;
+	__sync_synchronize();
+
+	writing = false;
+	publishedFrames->increment();
+	return true;
+}
+
+// Give up on the current frame; its slot reads as empty until reused
+void FramePublisher::abort()
+{
+	if (!writing)
+	{
+		return;
+	}
+	slotAt(header->published)->sequence = 0;
+	__sync_synchronize();
+	writing = false;
+	droppedFrames->increment();
+}
+
+/**
+ * Publish a frame that is already complete in memory
+ *
+ * @param data Frame bytes
+ * @param size Length of data
+ * @param info Frame description, see commit()
+ * @return true if readers can see the frame
+ */
+bool FramePublisher::publish(const void* data, uint32_t size, const FRAME_RING_SLOT& info)
+{
+	begin();
+	append(data, size);
+	return commit(info);
+}
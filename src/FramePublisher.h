@@ -0,0 +1,48 @@
+#pragma once
+
+#include "ofMain.h"
+#include "FrameRingFormat.h"
+#include "MetricsRegistry.h"
+
+/*
+ Single writer side of the shared memory frame ring (FrameRingFormat.h).
+ A frame is written straight into its slot as it arrives, e.g. one encoder
+ buffer at a time from the MMAL callback, and made visible to readers by
+ commit(). Readers map the same pages read-only, so each frame is copied
+ once on the way in and never again however many processes watch it.
+
+ One frame is in flight at a time: begin(), append()..., then commit()
+ or abort(). The calls may come from different threads as long as they
+ don't overlap, which is how a capture runs anyway.
+ */
+
+class FramePublisher
+{
+public:
+	FramePublisher();
+	~FramePublisher();
+	bool setup(string name_, int numSlots=4, uint32_t slotBytes=6*1024*1024, string metricLabels="");
+	void close();
+	bool isReady();
+
+	void begin();
+	bool append(const void* data, uint32_t size);
+	bool commit(const FRAME_RING_SLOT& info);
+	void abort();
+	bool publish(const void* data, uint32_t size, const FRAME_RING_SLOT& info);
+
+	string name;						// shm name, e.g. "/mmalCameraApp-cam0"
+
+private:
+	FRAME_RING_SLOT* slotAt(uint64_t frame);
+	unsigned char* dataAt(uint64_t frame);
+
+	FRAME_RING_HEADER* header;
+	size_t mappedBytes;
+	bool writing;						// between begin() and commit()/abort()
+	bool overflowed;					// current frame didn't fit its slot
+	uint32_t writeBytes;
+
+	MetricsCounter* publishedFrames;
+	MetricsCounter* droppedFrames;
+};
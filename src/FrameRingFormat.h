@@ -0,0 +1,253 @@
+#pragma once
+
+/*
+ Shared memory frame ring written by FramePublisher and read by any number
+ of local processes through FrameSubscriber. Kept free of openFrameworks
+ and MMAL so consumers (see tools/frameSubscriber) build with just a C++
+ compiler.
+
+ Layout of the POSIX shm object (/dev/shm/<name>):
+	FRAME_RING_HEADER
+	numSlots x FRAME_RING_SLOT
+	numSlots x slotBytes of frame data, starting at dataOffset (page aligned)
+
+ Frame n lives in slot n % numSlots. Each slot is a seqlock: the writer sets
+ sequence to 2n+1, writes the data, then sets 2n+2 and bumps published to
+ n+1. A reader holds on to the even value it saw and checks it again after
+ using the data in place; if it changed the writer lapped the reader and
+ the frame must be thrown away. Readers never write to the ring, so a slow
+ or dead consumer can't hold the camera up.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FRAME_RING_MAGIC		"MMFRRING"
+#define FRAME_RING_VERSION		1
+
+// Same values as MMAL_FOURCC
+#define FRAME_RING_FOURCC(a, b, c, d)	((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+#define FRAME_RING_JPEG					FRAME_RING_FOURCC('J', 'P', 'E', 'G')
+#define FRAME_RING_I420					FRAME_RING_FOURCC('I', '4', '2', '0')
+
+struct FRAME_RING_HEADER
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t numSlots;
+	uint32_t slotBytes;					// capacity of each slot's data area
+	uint32_t dataOffset;				// from the start of the object
+	volatile uint64_t published;		// frames committed so far, the next frame is this index
+	volatile uint32_t closed;			// set when the writer shuts down, readers should reopen
+	uint32_t writerPid;
+	uint32_t reserved[6];
+};
+
+struct FRAME_RING_SLOT
+{
+	volatile uint64_t sequence;			// 2n+1 while frame n is written, 2n+2 once complete, 0 if abandoned
+	uint64_t frameSequence;				// the camera's own frame or capture number
+	int64_t ptsMicros;					// VideoCore STC, INT64_MIN if unknown
+	int64_t monotonicMicros;			// CLOCK_MONOTONIC
+	int64_t realtimeMicros;				// CLOCK_REALTIME
+	uint32_t bytes;
+	uint32_t fourcc;					// FRAME_RING_JPEG, FRAME_RING_I420
+	uint16_t width;
+	uint16_t height;
+	uint16_t stride;					// I420 luma stride, 0 for encoded frames
+	uint16_t cameraNum;
+	uint16_t alignedHeight;				// I420 rows per plane including padding, 0 for encoded frames
+	uint16_t reserved16;
+	uint32_t reserved;
+};
+
+// Catch layout changes, consumers built elsewhere rely on these sizes
+typedef char frameRingHeaderSize[sizeof(FRAME_RING_HEADER) == 64 ? 1 : -1];
+typedef char frameRingSlotSize[sizeof(FRAME_RING_SLOT) == 64 ? 1 : -1];
+
+inline size_t frameRingDataOffset(uint32_t numSlots)
+{
+	size_t headers = sizeof(FRAME_RING_HEADER) + numSlots * sizeof(FRAME_RING_SLOT);
+	size_t page = 4096;
+	return (headers + page - 1) / page * page;
+}
+
+// A frame mapped in place, valid while FrameSubscriber::isValid() says so
+struct FrameView
+{
+	FRAME_RING_SLOT info;				// copy of the slot header
+	const unsigned char* data;			// info.bytes of frame data inside the ring
+	uint64_t frameIndex;				// position in the ring's sequence
+	const FRAME_RING_SLOT* slot;
+	uint64_t ticket;					// slot->sequence when the view was taken
+};
+
+class FrameSubscriber
+{
+public:
+	FrameSubscriber()
+	{
+		base = NULL;
+		mappedBytes = 0;
+		nextFrame = 0;
+		skippedFrames = 0;
+	}
+
+	~FrameSubscriber()
+	{
+		close();
+	}
+
+	/**
+	 * Map a ring read-only. Frames already in the ring are skipped, reading starts with the next one.
+	 *
+	 * @param name shm name as given to FramePublisher::setup(), e.g. "/mmalCameraApp-cam0"
+	 * @return false if there is no ring of this version
+	 */
+	bool open(const std::string& name)
+	{
+		close();
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd < 0)
+		{
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(FRAME_RING_HEADER))
+		{
+			::close(fd);
+			return false;
+		}
+		void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED)
+		{
+			return false;
+		}
+		const FRAME_RING_HEADER* header = (const FRAME_RING_HEADER*)mapped;
+		if (memcmp(header->magic, FRAME_RING_MAGIC, 8) != 0 || header->version != FRAME_RING_VERSION || header->numSlots < 2 ||
+			frameRingDataOffset(header->numSlots) + (size_t)header->numSlots * header->slotBytes > (size_t)info.st_size)
+		{
+			munmap(mapped, info.st_size);
+			return false;
+		}
+		base = (const unsigned char*)mapped;
+		mappedBytes = info.st_size;
+		nextFrame = header->published;
+		skippedFrames = 0;
+		return true;
+	}
+
+	void close()
+	{
+		if (base)
+		{
+			munmap((void*)base, mappedBytes);
+		}
+		base = NULL;
+		mappedBytes = 0;
+	}
+
+	bool isOpen()
+	{
+		return base != NULL;
+	}
+
+	// The writer went away; open() again to follow a restarted camera
+	bool isClosed()
+	{
+		return !base || header()->closed;
+	}
+
+	/**
+	 * Take the oldest frame not yet seen that is still intact. A reader that
+	 * fell more than a ring behind skips ahead, the frames it missed are
+	 * counted in skippedFrames.
+	 *
+	 * @param view Receives the frame, mapped in place
+	 * @return false if there is no new frame
+	 */
+	bool next(FrameView& view)
+	{
+		if (!base)
+		{
+			return false;
+		}
+		const FRAME_RING_HEADER* ring = header();
+		while (true)
+		{
+			uint64_t published = ring->published;
+			__sync_synchronize();
+			if (published < nextFrame)
+			{
+				// Writer restarted with the same name
+				nextFrame = published;
+			}
+			if (nextFrame >= published)
+			{
+				return false;
+			}
+			// The slot after the newest frame may be being rewritten, keep clear of it
+			uint64_t oldestSafe = published > ring->numSlots - 1 ? published - (ring->numSlots - 1) : 0;
+			if (nextFrame < oldestSafe)
+			{
+				skippedFrames += oldestSafe - nextFrame;
+				nextFrame = oldestSafe;
+			}
+
+			uint64_t index = nextFrame++;
+			const FRAME_RING_SLOT* slot = slotAt(index % ring->numSlots);
+			uint64_t ticket = slot->sequence;
+			__sync_synchronize();
+			if (ticket != 2 * index + 2)
+			{
+				skippedFrames++;
+				continue;
+			}
+			view.info = *slot;
+			view.data = base + ring->dataOffset + (size_t)(index % ring->numSlots) * ring->slotBytes;
+			view.frameIndex = index;
+			view.slot = slot;
+			view.ticket = ticket;
+			__sync_synchronize();
+			if (slot->sequence != ticket || view.info.bytes > ring->slotBytes)
+			{
+				skippedFrames++;
+				continue;
+			}
+			return true;
+		}
+	}
+
+	/**
+	 * Check a view after using its data; false means the writer reused the
+	 * slot meanwhile and whatever was read from view.data is garbage.
+	 */
+	bool isValid(const FrameView& view)
+	{
+		__sync_synchronize();
+		return view.slot->sequence == view.ticket;
+	}
+
+	uint64_t skippedFrames;				// frames overwritten before this reader got to them
+
+private:
+	const FRAME_RING_HEADER* header()
+	{
+		return (const FRAME_RING_HEADER*)base;
+	}
+
+	const FRAME_RING_SLOT* slotAt(uint32_t index)
+	{
+		return (const FRAME_RING_SLOT*)(base + sizeof(FRAME_RING_HEADER)) + index;
+	}
+
+	const unsigned char* base;
+	size_t mappedBytes;
+	uint64_t nextFrame;
+};
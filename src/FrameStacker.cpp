@@ -0,0 +1,473 @@
+/*
+ *  FrameStacker.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "FrameStacker.h"
+#include "ParallelFor.h"
+#include "TimelineTrace.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define STACKER_USE_NEON 1
+#endif
+
+// Pyramid levels below this size are too small to register against
+#define STACK_MIN_LEVEL_SIZE 32
+
+// Geometry of one I420 plane inside the aligned frame
+struct StackPlane
+{
+	size_t offset;
+	int stride;
+	int width;
+	int height;
+};
+
+static void stackPlanes(int width, int height, int stride, int alignedHeight, StackPlane planes[3])
+{
+	planes[0].offset = 0;
+	planes[0].stride = stride;
+	planes[0].width = width;
+	planes[0].height = height;
+	for (int p=1; p<3; p++)
+	{
+		planes[p].offset = (size_t)stride * alignedHeight + (size_t)(p - 1) * (stride / 2) * (alignedHeight / 2);
+		planes[p].stride = stride / 2;
+		planes[p].width = (width + 1) / 2;
+		planes[p].height = (height + 1) / 2;
+	}
+}
+
+/**
+ * acc[x] += src[x] for count pixels
+ */
+static void accumulateMean(const unsigned char* src, unsigned short* acc, int count)
+{
+	int x = 0;
+#ifdef STACKER_USE_NEON
+	for (; x + 16 <= count; x += 16)
+	{
+		uint8x16_t pixels = vld1q_u8(src + x);
+		uint16x8_t lo = vld1q_u16(acc + x);
+		uint16x8_t hi = vld1q_u16(acc + x + 8);
+		vst1q_u16(acc + x, vaddw_u8(lo, vget_low_u8(pixels)));
+		vst1q_u16(acc + x + 8, vaddw_u8(hi, vget_high_u8(pixels)));
+	}
+#endif
+	for (; x < count; x++)
+	{
+		acc[x] += src[x];
+	}
+}
+
+/**
+ * Move each 8.8 estimate toward its sample by at most clip/n levels
+ */
+static void accumulateMedian(const unsigned char* src, unsigned short* acc, int count, int n, int clip)
+{
+	int limit = clip << 8;
+	for (int x = 0; x < count; x++)
+	{
+		int difference = ((int)src[x] << 8) - acc[x];
+		if (difference > limit) difference = limit;
+		if (difference < -limit) difference = -limit;
+		acc[x] = (unsigned short)(acc[x] + difference / n);
+	}
+}
+
+class StackMergeTask : public ParallelTask
+{
+public:
+	const unsigned char* frame;
+	unsigned short* accumulator;
+	StackPlane planes[3];
+	int shiftX;
+	int shiftY;
+	FrameStacker::Mode mode;
+	int n;								// frames merged including this one
+	int medianClip;
+
+	void run(int begin, int end)
+	{
+		vector<unsigned char> shifted(planes[0].width);
+		for (int item = begin; item < end; item++)
+		{
+			// Items walk the visible rows of Y, then U, then V
+			int plane = 0;
+			int row = item;
+			while (plane < 2 && row >= planes[plane].height)
+			{
+				row -= planes[plane].height;
+				plane++;
+			}
+			const StackPlane& geometry = planes[plane];
+			int dx = plane ? (shiftX >> 1) : shiftX;
+			int dy = plane ? (shiftY >> 1) : shiftY;
+
+			int sourceRow = ofClamp(row + dy, 0, geometry.height - 1);
+			const unsigned char* source = frame + geometry.offset + (size_t)sourceRow * geometry.stride;
+			unsigned short* acc = accumulator + geometry.offset + (size_t)row * geometry.stride;
+
+			// Replicate the edge for pixels shifted in from outside the frame
+			const unsigned char* samples = source + dx;
+			if (dx != 0)
+			{
+				for (int x = 0; x < geometry.width; x++)
+				{
+					shifted[x] = source[(int)ofClamp(x + dx, 0, geometry.width - 1)];
+				}
+				samples = &shifted[0];
+			}
+
+			if (n == 1)
+			{
+				for (int x = 0; x < geometry.width; x++)
+				{
+					acc[x] = (mode == FrameStacker::STACK_MEDIAN) ? (samples[x] << 8) : samples[x];
+				}
+			}
+			else if (mode == FrameStacker::STACK_MEDIAN)
+			{
+				accumulateMedian(samples, acc, geometry.width, n, medianClip);
+			}
+			else
+			{
+				accumulateMean(samples, acc, geometry.width);
+			}
+		}
+	}
+};
+
+class StackResolveTask : public ParallelTask
+{
+public:
+	const unsigned short* accumulator;
+	unsigned char* output;
+	StackPlane planes[3];
+	FrameStacker::Mode mode;
+	const unsigned char* divide;		// STACK_MEAN: sum -> rounded mean
+
+	void run(int begin, int end)
+	{
+		for (int item = begin; item < end; item++)
+		{
+			int plane = 0;
+			int row = item;
+			while (plane < 2 && row >= planes[plane].height)
+			{
+				row -= planes[plane].height;
+				plane++;
+			}
+			size_t start = planes[plane].offset + (size_t)row * planes[plane].stride;
+			const unsigned short* acc = accumulator + start;
+			unsigned char* out = output + start;
+			if (mode == FrameStacker::STACK_MEDIAN)
+			{
+				for (int x = 0; x < planes[plane].width; x++)
+				{
+					out[x] = (unsigned char)min(255, (acc[x] + 128) >> 8);
+				}
+			}
+			else
+			{
+				for (int x = 0; x < planes[plane].width; x++)
+				{
+					out[x] = divide[acc[x]];
+				}
+			}
+		}
+	}
+};
+
+// Sum of absolute differences for a list of candidate offsets at one pyramid level
+class StackShiftSearchTask : public ParallelTask
+{
+public:
+	const unsigned char* reference;
+	int referenceStride;
+	const unsigned char* current;
+	int currentStride;
+	int width;
+	int height;
+	int margin;
+	int step;							// sample every step-th row and column
+	vector<int> candidateX;
+	vector<int> candidateY;
+	vector<float> cost;
+
+	void run(int begin, int end)
+	{
+		for (int c = begin; c < end; c++)
+		{
+			int dx = candidateX[c];
+			int dy = candidateY[c];
+			uint64_t sum = 0;
+			uint64_t count = 0;
+			for (int y = margin; y < height - margin; y += step)
+			{
+				const unsigned char* ref = reference + (size_t)y * referenceStride;
+				const unsigned char* cur = current + (size_t)(y + dy) * currentStride + dx;
+				for (int x = margin; x < width - margin; x += step)
+				{
+					sum += abs((int)ref[x] - (int)cur[x]);
+				}
+				count += (width - 2 * margin + step - 1) / step;
+			}
+			cost[c] = count ? (float)sum / count : 1e9f;
+		}
+	}
+};
+
+FrameStacker::FrameStacker()
+{
+	width = height = stride = alignedHeight = 0;
+	mode = STACK_MEAN;
+	maxShift = 64;
+	medianClip = 24;
+	rejectDifference = 24;
+	numFrames = 0;
+	rejectedFrames = 0;
+	lastShiftX = lastShiftY = 0;
+	lastDifference = 0;
+	lastAddMillis = 0;
+	currentLuma = NULL;
+	for (int l=0; l<STACK_PYRAMID_LEVELS; l++)
+	{
+		levelWidth[l] = levelHeight[l] = 0;
+	}
+}
+
+size_t FrameStacker::frameSize()
+{
+	return (size_t)stride * alignedHeight * 3 / 2;
+}
+
+/**
+ * Allocate the accumulator and pyramids for one frame geometry
+ *
+ * @param width_ Visible width
+ * @param height_ Visible height
+ * @param stride_ Luma stride in bytes, chroma uses half
+ * @param alignedHeight_ Rows allocated per luma plane
+ */
+void FrameStacker::setup(int width_, int height_, int stride_, int alignedHeight_)
+{
+	width = width_;
+	height = height_;
+	stride = stride_;
+	alignedHeight = alignedHeight_;
+
+	accumulator.assign(frameSize(), 0);
+	output.assign(frameSize(), 128);
+	memset(&output[0], 0, (size_t)stride * alignedHeight);
+
+	for (int l=0; l<STACK_PYRAMID_LEVELS; l++)
+	{
+		levelWidth[l] = width >> l;
+		levelHeight[l] = height >> l;
+		reference[l].assign((size_t)levelWidth[l] * levelHeight[l], 0);
+		current[l].assign(l ? (size_t)levelWidth[l] * levelHeight[l] : 0, 0);
+	}
+	begin(mode);
+}
+
+void FrameStacker::begin(Mode mode_)
+{
+	mode = mode_;
+	numFrames = 0;
+	rejectedFrames = 0;
+	lastShiftX = lastShiftY = 0;
+	lastDifference = 0;
+}
+
+/**
+ * Fill levels 1.. with 2x2 box downsamples of luma
+ */
+void FrameStacker::buildPyramid(const unsigned char* luma, int lumaStride, vector<unsigned char>* levels)
+{
+	const unsigned char* source = luma;
+	int sourceStride = lumaStride;
+	for (int l=1; l<STACK_PYRAMID_LEVELS; l++)
+	{
+		unsigned char* dest = &levels[l][0];
+		for (int y=0; y<levelHeight[l]; y++)
+		{
+			const unsigned char* row0 = source + (size_t)(y * 2) * sourceStride;
+			const unsigned char* row1 = row0 + sourceStride;
+			unsigned char* out = dest + (size_t)y * levelWidth[l];
+			for (int x=0; x<levelWidth[l]; x++)
+			{
+				out[x] = (row0[x*2] + row0[x*2+1] + row1[x*2] + row1[x*2+1] + 2) >> 2;
+			}
+		}
+		source = dest;
+		sourceStride = levelWidth[l];
+	}
+}
+
+/**
+ * Coarse to fine translation search of the current pyramid against the reference
+ *
+ * @param shiftX Receives the offset to add to reference coordinates to find the same point in the frame
+ * @param shiftY As shiftX
+ * @param difference Receives the mean abs luma error at full resolution
+ */
+void FrameStacker::estimateShift(int& shiftX, int& shiftY, float& difference)
+{
+	int coarsest = 0;
+	while (coarsest + 1 < STACK_PYRAMID_LEVELS &&
+		   levelWidth[coarsest + 1] >= STACK_MIN_LEVEL_SIZE &&
+		   levelHeight[coarsest + 1] >= STACK_MIN_LEVEL_SIZE)
+	{
+		coarsest++;
+	}
+
+	shiftX = 0;
+	shiftY = 0;
+	difference = 0;
+	for (int l = coarsest; l >= 0; l--)
+	{
+		int radius = 1;
+		if (l == coarsest)
+		{
+			radius = max(1, (maxShift + (1 << l) - 1) >> l);
+			radius = min(radius, min(levelWidth[l], levelHeight[l]) / 4);
+		}
+
+		StackShiftSearchTask search;
+		search.reference = &reference[l][0];
+		search.referenceStride = levelWidth[l];
+		search.current = l ? &current[l][0] : currentLuma;
+		search.currentStride = l ? levelWidth[l] : stride;
+		search.width = levelWidth[l];
+		search.height = levelHeight[l];
+		search.step = l ? 1 : 2;
+		for (int dy = -radius; dy <= radius; dy++)
+		{
+			for (int dx = -radius; dx <= radius; dx++)
+			{
+				search.candidateX.push_back(shiftX + dx);
+				search.candidateY.push_back(shiftY + dy);
+			}
+		}
+		search.margin = max(abs(shiftX), abs(shiftY)) + radius;
+		search.cost.assign(search.candidateX.size(), 0);
+		ParallelFor::getInstance().run(search.candidateX.size(), 4, search);
+
+		size_t best = 0;
+		for (size_t c=1; c<search.cost.size(); c++)
+		{
+			if (search.cost[c] < search.cost[best])
+				best = c;
+		}
+		shiftX = search.candidateX[best];
+		shiftY = search.candidateY[best];
+		difference = search.cost[best];
+
+		if (l > 0)
+		{
+			shiftX *= 2;
+			shiftY *= 2;
+		}
+	}
+}
+
+/**
+ * Register one frame against the first and fold it into the stack
+ *
+ * @param i420 frameSize() bytes in the layout given to setup()
+ * @return false if the frame was skipped (misaligned, too many frames)
+ */
+bool FrameStacker::add(const unsigned char* i420)
+{
+	TIMELINE_SCOPE("FrameStacker::add");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+
+	if (accumulator.empty() || numFrames >= STACK_MAX_FRAMES)
+	{
+		rejectedFrames++;
+		return false;
+	}
+
+	int shiftX = 0;
+	int shiftY = 0;
+	if (numFrames == 0)
+	{
+		for (int y=0; y<height; y++)
+		{
+			memcpy(&reference[0][(size_t)y * width], i420 + (size_t)y * stride, width);
+		}
+		buildPyramid(&reference[0][0], width, reference);
+		lastDifference = 0;
+	}
+	else
+	{
+		currentLuma = i420;
+		buildPyramid(i420, stride, current);
+		estimateShift(shiftX, shiftY, lastDifference);
+		if (lastDifference > rejectDifference)
+		{
+			lastShiftX = shiftX;
+			lastShiftY = shiftY;
+			rejectedFrames++;
+			lastAddMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+			return false;
+		}
+	}
+
+	numFrames++;
+	lastShiftX = shiftX;
+	lastShiftY = shiftY;
+
+	StackMergeTask merge;
+	merge.frame = i420;
+	merge.accumulator = &accumulator[0];
+	stackPlanes(width, height, stride, alignedHeight, merge.planes);
+	merge.shiftX = shiftX;
+	merge.shiftY = shiftY;
+	merge.mode = mode;
+	merge.n = numFrames;
+	merge.medianClip = medianClip;
+	int rows = merge.planes[0].height + merge.planes[1].height + merge.planes[2].height;
+	ParallelFor::getInstance().run(rows, 16, merge);
+
+	lastAddMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+	return true;
+}
+
+/**
+ * Resolve the stack into an I420 frame
+ *
+ * @return frameSize() bytes owned by the stacker, valid until the next setup(), NULL if nothing was added
+ */
+const unsigned char* FrameStacker::finish()
+{
+	TIMELINE_SCOPE("FrameStacker::finish");
+	if (!numFrames)
+	{
+		return NULL;
+	}
+
+	vector<unsigned char> divide;
+	if (mode == STACK_MEAN)
+	{
+		divide.resize(255 * numFrames + 1);
+		for (size_t sum=0; sum<divide.size(); sum++)
+		{
+			divide[sum] = (unsigned char)((sum + numFrames / 2) / numFrames);
+		}
+	}
+
+	StackResolveTask resolve;
+	resolve.accumulator = &accumulator[0];
+	resolve.output = &output[0];
+	stackPlanes(width, height, stride, alignedHeight, resolve.planes);
+	resolve.mode = mode;
+	resolve.divide = divide.empty() ? NULL : &divide[0];
+	int rows = resolve.planes[0].height + resolve.planes[1].height + resolve.planes[2].height;
+	ParallelFor::getInstance().run(rows, 16, resolve);
+
+	return &output[0];
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Merges a burst of I420 frames (camera layout: Y stride aligned to 32,
+ height to 16) into one low-noise frame.
+
+ Every frame is registered against the first with a translation found on
+ a luma pyramid: a full search at the coarsest level, then +-1 refinement
+ at each finer level. The shifted frame is folded into a 16 bit
+ accumulator straight away, so memory stays at the accumulator, the
+ reference luma and the output no matter how many frames are added.
+
+ STACK_MEAN      plain average, best for static scenes
+ STACK_MEDIAN    approximate running median: each frame moves the 8.8
+                 estimate by at most medianClip/n levels, so a passing car
+                 or a hot pixel in one frame barely registers
+ */
+
+#define STACK_MAX_FRAMES 256				// sums of 256 frames of 255 still fit in 16 bits
+#define STACK_PYRAMID_LEVELS 4
+
+class FrameStacker
+{
+public:
+	enum Mode
+	{
+		STACK_MEAN,
+		STACK_MEDIAN
+	};
+
+	FrameStacker();
+	void setup(int width_, int height_, int stride_, int alignedHeight_);
+	void begin(Mode mode_);
+	bool add(const unsigned char* i420);
+	const unsigned char* finish();
+	size_t frameSize();
+
+	int width;
+	int height;
+	int stride;
+	int alignedHeight;
+	Mode mode;
+	int maxShift;						// largest offset searched for, in full resolution pixels
+	int medianClip;						// STACK_MEDIAN: largest step toward a sample, in levels
+	float rejectDifference;				// frames still differing by more than this mean luma error after alignment are skipped
+	int numFrames;						// frames merged since begin()
+	int rejectedFrames;
+	int lastShiftX;
+	int lastShiftY;
+	float lastDifference;				// mean abs luma error of the last aligned frame
+	float lastAddMillis;
+
+private:
+	void buildPyramid(const unsigned char* luma, int lumaStride, vector<unsigned char>* levels);
+	void estimateShift(int& shiftX, int& shiftY, float& difference);
+
+	vector<unsigned short> accumulator;		// I420 layout, sums (mean) or 8.8 estimate (median)
+	vector<unsigned char> output;
+	vector<unsigned char> reference[STACK_PYRAMID_LEVELS];	// level 0 is full resolution luma, packed
+	vector<unsigned char> current[STACK_PYRAMID_LEVELS];	// scratch for the incoming frame, level 0 unused
+	const unsigned char* currentLuma;						// level 0 of the incoming frame, read in place
+	int levelWidth[STACK_PYRAMID_LEVELS];
+	int levelHeight[STACK_PYRAMID_LEVELS];
+};
@@ -0,0 +1,314 @@
+/*
+ *  FrameStatistics.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "FrameStatistics.h"
+#include "ParallelFor.h"
+#include "TimelineTrace.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define STATISTICS_USE_NEON 1
+#endif
+
+// Row blocks per thread, enough for uneven rows to balance
+#define STATISTICS_BLOCKS_PER_THREAD 4
+
+/**
+ * Luma of width RGB pixels taken every step pixels, integer Rec.601 as
+ * elsewhere in the app. NEON converts 8 pixels at a time when step is 1.
+ */
+static void rgbRowToLuma(const unsigned char* rgb, int width, int step, unsigned char* luma)
+{
+	int x = 0;
+#ifdef STATISTICS_USE_NEON
+	if (step == 1)
+	{
+		uint8x8_t redWeight = vdup_n_u8(77);
+		uint8x8_t greenWeight = vdup_n_u8(150);
+		uint8x8_t blueWeight = vdup_n_u8(29);
+		for (; x + 8 <= width; x += 8)
+		{
+			uint8x8x3_t pixels = vld3_u8(rgb + x * 3);
+			uint16x8_t sum = vmull_u8(pixels.val[0], redWeight);
+			sum = vmlal_u8(sum, pixels.val[1], greenWeight);
+			sum = vmlal_u8(sum, pixels.val[2], blueWeight);
+			vst1_u8(luma + x, vshrn_n_u16(sum, 8));
+		}
+	}
+#endif
+	for (int i = x; i * step < width; i++)
+	{
+		const unsigned char* p = rgb + (size_t)i * step * 3;
+		luma[i] = (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+	}
+}
+
+/**
+ * Count a row of levels into four interleaved histograms, which keep runs
+ * of equal levels (sky, walls) from stalling on the same counter. They
+ * are folded together once per block.
+ */
+static void countLevels(const unsigned char* levels, int count, int step, uint32_t* histograms)
+{
+	int end = count * step;
+	int i = 0;
+	for (; i + 4 * step <= end; i += 4 * step)
+	{
+		histograms[levels[i]]++;
+		histograms[256 + levels[i + step]]++;
+		histograms[512 + levels[i + 2 * step]]++;
+		histograms[768 + levels[i + 3 * step]]++;
+	}
+	for (; i < end; i += step)
+	{
+		histograms[levels[i]]++;
+	}
+}
+
+class StatisticsTask : public ParallelTask
+{
+public:
+	const unsigned char* data;
+	int width;
+	int height;
+	int stride;
+	int step;
+	bool rgb;
+	int rowsPerBlock;
+	uint32_t* histograms;				// 4 x 256 per block
+
+	void run(int begin, int end)
+	{
+		int samplesPerRow = (width + step - 1) / step;
+		vector<unsigned char> luma(samplesPerRow);
+		vector<uint32_t> interleaved(4 * 4 * 256);		// per channel, four histograms each
+		for (int block=begin; block<end; block++)
+		{
+			std::fill(interleaved.begin(), interleaved.end(), 0);
+			int lastRow = min(height, (block + 1) * rowsPerBlock);
+			for (int y = block * rowsPerBlock; y < lastRow; y += step)
+			{
+				const unsigned char* row = data + (size_t)y * stride;
+				if (!rgb)
+				{
+					countLevels(row, samplesPerRow, step, &interleaved[0]);
+					continue;
+				}
+				rgbRowToLuma(row, width, step, &luma[0]);
+				countLevels(&luma[0], samplesPerRow, 1, &interleaved[0]);
+				for (int c=0; c<3; c++)
+				{
+					countLevels(row + c, samplesPerRow, step * 3, &interleaved[(c + 1) * 4 * 256]);
+				}
+			}
+			
+			uint32_t* histogram = histograms + (size_t)block * 4 * 256;
+			for (int c=0; c<4; c++)
+			{
+				const uint32_t* parts = &interleaved[c * 4 * 256];
+				for (int level=0; level<256; level++)
+				{
+					histogram[c * 256 + level] = parts[level] + parts[256 + level] + parts[512 + level] + parts[768 + level];
+				}
+			}
+		}
+	}
+};
+
+int FrameStats::lumaPercentile(float fraction) const
+{
+	uint64_t target = (uint64_t)(fraction * samples);
+	uint64_t total = 0;
+	for (int level=0; level<256; level++)
+	{
+		total += luma[level];
+		if (total > target)
+		{
+			return level;
+		}
+	}
+	return 255;
+}
+
+FrameStatistics::FrameStatistics()
+{
+	sampleStep = 2;
+	shadowLevel = 2;
+	highlightLevel = 253;
+	memset(&last, 0, sizeof(last));
+	lastMillis = 0;
+	meanLuma = NULL;
+	meanRed = NULL;
+	meanGreen = NULL;
+	meanBlue = NULL;
+	shadowClipped = NULL;
+	highlightClipped = NULL;
+	medianLuma = NULL;
+}
+
+/**
+ * Register the camera_frame_* gauges, updated by every compute()
+ *
+ * @param labels Prometheus labels, e.g. camera="0"
+ */
+void FrameStatistics::setup(string labels)
+{
+	MetricsRegistry& registry = MetricsRegistry::getInstance();
+	string separator = labels.empty() ? "" : ",";
+	meanLuma = registry.addGauge("camera_frame_mean_level", "Mean level 0-255 of the last measured frame", labels + separator + "channel=\"y\"");
+	meanRed = registry.addGauge("camera_frame_mean_level", "Mean level 0-255 of the last measured frame", labels + separator + "channel=\"r\"");
+	meanGreen = registry.addGauge("camera_frame_mean_level", "Mean level 0-255 of the last measured frame", labels + separator + "channel=\"g\"");
+	meanBlue = registry.addGauge("camera_frame_mean_level", "Mean level 0-255 of the last measured frame", labels + separator + "channel=\"b\"");
+	medianLuma = registry.addGauge("camera_frame_median_luma", "Median luma 0-255 of the last measured frame", labels);
+	shadowClipped = registry.addGauge("camera_frame_shadow_clipped_permille", "Samples of the last measured frame crushed to black", labels);
+	highlightClipped = registry.addGauge("camera_frame_highlight_clipped_permille", "Samples of the last measured frame clipped to white", labels);
+}
+
+/**
+ * Measure a decoded RGB frame
+ *
+ * @param pixels 8 bit RGB
+ * @return The statistics, also kept in last
+ */
+const FrameStats& FrameStatistics::compute(const ofPixels& pixels)
+{
+	TIMELINE_SCOPE("FrameStatistics::compute");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	memset(&last, 0, sizeof(last));
+	if (pixels.getNumChannels() != 3 || !pixels.getWidth() || !pixels.getHeight())
+	{
+		return last;
+	}
+	
+	int step = max(sampleStep, 1);
+	int numBlocks = ParallelFor::getInstance().getNumThreads() * STATISTICS_BLOCKS_PER_THREAD;
+	StatisticsTask task;
+	task.data = pixels.getPixels();
+	task.width = pixels.getWidth();
+	task.height = pixels.getHeight();
+	task.stride = pixels.getWidth() * 3;
+	task.step = step;
+	task.rgb = true;
+	// Blocks start on sampled rows
+	task.rowsPerBlock = ((task.height + numBlocks - 1) / numBlocks + step - 1) / step * step;
+	numBlocks = (task.height + task.rowsPerBlock - 1) / task.rowsPerBlock;
+	blockHistograms.resize((size_t)numBlocks * 4 * 256);
+	task.histograms = &blockHistograms[0];
+	ParallelFor::getInstance().run(numBlocks, 1, task);
+	
+	last.hasRgb = true;
+	merge(numBlocks);
+	lastMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0;
+	return last;
+}
+
+/**
+ * Measure a luma plane, e.g. the Y plane of an I420 frame from the video port
+ *
+ * @param luma First row
+ * @param width Visible width
+ * @param height Visible height
+ * @param stride Bytes between rows
+ * @return The statistics, also kept in last; RGB fields are empty
+ */
+const FrameStats& FrameStatistics::compute(const unsigned char* luma, int width, int height, int stride)
+{
+	TIMELINE_SCOPE("FrameStatistics::compute");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	memset(&last, 0, sizeof(last));
+	if (!luma || width <= 0 || height <= 0)
+	{
+		return last;
+	}
+	
+	int step = max(sampleStep, 1);
+	int numBlocks = ParallelFor::getInstance().getNumThreads() * STATISTICS_BLOCKS_PER_THREAD;
+	StatisticsTask task;
+	task.data = luma;
+	task.width = width;
+	task.height = height;
+	task.stride = stride;
+	task.step = step;
+	task.rgb = false;
+	task.rowsPerBlock = ((height + numBlocks - 1) / numBlocks + step - 1) / step * step;
+	numBlocks = (height + task.rowsPerBlock - 1) / task.rowsPerBlock;
+	blockHistograms.resize((size_t)numBlocks * 4 * 256);
+	task.histograms = &blockHistograms[0];
+	ParallelFor::getInstance().run(numBlocks, 1, task);
+	
+	last.hasRgb = false;
+	merge(numBlocks);
+	lastMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0;
+	return last;
+}
+
+void FrameStatistics::merge(int numBlocks)
+{
+	uint32_t* channels[4] = {last.luma, last.red, last.green, last.blue};
+	for (int block=0; block<numBlocks; block++)
+	{
+		const uint32_t* histogram = &blockHistograms[(size_t)block * 4 * 256];
+		for (int c=0; c<4; c++)
+		{
+			for (int level=0; level<256; level++)
+			{
+				channels[c][level] += histogram[c * 256 + level];
+			}
+		}
+	}
+	
+	float* means[4] = {&last.meanLuma, &last.meanRed, &last.meanGreen, &last.meanBlue};
+	float* clipped[4] = {&last.highlightClipped, &last.redClipped, &last.greenClipped, &last.blueClipped};
+	last.samples = 0;
+	for (int level=0; level<256; level++)
+	{
+		last.samples += last.luma[level];
+	}
+	if (!last.samples)
+	{
+		return;
+	}
+	for (int c=0; c<4; c++)
+	{
+		uint64_t sum = 0;
+		uint64_t high = 0;
+		for (int level=0; level<256; level++)
+		{
+			sum += (uint64_t)channels[c][level] * level;
+			if (level >= highlightLevel)
+			{
+				high += channels[c][level];
+			}
+		}
+		*means[c] = (float)sum / last.samples;
+		*clipped[c] = (float)high / last.samples;
+	}
+	uint64_t low = 0;
+	for (int level=0; level<=shadowLevel && level<256; level++)
+	{
+		low += last.luma[level];
+	}
+	last.shadowClipped = (float)low / last.samples;
+	publish();
+}
+
+void FrameStatistics::publish()
+{
+	if (!meanLuma)
+	{
+		return;
+	}
+	meanLuma->set((int64_t)(last.meanLuma + 0.5f));
+	medianLuma->set(last.lumaPercentile(0.5f));
+	shadowClipped->set((int64_t)(last.shadowClipped * 1000 + 0.5f));
+	highlightClipped->set((int64_t)(last.highlightClipped * 1000 + 0.5f));
+	if (last.hasRgb)
+	{
+		meanRed->set((int64_t)(last.meanRed + 0.5f));
+		meanGreen->set((int64_t)(last.meanGreen + 0.5f));
+		meanBlue->set((int64_t)(last.meanBlue + 0.5f));
+	}
+}
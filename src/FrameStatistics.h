@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ofMain.h"
+#include "MetricsRegistry.h"
+
+/*
+ What the sensor actually delivered, as opposed to what CameraSettings
+ asked for: luma and RGB histograms, mean levels and the share of
+ clipped pixels. Computed from a decoded capture (RGB) or straight from an
+ I420 buffer (luma only), so exposure tuning and alerts need no JPEG
+ decoding after the fact.
+
+ Every sampleStep-th pixel of every sampleStep-th row is counted; a 2x2
+ subsample of a 5MP frame is still 1.3M samples. Row blocks run on
+ ParallelFor, each into its own histograms, merged at the end. Means and
+ clipping come from the merged histograms.
+ */
+
+struct FrameStats
+{
+	uint32_t luma[256];
+	uint32_t red[256];					// RGB histograms stay empty for I420 input
+	uint32_t green[256];
+	uint32_t blue[256];
+	uint32_t samples;
+	bool hasRgb;
+	float meanLuma;						// 0-255
+	float meanRed;
+	float meanGreen;
+	float meanBlue;
+	float shadowClipped;				// share of samples with luma <= shadowLevel
+	float highlightClipped;				// share of samples with luma >= highlightLevel
+	float redClipped;					// share of samples with that channel >= highlightLevel
+	float greenClipped;
+	float blueClipped;
+
+	int lumaPercentile(float fraction) const;	// level below which that share of samples falls
+};
+
+class FrameStatistics
+{
+public:
+	FrameStatistics();
+	void setup(string labels="");
+	const FrameStats& compute(const ofPixels& pixels);
+	const FrameStats& compute(const unsigned char* luma, int width, int height, int stride);
+
+	int sampleStep;						// 1 counts every pixel
+	int shadowLevel;					// luma at or below counts as crushed
+	int highlightLevel;					// at or above counts as clipped
+	FrameStats last;
+	float lastMillis;
+
+private:
+	void merge(int numBlocks);
+	void publish();
+
+	vector<uint32_t> blockHistograms;	// 4 x 256 per row block: luma, red, green, blue
+
+	MetricsGauge* meanLuma;				// gauges are integers: levels 0-255, shares in permille
+	MetricsGauge* meanRed;
+	MetricsGauge* meanGreen;
+	MetricsGauge* meanBlue;
+	MetricsGauge* shadowClipped;
+	MetricsGauge* highlightClipped;
+	MetricsGauge* medianLuma;
+};
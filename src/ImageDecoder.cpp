@@ -0,0 +1,222 @@
+/*
+ *  ImageDecoder.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "ImageDecoder.h"
+#include "PixelPool.h"
+#include "ParallelFor.h"
+#include "TimelineTrace.h"
+#include <setjmp.h>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+ImageDecoder::ImageDecoder()
+{
+	lastMillis = 0;
+	decodeMillis = NULL;
+	failures = NULL;
+}
+
+/**
+ * Register this decoder's metrics, labelled with its backend
+ *
+ * @param labels Extra labels, e.g. user="slideshow"
+ */
+void ImageDecoder::setup(string labels)
+{
+	string backend = (labels.empty() ? "" : labels + ",") + "backend=\"" + getName() + "\"";
+	static const double decodeBoundsMs[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000};
+	MetricsRegistry& registry = MetricsRegistry::getInstance();
+	decodeMillis = registry.addHistogram("image_decode_ms", "Time to decode one JPEG for display", decodeBoundsMs, sizeof(decodeBoundsMs)/sizeof(double), backend);
+	failures = registry.addCounter("image_decode_failures_total", "JPEGs a decoder could not decode", backend);
+}
+
+void ImageDecoder::record(bool success, unsigned long long startMicros)
+{
+	lastMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+	if (success && decodeMillis)
+	{
+		decodeMillis->observe(lastMillis);
+	}else if (!success && failures)
+	{
+		failures->increment();
+	}
+}
+
+/**
+ * The coarsest scale, as 1/denominator, that still covers the requested size
+ *
+ * @param width Size of the image
+ * @param coverWidth Size the result must be at least, 0 for full resolution
+ * @return 8, 4, 2 or 1
+ */
+int ImageDecoder::scaleDenominator(int width, int height, int coverWidth, int coverHeight)
+{
+	if (coverWidth <= 0 || coverHeight <= 0)
+	{
+		return 1;
+	}
+	for (int denominator=8; denominator>1; denominator/=2)
+	{
+		if (width / denominator >= coverWidth && height / denominator >= coverHeight)
+		{
+			return denominator;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Decode several files, one after another unless the backend can do better
+ *
+ * @param pixels Resized to match paths; entries that failed are left unallocated
+ * @return Files decoded
+ */
+int ImageDecoder::decodeAll(const vector<string>& paths, vector<ofPixels>& pixels, int coverWidth, int coverHeight)
+{
+	pixels.resize(paths.size());
+	int decoded = 0;
+	for (size_t i=0; i<paths.size(); i++)
+	{
+		decoded += decode(paths[i], pixels[i], coverWidth, coverHeight) ? 1 : 0;
+	}
+	return decoded;
+}
+
+struct JpegErrorManager
+{
+	struct jpeg_error_mgr manager;
+	jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	JpegErrorManager* error = (JpegErrorManager*)cinfo->err;
+	char message[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, message);
+	ofLogWarning() << "libjpeg: " << message;
+	longjmp(error->jump, 1);
+}
+
+// Corrupt data warnings would otherwise go to stderr for every damaged file
+static void jpeg_output_message(j_common_ptr cinfo)
+{
+}
+
+/**
+ * The decode itself, kept apart from anything with a destructor since
+ * libjpeg errors longjmp out of it
+ *
+ * @return false if libjpeg gave up or no buffer could be had
+ */
+static bool decode_jpeg_file(FILE* file, ofPixels& pixels, int coverWidth, int coverHeight)
+{
+	struct jpeg_decompress_struct cinfo;
+	JpegErrorManager error;
+	cinfo.err = jpeg_std_error(&error.manager);
+	error.manager.error_exit = jpeg_error_exit;
+	error.manager.output_message = jpeg_output_message;
+	if (setjmp(error.jump))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, file);
+	jpeg_read_header(&cinfo, TRUE);
+
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = ImageDecoder::scaleDenominator(cinfo.image_width, cinfo.image_height, coverWidth, coverHeight);
+	cinfo.out_color_space = (cinfo.num_components == 1) ? JCS_GRAYSCALE : JCS_RGB;
+	// For the screen, not for analysis: the fast integer IDCT is close enough
+	cinfo.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&cinfo);
+
+	if (!PixelPool::getInstance().borrow(pixels, cinfo.output_width, cinfo.output_height, cinfo.output_components))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	size_t rowBytes = (size_t)cinfo.output_width * cinfo.output_components;
+	unsigned char* base = pixels.getPixels();
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		JSAMPROW row = base + cinfo.output_scanline * rowBytes;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return true;
+}
+
+/**
+ * Decode a JPEG at the coarsest DCT scale that covers coverWidth x coverHeight
+ *
+ * @param pixels Receives the image in a PixelPool buffer
+ * @return false if the file couldn't be read or isn't a JPEG libjpeg understands
+ */
+bool LibJpegDecoder::decode(string path, ofPixels& pixels, int coverWidth, int coverHeight)
+{
+	TIMELINE_SCOPE("LibJpegDecoder::decode");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	FILE* file = fopen(path.c_str(), "rb");
+	bool success = false;
+	if (file)
+	{
+		success = decode_jpeg_file(file, pixels, coverWidth, coverHeight);
+		fclose(file);
+	}
+	if (!success)
+	{
+		// A truncated file may have died part way through the rows
+		PixelPool::getInstance().giveBack(pixels);
+	}
+	record(success, startMicros);
+	return success;
+}
+
+class DecodeFilesTask : public ParallelTask
+{
+public:
+	LibJpegDecoder* decoder;
+	const vector<string>* paths;
+	vector<ofPixels>* pixels;
+	int coverWidth;
+	int coverHeight;
+	volatile int decoded;
+
+	// Items are files, each decoded start to finish by one thread
+	void run(int begin, int end)
+	{
+		for (int i=begin; i<end; i++)
+		{
+			if (decoder->decode((*paths)[i], (*pixels)[i], coverWidth, coverHeight))
+			{
+				__sync_fetch_and_add(&decoded, 1);
+			}
+		}
+	}
+};
+
+/**
+ * Decode files in parallel, one per core at a time
+ */
+int LibJpegDecoder::decodeAll(const vector<string>& paths, vector<ofPixels>& pixels, int coverWidth, int coverHeight)
+{
+	TIMELINE_SCOPE("LibJpegDecoder::decodeAll");
+	// Sized before any thread holds a reference into it
+	pixels.resize(paths.size());
+	DecodeFilesTask task;
+	task.decoder = this;
+	task.paths = &paths;
+	task.pixels = &pixels;
+	task.coverWidth = coverWidth;
+	task.coverHeight = coverHeight;
+	task.decoded = 0;
+	ParallelFor::getInstance().run(paths.size(), 1, task);
+	return task.decoded;
+}
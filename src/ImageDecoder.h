@@ -0,0 +1,52 @@
+#pragma once
+
+#include "ofMain.h"
+#include "MetricsRegistry.h"
+
+/*
+ JPEG decoding for display. ofImage::loadImage goes through FreeImage:
+ one core, always full resolution, seconds per 5MP photo on a Pi. A
+ decoder is asked for a size to cover instead, and only ever decodes at
+ the smallest of 1/8, 1/4, 1/2 or full scale that still covers it, so a
+ 5MP photo shown at 640x480 costs a 1/4 decode, not a full one.
+
+ Two backends:
+	LibJpegDecoder		libjpeg scales in the DCT domain (scale_denom), so a
+						1/8 decode only runs a 1x1 IDCT per block. decodeAll()
+						spreads files over ParallelFor, one libjpeg instance each.
+	MmalJpegDecoder		the VideoCore image_decode component, tunnelled into
+						vc.ril.resize so the ARM only sees the scaled RGB.
+						Baseline JPEGs only; progressive ones fail and should go
+						to the software decoder.
+
+ Output goes into PixelPool buffers, RGB or greyscale as the file is.
+ */
+
+class ImageDecoder
+{
+public:
+	ImageDecoder();
+	virtual ~ImageDecoder() {}
+	virtual bool decode(string path, ofPixels& pixels, int coverWidth=0, int coverHeight=0) = 0;
+	virtual int decodeAll(const vector<string>& paths, vector<ofPixels>& pixels, int coverWidth=0, int coverHeight=0);
+	virtual string getName() = 0;
+	void setup(string labels="");
+
+	static int scaleDenominator(int width, int height, int coverWidth, int coverHeight);
+
+	float lastMillis;					// time of the last decode()
+
+protected:
+	void record(bool success, unsigned long long startMicros);
+
+	MetricsHistogram* decodeMillis;
+	MetricsCounter* failures;
+};
+
+class LibJpegDecoder : public ImageDecoder
+{
+public:
+	bool decode(string path, ofPixels& pixels, int coverWidth=0, int coverHeight=0);
+	int decodeAll(const vector<string>& paths, vector<ofPixels>& pixels, int coverWidth=0, int coverHeight=0);
+	string getName()					{ return "libjpeg"; }
+};
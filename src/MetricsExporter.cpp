@@ -0,0 +1,148 @@
+/*
+ *  MetricsExporter.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "MetricsExporter.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+
+MetricsExporter::MetricsExporter()
+{
+	intervalMillis = 1000;
+	listenSocket = -1;
+	processStats = NULL;
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	if (isThreadRunning())
+	{
+		waitForThread(true);
+	}
+	closeSocket();
+}
+
+void MetricsExporter::setup(string filePath_, string socketPath_, int intervalMillis_)
+{
+	filePath = filePath_;
+	socketPath = socketPath_;
+	intervalMillis = intervalMillis_;
+
+	if (!socketPath.empty())
+	{
+		openSocket();
+	}
+}
+
+bool MetricsExporter::openSocket()
+{
+	struct sockaddr_un address;
+
+	if (socketPath.size() >= sizeof(address.sun_path))
+	{
+		ofLogError() << "Metrics socket path too long: " << socketPath;
+		return false;
+	}
+
+	listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket < 0)
+	{
+		ofLogError() << "Could not create metrics socket";
+		return false;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path)-1);
+
+	// A stale socket from a previous run would make bind fail
+	unlink(socketPath.c_str());
+
+	if (bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenSocket, 4) != 0)
+	{
+		ofLogError() << "Could not bind metrics socket " << socketPath;
+		closeSocket();
+		return false;
+	}
+	ofLogVerbose() << "Serving metrics on " << socketPath;
+	return true;
+}
+
+void MetricsExporter::closeSocket()
+{
+	if (listenSocket >= 0)
+	{
+		close(listenSocket);
+		listenSocket = -1;
+		unlink(socketPath.c_str());
+	}
+}
+
+/**
+ * Wait up to timeoutMillis for scrapers and answer each with the current exposition
+ *
+ * @param timeoutMillis Time to block in poll
+ */
+void MetricsExporter::serveClients(int timeoutMillis)
+{
+	struct pollfd pfd;
+	pfd.fd = listenSocket;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, timeoutMillis) <= 0 || !(pfd.revents & POLLIN))
+	{
+		return;
+	}
+
+	int client = accept(listenSocket, NULL, NULL);
+	if (client < 0)
+	{
+		return;
+	}
+
+	string text = MetricsRegistry::getInstance().toPrometheusText();
+	size_t sent = 0;
+	while (sent < text.size())
+	{
+		ssize_t result = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+		if (result <= 0) break;
+		sent += result;
+	}
+	close(client);
+}
+
+void MetricsExporter::threadedFunction()
+{
+	unsigned long long lastWrite = 0;
+	while (isThreadRunning())
+	{
+		unsigned long long now = ofGetElapsedTimeMillis();
+		if (lastWrite == 0 || now - lastWrite >= (unsigned long long)intervalMillis)
+		{
+			if (processStats)
+			{
+				processStats->update();
+			}
+			if (!filePath.empty())
+			{
+				MetricsRegistry::getInstance().writePrometheusFile(filePath);
+			}
+			lastWrite = now;
+		}
+
+		if (listenSocket >= 0)
+		{
+			// poll doubles as the export interval so scrapes are answered promptly
+			serveClients(min(intervalMillis, 250));
+		}
+		else
+		{
+			sleep(min(intervalMillis, 250));
+		}
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "ofMain.h"
+#include "MetricsRegistry.h"
+#include "ProcessStats.h"
+
+/*
+ Publishes MetricsRegistry in Prometheus text format off the capture path.
+ It can rewrite a file (for a textfile collector) every intervalMillis and/or
+ answer on a local unix socket: connect, read the exposition, disconnect.
+ */
+class MetricsExporter : public ofThread
+{
+public:
+	MetricsExporter();
+	~MetricsExporter();
+	void setup(string filePath_, string socketPath_="", int intervalMillis_=1000);
+	void threadedFunction();
+
+	string filePath;		// Empty disables the file export
+	string socketPath;		// Empty disables the socket export
+	int intervalMillis;
+	ProcessStats* processStats;	// optional, brought up to date every interval
+
+private:
+	int listenSocket;
+	bool openSocket();
+	void closeSocket();
+	void serveClients(int timeoutMillis);
+};
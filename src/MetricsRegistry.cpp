@@ -0,0 +1,224 @@
+/*
+ *  MetricsRegistry.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "MetricsRegistry.h"
+
+MetricsCounter::MetricsCounter(string name_, string help_, string labels_)
+{
+	name = name_;
+	help = help_;
+	labels = labels_;
+	value = 0;
+}
+
+MetricsGauge::MetricsGauge(string name_, string help_, string labels_)
+{
+	name = name_;
+	help = help_;
+	labels = labels_;
+	value = 0;
+}
+
+void MetricsGauge::set(int64_t newValue)
+{
+	int64_t current = value;
+	while (!__sync_bool_compare_and_swap(&value, current, newValue))
+	{
+		current = value;
+	}
+}
+
+MetricsHistogram::MetricsHistogram(string name_, string help_, string labels_, const double* bounds_, int numBounds_)
+{
+	name = name_;
+	help = help_;
+	labels = labels_;
+	numBounds = min(numBounds_, METRICS_MAX_HISTOGRAM_BUCKETS);
+	for (int i=0; i<numBounds; i++)
+	{
+		bounds[i] = bounds_[i];
+	}
+	for (int i=0; i<=METRICS_MAX_HISTOGRAM_BUCKETS; i++)
+	{
+		buckets[i] = 0;
+	}
+	count = 0;
+	sumMicros = 0;
+}
+
+/**
+ * Record one sample. Costs a short bounds scan plus three atomic adds.
+ *
+ * @param sample Value in the histogram's unit (ms, bytes...)
+ */
+void MetricsHistogram::observe(double sample)
+{
+	int bucket = 0;
+	while (bucket < numBounds && sample > bounds[bucket])
+	{
+		bucket++;
+	}
+	__sync_fetch_and_add(&buckets[bucket], 1);
+	__sync_fetch_and_add(&sumMicros, (int64_t)(sample * 1000000.0));
+	__sync_fetch_and_add(&count, 1);
+}
+
+MetricsRegistry& MetricsRegistry::getInstance()
+{
+	static MetricsRegistry instance;
+	return instance;
+}
+
+MetricsRegistry::MetricsRegistry()
+{
+
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+	for (size_t i=0; i<counters.size(); i++) delete counters[i];
+	for (size_t i=0; i<gauges.size(); i++) delete gauges[i];
+	for (size_t i=0; i<histograms.size(); i++) delete histograms[i];
+}
+
+MetricsCounter* MetricsRegistry::addCounter(string name, string help, string labels)
+{
+	ofScopedLock lock(registryMutex);
+	MetricsCounter* counter = new MetricsCounter(name, help, labels);
+	counters.push_back(counter);
+	return counter;
+}
+
+MetricsGauge* MetricsRegistry::addGauge(string name, string help, string labels)
+{
+	ofScopedLock lock(registryMutex);
+	MetricsGauge* gauge = new MetricsGauge(name, help, labels);
+	gauges.push_back(gauge);
+	return gauge;
+}
+
+MetricsHistogram* MetricsRegistry::addHistogram(string name, string help, const double* bounds, int numBounds, string labels)
+{
+	ofScopedLock lock(registryMutex);
+	MetricsHistogram* histogram = new MetricsHistogram(name, help, labels, bounds, numBounds);
+	histograms.push_back(histogram);
+	return histogram;
+}
+
+static string withLabels(const string& name, const string& labels, const string& extra="")
+{
+	if (labels.empty() && extra.empty())
+	{
+		return name;
+	}
+	string joined = labels;
+	if (!labels.empty() && !extra.empty())
+	{
+		joined += ",";
+	}
+	joined += extra;
+	return name + "{" + joined + "}";
+}
+
+static void writeFamilyHeader(ostringstream& out, set<string>& written, const string& name, const string& help, const char* type)
+{
+	if (written.count(name))
+	{
+		return;
+	}
+	written.insert(name);
+	out << "# HELP " << name << " " << help << "\n";
+	out << "# TYPE " << name << " " << type << "\n";
+}
+
+/**
+ * Render every registered metric in the Prometheus text exposition format.
+ * Samples sharing a name (e.g. one per camera) are grouped under a single family.
+ *
+ * @return The exposition text
+ */
+string MetricsRegistry::toPrometheusText()
+{
+	ofScopedLock lock(registryMutex);
+	ostringstream out;
+	set<string> written;
+
+	for (size_t i=0; i<counters.size(); i++)
+	{
+		if (written.count(counters[i]->name)) continue;
+		writeFamilyHeader(out, written, counters[i]->name, counters[i]->help, "counter");
+		for (size_t j=i; j<counters.size(); j++)
+		{
+			if (counters[j]->name != counters[i]->name) continue;
+			out << withLabels(counters[j]->name, counters[j]->labels) << " " << counters[j]->get() << "\n";
+		}
+	}
+
+	for (size_t i=0; i<gauges.size(); i++)
+	{
+		if (written.count(gauges[i]->name)) continue;
+		writeFamilyHeader(out, written, gauges[i]->name, gauges[i]->help, "gauge");
+		for (size_t j=i; j<gauges.size(); j++)
+		{
+			if (gauges[j]->name != gauges[i]->name) continue;
+			out << withLabels(gauges[j]->name, gauges[j]->labels) << " " << gauges[j]->get() << "\n";
+		}
+	}
+
+	for (size_t i=0; i<histograms.size(); i++)
+	{
+		if (written.count(histograms[i]->name)) continue;
+		writeFamilyHeader(out, written, histograms[i]->name, histograms[i]->help, "histogram");
+		for (size_t j=i; j<histograms.size(); j++)
+		{
+			MetricsHistogram* h = histograms[j];
+			if (h->name != histograms[i]->name) continue;
+
+			uint64_t cumulative = 0;
+			for (int b=0; b<h->numBounds; b++)
+			{
+				cumulative += __sync_fetch_and_add(&h->buckets[b], 0);
+				out << withLabels(h->name + "_bucket", h->labels, "le=\"" + ofToString(h->bounds[b]) + "\"") << " " << cumulative << "\n";
+			}
+			cumulative += __sync_fetch_and_add(&h->buckets[h->numBounds], 0);
+			out << withLabels(h->name + "_bucket", h->labels, "le=\"+Inf\"") << " " << cumulative << "\n";
+			out << withLabels(h->name + "_sum", h->labels) << " " << (__sync_fetch_and_add(&h->sumMicros, 0) / 1000000.0) << "\n";
+			out << withLabels(h->name + "_count", h->labels) << " " << __sync_fetch_and_add(&h->count, 0) << "\n";
+		}
+	}
+
+	return out.str();
+}
+
+/**
+ * Write the exposition text next to path and rename it into place so a
+ * scraper (node_exporter textfile collector etc) never sees a partial file.
+ *
+ * @param path Destination file
+ * @return true if the file was replaced
+ */
+bool MetricsRegistry::writePrometheusFile(string path)
+{
+	string text = toPrometheusText();
+	string tempPath = path + ".tmp";
+
+	FILE* file = fopen(tempPath.c_str(), "wb");
+	if (!file)
+	{
+		ofLogError() << "Could not open metrics file " << tempPath;
+		return false;
+	}
+
+	size_t written = fwrite(text.data(), 1, text.size(), file);
+	fclose(file);
+
+	if (written != text.size() || rename(tempPath.c_str(), path.c_str()) != 0)
+	{
+		ofLogError() << "Could not write metrics file " << path;
+		return false;
+	}
+	return true;
+}
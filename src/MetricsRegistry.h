@@ -0,0 +1,77 @@
+#pragma once
+
+#include "ofMain.h"
+
+// Upper bound on histogram buckets, +Inf is implicit
+#define METRICS_MAX_HISTOGRAM_BUCKETS 16
+
+/*
+ Metrics are registered once during setup (under a mutex) and then updated
+ lock-free from any thread, including the MMAL callback thread. Every update
+ is a single __sync builtin so the hot path never blocks or allocates.
+ */
+
+class MetricsCounter
+{
+public:
+	MetricsCounter(string name_, string help_, string labels_);
+	void increment()			{ __sync_fetch_and_add(&value, 1); }
+	void add(uint64_t amount)	{ __sync_fetch_and_add(&value, amount); }
+	uint64_t get()				{ return __sync_fetch_and_add(&value, 0); }
+
+	string name;
+	string help;
+	string labels;					// Prometheus label set without braces, e.g. camera="0"
+	volatile uint64_t value;
+};
+
+class MetricsGauge
+{
+public:
+	MetricsGauge(string name_, string help_, string labels_);
+	void set(int64_t newValue);
+	void add(int64_t amount)	{ __sync_fetch_and_add(&value, amount); }
+	int64_t get()				{ return __sync_fetch_and_add(&value, 0); }
+
+	string name;
+	string help;
+	string labels;
+	volatile int64_t value;
+};
+
+class MetricsHistogram
+{
+public:
+	MetricsHistogram(string name_, string help_, string labels_, const double* bounds_, int numBounds_);
+	void observe(double sample);
+
+	string name;
+	string help;
+	string labels;
+	double bounds[METRICS_MAX_HISTOGRAM_BUCKETS];				// Upper bounds (le) in ascending order
+	int numBounds;
+	volatile uint64_t buckets[METRICS_MAX_HISTOGRAM_BUCKETS+1];	// Non-cumulative, last slot is +Inf
+	volatile uint64_t count;
+	volatile int64_t sumMicros;									// Sum scaled by 1e6 so it can stay an integer atomic
+};
+
+class MetricsRegistry
+{
+public:
+	static MetricsRegistry& getInstance();
+	~MetricsRegistry();
+
+	MetricsCounter*		addCounter(string name, string help, string labels="");
+	MetricsGauge*		addGauge(string name, string help, string labels="");
+	MetricsHistogram*	addHistogram(string name, string help, const double* bounds, int numBounds, string labels="");
+
+	string toPrometheusText();
+	bool writePrometheusFile(string path);
+
+private:
+	MetricsRegistry();
+	ofMutex registryMutex;
+	vector<MetricsCounter*> counters;
+	vector<MetricsGauge*> gauges;
+	vector<MetricsHistogram*> histograms;
+};
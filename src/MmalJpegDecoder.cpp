@@ -0,0 +1,405 @@
+/*
+ *  MmalJpegDecoder.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "MmalJpegDecoder.h"
+#include "PixelPool.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
+
+// Not in mmal_default_components.h
+#define MMAL_COMPONENT_RESIZER "vc.ril.resize"
+
+static void mmal_decoder_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	// The chunk has been consumed, give the header back to its pool
+	mmal_buffer_header_release(buffer);
+}
+
+static void mmal_decoder_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	// Frames and events alike, decode() is waiting for either
+	MMAL_DECODER_USERDATA *pData = (MMAL_DECODER_USERDATA *)port->userdata;
+	mmal_queue_put(pData->frames, buffer);
+}
+
+MmalJpegDecoder::MmalJpegDecoder()
+{
+	timeoutMillis = 2000;
+	decoder = NULL;
+	resizer = NULL;
+	connection = NULL;
+	input_pool = NULL;
+	output_pool = NULL;
+	userdata.frames = NULL;
+	configuredWidth = configuredHeight = 0;
+	configuredOutputWidth = configuredOutputHeight = 0;
+	failedToOpen = false;
+}
+
+MmalJpegDecoder::~MmalJpegDecoder()
+{
+	close();
+}
+
+/**
+ * Whether this system has the VideoCore decoder, creating the components if it does
+ */
+bool MmalJpegDecoder::isAvailable()
+{
+	ofScopedLock lock(decoderMutex);
+	return open();
+}
+
+bool MmalJpegDecoder::open()
+{
+	if (decoder)
+	{
+		return true;
+	}
+	if (failedToOpen)
+	{
+		return false;
+	}
+	TIMELINE_SCOPE("MmalJpegDecoder::open");
+	MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_DECODER, &decoder);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder create image_decode FAIL error: %d", status);
+		decoder = NULL;
+		failedToOpen = true;
+		return false;
+	}
+	status = mmal_component_create(MMAL_COMPONENT_RESIZER, &resizer);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder create resize FAIL error: %d", status);
+		resizer = NULL;
+		failedToOpen = true;
+		close();
+		return false;
+	}
+
+	MMAL_PORT_T* input = decoder->input[0];
+	input->format->encoding = MMAL_ENCODING_JPEG;
+	if (mmal_port_format_commit(input) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder input format FAIL");
+		close();
+		return false;
+	}
+	input->buffer_num = max(input->buffer_num_recommended, input->buffer_num_min);
+	input->buffer_size = max(input->buffer_size_recommended, input->buffer_size_min);
+
+	if (mmal_component_enable(decoder) != MMAL_SUCCESS || mmal_component_enable(resizer) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder enable FAIL");
+		close();
+		return false;
+	}
+
+	input_pool = mmal_port_pool_create(input, input->buffer_num, input->buffer_size);
+	userdata.frames = mmal_queue_create();
+	if (!input_pool || !userdata.frames || mmal_port_enable(input, mmal_decoder_input_callback) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder input port FAIL");
+		close();
+		return false;
+	}
+	TRACE_VERBOSE("MmalJpegDecoder ready");
+	return true;
+}
+
+/**
+ * Set the decoder output and resizer ports up for one image and output size,
+ * unless they already are
+ *
+ * @return false if the firmware refused either format
+ */
+bool MmalJpegDecoder::configure(int width, int height, int outputWidth, int outputHeight)
+{
+	if (connection && width == configuredWidth && height == configuredHeight &&
+		outputWidth == configuredOutputWidth && outputHeight == configuredOutputHeight)
+	{
+		return true;
+	}
+	TIMELINE_SCOPE("MmalJpegDecoder::configure");
+
+	MMAL_PORT_T* output = resizer->output[0];
+	if (connection)
+	{
+		mmal_connection_disable(connection);
+		mmal_connection_destroy(connection);
+		connection = NULL;
+	}
+	if (output->is_enabled)
+	{
+		mmal_port_disable(output);
+	}
+	if (output_pool)
+	{
+		mmal_port_pool_destroy(output, output_pool);
+		output_pool = NULL;
+	}
+	configuredWidth = configuredHeight = 0;
+
+	MMAL_PORT_T* decoded = decoder->output[0];
+	decoded->format->encoding = MMAL_ENCODING_I420;
+	decoded->format->es->video.width = VCOS_ALIGN_UP(width, 32);
+	decoded->format->es->video.height = VCOS_ALIGN_UP(height, 16);
+	decoded->format->es->video.crop.x = 0;
+	decoded->format->es->video.crop.y = 0;
+	decoded->format->es->video.crop.width = width;
+	decoded->format->es->video.crop.height = height;
+	if (mmal_port_format_commit(decoded) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder decoder output format FAIL for %dx%d", width, height);
+		return false;
+	}
+
+	// Creating the connection copies the decoded format onto the resizer input
+	MMAL_STATUS_T status = mmal_connection_create(&connection, decoded, resizer->input[0], MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder connect decoder to resizer FAIL error: %d", status);
+		connection = NULL;
+		return false;
+	}
+
+	mmal_format_copy(output->format, resizer->input[0]->format);
+	output->format->encoding = MMAL_ENCODING_RGBA;
+	output->format->es->video.width = VCOS_ALIGN_UP(outputWidth, 32);
+	output->format->es->video.height = VCOS_ALIGN_UP(outputHeight, 16);
+	output->format->es->video.crop.x = 0;
+	output->format->es->video.crop.y = 0;
+	output->format->es->video.crop.width = outputWidth;
+	output->format->es->video.crop.height = outputHeight;
+	if (mmal_port_format_commit(output) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder resizer output format FAIL for %dx%d", outputWidth, outputHeight);
+		return false;
+	}
+	// One frame per image, the buffer holds all of it
+	output->buffer_num = max(output->buffer_num_min, (uint32_t)1);
+	output->buffer_size = max(output->buffer_size_recommended, output->buffer_size_min);
+	output_pool = mmal_port_pool_create(output, output->buffer_num, output->buffer_size);
+	output->userdata = (struct MMAL_PORT_USERDATA_T *)&userdata;
+	if (!output_pool || mmal_port_enable(output, mmal_decoder_output_callback) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder resizer output port FAIL");
+		return false;
+	}
+	if (mmal_connection_enable(connection) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("MmalJpegDecoder enable connection FAIL");
+		return false;
+	}
+
+	configuredWidth = width;
+	configuredHeight = height;
+	configuredOutputWidth = outputWidth;
+	configuredOutputHeight = outputHeight;
+	TRACE_VERBOSE("MmalJpegDecoder %dx%d to %dx%d", width, height, outputWidth, outputHeight);
+	return true;
+}
+
+/**
+ * Feed the whole file to the decoder in input buffer sized chunks, the last one marked FRAME_END
+ */
+bool MmalJpegDecoder::send_file(FILE* file)
+{
+	MMAL_PORT_T* input = decoder->input[0];
+	bool end = false;
+	while (!end)
+	{
+		MMAL_BUFFER_HEADER_T* buffer = mmal_queue_timedwait(input_pool->queue, timeoutMillis);
+		if (!buffer)
+		{
+			TRACE_ERROR("MmalJpegDecoder input buffers never came back");
+			return false;
+		}
+		mmal_buffer_header_mem_lock(buffer);
+		buffer->length = fread(buffer->data, 1, buffer->alloc_size, file);
+		mmal_buffer_header_mem_unlock(buffer);
+		buffer->offset = 0;
+		end = buffer->length < buffer->alloc_size;
+		buffer->flags = end ? MMAL_BUFFER_HEADER_FLAG_FRAME_END : 0;
+		if (mmal_port_send_buffer(input, buffer) != MMAL_SUCCESS)
+		{
+			TRACE_ERROR("MmalJpegDecoder could not send input");
+			mmal_buffer_header_release(buffer);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Decode a colour JPEG on the VideoCore, scaled to what LibJpegDecoder
+ * would produce for the same cover size
+ *
+ * @param pixels Receives the RGB image in a PixelPool buffer
+ * @return false if the firmware couldn't decode it, e.g. a progressive or greyscale JPEG
+ */
+bool MmalJpegDecoder::decode(string path, ofPixels& pixels, int coverWidth, int coverHeight)
+{
+	TIMELINE_SCOPE("MmalJpegDecoder::decode");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	ofScopedLock lock(decoderMutex);
+
+	int width, height, channels;
+	if (!PixelPool::readJpegSize(path, width, height, channels) || channels != 3)
+	{
+		record(false, startMicros);
+		return false;
+	}
+	int denominator = scaleDenominator(width, height, coverWidth, coverHeight);
+	int outputWidth = (width + denominator - 1) / denominator;
+	int outputHeight = (height + denominator - 1) / denominator;
+	FILE* file = fopen(path.c_str(), "rb");
+	// A refused format leaves the ports to be set up again on the next call, nothing to rebuild
+	if (!file || !open() || !configure(width, height, outputWidth, outputHeight))
+	{
+		if (file)
+		{
+			fclose(file);
+		}
+		record(false, startMicros);
+		return false;
+	}
+
+	MMAL_PORT_T* output = resizer->output[0];
+	MMAL_BUFFER_HEADER_T* buffer;
+	while ((buffer = mmal_queue_get(output_pool->queue)) != NULL)
+	{
+		mmal_port_send_buffer(output, buffer);
+	}
+	bool sent = send_file(file);
+	fclose(file);
+
+	MMAL_BUFFER_HEADER_T* frame = NULL;
+	if (sent)
+	{
+		TIMELINE_SCOPE("MmalJpegDecoder_wait");
+		frame = mmal_queue_timedwait(userdata.frames, timeoutMillis);
+	}
+	size_t stride = (size_t)output->format->es->video.width * 4;
+	bool success = frame && !frame->cmd && frame->length >= stride * (outputHeight - 1) + outputWidth * 4 &&
+		PixelPool::getInstance().borrow(pixels, outputWidth, outputHeight, 3);
+	if (success)
+	{
+		// RGBA rows at the port's stride into packed RGB
+		mmal_buffer_header_mem_lock(frame);
+		const unsigned char* source = frame->data + frame->offset;
+		unsigned char* destination = pixels.getPixels();
+		for (int y=0; y<outputHeight; y++)
+		{
+			const unsigned char* in = source + y * stride;
+			for (int x=0; x<outputWidth; x++)
+			{
+				destination[0] = in[0];
+				destination[1] = in[1];
+				destination[2] = in[2];
+				destination += 3;
+				in += 4;
+			}
+		}
+		mmal_buffer_header_mem_unlock(frame);
+	}
+	if (frame)
+	{
+		mmal_buffer_header_release(frame);
+	}
+	if (!success)
+	{
+		ofLogWarning() << "MmalJpegDecoder could not decode " << path << (frame ? "" : ", timed out");
+		// A bad file only needs the ports flushed; rebuild if the components don't give their buffers back
+		if (!sent || !flush())
+		{
+			TRACE_ERROR("MmalJpegDecoder stuck, recreating the components");
+			close();
+		}
+	}
+	record(success, startMicros);
+	return success;
+}
+
+/**
+ * Abandon whatever is in the pipeline after a failed decode and wait for
+ * every buffer to come home, so the next file starts clean on the same components
+ *
+ * @return false if the buffers didn't come back within timeoutMillis
+ */
+bool MmalJpegDecoder::flush()
+{
+	TIMELINE_SCOPE("MmalJpegDecoder::flush");
+	if (mmal_port_flush(decoder->input[0]) != MMAL_SUCCESS ||
+		mmal_port_flush(decoder->output[0]) != MMAL_SUCCESS ||
+		mmal_port_flush(resizer->output[0]) != MMAL_SUCCESS)
+	{
+		return false;
+	}
+	unsigned long long deadline = ofGetElapsedTimeMillis() + timeoutMillis;
+	while (true)
+	{
+		// Flushed frames and late events land here, releasing puts frames back in output_pool
+		MMAL_BUFFER_HEADER_T* buffer;
+		while ((buffer = mmal_queue_get(userdata.frames)) != NULL)
+		{
+			mmal_buffer_header_release(buffer);
+		}
+		if (mmal_queue_length(input_pool->queue) == input_pool->headers_num &&
+			mmal_queue_length(output_pool->queue) == output_pool->headers_num)
+		{
+			return true;
+		}
+		if (ofGetElapsedTimeMillis() > deadline)
+		{
+			return false;
+		}
+		ofSleepMillis(1);
+	}
+}
+
+void MmalJpegDecoder::close()
+{
+	if (connection)
+	{
+		mmal_connection_disable(connection);
+		mmal_connection_destroy(connection);
+	}
+	if (resizer)
+	{
+		if (resizer->output[0]->is_enabled) mmal_port_disable(resizer->output[0]);
+		mmal_component_disable(resizer);
+		if (output_pool) mmal_port_pool_destroy(resizer->output[0], output_pool);
+		mmal_component_destroy(resizer);
+	}
+	if (decoder)
+	{
+		if (decoder->input[0]->is_enabled) mmal_port_disable(decoder->input[0]);
+		mmal_component_disable(decoder);
+		if (input_pool) mmal_port_pool_destroy(decoder->input[0], input_pool);
+		mmal_component_destroy(decoder);
+	}
+	if (userdata.frames)
+	{
+		// Disabling the output port returned anything still queued here
+		MMAL_BUFFER_HEADER_T* buffer;
+		while ((buffer = mmal_queue_get(userdata.frames)) != NULL)
+		{
+			mmal_buffer_header_release(buffer);
+		}
+		mmal_queue_destroy(userdata.frames);
+	}
+	decoder = NULL;
+	resizer = NULL;
+	connection = NULL;
+	input_pool = NULL;
+	output_pool = NULL;
+	userdata.frames = NULL;
+	configuredWidth = configuredHeight = 0;
+	configuredOutputWidth = configuredOutputHeight = 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ImageDecoder.h"
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+#include "interface/mmal/util/mmal_connection.h"
+#include "interface/mmal/util/mmal_default_components.h"
+
+/*
+ Hardware JPEG decode: vc.ril.image_decode tunnelled into vc.ril.resize.
+ The full size I420 frame stays in VideoCore memory; the resizer scales it
+ to the same size LibJpegDecoder would produce and converts it to RGBA,
+ and only that crosses to the ARM, where the alpha byte is dropped on the
+ copy into the pool buffer.
+
+ Ports are reconfigured only when the image or output size changes, which
+ in a slideshow of one camera's photos is once. The components are created
+ on first use. After a failed decode (a progressive JPEG, a truncated
+ file) the ports are flushed and the same components decode the next
+ file; they are only rebuilt if their buffers don't come back.
+ */
+
+struct MMAL_DECODER_USERDATA
+{
+	MMAL_QUEUE_T* frames;					// resizer output buffers and events for decode() to pick up
+};
+
+class MmalJpegDecoder : public ImageDecoder
+{
+public:
+	MmalJpegDecoder();
+	~MmalJpegDecoder();
+	bool decode(string path, ofPixels& pixels, int coverWidth=0, int coverHeight=0);
+	string getName()						{ return "mmal"; }
+	bool isAvailable();
+	void close();
+
+	int timeoutMillis;						// for the scaled frame once the file is sent
+
+private:
+	bool open();
+	bool configure(int width, int height, int outputWidth, int outputHeight);
+	bool send_file(FILE* file);
+	bool flush();
+
+	ofMutex decoderMutex;					// one image in the pipeline at a time
+	MMAL_COMPONENT_T* decoder;
+	MMAL_COMPONENT_T* resizer;
+	MMAL_CONNECTION_T* connection;
+	MMAL_POOL_T* input_pool;
+	MMAL_POOL_T* output_pool;
+	MMAL_DECODER_USERDATA userdata;
+	int configuredWidth;					// image size the ports are set up for
+	int configuredHeight;
+	int configuredOutputWidth;
+	int configuredOutputHeight;
+	bool failedToOpen;						// no image_decode on this system, don't keep trying
+};
@@ -0,0 +1,145 @@
+/*
+ *  ParallelFor.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "ParallelFor.h"
+
+ParallelFor& ParallelFor::getInstance()
+{
+	static ParallelFor instance;
+	return instance;
+}
+
+ParallelFor::ParallelFor()
+{
+	for (int i=0; i<2; i++)
+	{
+		jobs[i].task = NULL;
+		jobs[i].numItems = 0;
+		jobs[i].itemsPerChunk = 1;
+		jobs[i].nextItem = 0;
+	}
+	activeWorkers = 0;
+	generation = 0;
+	shuttingDown = false;
+
+	pthread_mutex_init(&jobMutex, NULL);
+	pthread_mutex_init(&stateMutex, NULL);
+	pthread_cond_init(&jobReady, NULL);
+	pthread_cond_init(&jobDone, NULL);
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	numWorkers = cores > 1 ? (int)cores - 1 : 0;
+	workers.resize(numWorkers);
+	for (int i=0; i<numWorkers; i++)
+	{
+		pthread_create(&workers[i], NULL, &ParallelFor::workerMain, this);
+	}
+	ofLogVerbose() << "ParallelFor using " << getNumThreads() << " threads";
+}
+
+ParallelFor::~ParallelFor()
+{
+	pthread_mutex_lock(&stateMutex);
+	shuttingDown = true;
+	pthread_cond_broadcast(&jobReady);
+	pthread_mutex_unlock(&stateMutex);
+
+	for (int i=0; i<numWorkers; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	pthread_cond_destroy(&jobReady);
+	pthread_cond_destroy(&jobDone);
+	pthread_mutex_destroy(&stateMutex);
+	pthread_mutex_destroy(&jobMutex);
+}
+
+void ParallelFor::workChunks(ParallelJob& job)
+{
+	while (true)
+	{
+		int begin = __sync_fetch_and_add(&job.nextItem, job.itemsPerChunk);
+		if (begin >= job.numItems)
+		{
+			break;
+		}
+		job.task->run(begin, min(begin + job.itemsPerChunk, job.numItems));
+	}
+}
+
+void* ParallelFor::workerMain(void* arg)
+{
+	ParallelFor* pool = (ParallelFor*)arg;
+	unsigned int seenGeneration = 0;
+
+	pthread_mutex_lock(&pool->stateMutex);
+	while (true)
+	{
+		while (!pool->shuttingDown && pool->generation == seenGeneration)
+		{
+			pthread_cond_wait(&pool->jobReady, &pool->stateMutex);
+		}
+		if (pool->shuttingDown)
+		{
+			break;
+		}
+		seenGeneration = pool->generation;
+		ParallelJob& job = pool->jobs[seenGeneration & 1];
+		pool->activeWorkers++;
+		pthread_mutex_unlock(&pool->stateMutex);
+
+		pool->workChunks(job);
+
+		pthread_mutex_lock(&pool->stateMutex);
+		pool->activeWorkers--;
+		if (pool->activeWorkers == 0)
+		{
+			pthread_cond_signal(&pool->jobDone);
+		}
+	}
+	pthread_mutex_unlock(&pool->stateMutex);
+	return NULL;
+}
+
+/**
+ * Run task over [0, numItems) in chunks and wait for completion
+ *
+ * @param numItems_ Number of items (rows, tiles...)
+ * @param itemsPerChunk_ Items claimed per grab, larger means less contention
+ * @param task_ Work to do, run(begin, end) may be called concurrently
+ */
+void ParallelFor::run(int numItems_, int itemsPerChunk_, ParallelTask& task_)
+{
+	if (numItems_ <= 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&jobMutex);
+
+	pthread_mutex_lock(&stateMutex);
+	ParallelJob& job = jobs[(generation + 1) & 1];
+	job.task = &task_;
+	job.numItems = numItems_;
+	job.itemsPerChunk = max(1, itemsPerChunk_);
+	job.nextItem = 0;
+	generation++;
+	pthread_cond_broadcast(&jobReady);
+	pthread_mutex_unlock(&stateMutex);
+
+	workChunks(job);
+
+	// Workers that woke late find no items left in their slot and return immediately
+	pthread_mutex_lock(&stateMutex);
+	while (activeWorkers > 0)
+	{
+		pthread_cond_wait(&jobDone, &stateMutex);
+	}
+	job.task = NULL;
+	pthread_mutex_unlock(&stateMutex);
+
+	pthread_mutex_unlock(&jobMutex);
+}
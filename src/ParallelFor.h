@@ -0,0 +1,64 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Small fixed pool of worker threads for tile-parallel image kernels.
+ A job is split into numItems items (rows, tiles, files...); workers
+ claim items with an atomic counter so uneven tiles balance themselves.
+
+	class Brighten : public ParallelTask
+	{
+		void run(int begin, int end) { for (int row=begin; row<end; row++) ... }
+	};
+	Brighten task;
+	ParallelFor::getInstance().run(height, 16, task);
+
+ run() blocks until every item is done; the calling thread works too.
+ */
+
+class ParallelTask
+{
+public:
+	virtual ~ParallelTask() {}
+	virtual void run(int begin, int end) = 0;
+};
+
+// One run() call; workers hold a pointer to it rather than reading shared fields
+struct ParallelJob
+{
+	ParallelTask* task;
+	int numItems;
+	int itemsPerChunk;
+	volatile int nextItem;
+};
+
+class ParallelFor
+{
+public:
+	static ParallelFor& getInstance();
+	~ParallelFor();
+
+	void run(int numItems, int itemsPerChunk, ParallelTask& task);
+	int getNumThreads() { return numWorkers + 1; }
+
+private:
+	ParallelFor();
+	static void* workerMain(void* arg);
+	void workChunks(ParallelJob& job);
+
+	int numWorkers;
+	vector<pthread_t> workers;
+	pthread_mutex_t jobMutex;			// serializes callers of run()
+	pthread_mutex_t stateMutex;
+	pthread_cond_t jobReady;
+	pthread_cond_t jobDone;
+
+	// Alternate by generation: a worker that wakes late for a finished run
+	// still sees that run's exhausted slot, never a half published new one.
+	// A slot is reused two runs later, after its run waited out every worker.
+	ParallelJob jobs[2];
+	int activeWorkers;
+	unsigned int generation;
+	bool shuttingDown;
+};
@@ -0,0 +1,364 @@
+/*
+ *  PerceptualDedup.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "PerceptualDedup.h"
+#include "ParallelFor.h"
+#include "TimelineTrace.h"
+
+static bool compareMatchId(const HammingMatch& a, const HammingMatch& b)
+{
+	return a.id < b.id;
+}
+
+static bool sameMatchId(const HammingMatch& a, const HammingMatch& b)
+{
+	return a.id == b.id;
+}
+
+HammingIndex::HammingIndex()
+{
+	count = 0;
+}
+
+void HammingIndex::add(uint32_t id, uint64_t hash)
+{
+	Entry entry;
+	entry.hash = hash;
+	entry.id = id;
+	for (int table=0; table<4; table++)
+	{
+		tables[table][(uint16_t)(hash >> (table * 16))].push_back(entry);
+	}
+	count++;
+}
+
+void HammingIndex::remove(uint32_t id, uint64_t hash)
+{
+	for (int table=0; table<4; table++)
+	{
+		map<uint16_t, vector<Entry> >::iterator bucket = tables[table].find((uint16_t)(hash >> (table * 16)));
+		if (bucket == tables[table].end())
+		{
+			continue;
+		}
+		vector<Entry>& entries = bucket->second;
+		for (size_t i=0; i<entries.size(); i++)
+		{
+			if (entries[i].id == id)
+			{
+				entries.erase(entries.begin() + i);
+				break;
+			}
+		}
+		if (entries.empty())
+		{
+			tables[table].erase(bucket);
+		}
+	}
+	count--;
+}
+
+size_t HammingIndex::size()
+{
+	return count;
+}
+
+void HammingIndex::clear()
+{
+	for (int table=0; table<4; table++)
+	{
+		tables[table].clear();
+	}
+	count = 0;
+}
+
+void HammingIndex::probe(int table, uint16_t key, uint64_t hash, int maxDistance, vector<HammingMatch>& matches)
+{
+	map<uint16_t, vector<Entry> >::iterator bucket = tables[table].find(key);
+	if (bucket == tables[table].end())
+	{
+		return;
+	}
+	vector<Entry>& entries = bucket->second;
+	for (size_t i=0; i<entries.size(); i++)
+	{
+		int bits = distance(entries[i].hash, hash);
+		if (bits <= maxDistance)
+		{
+			HammingMatch match;
+			match.id = entries[i].id;
+			match.distance = bits;
+			matches.push_back(match);
+		}
+	}
+}
+
+/**
+ * Every stored hash within maxDistance of hash
+ *
+ * @param hash Query
+ * @param maxDistance Bits that may differ, at most 11
+ * @param matches Replaced with one match per id, in id order
+ */
+void HammingIndex::search(uint64_t hash, int maxDistance, vector<HammingMatch>& matches)
+{
+	matches.clear();
+	maxDistance = min(maxDistance, 11);
+	int wordDistance = maxDistance / 4;
+	for (int table=0; table<4; table++)
+	{
+		uint16_t key = (uint16_t)(hash >> (table * 16));
+		probe(table, key, hash, maxDistance, matches);
+		for (int a=0; a<16 && wordDistance >= 1; a++)
+		{
+			probe(table, key ^ (1 << a), hash, maxDistance, matches);
+			for (int b=a+1; b<16 && wordDistance >= 2; b++)
+			{
+				probe(table, key ^ (1 << a) ^ (1 << b), hash, maxDistance, matches);
+			}
+		}
+	}
+	// A hash close in several words is found in each of those tables
+	sort(matches.begin(), matches.end(), compareMatchId);
+	matches.erase(unique(matches.begin(), matches.end(), sameMatchId), matches.end());
+}
+
+class DedupBandTask : public ParallelTask
+{
+public:
+	const unsigned char* pixels;
+	int width;
+	int height;
+	int stride;
+	int channels;						// 1 for luma, 3 for RGB
+	const int* columnBin;				// source column to grid column
+	uint64_t* sums;						// DHASH_ROWS x DHASH_COLUMNS
+	uint32_t* areas;
+
+	// Items are grid rows, each sums its band of source rows into 9 bins
+	void run(int begin, int end)
+	{
+		for (int band=begin; band<end; band++)
+		{
+			int rowStart = (int)((int64_t)band * height / DHASH_ROWS);
+			int rowEnd = (int)((int64_t)(band + 1) * height / DHASH_ROWS);
+			uint64_t* bandSums = sums + band * DHASH_COLUMNS;
+			uint32_t* bandAreas = areas + band * DHASH_COLUMNS;
+			for (int bin=0; bin<DHASH_COLUMNS; bin++)
+			{
+				bandSums[bin] = 0;
+				bandAreas[bin] = 0;
+			}
+			for (int y=rowStart; y<rowEnd; y++)
+			{
+				const unsigned char* row = pixels + (size_t)y * stride;
+				// Bin boundaries are column runs, so sum a run before touching the 64 bit total
+				int x = 0;
+				while (x < width)
+				{
+					int bin = columnBin[x];
+					uint32_t total = 0;
+					int runStart = x;
+					if (channels == 3)
+					{
+						for (; x < width && columnBin[x] == bin; x++)
+						{
+							const unsigned char* p = row + x * 3;
+							// Integer Rec.601 luma
+							total += (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+						}
+					}else
+					{
+						for (; x < width && columnBin[x] == bin; x++)
+						{
+							total += row[x * channels];
+						}
+					}
+					bandSums[bin] += total;
+					bandAreas[bin] += x - runStart;
+				}
+			}
+		}
+	}
+};
+
+PerceptualDedup::PerceptualDedup()
+{
+	policy = DEDUP_OFF;
+	maxDistance = 6;
+	thinEvery = 10;
+	thinSeconds = 0;
+	windowSize = 1024;
+	lastHash = 0;
+	lastDistance = -1;
+	lastMillis = 0;
+	nextId = 1;
+	numLookups = 0;
+	numHits = 0;
+	lookups = NULL;
+	hits = NULL;
+	dropped = NULL;
+	hitRate = NULL;
+	lookupMicros = NULL;
+}
+
+void PerceptualDedup::setup(string labels)
+{
+	MetricsRegistry& registry = MetricsRegistry::getInstance();
+	lookups = registry.addCounter("camera_dedup_lookups_total", "Captures compared with recently kept photos", labels);
+	hits = registry.addCounter("camera_dedup_hits_total", "Captures found to be near duplicates of a recently kept photo", labels);
+	dropped = registry.addCounter("camera_dedup_dropped_total", "Near duplicates discarded before reaching photos/", labels);
+	hitRate = registry.addGauge("camera_dedup_hit_permille", "Share of lookups that found a near duplicate since startup, in thousandths", labels);
+	static const double lookupBoundsMicros[] = {5, 10, 25, 50, 100, 250, 500, 1000, 5000};
+	lookupMicros = registry.addHistogram("camera_dedup_lookup_microseconds", "Time to search the index of kept hashes", lookupBoundsMicros, sizeof(lookupBoundsMicros)/sizeof(double), labels);
+}
+
+uint64_t PerceptualDedup::hashBands(const unsigned char* pixels, int width, int height, int stride, int channels)
+{
+	TIMELINE_SCOPE("perceptualHash");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+
+	vector<int> columnBin(width);
+	for (int x=0; x<width; x++)
+	{
+		columnBin[x] = (int)((int64_t)x * DHASH_COLUMNS / width);
+	}
+	uint64_t sums[DHASH_ROWS * DHASH_COLUMNS];
+	uint32_t areas[DHASH_ROWS * DHASH_COLUMNS];
+
+	DedupBandTask task;
+	task.pixels = pixels;
+	task.width = width;
+	task.height = height;
+	task.stride = stride;
+	task.channels = channels;
+	task.columnBin = &columnBin[0];
+	task.sums = sums;
+	task.areas = areas;
+	ParallelFor::getInstance().run(DHASH_ROWS, 1, task);
+
+	uint64_t frameHash = 0;
+	for (int row=0; row<DHASH_ROWS; row++)
+	{
+		for (int column=0; column<DHASH_COLUMNS-1; column++)
+		{
+			// Compare means, cross multiplied since the bins may differ in area by a column
+			int cell = row * DHASH_COLUMNS + column;
+			bool brighter = sums[cell + 1] * areas[cell] > sums[cell] * areas[cell + 1];
+			frameHash = (frameHash << 1) | (brighter ? 1 : 0);
+		}
+	}
+	lastHash = frameHash;
+	lastMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+	return frameHash;
+}
+
+/**
+ * Hash a decoded photo
+ *
+ * @param pixels RGB, or a single luma channel
+ * @return The 64 bit dHash, 0 if pixels is too small to hash
+ */
+uint64_t PerceptualDedup::hash(const ofPixels& pixels)
+{
+	int channels = pixels.getNumChannels();
+	if (pixels.getWidth() < DHASH_COLUMNS || pixels.getHeight() < DHASH_ROWS || (channels != 1 && channels != 3))
+	{
+		return 0;
+	}
+	return hashBands(pixels.getPixels(), pixels.getWidth(), pixels.getHeight(), pixels.getWidth() * channels, channels);
+}
+
+void PerceptualDedup::keep(uint64_t frameHash, unsigned long long keptMillis)
+{
+	KeptFrame frame;
+	frame.id = nextId++;
+	frame.hash = frameHash;
+	frame.keptMillis = keptMillis;
+	frame.suppressed = 0;
+	kept.push_back(frame);
+	index.add(frame.id, frame.hash);
+	while (kept.size() > max(windowSize, (size_t)1))
+	{
+		index.remove(kept.front().id, kept.front().hash);
+		kept.pop_front();
+	}
+}
+
+/**
+ * Remember a photo kept before this run, e.g. from the catalog, so a
+ * restart doesn't begin by keeping another copy of the same scene
+ *
+ * @param frameHash Its dHash
+ * @param ageMillis How long ago it was taken
+ */
+void PerceptualDedup::seed(uint64_t frameHash, unsigned long long ageMillis)
+{
+	unsigned long long now = ofGetElapsedTimeMillis();
+	// Elapsed time starts at 0, so older photos are clamped to the start; they only matter to thinSeconds
+	keep(frameHash, now > ageMillis ? now - ageMillis : 0);
+}
+
+/**
+ * Decide whether a capture is kept. Nothing is indexed here; call
+ * remember() once the photo has really been kept, since a later check
+ * (focus, storage) may still throw it away.
+ *
+ * @param frameHash From hash()
+ * @return false if policy says the capture should be discarded
+ */
+bool PerceptualDedup::check(uint64_t frameHash)
+{
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	index.search(frameHash, maxDistance, matches);
+	// The closest kept frame, the most recent one on a tie
+	const HammingMatch* best = NULL;
+	for (size_t i=0; i<matches.size(); i++)
+	{
+		if (!best || matches[i].distance <= best->distance)
+		{
+			best = &matches[i];
+		}
+	}
+	lookupMicros->observe(ofGetElapsedTimeMicros() - startMicros);
+	lookups->increment();
+	numLookups++;
+	lastDistance = best ? best->distance : -1;
+
+	unsigned long long now = ofGetElapsedTimeMillis();
+	if (best)
+	{
+		hits->increment();
+		numHits++;
+	}
+	hitRate->set(numHits * 1000 / numLookups);
+
+	if (!best || policy == DEDUP_OFF || policy == DEDUP_KEEP)
+	{
+		return true;
+	}
+
+	KeptFrame& match = kept[best->id - kept.front().id];
+	match.suppressed++;
+	if (policy == DEDUP_THIN &&
+		((thinEvery > 0 && match.suppressed >= thinEvery) || (thinSeconds > 0 && now - match.keptMillis >= (unsigned long long)thinSeconds * 1000)))
+	{
+		// Kept as the new reference for this scene
+		return true;
+	}
+	dropped->increment();
+	return false;
+}
+
+/**
+ * Index a photo check() passed, once it has been committed
+ *
+ * @param frameHash From hash()
+ */
+void PerceptualDedup::remember(uint64_t frameHash)
+{
+	keep(frameHash, ofGetElapsedTimeMillis());
+}
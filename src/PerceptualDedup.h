@@ -0,0 +1,117 @@
+#pragma once
+
+#include "ofMain.h"
+#include "MetricsRegistry.h"
+
+/*
+ Finds captures that look the same as one kept recently, so a static scene
+ doesn't fill the card with thousands of identical photos.
+
+ The hash is a 64 bit dHash: the frame's luma box averaged down to 9x8,
+ one bit per horizontally adjacent pair saying which is brighter. It
+ ignores exposure drift, JPEG noise and small shifts, and two frames of
+ the same scene land a few bits apart. Hashing is one pass over the
+ image, with bands of rows split across ParallelFor; a 1/8 scale decode
+ gives the same cell means as the full photo for a fraction of the work.
+
+ Kept hashes go into a HammingIndex of the last windowSize kept frames,
+ added with remember() only once the photo is committed, so a capture
+ thrown away for another reason (blur) is never matched against.
+ Each frame is compared with the closest kept frame within maxDistance.
+ Dropped frames are never indexed, so a slow change (a shadow moving,
+ light fading) builds up against the last kept photo until a new one is
+ kept, rather than creeping along frame by frame.
+ */
+
+// dHash grid: 9 columns give 8 adjacent pairs per row. Also the smallest image hash() accepts
+#define DHASH_COLUMNS 9
+#define DHASH_ROWS 8
+
+struct HammingMatch
+{
+	uint32_t id;
+	int distance;
+};
+
+/*
+ Multi-index hashing: the 64 bits are split into four 16 bit words, each
+ with its own table. Two hashes within distance r agree to within r/4
+ bits in at least one word, so a search probes every word value that
+ close to the query's in each table, then checks the full distance of
+ what it finds. That is 4 x 17 probes for r < 8, against a scan of every
+ stored hash.
+ */
+class HammingIndex
+{
+public:
+	HammingIndex();
+	void add(uint32_t id, uint64_t hash);
+	void remove(uint32_t id, uint64_t hash);
+	void search(uint64_t hash, int maxDistance, vector<HammingMatch>& matches);
+	size_t size();
+	void clear();
+
+	static int distance(uint64_t a, uint64_t b)	{ return __builtin_popcountll(a ^ b); }
+
+private:
+	struct Entry
+	{
+		uint64_t hash;
+		uint32_t id;
+	};
+	void probe(int table, uint16_t key, uint64_t hash, int maxDistance, vector<HammingMatch>& matches);
+	map<uint16_t, vector<Entry> > tables[4];
+	size_t count;
+};
+
+enum DedupPolicy
+{
+	DEDUP_OFF,							// captures aren't hashed
+	DEDUP_KEEP,							// hash and count near duplicates, keep them all
+	DEDUP_DROP,							// drop every near duplicate
+	DEDUP_THIN							// keep one in thinEvery near duplicates, and one every thinSeconds
+};
+
+class PerceptualDedup
+{
+public:
+	PerceptualDedup();
+	void setup(string labels);
+	uint64_t hash(const ofPixels& pixels);
+	bool check(uint64_t frameHash);
+	void remember(uint64_t frameHash);
+	void seed(uint64_t frameHash, unsigned long long ageMillis);
+
+	DedupPolicy policy;
+	int maxDistance;					// bits of 64 that may differ in a near duplicate, at most 11
+	int thinEvery;						// DEDUP_THIN: keep every thinEvery'th near duplicate of a kept photo
+	int thinSeconds;					// DEDUP_THIN: also keep one when the last kept match is this old, 0 disables
+	size_t windowSize;					// kept hashes remembered
+	uint64_t lastHash;
+	int lastDistance;					// to the closest kept frame, -1 if none was within maxDistance
+	float lastMillis;					// hashing time of the last frame
+
+private:
+	struct KeptFrame
+	{
+		uint32_t id;
+		uint64_t hash;
+		unsigned long long keptMillis;
+		int suppressed;					// near duplicates of it dropped since it was kept
+	};
+	uint64_t hashBands(const unsigned char* pixels, int width, int height, int stride, int channels);
+	void keep(uint64_t frameHash, unsigned long long keptMillis);
+
+	HammingIndex index;
+	deque<KeptFrame> kept;				// oldest first, ids consecutive
+	uint32_t nextId;
+	vector<HammingMatch> matches;
+	uint64_t numLookups;
+	uint64_t numHits;
+
+	MetricsCounter* lookups;
+	MetricsCounter* hits;
+	MetricsCounter* dropped;
+	MetricsGauge* hitRate;
+	MetricsHistogram* lookupMicros;
+};
@@ -16,6 +16,9 @@ Photo::Photo()
 	width = 2592;
 	height = 1944;
 	quality = 100;
+	sensorMode = 0;
+	frameRateNum = 3;
+	frameRateDen = 1;
 	wantRAW = 0;
 	filename = NULL;
 	camera = NULL;
@@ -24,6 +27,8 @@ Photo::Photo()
 	encoder_pool = NULL;
 	encoding = MMAL_ENCODING_JPEG;
 	numExifTags = 0;
+	exifDateTime[0] = 0;
+	exifSubSec[0] = 0;
 }
 void Photo::setup(MMAL_COMPONENT_T* camera_)
 {
@@ -64,44 +69,65 @@ MMAL_STATUS_T Photo::add_exif_tag(const char *exif_tag)
 }
 
 /**
- * Add a basic set of EXIF tags to the capture
- * Make, Time etc
+ * Format a time the way add_exif_tags() sends it
  *
- * @param state Pointer to state control struct
+ * @param when Time to format, shown in local time
+ * @param dateTime Receives "YYYY:MM:DD:HH:MM:SS", 20 bytes
+ * @param subSec Receives the microseconds as 6 digits, 7 bytes
+ */
+void Photo::format_exif_time(const struct timeval& when, char* dateTime, char* subSec)
+{
+	struct tm timeinfo;
+	time_t seconds = when.tv_sec;
+	localtime_r(&seconds, &timeinfo);
+	
+	snprintf(dateTime, 20,
+			 "%04d:%02d:%02d:%02d:%02d:%02d",
+			 timeinfo.tm_year+1900,
+			 timeinfo.tm_mon+1,
+			 timeinfo.tm_mday,
+			 timeinfo.tm_hour,
+			 timeinfo.tm_min,
+			 timeinfo.tm_sec);
+	snprintf(subSec, 7, "%06d", (int)when.tv_usec);
+}
+
+/**
+ * Add a basic set of EXIF tags to the capture
+ * Make, Time etc. The times are fixed width so the encoder callback can
+ * overwrite them in place with the time the frame was actually exposed.
  *
+ * @param when Best estimate of the capture time
+ * @param uniqueId 32 hex digits for EXIF.ImageUniqueID, NULL to leave it out
  */
-void Photo::add_exif_tags()
+void Photo::add_exif_tags(const struct timeval& when, const char* uniqueId)
 {
-	time_t rawtime;
-	struct tm *timeinfo;
-	char time_buf[32];
 	char exif_buf[128];
 	int i;
 	
 	add_exif_tag("IFD0.Model=RP_OV5647");
 	add_exif_tag("IFD0.Make=RaspberryPi");
 	
-	time(&rawtime);
-	timeinfo = localtime(&rawtime);
+	format_exif_time(when, exifDateTime, exifSubSec);
 	
-	snprintf(time_buf, sizeof(time_buf),
-			 "%04d:%02d:%02d:%02d:%02d:%02d",
-			 timeinfo->tm_year+1900,
-			 timeinfo->tm_mon+1,
-			 timeinfo->tm_mday,
-			 timeinfo->tm_hour,
-			 timeinfo->tm_min,
-			 timeinfo->tm_sec);
-	
-	snprintf(exif_buf, sizeof(exif_buf), "EXIF.DateTimeDigitized=%s", time_buf);
+	snprintf(exif_buf, sizeof(exif_buf), "EXIF.DateTimeDigitized=%s", exifDateTime);
+	add_exif_tag(exif_buf);
+	
+	snprintf(exif_buf, sizeof(exif_buf), "EXIF.DateTimeOriginal=%s", exifDateTime);
 	add_exif_tag(exif_buf);
 	
-	snprintf(exif_buf, sizeof(exif_buf), "EXIF.DateTimeOriginal=%s", time_buf);
+	snprintf(exif_buf, sizeof(exif_buf), "IFD0.DateTime=%s", exifDateTime);
 	add_exif_tag(exif_buf);
 	
-	snprintf(exif_buf, sizeof(exif_buf), "IFD0.DateTime=%s", time_buf);
+	snprintf(exif_buf, sizeof(exif_buf), "EXIF.SubSecTimeOriginal=%s", exifSubSec);
 	add_exif_tag(exif_buf);
 	
+	if (uniqueId)
+	{
+		snprintf(exif_buf, sizeof(exif_buf), "EXIF.ImageUniqueID=%s", uniqueId);
+		add_exif_tag(exif_buf);
+	}
+	
 	// Now send any user supplied tags
 	
 	for (i=0;i<numExifTags && i < MAX_USER_EXIF_TAGS; i++)
@@ -17,10 +17,13 @@ class Photo
 {
 public:
 	Photo();
-	int					timeout;									// Time taken before frame is grabbed and app then shuts down. Units are milliseconds
+	int					timeout;									// Longest wait for AE/AWB to settle before a capture. Units are milliseconds
 	int					width;                          
 	int					height;                         
 	int					quality;									// JPEG quality setting (1-100)
+	int					sensorMode;									// MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG, 0 lets the firmware choose
+	int					frameRateNum;								// stills port frame rate, bounds the exposure time
+	int					frameRateDen;
 	int					wantRAW;									// Flag for whether the JPEG metadata also contains the RAW bayer image
 	char*				filename;									// filename of output file
 	MMAL_FOURCC_T		encoding;									// Encoding to use for the output file. defined in userland/interface/mmal/util/mmal_il.c
@@ -35,7 +38,10 @@ public:
 	
 	MMAL_POOL_T*		encoder_pool;								// Pointer to the pool of buffers used by encoder output port
 	
-	void add_exif_tags();
+	void add_exif_tags(const struct timeval& when, const char* uniqueId=NULL);
+	static void format_exif_time(const struct timeval& when, char* dateTime, char* subSec);
+	char				exifDateTime[20];							// "YYYY:MM:DD:HH:MM:SS" as last sent, so the encoder callback can restamp it
+	char				exifSubSec[7];								// microseconds of exifDateTime, 6 digits
 	MMAL_STATUS_T add_exif_tag(const char* exif_tag);
 	
 	void setup(MMAL_COMPONENT_T* camera_);
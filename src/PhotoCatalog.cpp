@@ -0,0 +1,272 @@
+/*
+ *  PhotoCatalog.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "PhotoCatalog.h"
+#include "AtomicFile.h"
+
+#include <unistd.h>
+
+#define CATALOG_COLUMNS "path\tcamera\tcapture_us\tbytes\tgroup\tcrc32c\tfocus\tdhash"
+
+// Forgotten rows tolerated in the file before it is rewritten, at least
+// half the live rows so a large catalog isn't rewritten for every photo
+#define CATALOG_COMPACT_ROWS 1024
+
+CatalogEntry::CatalogEntry()
+{
+	cameraNum = 0;
+	captureTimeMicros = 0;
+	bytes = 0;
+	groupId = 0;
+	crc32c = 0;
+	focusScore = -1;
+	perceptualHash = 0;
+}
+
+PhotoCatalog::PhotoCatalog()
+{
+	added = 0;
+	staleRows = 0;
+}
+
+/**
+ * Load an existing catalog or start a new one
+ *
+ * @param catalogPath_ Absolute path of the catalog file
+ */
+void PhotoCatalog::setup(string catalogPath_)
+{
+	catalogPath = catalogPath_;
+	ofScopedLock lock(catalogMutex);
+	entries.clear();
+	sequences.clear();
+	added = 0;
+	staleRows = 0;
+	if (!load())
+	{
+		FILE* file = fopen(catalogPath.c_str(), "w");
+		if (file)
+		{
+			fprintf(file, "%s\n", CATALOG_COLUMNS);
+			fclose(file);
+		}
+		else
+		{
+			ofLogError() << "Could not create catalog " << catalogPath;
+		}
+	}
+	ofLogVerbose() << "Catalog " << catalogPath << " has " << entries.size() << " entries";
+}
+
+bool PhotoCatalog::load()
+{
+	ifstream input(catalogPath.c_str());
+	if (!input.good())
+	{
+		return false;
+	}
+
+	string line;
+	if (!getline(input, line))
+	{
+		return false;
+	}
+
+	// Map column names to positions so added or reordered columns still parse
+	vector<string> columns = ofSplitString(line, "\t");
+	map<string, int> columnIndex;
+	for (size_t i=0; i<columns.size(); i++)
+	{
+		columnIndex[columns[i]] = i;
+	}
+
+	bool damaged = false;
+	while (getline(input, line))
+	{
+		if (line.empty()) continue;
+		vector<string> fields = ofSplitString(line, "\t");
+		// A row without its newline or some columns was cut short by a power cut, and its
+		// bytes may be too. Leave the photo unknown so discardIncomplete checks the file itself
+		if (input.eof() || fields.size() < columns.size())
+		{
+			ofLogWarning() << "Catalog " << catalogPath << " has a truncated row, dropping it: " << line;
+			damaged = true;
+			continue;
+		}
+
+		CatalogEntry entry;
+		map<string, int>::iterator it;
+		if ((it = columnIndex.find("path")) != columnIndex.end() && it->second < (int)fields.size())
+			entry.path = fields[it->second];
+		if ((it = columnIndex.find("camera")) != columnIndex.end() && it->second < (int)fields.size())
+			entry.cameraNum = ofToInt(fields[it->second]);
+		if ((it = columnIndex.find("capture_us")) != columnIndex.end() && it->second < (int)fields.size())
+			entry.captureTimeMicros = strtoull(fields[it->second].c_str(), NULL, 10);
+		if ((it = columnIndex.find("bytes")) != columnIndex.end() && it->second < (int)fields.size())
+			entry.bytes = strtoul(fields[it->second].c_str(), NULL, 10);
+		if ((it = columnIndex.find("group")) != columnIndex.end() && it->second < (int)fields.size())
+			entry.groupId = strtoull(fields[it->second].c_str(), NULL, 10);
+		if ((it = columnIndex.find("crc32c")) != columnIndex.end() && it->second < (int)fields.size())
+			entry.crc32c = strtoul(fields[it->second].c_str(), NULL, 16);
+		if ((it = columnIndex.find("focus")) != columnIndex.end() && it->second < (int)fields.size())
+			entry.focusScore = ofToFloat(fields[it->second]);
+		if ((it = columnIndex.find("dhash")) != columnIndex.end() && it->second < (int)fields.size())
+			entry.perceptualHash = strtoull(fields[it->second].c_str(), NULL, 16);
+
+		if (!entry.path.empty())
+		{
+			entries.push_back(entry);
+			sequences.push_back(added++);
+		}
+	}
+	
+	// Rows are appended in the current layout, so an older header has to be brought up to date first
+	if (columns != ofSplitString(CATALOG_COLUMNS, "\t"))
+	{
+		rewrite();
+		ofLogNotice() << "Catalog " << catalogPath << " updated to columns: " << CATALOG_COLUMNS;
+	}else if (damaged)
+	{
+		// Otherwise the next row would be appended to the partial one
+		rewrite();
+	}
+	return true;
+}
+
+/**
+ * Write every entry back out under the current header, atomically
+ */
+void PhotoCatalog::rewrite()
+{
+	string text = string(CATALOG_COLUMNS) + "\n";
+	for (size_t i=0; i<entries.size(); i++)
+	{
+		text += formatLine(entries[i]);
+	}
+	if (!atomicFileWrite(catalogPath, text.data(), text.size()))
+	{
+		ofLogError() << "Could not rewrite catalog " << catalogPath;
+		return;
+	}
+	staleRows = 0;
+}
+
+string PhotoCatalog::formatLine(const CatalogEntry& entry)
+{
+	char numbers[128];
+	snprintf(numbers, sizeof(numbers), "\t%d\t%llu\t%u\t%llu\t%08x\t%.1f\t%016llx\n",
+			 entry.cameraNum,
+			 (unsigned long long)entry.captureTimeMicros,
+			 entry.bytes,
+			 (unsigned long long)entry.groupId,
+			 entry.crc32c,
+			 entry.focusScore,
+			 (unsigned long long)entry.perceptualHash);
+	return entry.path + numbers;
+}
+
+void PhotoCatalog::appendLine(const CatalogEntry& entry)
+{
+	FILE* file = fopen(catalogPath.c_str(), "a");
+	if (!file)
+	{
+		ofLogError() << "Could not append to catalog " << catalogPath;
+		return;
+	}
+	string line = formatLine(entry);
+	fwrite(line.data(), 1, line.size(), file);
+	// The photo itself was synced before it was catalogued; without this the row
+	// could still be lost, or land half written, in a power cut
+	if (fflush(file) != 0 || fdatasync(fileno(file)) != 0)
+	{
+		int error = errno;
+		ofLogWarning() << "Could not sync catalog " << catalogPath << " (errno " << error << ")";
+	}
+	fclose(file);
+}
+
+/**
+ * Record a photo. Safe to call from several capture threads at once.
+ *
+ * @param entry The photo to add
+ */
+void PhotoCatalog::add(const CatalogEntry& entry)
+{
+	ofScopedLock lock(catalogMutex);
+	entries.push_back(entry);
+	sequences.push_back(added++);
+	if (!catalogPath.empty())
+	{
+		appendLine(entry);
+	}
+}
+
+vector<CatalogEntry> PhotoCatalog::getEntries()
+{
+	ofScopedLock lock(catalogMutex);
+	return entries;
+}
+
+/**
+ * Entries added since a reader last looked, for pollers that keep a cursor.
+ * Positions count every entry ever added, so forget() doesn't move a cursor.
+ *
+ * @param first Position of the first entry wanted, usually the size() seen last time
+ * @return Entries from first on that are still catalogued, empty if there are none
+ */
+vector<CatalogEntry> PhotoCatalog::getEntries(size_t first)
+{
+	ofScopedLock lock(catalogMutex);
+	size_t index = lower_bound(sequences.begin(), sequences.end(), first) - sequences.begin();
+	return vector<CatalogEntry>(entries.begin() + index, entries.end());
+}
+
+/**
+ * @return Entries ever added, including forgotten ones; the cursor for getEntries(first)
+ */
+size_t PhotoCatalog::size()
+{
+	ofScopedLock lock(catalogMutex);
+	return added;
+}
+
+/**
+ * Drop the rows of photos that no longer exist, e.g. rotated out by
+ * StorageManager. The file is rewritten once enough rows are stale.
+ *
+ * @param paths Absolute paths of the deleted photos
+ */
+void PhotoCatalog::forget(const vector<string>& paths)
+{
+	if (paths.empty())
+	{
+		return;
+	}
+	set<string> gone(paths.begin(), paths.end());
+	ofScopedLock lock(catalogMutex);
+	size_t kept = 0;
+	for (size_t i=0; i<entries.size(); i++)
+	{
+		if (gone.count(entries[i].path))
+		{
+			continue;
+		}
+		if (kept != i)
+		{
+			entries[kept] = entries[i];
+			sequences[kept] = sequences[i];
+		}
+		kept++;
+	}
+	staleRows += entries.size() - kept;
+	entries.resize(kept);
+	sequences.resize(kept);
+
+	if (!catalogPath.empty() && staleRows >= max((size_t)CATALOG_COMPACT_ROWS, entries.size() / 2))
+	{
+		rewrite();
+	}
+}
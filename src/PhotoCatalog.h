@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Record of every photo written, shared by all cameras. Persisted as tab
+ separated text with a header row naming the columns, so older catalogs
+ still load when columns are added. Rows are appended as photos arrive;
+ rows of photos rotated away are dropped in memory at once and from the
+ file by an occasional rewrite.
+ */
+
+struct CatalogEntry
+{
+	CatalogEntry();
+	string path;						// absolute path of the JPEG
+	int cameraNum;						// MMAL camera index that took it
+	uint64_t captureTimeMicros;			// realtime (epoch) microseconds at trigger
+	uint32_t bytes;						// encoded size
+	uint64_t groupId;					// shared by frames from one synchronized trigger, 0 if none
+	uint32_t crc32c;					// checksum of the file as written, 0 if unknown
+	float focusScore;					// FocusScorer Laplacian variance, -1 if not scored
+	uint64_t perceptualHash;			// PerceptualDedup dHash, 0 if not hashed
+};
+
+class PhotoCatalog
+{
+public:
+	PhotoCatalog();
+	void setup(string catalogPath_);
+	void add(const CatalogEntry& entry);
+	vector<CatalogEntry> getEntries();
+	vector<CatalogEntry> getEntries(size_t first);
+	size_t size();
+	void forget(const vector<string>& paths);
+
+	string catalogPath;
+
+private:
+	bool load();
+	void appendLine(const CatalogEntry& entry);
+	void rewrite();
+	string formatLine(const CatalogEntry& entry);
+	ofMutex catalogMutex;
+	vector<CatalogEntry> entries;
+	vector<size_t> sequences;			// position each entry was added at, what getEntries(first) and size() count
+	size_t added;						// entries ever added, the next sequence
+	size_t staleRows;					// rows still in the file for forgotten photos
+};
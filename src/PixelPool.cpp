@@ -0,0 +1,339 @@
+/*
+ *  PixelPool.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "PixelPool.h"
+
+// Bytes in a tightly packed buffer of the shape PixelPool::shapeKey() encoded
+static size_t shapeBytes(uint64_t key)
+{
+	return (size_t)(key >> 32) * (size_t)((key >> 8) & 0xFFFFFF) * (size_t)(key & 0xFF);
+}
+
+PixelPool& PixelPool::getInstance()
+{
+	static PixelPool instance;
+	return instance;
+}
+
+PixelPool::PixelPool()
+{
+	maxIdleBytes = 48 * 1024 * 1024;
+	idleBytes = 0;
+	lentBytes = 0;
+	highWaterBytes = 0;
+
+	MetricsRegistry& registry = MetricsRegistry::getInstance();
+	allocations = registry.addCounter("pixel_pool_allocations_total", "Pixel buffers the pool had to allocate");
+	reuses = registry.addCounter("pixel_pool_reuses_total", "Pixel buffer requests served from an idle buffer");
+	frees = registry.addCounter("pixel_pool_frees_total", "Idle pixel buffers freed to stay under maxIdleBytes");
+	allocatedBytes = registry.addGauge("pixel_pool_allocated_bytes", "Pixel buffer memory held by the pool, idle and lent");
+	lentGauge = registry.addGauge("pixel_pool_lent_bytes", "Pixel buffer memory currently borrowed");
+	highWater = registry.addGauge("pixel_pool_high_water_bytes", "Most pixel buffer memory ever held at once");
+}
+
+// Lent buffers may belong to images that outlive the pool at exit, only idle ones are freed
+PixelPool::~PixelPool()
+{
+	trim();
+}
+
+uint64_t PixelPool::shapeKey(int width, int height, int channels)
+{
+	return ((uint64_t)width << 32) | ((uint64_t)height << 8) | (uint64_t)channels;
+}
+
+void PixelPool::updateGauges()
+{
+	allocatedBytes->set(idleBytes + lentBytes);
+	lentGauge->set(lentBytes);
+	if (idleBytes + lentBytes > highWaterBytes)
+	{
+		highWaterBytes = idleBytes + lentBytes;
+		highWater->set(highWaterBytes);
+	}
+}
+
+unsigned char* PixelPool::take(uint64_t key, size_t bytes)
+{
+	ofScopedLock lock(poolMutex);
+	unsigned char* data = NULL;
+	vector<unsigned char*>& shapeIdle = idle[key];
+	if (!shapeIdle.empty())
+	{
+		data = shapeIdle.back();
+		shapeIdle.pop_back();
+		idleBytes -= bytes;
+		reuses->increment();
+	}else
+	{
+		void* allocated = NULL;
+		if (posix_memalign(&allocated, PIXEL_POOL_ALIGNMENT, bytes) != 0)
+		{
+			ofLogError() << "PixelPool could not allocate " << bytes << " bytes";
+			return NULL;
+		}
+		data = (unsigned char*)allocated;
+		allocations->increment();
+	}
+	lent[data] = key;
+	lentBytes += bytes;
+	updateGauges();
+	return data;
+}
+
+void PixelPool::put(unsigned char* data)
+{
+	ofScopedLock lock(poolMutex);
+	map<unsigned char*, uint64_t>::iterator it = lent.find(data);
+	if (it == lent.end())
+	{
+		return;
+	}
+	uint64_t key = it->second;
+	size_t bytes = shapeBytes(key);
+	lent.erase(it);
+	lentBytes -= bytes;
+	if (idleBytes + bytes <= maxIdleBytes)
+	{
+		idle[key].push_back(data);
+		idleBytes += bytes;
+	}else
+	{
+		free(data);
+		frees->increment();
+	}
+	updateGauges();
+}
+
+/**
+ * Allocate idle buffers ahead of time, e.g. off the startup path for the capture size
+ *
+ * @param count Idle buffers of this shape wanted, existing ones count towards it
+ */
+void PixelPool::reserve(int width, int height, int channels, int count)
+{
+	uint64_t key = shapeKey(width, height, channels);
+	size_t bytes = shapeBytes(key);
+	ofScopedLock lock(poolMutex);
+	vector<unsigned char*>& shapeIdle = idle[key];
+	while ((int)shapeIdle.size() < count)
+	{
+		void* allocated = NULL;
+		if (posix_memalign(&allocated, PIXEL_POOL_ALIGNMENT, bytes) != 0)
+		{
+			ofLogError() << "PixelPool could not reserve " << bytes << " bytes";
+			break;
+		}
+		shapeIdle.push_back((unsigned char*)allocated);
+		idleBytes += bytes;
+		allocations->increment();
+	}
+	updateGauges();
+}
+
+/**
+ * Point pixels at a pool buffer of the given shape. A buffer pixels
+ * already borrowed is kept if it has the same shape, otherwise given back.
+ *
+ * @return false if no memory could be had
+ */
+bool PixelPool::borrow(ofPixels& pixels, int width, int height, int channels)
+{
+	if (width <= 0 || height <= 0 || channels <= 0)
+	{
+		return false;
+	}
+	uint64_t key = shapeKey(width, height, channels);
+	{
+		ofScopedLock lock(poolMutex);
+		map<unsigned char*, uint64_t>::iterator it = lent.find(pixels.getPixels());
+		if (it != lent.end() && it->second == key)
+		{
+			return true;
+		}
+	}
+	giveBack(pixels);
+	unsigned char* data = take(key, shapeBytes(key));
+	if (!data)
+	{
+		return false;
+	}
+	pixels.setFromExternalPixels(data, width, height, channels);
+	return true;
+}
+
+/**
+ * Return the buffer pixels borrowed and leave it empty. Pixels that own
+ * their memory, or hold none, are left alone.
+ */
+void PixelPool::giveBack(ofPixels& pixels)
+{
+	unsigned char* data = pixels.getPixels();
+	bool pooled;
+	{
+		ofScopedLock lock(poolMutex);
+		pooled = data && lent.count(data);
+	}
+	if (pooled)
+	{
+		// External memory, clear() only forgets it
+		pixels.clear();
+		put(data);
+	}
+}
+
+/**
+ * Hand a decode over to another ofPixels without copying it, e.g. into
+ * an ofImage. from is left empty; to gives back whatever it held.
+ */
+void PixelPool::transfer(ofPixels& from, ofPixels& to)
+{
+	unsigned char* data = from.getPixels();
+	bool pooled;
+	{
+		ofScopedLock lock(poolMutex);
+		pooled = data && lent.count(data);
+	}
+	if (!pooled)
+	{
+		// Decoded into its own memory, copy it into a pool buffer
+		if (data && borrow(to, from.getWidth(), from.getHeight(), from.getNumChannels()))
+		{
+			memcpy(to.getPixels(), data, (size_t)from.getWidth() * from.getHeight() * from.getNumChannels());
+		}
+		from.clear();
+		return;
+	}
+	giveBack(to);
+	to.setFromExternalPixels(data, from.getWidth(), from.getHeight(), from.getNumChannels());
+	from.clear();
+}
+
+/**
+ * Decode an image into a pool buffer. JPEGs are sized from their header
+ * first so ofLoadImage() writes into the borrowed buffer; anything else
+ * decodes into memory of its own as before.
+ *
+ * @param pixels Receives the image, any buffer it held is reused or given back
+ * @return false if the file couldn't be decoded
+ */
+bool PixelPool::load(ofPixels& pixels, string path)
+{
+	int width, height, channels;
+	if (!readJpegSize(path, width, height, channels) || !borrow(pixels, width, height, channels))
+	{
+		giveBack(pixels);
+		return ofLoadImage(pixels, path);
+	}
+	unsigned char* borrowed = pixels.getPixels();
+	bool loaded = ofLoadImage(pixels, path);
+	if (pixels.getPixels() != borrowed)
+	{
+		// Decoded to another shape than the header said, ofPixels let go of the buffer
+		put(borrowed);
+	}else if (!loaded)
+	{
+		giveBack(pixels);
+	}
+	return loaded;
+}
+
+/**
+ * load() into an ofImage and upload its texture
+ */
+bool PixelPool::loadImage(ofImage& image, string path)
+{
+	if (!load(image.getPixelsRef(), path))
+	{
+		return false;
+	}
+	image.update();
+	return true;
+}
+
+/**
+ * Free every idle buffer
+ */
+void PixelPool::trim()
+{
+	ofScopedLock lock(poolMutex);
+	for (map<uint64_t, vector<unsigned char*> >::iterator it=idle.begin(); it!=idle.end(); ++it)
+	{
+		for (size_t i=0; i<it->second.size(); i++)
+		{
+			free(it->second[i]);
+			frees->increment();
+		}
+	}
+	idle.clear();
+	idleBytes = 0;
+	updateGauges();
+}
+
+/**
+ * Size of a JPEG from its frame header, without decoding anything
+ *
+ * @param channels 1 for greyscale, 3 for colour
+ * @return false if path isn't a JPEG with 1 or 3 components
+ */
+bool PixelPool::readJpegSize(string path, int& width, int& height, int& channels)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+	bool found = false;
+	if (fgetc(file) == 0xFF && fgetc(file) == 0xD8)
+	{
+		while (!found)
+		{
+			int marker = fgetc(file);
+			if (marker != 0xFF)
+			{
+				break;
+			}
+			while (marker == 0xFF)
+			{
+				// Fill bytes may pad any marker
+				marker = fgetc(file);
+			}
+			if (marker == EOF || marker == 0xD9 || marker == 0xDA)
+			{
+				break;
+			}
+			if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+			{
+				continue;
+			}
+			unsigned char lengthBytes[2];
+			if (fread(lengthBytes, 1, 2, file) != 2)
+			{
+				break;
+			}
+			int length = (lengthBytes[0] << 8) | lengthBytes[1];
+			// SOF0-SOF15, less DHT, JPG and DAC which share the range
+			bool frameHeader = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+			if (frameHeader)
+			{
+				unsigned char frame[6];
+				if (length < 8 || fread(frame, 1, 6, file) != 6)
+				{
+					break;
+				}
+				height = (frame[1] << 8) | frame[2];
+				width = (frame[3] << 8) | frame[4];
+				channels = frame[5];
+				found = true;
+			}else if (length < 2 || fseek(file, length - 2, SEEK_CUR) != 0)
+			{
+				break;
+			}
+		}
+	}
+	fclose(file);
+	return found && width > 0 && height > 0 && (channels == 1 || channels == 3);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ofMain.h"
+#include "MetricsRegistry.h"
+
+// Buffers start on a cache line, which also covers NEON's 16 byte loads
+#define PIXEL_POOL_ALIGNMENT 64
+
+/*
+ Decoded photos are 15MB each at 5MP RGB. Allocating one per capture and
+ per slide churns the heap and fragments a 512MB Pi until a large
+ allocation fails, so decodes borrow their buffers from here instead and
+ hand them back when done. Idle buffers are kept by size and channel
+ count and reused by the next decode of the same shape, which in practice
+ is every capture after the first.
+
+ A borrowed buffer is set on the ofPixels as external memory, so the
+ ofPixels never frees it. ofLoadImage() decodes straight into it when the
+ size matches; load() reads the JPEG header first so it does. An ofPixels
+ holding a pool buffer must be given back (or its buffer transferred)
+ before it goes away, otherwise the buffer stays lent until exit.
+
+ Idle buffers beyond maxIdleBytes are freed rather than kept, so a one-off
+ size (a strange file in the slideshow) doesn't pin memory for good.
+ */
+
+class PixelPool
+{
+public:
+	static PixelPool& getInstance();
+	~PixelPool();
+
+	void reserve(int width, int height, int channels, int count);
+	bool borrow(ofPixels& pixels, int width, int height, int channels);
+	void giveBack(ofPixels& pixels);
+	void transfer(ofPixels& from, ofPixels& to);
+	bool load(ofPixels& pixels, string path);
+	bool loadImage(ofImage& image, string path);
+	void trim();
+
+	static bool readJpegSize(string path, int& width, int& height, int& channels);
+
+	size_t maxIdleBytes;				// idle buffers kept for reuse, beyond this they are freed
+
+private:
+	PixelPool();
+	static uint64_t shapeKey(int width, int height, int channels);
+	unsigned char* take(uint64_t key, size_t bytes);
+	void put(unsigned char* data);
+	void updateGauges();
+
+	ofMutex poolMutex;
+	map<uint64_t, vector<unsigned char*> > idle;	// by shapeKey()
+	map<unsigned char*, uint64_t> lent;
+	size_t idleBytes;
+	size_t lentBytes;
+	size_t highWaterBytes;				// most ever allocated at once, idle and lent
+
+	MetricsCounter* allocations;
+	MetricsCounter* reuses;
+	MetricsCounter* frees;
+	MetricsGauge* allocatedBytes;
+	MetricsGauge* lentGauge;
+	MetricsGauge* highWater;
+};
+
+// Hands its buffer back to the pool when it goes out of scope, for decodes local to one function
+class PooledPixels
+{
+public:
+	~PooledPixels()					{ PixelPool::getInstance().giveBack(pixels); }
+	ofPixels pixels;
+};
@@ -0,0 +1,157 @@
+/*
+ *  ProcessStats.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "ProcessStats.h"
+
+#include <dirent.h>
+
+ProcessStats::ProcessStats()
+{
+	memset(&startCounters, 0, sizeof(startCounters));
+	memset(&lastCounters, 0, sizeof(lastCounters));
+	cpuMillis = NULL;
+	contextSwitches = NULL;
+	residentBytes = NULL;
+	threads = NULL;
+}
+
+/**
+ * Register the process_* metrics and take the baseline for update()
+ *
+ * @param labels Prometheus labels for every metric
+ */
+void ProcessStats::setup(string labels)
+{
+	MetricsRegistry& registry = MetricsRegistry::getInstance();
+	cpuMillis = registry.addCounter("process_cpu_milliseconds_total", "User and system CPU time of all threads", labels);
+	contextSwitches = registry.addCounter("process_context_switches_total", "Voluntary and involuntary context switches of all threads", labels);
+	residentBytes = registry.addGauge("process_resident_bytes", "Resident set size", labels);
+	threads = registry.addGauge("process_threads", "Threads in the process", labels);
+	startCounters = read();
+	lastCounters = startCounters;
+	residentBytes->set(startCounters.residentBytes);
+	threads->set(startCounters.threads);
+}
+
+// Advance the metrics to the current totals, called from the export thread
+void ProcessStats::update()
+{
+	if (!cpuMillis)
+	{
+		return;
+	}
+	ProcessCounters now = read();
+	if (now.cpuMillis > lastCounters.cpuMillis)
+	{
+		cpuMillis->add(now.cpuMillis - lastCounters.cpuMillis);
+	}
+	if (now.contextSwitches > lastCounters.contextSwitches)
+	{
+		contextSwitches->add(now.contextSwitches - lastCounters.contextSwitches);
+	}
+	residentBytes->set(now.residentBytes);
+	threads->set(now.threads);
+	// Threads that exited take their switches with them, never count backwards
+	now.contextSwitches = max(now.contextSwitches, lastCounters.contextSwitches);
+	now.cpuMillis = max(now.cpuMillis, lastCounters.cpuMillis);
+	lastCounters = now;
+}
+
+static uint64_t statusField(const char* text, const char* field)
+{
+	const char* found = strstr(text, field);
+	return found ? strtoull(found + strlen(field), NULL, 10) : 0;
+}
+
+/**
+ * Read the current totals. Costs a few small /proc reads per thread, fine
+ * once a second, not for a hot path.
+ *
+ * @return Cumulative counters since the process started
+ */
+ProcessCounters ProcessStats::read()
+{
+	ProcessCounters counters;
+	memset(&counters, 0, sizeof(counters));
+	counters.micros = ofGetElapsedTimeMicros();
+
+	char text[2048];
+	FILE* file = fopen("/proc/self/stat", "r");
+	if (file)
+	{
+		size_t length = fread(text, 1, sizeof(text) - 1, file);
+		text[length] = 0;
+		fclose(file);
+		// utime and stime are fields 14 and 15, counting from after the ')' closing the command name
+		const char* p = strrchr(text, ')');
+		unsigned long long userTicks = 0, systemTicks = 0;
+		if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &userTicks, &systemTicks) == 2)
+		{
+			counters.cpuMillis = (userTicks + systemTicks) * 1000ULL / sysconf(_SC_CLK_TCK);
+		}
+	}
+
+	file = fopen("/proc/self/status", "r");
+	if (file)
+	{
+		size_t length = fread(text, 1, sizeof(text) - 1, file);
+		text[length] = 0;
+		fclose(file);
+		counters.residentBytes = statusField(text, "VmRSS:") * 1024;
+		counters.threads = statusField(text, "Threads:");
+	}
+
+	// Switch counts in /proc/self/status are the main thread's only
+	DIR* tasks = opendir("/proc/self/task");
+	if (tasks)
+	{
+		struct dirent* entry;
+		while ((entry = readdir(tasks)) != NULL)
+		{
+			if (entry->d_name[0] == '.')
+			{
+				continue;
+			}
+			string path = string("/proc/self/task/") + entry->d_name + "/status";
+			file = fopen(path.c_str(), "r");
+			if (!file)
+			{
+				continue;
+			}
+			size_t length = fread(text, 1, sizeof(text) - 1, file);
+			text[length] = 0;
+			fclose(file);
+			counters.contextSwitches += statusField(text, "voluntary_ctxt_switches:") + statusField(text, "nonvoluntary_ctxt_switches:");
+		}
+		closedir(tasks);
+	}
+	return counters;
+}
+
+/**
+ * Rates over the interval between two reads
+ *
+ * @param from Earlier read()
+ * @param to Later read()
+ * @return CPU and wakeup rates, memory as of to
+ */
+ProcessSample ProcessStats::difference(const ProcessCounters& from, const ProcessCounters& to)
+{
+	ProcessSample sample;
+	sample.seconds = (to.micros - from.micros) / 1000000.0;
+	double seconds = max(sample.seconds, 0.001);
+	sample.cpuPercent = to.cpuMillis > from.cpuMillis ? (to.cpuMillis - from.cpuMillis) / 10.0 / seconds : 0;
+	sample.wakeupsPerSecond = to.contextSwitches > from.contextSwitches ? (to.contextSwitches - from.contextSwitches) / seconds : 0;
+	sample.residentBytes = to.residentBytes;
+	sample.threads = to.threads;
+	return sample;
+}
+
+string ProcessStats::describe(const ProcessSample& sample)
+{
+	return "cpu " + ofToString(sample.cpuPercent, 1) + "% wakeups " + ofToString(sample.wakeupsPerSecond, 1) + "/s rss " +
+		ofToString(sample.residentBytes / (1024.0 * 1024.0), 1) + "MB threads " + ofToString(sample.threads) + " over " + ofToString(sample.seconds, 1) + "s";
+}
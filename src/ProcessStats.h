@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ofMain.h"
+#include "MetricsRegistry.h"
+
+/*
+ CPU time, resident memory and context switches of this process, read from
+ /proc. Used to compare the headless capture station with the windowed
+ build: idle CPU and wakeups (context switches) should drop to near zero
+ without the render loop, RSS by the GL context and SlideShow textures.
+ */
+
+struct ProcessCounters
+{
+	uint64_t micros;					// CLOCK_MONOTONIC when read
+	uint64_t cpuMillis;					// user + system, all threads
+	uint64_t contextSwitches;			// voluntary + involuntary, all threads
+	uint64_t residentBytes;
+	int threads;
+};
+
+struct ProcessSample
+{
+	double seconds;						// length of the interval
+	double cpuPercent;					// of one core
+	double wakeupsPerSecond;			// context switches per second
+	uint64_t residentBytes;				// at the end of the interval
+	int threads;
+};
+
+class ProcessStats
+{
+public:
+	ProcessStats();
+	void setup(string labels="");
+	void update();
+	static ProcessCounters read();
+	static ProcessSample difference(const ProcessCounters& from, const ProcessCounters& to);
+	static string describe(const ProcessSample& sample);
+
+	ProcessCounters startCounters;		// read by setup()
+
+private:
+	ProcessCounters lastCounters;
+	MetricsCounter* cpuMillis;
+	MetricsCounter* contextSwitches;
+	MetricsGauge* residentBytes;
+	MetricsGauge* threads;
+};
@@ -0,0 +1,110 @@
+/*
+ *  QualityController.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "QualityController.h"
+
+// Bandwidth budgets ignore gaps longer than this (e.g. the first capture after a pause)
+#define QUALITY_MAX_INTERVAL_SECONDS 60.0
+
+QualityController::QualityController()
+{
+	targetBytes = 0;
+	targetBytesPerSecond = 0;
+	minQuality = 40;
+	maxQuality = 100;
+	proportionalGain = 10;
+	integralGain = 12;
+	quality = 90;
+	baseQuality = 90;
+	qualityGauge = NULL;
+	budgetGauge = NULL;
+	reset();
+}
+
+/**
+ * @param targetBytes_ Average encoded size to hold
+ * @param initialQuality Q factor of the first capture, the loop works around it
+ * @param labels Prometheus labels for the gauges
+ */
+void QualityController::setup(uint32_t targetBytes_, int initialQuality, string labels)
+{
+	targetBytes = targetBytes_;
+	baseQuality = ofClamp(initialQuality, minQuality, maxQuality);
+	reset();
+	if (!qualityGauge)
+	{
+		qualityGauge = MetricsRegistry::getInstance().addGauge("camera_jpeg_quality", "JPEG Q factor chosen for the next capture", labels);
+		budgetGauge = MetricsRegistry::getInstance().addGauge("camera_jpeg_budget_bytes", "Encoded size the quality controller is aiming for", labels);
+	}
+	qualityGauge->set(quality);
+}
+
+void QualityController::setBandwidth(uint64_t bytesPerSecond)
+{
+	targetBytesPerSecond = bytesPerSecond;
+	reset();
+}
+
+void QualityController::reset()
+{
+	quality = baseQuality;
+	integral = 0;
+	averageBytes = 0;
+	lastBudget = 0;
+	lastError = 0;
+	lastTriggerMicros = 0;
+}
+
+/**
+ * Feed one finished capture and get the Q factor for the next one
+ *
+ * @param frameBytes Encoded size of the capture
+ * @param frameQuality Q factor it was encoded with
+ * @param triggerMicros ofGetElapsedTimeMicros() at its trigger, paces bandwidth budgets
+ * @return Q factor for the next capture
+ */
+int QualityController::update(uint32_t frameBytes, int frameQuality, unsigned long long triggerMicros)
+{
+	float budget = targetBytes;
+	if (targetBytesPerSecond)
+	{
+		if (!lastTriggerMicros || triggerMicros <= lastTriggerMicros)
+		{
+			// No interval yet, nothing to budget against
+			lastTriggerMicros = triggerMicros;
+			return quality;
+		}
+		double seconds = min(QUALITY_MAX_INTERVAL_SECONDS, (triggerMicros - lastTriggerMicros) / 1000000.0);
+		budget = targetBytesPerSecond * seconds;
+	}
+	lastTriggerMicros = triggerMicros;
+	if (budget <= 0 || !frameBytes)
+	{
+		return quality;
+	}
+
+	averageBytes = averageBytes ? averageBytes * 0.75f + frameBytes * 0.25f : frameBytes;
+	lastBudget = budget;
+	lastError = log(budget / frameBytes);
+
+	// The loop measured frameQuality, which may not be what we last asked for
+	float output = baseQuality + proportionalGain * lastError + integralGain * (integral + lastError);
+	bool saturated = (output >= maxQuality && lastError > 0) || (output <= minQuality && lastError < 0);
+	if (!saturated)
+	{
+		integral += lastError;
+		output = baseQuality + proportionalGain * lastError + integralGain * integral;
+	}
+	quality = ofClamp((int)floor(output + 0.5f), minQuality, maxQuality);
+
+	if (qualityGauge)
+	{
+		qualityGauge->set(quality);
+		budgetGauge->set((int64_t)budget);
+	}
+	ofLogVerbose() << "QualityController: " << frameBytes << " bytes at Q" << frameQuality << ", budget " << (int)budget << " -> Q" << quality;
+	return quality;
+}
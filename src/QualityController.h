@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ofMain.h"
+#include "MetricsRegistry.h"
+
+/*
+ Closed loop on JPEG size. After each capture the measured frame size is
+ compared with a budget - a fixed targetBytes, or targetBytesPerSecond
+ times the time since the previous capture - and the next Q factor is set
+ by a PI controller working on log(budget / bytes): JPEG size grows
+ roughly exponentially with Q, so a log error gives the loop the same
+ gain over the whole range. The integral term holds the long term average
+ on budget and is frozen while the output sits on a quality limit.
+ */
+
+class QualityController
+{
+public:
+	QualityController();
+	void setup(uint32_t targetBytes_, int initialQuality=90, string labels="");
+	void setBandwidth(uint64_t bytesPerSecond);		// budget each frame from the capture interval instead
+	int update(uint32_t frameBytes, int frameQuality, unsigned long long triggerMicros);
+	void reset();
+
+	uint32_t targetBytes;				// per frame budget, used while targetBytesPerSecond is 0
+	uint64_t targetBytesPerSecond;
+	int minQuality;
+	int maxQuality;
+	float proportionalGain;				// Q points per unit of log size error
+	float integralGain;					// Q points per unit of accumulated log error per capture
+	int quality;						// Q factor the next capture should use
+	float averageBytes;					// exponential average of frame sizes
+	float lastBudget;
+	float lastError;
+
+private:
+	int baseQuality;
+	float integral;
+	unsigned long long lastTriggerMicros;
+	MetricsGauge* qualityGauge;
+	MetricsGauge* budgetGauge;
+};
@@ -0,0 +1,125 @@
+/*
+ *  RegionCropper.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "RegionCropper.h"
+#include "TimelineTrace.h"
+
+RegionCropper::RegionCropper()
+{
+	quality = 90;
+	maxEncoders = 4;
+	lastMillis = 0;
+}
+
+RegionCropper::~RegionCropper()
+{
+	for (size_t i=0; i<encoders.size(); i++)
+	{
+		delete encoders[i];
+	}
+}
+
+YUVEncoder* RegionCropper::getEncoder(int width, int height)
+{
+	for (size_t i=0; i<encoders.size(); i++)
+	{
+		YUVEncoder* encoder = encoders[i];
+		if (encoder->width == width && encoder->height == height)
+		{
+			encoders.erase(encoders.begin() + i);
+			encoders.insert(encoders.begin(), encoder);
+			encoder->setQuality(quality);
+			return encoder;
+		}
+	}
+
+	if (encoders.size() >= maxEncoders && !encoders.empty())
+	{
+		delete encoders.back();
+		encoders.pop_back();
+	}
+
+	YUVEncoder* encoder = new YUVEncoder();
+	if (!encoder->setup(width, height, quality))
+	{
+		delete encoder;
+		return NULL;
+	}
+	encoders.insert(encoders.begin(), encoder);
+	return encoder;
+}
+
+/**
+ * Crop and encode each region of one frame
+ *
+ * @param i420 Source frame, layout as delivered by the camera video port
+ * @param width Visible width
+ * @param height Visible height
+ * @param stride Luma stride, chroma uses half
+ * @param alignedHeight Rows allocated per luma plane
+ * @param regions Normalized rectangles
+ * @param paths One output file per region
+ * @return Number of regions written
+ */
+int RegionCropper::encodeRegions(const unsigned char* i420, int width, int height, int stride, int alignedHeight,
+								 const vector<ofRectangle>& regions, const vector<string>& paths)
+{
+	TIMELINE_SCOPE("RegionCropper::encodeRegions");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+
+	const unsigned char* sourceU = i420 + (size_t)stride * alignedHeight;
+	const unsigned char* sourceV = sourceU + (size_t)(stride / 2) * (alignedHeight / 2);
+
+	int written = 0;
+	lastBytes.assign(regions.size(), 0);
+	lastCrcs.assign(regions.size(), 0);
+	for (size_t r=0; r<regions.size() && r<paths.size(); r++)
+	{
+		// Even origin and size keep the chroma planes aligned with luma
+		const ofRectangle& region = regions[r];
+		int x = (int)(ofClamp(region.x, 0, 1) * width) & ~1;
+		int y = (int)(ofClamp(region.y, 0, 1) * height) & ~1;
+		int w = min(max(16, (int)(region.width * width)), width - x) & ~1;
+		int h = min(max(16, (int)(region.height * height)), height - y) & ~1;
+		if (w < 16 || h < 16)
+		{
+			ofLogError() << "RegionCropper: region " << r << " is outside the frame";
+			continue;
+		}
+
+		YUVEncoder* encoder = getEncoder(w, h);
+		if (!encoder)
+		{
+			continue;
+		}
+
+		cropped.resize(encoder->frameSize());
+		unsigned char* destY = &cropped[0];
+		unsigned char* destU = destY + (size_t)encoder->stride * encoder->alignedHeight;
+		unsigned char* destV = destU + (size_t)(encoder->stride / 2) * (encoder->alignedHeight / 2);
+		for (int row=0; row<h; row++)
+		{
+			memcpy(destY + (size_t)row * encoder->stride, i420 + (size_t)(y + row) * stride + x, w);
+		}
+		for (int row=0; row<h/2; row++)
+		{
+			size_t source = (size_t)(y / 2 + row) * (stride / 2) + x / 2;
+			size_t dest = (size_t)row * (encoder->stride / 2);
+			memcpy(destU + dest, sourceU + source, w / 2);
+			memcpy(destV + dest, sourceV + source, w / 2);
+		}
+
+		if (encoder->encode(&cropped[0], paths[r]))
+		{
+			lastBytes[r] = encoder->lastBytes;
+			lastCrcs[r] = encoder->lastCrc;
+			written++;
+		}
+	}
+
+	lastMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+	return written;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ofMain.h"
+#include "YUVEncoder.h"
+
+/*
+ Cuts several regions out of one I420 frame from the raw path and JPEG
+ encodes each of them, for when more than one area of a single exposure
+ is needed (setRegionOfInterest() can only crop one).
+
+ Encoders are kept per region size so a fixed set of inspection regions
+ doesn't recreate MMAL components every frame.
+ */
+
+class RegionCropper
+{
+public:
+	RegionCropper();
+	~RegionCropper();
+	int encodeRegions(const unsigned char* i420, int width, int height, int stride, int alignedHeight,
+					  const vector<ofRectangle>& regions, const vector<string>& paths);
+
+	int quality;
+	size_t maxEncoders;					// encoder instances kept for reuse
+	vector<uint32_t> lastBytes;			// encoded size of each region, 0 if it failed
+	vector<uint32_t> lastCrcs;			// CRC32C of each region's file
+	float lastMillis;					// crop and encode time for all regions
+
+private:
+	YUVEncoder* getEncoder(int width, int height);
+	vector<YUVEncoder*> encoders;		// most recently used first
+	vector<unsigned char> cropped;
+};
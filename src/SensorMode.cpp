@@ -0,0 +1,106 @@
+/*
+ *  SensorMode.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "SensorMode.h"
+
+string SensorMode::description() const
+{
+	ostringstream out;
+	if (index == 0)
+	{
+		out << "mode 0 (automatic)";
+		return out.str();
+	}
+	out << "mode " << index << " " << width << "x" << height
+		<< " " << minFps << "-" << maxFps << "fps"
+		<< (binning > 1 ? " binned" : "")
+		<< (fullFieldOfView ? "" : " cropped");
+	return out.str();
+}
+
+const vector<SensorMode>& getSensorModes()
+{
+	static vector<SensorMode> modes;
+	if (modes.empty())
+	{
+		//                       index  width height minFps maxFps binning fullFov
+		const SensorMode table[] = {{1,  1920, 1080,  1,      30,    1,      false},
+									{2,  2592, 1944,  1,      15,    1,      true},
+									{3,  2592, 1944,  0.1666f, 1,    1,      true},
+									{4,  1296, 972,   1,      42,    2,      true},
+									{5,  1296, 730,   1,      49,    2,      false},
+									{6,  640,  480,   42.1f,  60,    4,      false},
+									{7,  640,  480,   60.1f,  90,    4,      false}};
+		modes.assign(table, table + sizeof(table) / sizeof(table[0]));
+	}
+	return modes;
+}
+
+/**
+ * Pick the readout mode that covers the requested output at the requested
+ * rate while reading as little of the sensor as possible.
+ *
+ * Preference order: supports fps and covers width x height with the same
+ * aspect ratio, then covering with another aspect ratio (the ISP crops or
+ * stretches), then anything supporting fps. Covering modes prefer the
+ * smallest readout, the rest the largest. Failing all that, the closest
+ * frame rate wins.
+ *
+ * @param width Output width the still port will be set to
+ * @param height Output height
+ * @param fps Frame rate, <= 0 for "don't care"
+ * @return The chosen mode
+ */
+SensorMode chooseSensorMode(int width, int height, float fps)
+{
+	const vector<SensorMode>& modes = getSensorModes();
+	const SensorMode* best = NULL;
+	int bestTier = 0;
+	int bestPixels = 0;
+	float aspect = height > 0 ? (float)width / height : 0;
+
+	for (size_t i=0; i<modes.size(); i++)
+	{
+		const SensorMode& mode = modes[i];
+		if (fps > 0 && (fps < mode.minFps || fps > mode.maxFps))
+		{
+			continue;
+		}
+
+		bool covers = mode.width >= width && mode.height >= height;
+		bool sameAspect = fabs((float)mode.width / mode.height - aspect) < 0.05f;
+		int tier = covers ? (sameAspect ? 2 : 1) : 0;
+		int pixels = mode.width * mode.height;
+
+		bool better = !best || tier > bestTier;
+		if (best && tier == bestTier)
+		{
+			// Equal sizes (modes 2 and 3) keep the first, faster one
+			better = covers ? pixels < bestPixels : pixels > bestPixels;
+		}
+		if (better)
+		{
+			best = &mode;
+			bestTier = tier;
+			bestPixels = pixels;
+		}
+	}
+
+	if (!best)
+	{
+		float bestDistance = 0;
+		for (size_t i=0; i<modes.size(); i++)
+		{
+			float distance = min(fabs(fps - modes[i].minFps), fabs(fps - modes[i].maxFps));
+			if (!best || distance < bestDistance)
+			{
+				best = &modes[i];
+				bestDistance = distance;
+			}
+		}
+	}
+	return *best;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "ofMain.h"
+
+/*
+ Readout modes of the OV5647 (camera module v1), as selected with
+ MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG. Mode 0 lets the firmware pick.
+ Binned modes read fewer rows so they start and finish a frame sooner and
+ gather more light per output pixel; cropped modes lose field of view.
+ */
+
+struct SensorMode
+{
+	int index;							// value for MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG
+	int width;							// readout size after binning
+	int height;
+	float minFps;
+	float maxFps;
+	int binning;						// 1 none, 2 for 2x2...
+	bool fullFieldOfView;				// false if the mode crops the sensor
+	string description() const;
+};
+
+const vector<SensorMode>& getSensorModes();
+SensorMode chooseSensorMode(int width, int height, float fps);
@@ -12,10 +12,17 @@
 SlideShow::SlideShow()
 {
 	isReloading = false;
+	currentImage = NULL;
+	previousImage = NULL;
+	counter = 0;
+	transitionColor = 0;
+	waitCounter = 0;
 }
 
 void SlideShow::setup(string photosFolder)
 {
+	hardwareDecoder.setup("user=\"slideshow\"");
+	softwareDecoder.setup("user=\"slideshow\"");
     ofDirectory photosDirectory(photosFolder);
     photosDirectory.listDir();
 	//photosDirectory.sort();
@@ -25,46 +32,101 @@ void SlideShow::setup(string photosFolder)
     
     int numFiles = files.size();
     int maxNumFiles = 4;
+    vector<string> paths;
     for (int i=0; i<files.size(); i++)
     {
-        if (images.size()<maxNumFiles)
+        if (paths.size()<maxNumFiles)
         {
             ofFile file = files[ofRandom(files.size())];
             if (file.getExtension() == "jpg" && ofIsStringInString(file.path(), "half"))
             {
-                addPhoto(file.path());
+                paths.push_back(file.path());
             }
         }
         
         
         
     }
+	decode_photos(paths);
     ofLogVerbose() << "images.size() " << images.size();
     counter = 0;
-    currentImage = &images[counter];
+    currentImage = images.empty() ? NULL : &images[counter];
     previousImage = NULL;
     waitCounter = 0;
+    transitionColor = 0;
 
 }
 void SlideShow::addPhoto(string photoPath)
 {
 	isReloading = true;
-	ofImage image;
-	if(image.loadImage(photoPath))
+	if(decode_photos(vector<string>(1, photoPath)))
 	{
 		ofLogVerbose() << "loading :" << photoPath;
-		//image.resize(ofGetWidth(), ofGetHeight());
-		images.push_back(image);
 	}
 	isReloading = false;
 	counter = 0;
-    currentImage = &images[counter];
+    currentImage = images.empty() ? NULL : &images[counter];
     previousImage = NULL;
     waitCounter = 0;
 }
+/**
+ * Decode photos at no more than screen size and append them to images.
+ * Each goes to the GPU decoder first; whatever it can't do is decoded by
+ * libjpeg, in parallel when there are several.
+ *
+ * @return Photos added
+ */
+int SlideShow::decode_photos(const vector<string>& paths)
+{
+	int coverWidth = ofGetWidth();
+	int coverHeight = ofGetHeight();
+	vector<ofPixels> decoded(paths.size());
+	vector<string> remaining;
+	vector<int> remainingIndex;
+	bool hardware = hardwareDecoder.isAvailable();
+	for (size_t i=0; i<paths.size(); i++)
+	{
+		if (!hardware || !hardwareDecoder.decode(paths[i], decoded[i], coverWidth, coverHeight))
+		{
+			remaining.push_back(paths[i]);
+			remainingIndex.push_back(i);
+		}
+	}
+	if (!remaining.empty())
+	{
+		vector<ofPixels> software;
+		softwareDecoder.decodeAll(remaining, software, coverWidth, coverHeight);
+		for (size_t i=0; i<remaining.size(); i++)
+		{
+			PixelPool::getInstance().transfer(software[i], decoded[remainingIndex[i]]);
+		}
+	}
+	int added = 0;
+	for (size_t i=0; i<decoded.size(); i++)
+	{
+		if (decoded[i].isAllocated())
+		{
+			add_image(decoded[i]);
+			added++;
+		}else
+		{
+			ofLogError() << "could not decode " << paths[i];
+		}
+	}
+	return added;
+}
+
+void SlideShow::add_image(ofPixels& decoded)
+{
+	// The pool buffer moves into the image rather than being copied into the list
+	images.push_back(ofImage());
+	PixelPool::getInstance().transfer(decoded, images.back().getPixelsRef());
+	images.back().update();
+}
+
 void SlideShow::update()
 {
-    if (isReloading) {
+    if (isReloading || images.empty()) {
 		return;
 	}
     if (transitionColor+1<=255)
@@ -103,6 +165,10 @@ void SlideShow::update()
 
 void SlideShow::draw()
 {
+    if (currentImage == NULL)
+    {
+        return;
+    }
     ofEnableAlphaBlending();
     if (previousImage != NULL)
     {
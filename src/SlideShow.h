@@ -9,6 +9,9 @@
 #pragma once
 
 #include "ofMain.h"
+#include "PixelPool.h"
+#include "ImageDecoder.h"
+#include "MmalJpegDecoder.h"
 
 class SlideShow
 {
@@ -17,7 +20,7 @@ public:
     void setup(string photosFolder);
     void update();
     void draw();
-    vector<ofImage> images;
+    deque<ofImage> images;				// pixels borrowed from PixelPool; a deque so currentImage stays valid as photos are added
     ofImage* currentImage;
     ofImage* previousImage;
     int counter;
@@ -25,4 +28,11 @@ public:
     int waitCounter;
 	void addPhoto(string photoPath);
 	bool isReloading;
+
+	MmalJpegDecoder hardwareDecoder;	// photos are decoded at screen size, on the GPU when it can
+	LibJpegDecoder softwareDecoder;		// progressive JPEGs, or no image_decode component
+
+private:
+	int decode_photos(const vector<string>& paths);
+	void add_image(ofPixels& decoded);
 };
@@ -0,0 +1,463 @@
+/*
+ *  StorageManager.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "StorageManager.h"
+#include "AtomicFile.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+// Encodes remembered for sizing preallocations
+#define STORAGE_RECENT_SIZES 16
+
+static bool storedFileOlder(const StoredFile& a, const StoredFile& b)
+{
+	if (a.modified != b.modified)
+		return a.modified < b.modified;
+	return a.path < b.path;
+}
+
+StorageManager::StorageManager()
+{
+	maxBytes = 0;
+	maxFiles = 0;
+	// Off by default: the floor deletes the oldest photos whether or not they were uploaded
+	minFreeBytes = 0;
+	catalog = NULL;
+	dateSharded = false;
+	preallocate = true;
+	totalBytes = 0;
+	bytesGauge = NULL;
+	filesGauge = NULL;
+	freeGauge = NULL;
+	rotatedFiles = NULL;
+	discardedFiles = NULL;
+	discardedStartup = 0;
+}
+
+/**
+ * Index the existing photos and apply the quota
+ *
+ * @param rootPath_ Photos folder, absolute
+ * @param maxBytes_ Byte quota, 0 for none
+ * @param maxFiles_ File quota, 0 for none
+ * @param dateSharded_ Write new photos under YYYY/MM/DD
+ */
+void StorageManager::setup(string rootPath_, uint64_t maxBytes_, int maxFiles_, bool dateSharded_)
+{
+	TIMELINE_SCOPE("StorageManager::setup");
+	rootPath = rootPath_;
+	maxBytes = maxBytes_;
+	maxFiles = maxFiles_;
+	dateSharded = dateSharded_;
+
+	if (!bytesGauge)
+	{
+		MetricsRegistry& registry = MetricsRegistry::getInstance();
+		bytesGauge = registry.addGauge("storage_bytes", "Bytes of photos under the storage root");
+		filesGauge = registry.addGauge("storage_files", "Photos under the storage root");
+		freeGauge = registry.addGauge("storage_free_bytes", "Free space on the photos filesystem");
+		rotatedFiles = registry.addCounter("storage_rotated_files_total", "Photos deleted to stay within quota");
+		discardedFiles = registry.addCounter("storage_discarded_files_total", "Incomplete photos deleted at startup");
+	}
+
+	ofDirectory::createDirectory(rootPath, false, true);
+
+	unsigned long long startMillis = ofGetElapsedTimeMillis();
+	vector<StoredFile> found;
+	discardedStartup = 0;
+	scan(rootPath, found);
+	sort(found.begin(), found.end(), storedFileOlder);
+
+	{
+		ofScopedLock lock(storageMutex);
+		files.assign(found.begin(), found.end());
+		totalBytes = 0;
+		recentSizes.clear();
+		for (size_t i=0; i<found.size(); i++)
+		{
+			totalBytes += found[i].bytes;
+		}
+		for (size_t i=found.size() > STORAGE_RECENT_SIZES ? found.size() - STORAGE_RECENT_SIZES : 0; i<found.size(); i++)
+		{
+			recentSizes.push_back(found[i].bytes);
+		}
+	}
+	ofLogNotice() << "StorageManager: " << found.size() << " photos, " << getTotalBytes() / (1024 * 1024) << "MB in " << rootPath
+				<< " indexed in " << ofGetElapsedTimeMillis() - startMillis << "ms";
+	discardedFiles->add(discardedStartup);
+	enforceQuota();
+}
+
+/**
+ * Delete photos that can't be complete, without decoding any of them.
+ * A photo in the catalog must have the catalogued size. Photos the catalog
+ * doesn't know (written before it existed, or by hand) must at least end
+ * with the JPEG end of image marker. Rows of photos under rootPath that are
+ * gone are dropped from the catalog.
+ *
+ * @param catalog Catalog of the photos under rootPath
+ * @return Number of photos deleted
+ */
+int StorageManager::discardIncomplete(PhotoCatalog& catalog)
+{
+	TIMELINE_SCOPE("StorageManager::discardIncomplete");
+	vector<CatalogEntry> entries = catalog.getEntries();
+	map<string, uint64_t> catalogBytes;
+	for (size_t i=0; i<entries.size(); i++)
+	{
+		catalogBytes[entries[i].path] = entries[i].bytes;
+	}
+
+	storageMutex.lock();
+	int discarded = 0;
+	for (deque<StoredFile>::iterator it = files.begin(); it != files.end(); )
+	{
+		bool complete;
+		map<string, uint64_t>::iterator known = catalogBytes.find(it->path);
+		if (known != catalogBytes.end())
+		{
+			complete = known->second == it->bytes;
+			catalogBytes.erase(known);
+		}
+		else
+		{
+			complete = false;
+			FILE* file = fopen(it->path.c_str(), "rb");
+			if (file)
+			{
+				unsigned char marker[2] = {0, 0};
+				complete = fseek(file, -2, SEEK_END) == 0 && fread(marker, 1, 2, file) == 2 && marker[0] == 0xFF && marker[1] == 0xD9;
+				fclose(file);
+			}
+		}
+
+		if (complete)
+		{
+			++it;
+			continue;
+		}
+		ofLogNotice() << "Discarding incomplete " << it->path;
+		unlink(it->path.c_str());
+		totalBytes -= it->bytes;
+		it = files.erase(it);
+		discarded++;
+	}
+	storageMutex.unlock();
+	if (discarded)
+	{
+		discardedFiles->add(discarded);
+		ofLogNotice() << "StorageManager: discarded " << discarded << " incomplete photos";
+	}
+
+	// What's left in catalogBytes wasn't found on disk, or was just discarded
+	vector<string> gone;
+	for (map<string, uint64_t>::iterator it = catalogBytes.begin(); it != catalogBytes.end(); ++it)
+	{
+		if (it->first.compare(0, rootPath.size() + 1, rootPath + "/") == 0)
+		{
+			gone.push_back(it->first);
+		}
+	}
+	catalog.forget(gone);
+	return discarded;
+}
+
+/**
+ * Recursively collect the JPEGs below directory. Uses readdir's d_type so
+ * only files need a stat, which matters with hundreds of thousands of them.
+ */
+void StorageManager::scan(const string& directory, vector<StoredFile>& found)
+{
+	DIR* dir = opendir(directory.c_str());
+	if (!dir)
+	{
+		return;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+		string path = directory + "/" + entry->d_name;
+		bool isDirectory = entry->d_type == DT_DIR;
+		bool isFile = entry->d_type == DT_REG;
+		struct stat info;
+		if (entry->d_type == DT_UNKNOWN || isFile)
+		{
+			if (stat(path.c_str(), &info) != 0)
+			{
+				continue;
+			}
+			isDirectory = S_ISDIR(info.st_mode);
+			isFile = S_ISREG(info.st_mode);
+		}
+		if (isDirectory)
+		{
+			scan(path, found);
+		}
+		else if (isFile && path.size() > 4 && path.compare(path.size() - 4, 4, ATOMIC_FILE_SUFFIX) == 0)
+		{
+			// Never committed, the write was cut short
+			ofLogNotice() << "Discarding unfinished " << path;
+			unlink(path.c_str());
+			discardedStartup++;
+		}
+		else if (isFile && path.size() > 4 && path.compare(path.size() - 4, 4, ".jpg") == 0)
+		{
+			StoredFile file;
+			file.path = path;
+			file.bytes = info.st_size;
+			file.modified = info.st_mtime;
+			found.push_back(file);
+		}
+	}
+	closedir(dir);
+}
+
+/**
+ * Path for a new photo, creating its date shard if needed
+ *
+ * @param suffix Appended to the timestamp, e.g. "-cam1"
+ * @param extension Including the dot
+ * @return Absolute path
+ */
+string StorageManager::nextPath(string suffix, string extension)
+{
+	string directory = rootPath;
+	if (dateSharded)
+	{
+		directory += "/" + ofGetTimestampString("%Y/%m/%d");
+		ofScopedLock lock(storageMutex);
+		if (directory != lastDirectory)
+		{
+			ofDirectory::createDirectory(directory, false, true);
+			lastDirectory = directory;
+		}
+	}
+	return directory + "/" + ofGetTimestampString() + suffix + extension;
+}
+
+uint64_t StorageManager::expectedBytes()
+{
+	ofScopedLock lock(storageMutex);
+	uint64_t largest = 0;
+	for (size_t i=0; i<recentSizes.size(); i++)
+	{
+		largest = max(largest, recentSizes[i]);
+	}
+	// A little headroom so a slightly bigger frame still lands in the extent
+	return largest + largest / 8;
+}
+
+/**
+ * Open a photo for writing. The data goes to a temp file (see AtomicFile)
+ * with its blocks reserved up front; FALLOC_FL_KEEP_SIZE leaves the visible
+ * size at 0 and close() trims whatever wasn't used.
+ *
+ * @param path From nextPath()
+ * @return File, NULL if it couldn't be opened
+ */
+FILE* StorageManager::open(const string& path)
+{
+	FILE* file = atomicFileOpen(path);
+	if (!file)
+	{
+		return NULL;
+	}
+
+	uint64_t bytes = expectedBytes();
+	if (preallocate && bytes)
+	{
+		TIMELINE_SCOPE("fallocate");
+		if (fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, bytes) != 0)
+		{
+			// vfat on older kernels and some FUSE mounts can't; don't keep paying for the failure
+			TRACE_WARNING("fallocate failed (errno %d), preallocation disabled", errno);
+			preallocate = false;
+		}
+	}
+	return file;
+}
+
+/**
+ * Finish a file from open(): trim, sync and rename it into place, then account for it
+ *
+ * @param file From open(), always closed
+ * @param path Its final path
+ * @param bytesWritten Final size
+ * @param keep false to throw the file away (failed capture)
+ * @return true if path now holds the complete photo
+ */
+bool StorageManager::close(FILE* file, const string& path, uint64_t bytesWritten, bool keep)
+{
+	if (!keep)
+	{
+		atomicFileDiscard(file, path);
+		return false;
+	}
+	if (!atomicFileCommit(file, path, bytesWritten))
+	{
+		return false;
+	}
+	add(path, bytesWritten);
+	return true;
+}
+
+/**
+ * Account for a photo written without open(), e.g. by a YUVEncoder
+ *
+ * @param path Absolute path under rootPath
+ * @param bytes Its size
+ */
+void StorageManager::add(const string& path, uint64_t bytes)
+{
+	record(path, bytes);
+	enforceQuota();
+}
+
+void StorageManager::record(const string& path, uint64_t bytes)
+{
+	ofScopedLock lock(storageMutex);
+	StoredFile file;
+	file.path = path;
+	file.bytes = bytes;
+	file.modified = time(NULL);
+	files.push_back(file);
+	totalBytes += bytes;
+	recentSizes.push_back(bytes);
+	if (recentSizes.size() > STORAGE_RECENT_SIZES)
+	{
+		recentSizes.pop_front();
+	}
+}
+
+/**
+ * Delete a photo and forget it, e.g. intermediate bracket frames
+ *
+ * @param path Absolute path
+ */
+void StorageManager::remove(const string& path)
+{
+	ofScopedLock lock(storageMutex);
+	// Recent files are the usual case, search from the back
+	for (deque<StoredFile>::reverse_iterator it = files.rbegin(); it != files.rend(); ++it)
+	{
+		if (it->path == path)
+		{
+			totalBytes -= it->bytes;
+			files.erase((it + 1).base());
+			break;
+		}
+	}
+	unlink(path.c_str());
+}
+
+uint64_t StorageManager::freeBytes()
+{
+	struct statvfs info;
+	if (statvfs(rootPath.c_str(), &info) != 0)
+	{
+		return 0;
+	}
+	return (uint64_t)info.f_bavail * info.f_frsize;
+}
+
+/**
+ * Delete the oldest file and its date shard if that left it empty.
+ * Called with storageMutex held.
+ */
+void StorageManager::removeOldest()
+{
+	StoredFile oldest = files.front();
+	files.pop_front();
+	totalBytes -= oldest.bytes;
+	if (unlink(oldest.path.c_str()) != 0 && errno != ENOENT)
+	{
+		int error = errno;
+		ofLogWarning() << "Could not rotate out " << oldest.path << " (errno " << error << ")";
+	}
+	rotatedFiles->increment();
+
+	// rmdir only succeeds on empty directories, so this walks up until it hits a live one
+	string directory = oldest.path.substr(0, oldest.path.rfind('/'));
+	while (directory.size() > rootPath.size() && directory.compare(0, rootPath.size(), rootPath) == 0)
+	{
+		if (rmdir(directory.c_str()) != 0)
+		{
+			break;
+		}
+		if (directory == lastDirectory)
+		{
+			lastDirectory.clear();
+		}
+		directory = directory.substr(0, directory.rfind('/'));
+	}
+}
+
+/**
+ * Delete oldest photos until the byte and file quotas and the free space floor hold
+ */
+void StorageManager::enforceQuota()
+{
+	vector<string> rotatedPaths;
+	storageMutex.lock();
+	struct statvfs info;
+	bool knowsFree = statvfs(rootPath.c_str(), &info) == 0;
+	uint64_t available = knowsFree ? (uint64_t)info.f_bavail * info.f_frsize : 0;
+	int rotated = 0;
+
+	while (!files.empty())
+	{
+		bool overBytes = maxBytes && totalBytes > maxBytes;
+		bool overFiles = maxFiles && (int)files.size() > maxFiles;
+		bool lowSpace = knowsFree && available < minFreeBytes;
+		if (!overBytes && !overFiles && !lowSpace)
+		{
+			break;
+		}
+		available += files.front().bytes;
+		rotatedPaths.push_back(files.front().path);
+		removeOldest();
+		rotated++;
+	}
+
+	if (rotated)
+	{
+		TRACE_NOTICE("Rotated out %d photos, %d left", rotated, (int)files.size());
+	}
+	if (bytesGauge)
+	{
+		bytesGauge->set(totalBytes);
+		filesGauge->set(files.size());
+		freeGauge->set(available);
+	}
+	storageMutex.unlock();
+
+	// After unlocking, the catalog has its own lock
+	if (catalog)
+	{
+		catalog->forget(rotatedPaths);
+	}
+}
+
+uint64_t StorageManager::getTotalBytes()
+{
+	ofScopedLock lock(storageMutex);
+	return totalBytes;
+}
+
+int StorageManager::getTotalFiles()
+{
+	ofScopedLock lock(storageMutex);
+	return files.size();
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "ofMain.h"
+#include "MetricsRegistry.h"
+#include "PhotoCatalog.h"
+
+/*
+ Owns the photos folder: hands out paths, keeps it inside a byte/file
+ quota and a free space floor by deleting the oldest photos, and
+ preallocates each new file so the SD card sees one contiguous extent
+ instead of a chain of small appends. Rotated photos are dropped from
+ the catalog, if one is set.
+
+ Files are tracked in an in-memory index built by one scan at setup(),
+ oldest first, so rotation never has to list the directory again. The
+ same scan deletes .tmp files left by writes a power cut interrupted.
+ With dateSharded, photos land in root/YYYY/MM/DD/ which keeps each
+ directory small even with hundreds of thousands of photos.
+ */
+
+struct StoredFile
+{
+	string path;
+	uint64_t bytes;
+	time_t modified;
+};
+
+class StorageManager
+{
+public:
+	StorageManager();
+	void setup(string rootPath_, uint64_t maxBytes_=0, int maxFiles_=0, bool dateSharded_=false);
+
+	string nextPath(string suffix, string extension=".jpg");
+	FILE* open(const string& path);
+	bool close(FILE* file, const string& path, uint64_t bytesWritten, bool keep=true);
+	void add(const string& path, uint64_t bytes);
+	void remove(const string& path);
+	void enforceQuota();
+	int discardIncomplete(PhotoCatalog& catalog);
+
+	uint64_t expectedBytes();			// preallocation size, from recent encodes
+	uint64_t freeBytes();				// free space on the photos filesystem
+	uint64_t getTotalBytes();
+	int getTotalFiles();
+
+	string rootPath;
+	uint64_t maxBytes;					// 0 for no limit
+	int maxFiles;						// 0 for no limit
+	uint64_t minFreeBytes;				// rotate to keep at least this much of the filesystem free, 0 for no floor
+	PhotoCatalog* catalog;				// optional, forgets the photos rotated out
+	bool dateSharded;
+	bool preallocate;					// cleared if the filesystem can't fallocate
+
+private:
+	void scan(const string& directory, vector<StoredFile>& found);
+	void record(const string& path, uint64_t bytes);
+	void removeOldest();
+	ofMutex storageMutex;
+	deque<StoredFile> files;			// oldest first
+	deque<uint64_t> recentSizes;
+	uint64_t totalBytes;
+	string lastDirectory;				// last shard created, saves a mkdir per photo
+
+	MetricsGauge* bytesGauge;
+	MetricsGauge* filesGauge;
+	MetricsGauge* freeGauge;
+	MetricsCounter* rotatedFiles;
+	MetricsCounter* discardedFiles;
+	int discardedStartup;				// .tmp files removed by the last scan
+};
@@ -0,0 +1,514 @@
+/*
+ *  TimelapseAssembler.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "TimelapseAssembler.h"
+#include "ParallelFor.h"
+#include "AtomicFile.h"
+#include "TimelineTrace.h"
+#include "TraceLog.h"
+
+// AVI 1.0 keeps every size in 32 bits; readers commonly treat them as signed
+#define AVI_MAX_FILE_BYTES 0x7FFF0000ULL
+#define AVIF_HASINDEX 0x10
+#define AVIIF_KEYFRAME 0x10
+
+/*
+ Minimal AVI 1.0 writer for a single MJPEG video stream:
+
+	RIFF 'AVI '
+		LIST 'hdrl' { avih, LIST 'strl' { strh, strf } }
+		LIST 'movi' { '00dc' jpeg ... }
+		idx1
+
+ Counts and sizes unknown up front are patched by close().
+ */
+class MjpegAviWriter
+{
+public:
+	MjpegAviWriter()
+	{
+		file = NULL;
+	}
+
+	bool open(const string& path_, int width_, int height_, int fps_)
+	{
+		path = path_;
+		width = width_;
+		height = height_;
+		fps = fps_;
+		frameSizes.clear();
+		frameOffsets.clear();
+		maxFrameBytes = 0;
+		bytes = 0;
+		file = atomicFileOpen(path);
+		if (!file)
+		{
+			return false;
+		}
+
+		writeFourcc("RIFF");
+		riffSizeOffset = bytes;
+		write32(0);
+		writeFourcc("AVI ");
+
+		writeFourcc("LIST");
+		write32(4 + 8 + 56 + 8 + 4 + 8 + 56 + 8 + 40);
+		writeFourcc("hdrl");
+
+		writeFourcc("avih");
+		write32(56);
+		write32(1000000 / fps);					// dwMicroSecPerFrame
+		maxBytesPerSecOffset = bytes;
+		write32(0);								// dwMaxBytesPerSec
+		write32(0);								// dwPaddingGranularity
+		write32(AVIF_HASINDEX);					// dwFlags
+		totalFramesOffset = bytes;
+		write32(0);								// dwTotalFrames
+		write32(0);								// dwInitialFrames
+		write32(1);								// dwStreams
+		aviSuggestedBufferOffset = bytes;
+		write32(0);								// dwSuggestedBufferSize
+		write32(width);
+		write32(height);
+		write32(0); write32(0); write32(0); write32(0);
+
+		writeFourcc("LIST");
+		write32(4 + 8 + 56 + 8 + 40);
+		writeFourcc("strl");
+
+		writeFourcc("strh");
+		write32(56);
+		writeFourcc("vids");
+		writeFourcc("MJPG");
+		write32(0);								// dwFlags
+		write32(0);								// wPriority, wLanguage
+		write32(0);								// dwInitialFrames
+		write32(1);								// dwScale
+		write32(fps);							// dwRate
+		write32(0);								// dwStart
+		lengthOffset = bytes;
+		write32(0);								// dwLength
+		streamSuggestedBufferOffset = bytes;
+		write32(0);								// dwSuggestedBufferSize
+		write32(0xFFFFFFFF);					// dwQuality, default
+		write32(0);								// dwSampleSize, varies per frame
+		write16(0); write16(0); write16(width); write16(height);
+
+		writeFourcc("strf");
+		write32(40);
+		write32(40);							// biSize
+		write32(width);
+		write32(height);
+		write16(1);								// biPlanes
+		write16(24);							// biBitCount
+		writeFourcc("MJPG");
+		write32(width * height * 3);			// biSizeImage
+		write32(0); write32(0); write32(0); write32(0);
+
+		writeFourcc("LIST");
+		moviSizeOffset = bytes;
+		write32(0);
+		moviStart = bytes;
+		writeFourcc("movi");
+		return !ferror(file);
+	}
+
+	// false once the file would pass what AVI 1.0 can address
+	bool addFrame(const char* data, uint32_t size)
+	{
+		uint32_t padded = size + (size & 1);
+		uint64_t indexBytes = 8 + (frameSizes.size() + 1) * 16ULL;
+		if (bytes + 8 + padded + indexBytes > AVI_MAX_FILE_BYTES)
+		{
+			return false;
+		}
+		frameOffsets.push_back(bytes - moviStart);
+		frameSizes.push_back(size);
+		maxFrameBytes = max(maxFrameBytes, size);
+
+		writeFourcc("00dc");
+		write32(size);
+		writeBytes(data, size);
+		if (size & 1)
+		{
+			char pad = 0;
+			writeBytes(&pad, 1);
+		}
+		return !ferror(file);
+	}
+
+	bool close()
+	{
+		if (!file)
+		{
+			return false;
+		}
+		uint32_t moviSize = bytes - moviStart;
+
+		writeFourcc("idx1");
+		write32(frameSizes.size() * 16);
+		for (size_t i=0; i<frameSizes.size(); i++)
+		{
+			writeFourcc("00dc");
+			write32(AVIIF_KEYFRAME);
+			write32(frameOffsets[i]);			// from the 'movi' fourcc
+			write32(frameSizes[i]);
+		}
+		uint64_t fileBytes = bytes;
+
+		patch32(riffSizeOffset, fileBytes - 8);
+		patch32(moviSizeOffset, moviSize);
+		patch32(totalFramesOffset, frameSizes.size());
+		patch32(lengthOffset, frameSizes.size());
+		patch32(maxBytesPerSecOffset, maxFrameBytes * fps);
+		patch32(aviSuggestedBufferOffset, maxFrameBytes + 8);
+		patch32(streamSuggestedBufferOffset, maxFrameBytes + 8);
+
+		bool success = !ferror(file) && fseeko(file, 0, SEEK_END) == 0;
+		if (!success)
+		{
+			atomicFileDiscard(file, path);
+		}else
+		{
+			success = atomicFileCommit(file, path, fileBytes);
+		}
+		file = NULL;
+		return success;
+	}
+
+	void discard()
+	{
+		if (file)
+		{
+			atomicFileDiscard(file, path);
+			file = NULL;
+		}
+	}
+
+	int numFrames()
+	{
+		return frameSizes.size();
+	}
+
+	uint64_t bytes;
+
+private:
+	void writeBytes(const void* data, size_t size)
+	{
+		fwrite(data, 1, size, file);
+		bytes += size;
+	}
+
+	void writeFourcc(const char* fourcc)
+	{
+		writeBytes(fourcc, 4);
+	}
+
+	void write16(uint32_t value)
+	{
+		unsigned char data[2] = {(unsigned char)value, (unsigned char)(value >> 8)};
+		writeBytes(data, 2);
+	}
+
+	void write32(uint32_t value)
+	{
+		unsigned char data[4] = {(unsigned char)value, (unsigned char)(value >> 8), (unsigned char)(value >> 16), (unsigned char)(value >> 24)};
+		writeBytes(data, 4);
+	}
+
+	void patch32(uint64_t offset, uint32_t value)
+	{
+		unsigned char data[4] = {(unsigned char)value, (unsigned char)(value >> 8), (unsigned char)(value >> 16), (unsigned char)(value >> 24)};
+		fseeko(file, offset, SEEK_SET);
+		fwrite(data, 1, 4, file);
+	}
+
+	FILE* file;
+	string path;
+	int width;
+	int height;
+	int fps;
+	uint32_t maxFrameBytes;
+	vector<uint32_t> frameSizes;
+	vector<uint32_t> frameOffsets;
+	uint64_t riffSizeOffset;
+	uint64_t maxBytesPerSecOffset;
+	uint64_t totalFramesOffset;
+	uint64_t aviSuggestedBufferOffset;
+	uint64_t lengthOffset;
+	uint64_t streamSuggestedBufferOffset;
+	uint64_t moviSizeOffset;
+	uint64_t moviStart;
+};
+
+/**
+ * Area-average downscale, every source pixel contributes to exactly one output pixel
+ *
+ * @param source Decoded frame
+ * @param target Allocated to width x height with source's channel count
+ */
+static void boxDownscale(const ofPixels& source, ofPixels& target, int width, int height)
+{
+	int channels = source.getNumChannels();
+	int sourceWidth = source.getWidth();
+	int sourceHeight = source.getHeight();
+	target.allocate(width, height, channels);
+
+	vector<int> columnStart(width + 1);
+	for (int x=0; x<=width; x++)
+	{
+		columnStart[x] = (int)((int64_t)x * sourceWidth / width);
+	}
+
+	const unsigned char* in = source.getPixels();
+	unsigned char* out = target.getPixels();
+	vector<uint32_t> sums(width * channels);
+	for (int y=0; y<height; y++)
+	{
+		int rowStart = (int)((int64_t)y * sourceHeight / height);
+		int rowEnd = max(rowStart + 1, (int)((int64_t)(y + 1) * sourceHeight / height));
+		std::fill(sums.begin(), sums.end(), 0);
+		for (int sy=rowStart; sy<rowEnd; sy++)
+		{
+			const unsigned char* row = in + (size_t)sy * sourceWidth * channels;
+			for (int x=0; x<width; x++)
+			{
+				int end = max(columnStart[x] + 1, columnStart[x+1]);
+				uint32_t* sum = &sums[x * channels];
+				for (int sx=columnStart[x]; sx<end; sx++)
+				{
+					for (int c=0; c<channels; c++)
+					{
+						sum[c] += row[sx * channels + c];
+					}
+				}
+			}
+		}
+		for (int x=0; x<width; x++)
+		{
+			uint32_t area = (rowEnd - rowStart) * max(1, columnStart[x+1] - columnStart[x]);
+			for (int c=0; c<channels; c++)
+			{
+				out[((size_t)y * width + x) * channels + c] = (sums[x * channels + c] + area / 2) / area;
+			}
+		}
+	}
+}
+
+class TimelapseFrameTask : public ParallelTask
+{
+public:
+	const vector<string>* paths;
+	vector<ofBuffer>* jpegs;
+	vector<bool>* loaded;
+	int width;
+	int height;
+	ofImageQualityType quality;
+
+	// One frame per item: decode, shrink and re-encode without leaving the worker
+	void run(int begin, int end)
+	{
+		for (int i=begin; i<end; i++)
+		{
+			ofPixels full;
+			(*loaded)[i] = false;
+			if (!ofLoadImage(full, (*paths)[i]))
+			{
+				continue;
+			}
+			ofPixels small;
+			if (full.getWidth() == width && full.getHeight() == height)
+			{
+				small = full;
+			}else
+			{
+				boxDownscale(full, small, width, height);
+			}
+			ofSaveImage(small, (*jpegs)[i], OF_IMAGE_FORMAT_JPEG, quality);
+			(*loaded)[i] = (*jpegs)[i].size() > 0;
+		}
+	}
+};
+
+static bool compareCaptureTime(const CatalogEntry& a, const CatalogEntry& b)
+{
+	return a.captureTimeMicros < b.captureTimeMicros;
+}
+
+TimelapseAssembler::TimelapseAssembler()
+{
+	catalog = NULL;
+	outputWidth = 1280;
+	framesPerSecond = 25;
+	quality = OF_IMAGE_QUALITY_HIGH;
+	groupId = 0;
+	lastReport = TimelapseReport();
+	lastReport.success = false;
+}
+
+void TimelapseAssembler::setup(PhotoCatalog* catalog_)
+{
+	catalog = catalog_;
+}
+
+/**
+ * Assemble on the assembler's thread, the result lands in lastReport
+ *
+ * @param groupId_ TimelapseScheduler::sequenceId of the run
+ * @param outputPath_ .avi file to write
+ */
+void TimelapseAssembler::assembleAsync(uint64_t groupId_, string outputPath_)
+{
+	if (isThreadRunning())
+	{
+		ofLogWarning() << "Timelapse assembly already running";
+		return;
+	}
+	groupId = groupId_;
+	outputPath = outputPath_;
+	startThread(true, false);
+}
+
+void TimelapseAssembler::threadedFunction()
+{
+	TimelineTrace::getInstance().nameCurrentThread("TimelapseAssembler");
+	TimelapseReport report = assemble(groupId, outputPath);
+	lock();
+	lastReport = report;
+	unlock();
+}
+
+/**
+ * Write every catalogued photo of a sequence, oldest first, as one MJPEG frame each
+ *
+ * @param sequenceId Catalog groupId shared by the sequence
+ * @param path .avi file to write, replaced atomically
+ * @return What was written and how long each stage took
+ */
+TimelapseReport TimelapseAssembler::assemble(uint64_t sequenceId, string path)
+{
+	TIMELINE_SCOPE("timelapse_assemble");
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	TimelapseReport report = TimelapseReport();
+	report.success = false;
+	report.outputPath = path;
+
+	if (!catalog)
+	{
+		ofLogError() << "TimelapseAssembler has no catalog";
+		return report;
+	}
+
+	vector<CatalogEntry> all = catalog->getEntries();
+	vector<CatalogEntry> sequence;
+	for (size_t i=0; i<all.size(); i++)
+	{
+		if (all[i].groupId != sequenceId)
+		{
+			continue;
+		}
+		// Rotation may have removed the oldest frames
+		if (ofFile::doesFileExist(all[i].path, false))
+		{
+			sequence.push_back(all[i]);
+		}else
+		{
+			report.skipped++;
+		}
+	}
+	std::sort(sequence.begin(), sequence.end(), compareCaptureTime);
+	if (sequence.empty())
+	{
+		ofLogError() << "No frames found for timelapse " << sequenceId;
+		return report;
+	}
+
+	// The first frame fixes the video size, rounded to even for chroma subsampling
+	ofPixels first;
+	size_t firstIndex = 0;
+	while (firstIndex < sequence.size() && !ofLoadImage(first, sequence[firstIndex].path))
+	{
+		firstIndex++;
+	}
+	if (firstIndex == sequence.size())
+	{
+		ofLogError() << "No readable frames for timelapse " << sequenceId;
+		report.skipped += sequence.size();
+		return report;
+	}
+	report.skipped += firstIndex;
+	int width = min(outputWidth, (int)first.getWidth()) & ~1;
+	int height = (int)((int64_t)width * first.getHeight() / first.getWidth()) & ~1;
+	first.clear();
+
+	MjpegAviWriter writer;
+	if (!writer.open(path, width, height, framesPerSecond))
+	{
+		ofLogError() << "Could not open " << path;
+		return report;
+	}
+
+	// Enough frames in flight to keep every worker busy, few enough to bound memory
+	int batchSize = ParallelFor::getInstance().getNumThreads() * 2;
+	bool full = false;
+	for (size_t batchStart=firstIndex; batchStart<sequence.size() && !full; batchStart+=batchSize)
+	{
+		size_t batchEnd = min(sequence.size(), batchStart + batchSize);
+		vector<string> paths;
+		for (size_t i=batchStart; i<batchEnd; i++)
+		{
+			paths.push_back(sequence[i].path);
+		}
+		vector<ofBuffer> jpegs(paths.size());
+		vector<bool> loaded(paths.size(), false);
+
+		unsigned long long decodeStart = ofGetElapsedTimeMicros();
+		TimelapseFrameTask task;
+		task.paths = &paths;
+		task.jpegs = &jpegs;
+		task.loaded = &loaded;
+		task.width = width;
+		task.height = height;
+		task.quality = quality;
+		{
+			TIMELINE_SCOPE("timelapse_decode_batch");
+			ParallelFor::getInstance().run(paths.size(), 1, task);
+		}
+		report.decodeMillis += (ofGetElapsedTimeMicros() - decodeStart) / 1000.0f;
+
+		unsigned long long writeStart = ofGetElapsedTimeMicros();
+		for (size_t i=0; i<paths.size(); i++)
+		{
+			if (!loaded[i])
+			{
+				report.skipped++;
+				continue;
+			}
+			if (!writer.addFrame(jpegs[i].getBinaryBuffer(), jpegs[i].size()))
+			{
+				TRACE_WARNING("Timelapse video reached the AVI size limit after %d frames", writer.numFrames());
+				full = true;
+				break;
+			}
+		}
+		report.writeMillis += (ofGetElapsedTimeMicros() - writeStart) / 1000.0f;
+	}
+
+	report.frames = writer.numFrames();
+	if (!report.frames)
+	{
+		writer.discard();
+		ofLogError() << "No readable frames for timelapse " << sequenceId;
+		return report;
+	}
+	report.success = writer.close();
+	report.bytes = writer.bytes;
+	report.totalMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+	ofLogNotice() << "Timelapse " << path << ": " << report.frames << " frames " << width << "x" << height
+				<< " (" << report.skipped << " skipped) in " << report.totalMillis << "ms, decode " << report.decodeMillis
+				<< "ms write " << report.writeMillis << "ms";
+	return report;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "ofMain.h"
+#include "PhotoCatalog.h"
+
+/*
+ Turns a timelapse sequence (catalog entries sharing a groupId) into an
+ MJPEG AVI that plays anywhere (VLC, ffmpeg, browsers via remux). Frames
+ are decoded, box-filtered down to outputWidth and re-encoded in batches
+ spread over ParallelFor, so the full-size JPEGs are read concurrently;
+ only the container write is sequential. Runs on its own thread so the
+ app stays responsive; check isThreadRunning() and lastReport.
+ */
+
+struct TimelapseReport
+{
+	bool success;
+	string outputPath;
+	int frames;						// written to the video
+	int skipped;					// catalog entries whose file was missing or unreadable
+	float decodeMillis;				// decode, scale and re-encode, summed over batches
+	float writeMillis;
+	float totalMillis;
+	uint64_t bytes;
+};
+
+class TimelapseAssembler : public ofThread
+{
+public:
+	TimelapseAssembler();
+	void setup(PhotoCatalog* catalog_);
+	void assembleAsync(uint64_t groupId_, string outputPath_);
+	TimelapseReport assemble(uint64_t sequenceId, string path);
+	void threadedFunction();
+
+	int outputWidth;				// height follows the first frame's aspect
+	int framesPerSecond;
+	ofImageQualityType quality;
+	TimelapseReport lastReport;
+
+private:
+	PhotoCatalog* catalog;
+	uint64_t groupId;
+	string outputPath;
+};
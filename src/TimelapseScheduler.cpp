@@ -0,0 +1,236 @@
+/*
+ *  TimelapseScheduler.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "TimelapseScheduler.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
+
+#include <time.h>
+#include <sys/time.h>
+
+// Longest single sleep, so stop() is noticed promptly
+#define TIMELAPSE_SLEEP_SLICE_NANOS 100000000LL
+// Least time between prepareCapture() and the deadline; twice the slowest prepare seen if that's longer
+#define TIMELAPSE_PREPARE_MARGIN_NANOS 50000000LL
+
+static int64_t timespecNanos(const struct timespec& t)
+{
+	return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static struct timespec nanosTimespec(int64_t nanos)
+{
+	struct timespec t;
+	t.tv_sec = nanos / 1000000000LL;
+	t.tv_nsec = nanos % 1000000000LL;
+	return t;
+}
+
+static int64_t monotonicNanos()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespecNanos(now);
+}
+
+TimelapseScheduler::TimelapseScheduler()
+{
+	camera = NULL;
+	intervalMillis = 10000;
+	numShots = 0;
+	sequenceId = 0;
+	jitterHistogram = NULL;
+	missedCounter = NULL;
+	memset(&stats, 0, sizeof(stats));
+	jitterSum = 0;
+	jitterSquaredSum = 0;
+	shotMillisSum = 0;
+}
+
+/**
+ * @param camera_ A camera that has been (or is being) set up
+ * @param intervalMillis_ Time between shots
+ * @param numShots_ Shots to take, 0 to run until stop()
+ */
+void TimelapseScheduler::setup(ofxRaspicam* camera_, int intervalMillis_, int numShots_)
+{
+	camera = camera_;
+	intervalMillis = intervalMillis_;
+	numShots = numShots_;
+	if (!jitterHistogram)
+	{
+		static const double boundsMicros[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 50000};
+		jitterHistogram = MetricsRegistry::getInstance().addHistogram("timelapse_jitter_us", "Timelapse trigger time minus its deadline", boundsMicros, sizeof(boundsMicros)/sizeof(double), camera->metricsLabels());
+		missedCounter = MetricsRegistry::getInstance().addCounter("timelapse_missed_slots_total", "Timelapse deadlines skipped because a shot overran", camera->metricsLabels());
+	}
+}
+
+void TimelapseScheduler::start()
+{
+	if (isThreadRunning())
+	{
+		return;
+	}
+	lock();
+	memset(&stats, 0, sizeof(stats));
+	jitterSum = 0;
+	jitterSquaredSum = 0;
+	shotMillisSum = 0;
+	unlock();
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	sequenceId = (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
+	startThread(true, false);
+}
+
+void TimelapseScheduler::stop()
+{
+	waitForThread(true);
+}
+
+/**
+ * Sleep until an absolute CLOCK_MONOTONIC time, in slices so stop() isn't held up
+ *
+ * @param deadline When to wake
+ * @return false if the thread was asked to stop
+ */
+bool TimelapseScheduler::sleepUntil(const struct timespec& deadline)
+{
+	int64_t deadlineNanos = timespecNanos(deadline);
+	while (isThreadRunning())
+	{
+		int64_t remaining = deadlineNanos - monotonicNanos();
+		if (remaining <= 0)
+		{
+			return true;
+		}
+		// The last slice targets the deadline itself, so slicing costs no precision
+		struct timespec wake = remaining > TIMELAPSE_SLEEP_SLICE_NANOS ? nanosTimespec(monotonicNanos() + TIMELAPSE_SLEEP_SLICE_NANOS) : deadline;
+		int result;
+		do
+		{
+			result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+		}
+		while (result == EINTR);
+	}
+	return false;
+}
+
+void TimelapseScheduler::threadedFunction()
+{
+	TimelineTrace::getInstance().nameCurrentThread("TimelapseScheduler");
+	if (!camera)
+	{
+		return;
+	}
+
+	camera->waitUntilReady();
+	if (!camera->isReady())
+	{
+		TRACE_ERROR("Timelapse not started, camera is not ready");
+		return;
+	}
+
+	// Nothing shows a timelapse frame by frame, skip the full decode into lastImage
+	bool loadLastImage = camera->loadLastImage;
+	camera->loadLastImage = false;
+
+	const int64_t intervalNanos = (int64_t)intervalMillis * 1000000LL;
+	// Exposure settles once, the camera keeps running between shots
+	camera->settle();
+	int64_t startNanos = monotonicNanos();
+	int64_t slot = 0;
+	int64_t slowestPrepareNanos = 0;
+
+	ofLogNotice() << "Timelapse " << sequenceId << " every " << intervalMillis << "ms" << (numShots ? " for " + ofToString(numShots) + " shots" : "");
+
+	while (isThreadRunning() && (!numShots || stats.shots + stats.failures < numShots))
+	{
+		int64_t deadlineNanos = startNanos + slot * intervalNanos;
+
+		// Prepare just ahead of the deadline, not right after the last shot: an open
+		// capture holds its .tmp file and keeps UploadQueue waiting the whole time
+		int64_t marginNanos = max((int64_t)TIMELAPSE_PREPARE_MARGIN_NANOS, 2 * slowestPrepareNanos);
+		if (!sleepUntil(nanosTimespec(deadlineNanos - marginNanos)))
+		{
+			break;
+		}
+
+		// Everything slow happens before the deadline
+		unsigned long long shotStartMicros = ofGetElapsedTimeMicros();
+		int64_t prepareStartNanos = monotonicNanos();
+		bool prepared = camera->prepareCapture();
+		slowestPrepareNanos = max(slowestPrepareNanos, monotonicNanos() - prepareStartNanos);
+		if (!sleepUntil(nanosTimespec(deadlineNanos)))
+		{
+			if (prepared)
+			{
+				camera->finishCapture(sequenceId);
+			}
+			break;
+		}
+
+		double jitterMicros = (monotonicNanos() - deadlineNanos) / 1000.0;
+		bool captured = prepared && camera->triggerCapture();
+		captured = camera->finishCapture(sequenceId) && captured;
+
+		lock();
+		if (captured)
+		{
+			stats.shots++;
+			jitterSum += jitterMicros;
+			jitterSquaredSum += jitterMicros * jitterMicros;
+			shotMillisSum += (ofGetElapsedTimeMicros() - shotStartMicros) / 1000.0;
+			stats.lastJitterMicros = jitterMicros;
+			stats.maxJitterMicros = max(stats.maxJitterMicros, jitterMicros);
+		}
+		else
+		{
+			stats.failures++;
+		}
+		unlock();
+		if (captured && jitterHistogram)
+		{
+			jitterHistogram->observe(jitterMicros);
+		}
+		TRACE_VERBOSE("Timelapse shot %d jitter %d us", (int)slot, (int)jitterMicros);
+
+		// Next slot on the grid that is still in the future
+		slot++;
+		int64_t nextSlot = (monotonicNanos() - startNanos) / intervalNanos + 1;
+		if (nextSlot > slot)
+		{
+			lock();
+			stats.missedSlots += nextSlot - slot;
+			unlock();
+			if (missedCounter)
+				missedCounter->add(nextSlot - slot);
+			TRACE_WARNING("Timelapse shot overran, skipping %d slots", (int)(nextSlot - slot));
+			slot = nextSlot;
+		}
+	}
+
+	camera->loadLastImage = loadLastImage;
+	TimelapseStats finalStats = getStats();
+	ofLogNotice() << "Timelapse " << sequenceId << " done: " << finalStats.shots << " shots, " << finalStats.failures << " failed, "
+				<< finalStats.missedSlots << " missed slots, jitter mean " << finalStats.meanJitterMicros << "us"
+				<< " sd " << finalStats.jitterStdDevMicros << "us max " << finalStats.maxJitterMicros << "us";
+}
+
+TimelapseStats TimelapseScheduler::getStats()
+{
+	lock();
+	TimelapseStats result = stats;
+	if (stats.shots)
+	{
+		result.meanJitterMicros = jitterSum / stats.shots;
+		result.jitterStdDevMicros = sqrt(max(0.0, jitterSquaredSum / stats.shots - result.meanJitterMicros * result.meanJitterMicros));
+		result.meanShotMillis = shotMillisSum / stats.shots;
+	}
+	unlock();
+	return result;
+}
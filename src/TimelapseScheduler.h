@@ -0,0 +1,56 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ofxRaspicam.h"
+
+/*
+ Takes a photo every intervalMillis on a fixed CLOCK_MONOTONIC grid:
+ shot k is due at start + k * interval no matter how long earlier shots
+ took, so the sequence doesn't drift over days. Each shot's file is opened
+ and its buffers queued a short margin before the deadline (at least 50ms,
+ twice the slowest prepare so far), then the thread sleeps with
+ clock_nanosleep(TIMER_ABSTIME) and triggers the moment it wakes. The
+ camera stays running between shots; only the first one waits for
+ AE/AWB to settle. A shot that overruns the next slot skips it rather than
+ firing late.
+
+ Every photo in a run shares a catalog groupId (sequenceId) so
+ TimelapseAssembler can find them again.
+ */
+
+struct TimelapseStats
+{
+	int shots;
+	int failures;
+	int missedSlots;					// deadlines skipped because the previous shot overran
+	double lastJitterMicros;			// trigger time minus deadline
+	double maxJitterMicros;
+	double meanJitterMicros;
+	double jitterStdDevMicros;
+	double meanShotMillis;				// prepare to file closed
+};
+
+class TimelapseScheduler : public ofThread
+{
+public:
+	TimelapseScheduler();
+	void setup(ofxRaspicam* camera_, int intervalMillis_, int numShots_=0);
+	void start();
+	void stop();
+	void threadedFunction();
+	TimelapseStats getStats();
+
+	int intervalMillis;
+	int numShots;						// 0 runs until stop()
+	uint64_t sequenceId;				// catalog groupId of the current or last run
+
+private:
+	bool sleepUntil(const struct timespec& deadline);
+	ofxRaspicam* camera;
+	TimelapseStats stats;
+	double jitterSum;
+	double jitterSquaredSum;
+	double shotMillisSum;
+	MetricsHistogram* jitterHistogram;
+	MetricsCounter* missedCounter;
+};
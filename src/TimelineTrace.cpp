@@ -0,0 +1,183 @@
+/*
+ *  TimelineTrace.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "TimelineTrace.h"
+
+static __thread bool timelineThreadNamed = false;
+
+TimelineTrace& TimelineTrace::getInstance()
+{
+	static TimelineTrace instance;
+	return instance;
+}
+
+TimelineTrace::TimelineTrace()
+{
+	recording = false;
+	head = 0;
+	dropped = 0;
+}
+
+/**
+ * Allocate the event buffer and begin recording. Events past capacity are
+ * counted and dropped rather than growing the buffer from a hot thread.
+ *
+ * @param capacity Maximum number of events in this recording
+ */
+void TimelineTrace::start(int capacity)
+{
+	if (recording)
+	{
+		return;
+	}
+	events.assign(capacity, TimelineEvent());
+	for (size_t i=0; i<events.size(); i++)
+	{
+		events[i].ready = 0;
+	}
+	head = 0;
+	dropped = 0;
+	__sync_synchronize();
+	recording = true;
+	ofLogNotice() << "Timeline recording started";
+}
+
+void TimelineTrace::nameCurrentThread(const char* threadName)
+{
+	if (timelineThreadNamed)
+	{
+		return;
+	}
+	ofScopedLock lock(threadNamesMutex);
+	threadNames[traceCurrentThreadId()] = threadName;
+	timelineThreadNamed = true;
+}
+
+TimelineEvent* TimelineTrace::claim()
+{
+	uint32_t index = __sync_fetch_and_add(&head, 1);
+	if (index >= events.size())
+	{
+		__sync_fetch_and_add(&dropped, 1);
+		return NULL;
+	}
+	return &events[index];
+}
+
+void TimelineTrace::addComplete(const char* name, const char* category, uint64_t startMicros, uint64_t endMicros, int64_t arg)
+{
+	TimelineEvent* event = claim();
+	if (!event)
+	{
+		return;
+	}
+	event->name = name;
+	event->category = category;
+	event->startMicros = startMicros;
+	event->durationMicros = endMicros - startMicros;
+	event->arg = arg;
+	event->threadId = traceCurrentThreadId();
+	event->phase = 'X';
+	__sync_synchronize();
+	event->ready = 1;
+}
+
+void TimelineTrace::addInstant(const char* name, const char* category, int64_t arg)
+{
+	if (!recording)
+	{
+		return;
+	}
+	TimelineEvent* event = claim();
+	if (!event)
+	{
+		return;
+	}
+	event->name = name;
+	event->category = category;
+	event->startMicros = traceMonotonicMicros();
+	event->durationMicros = 0;
+	event->arg = arg;
+	event->threadId = traceCurrentThreadId();
+	event->phase = 'i';
+	__sync_synchronize();
+	event->ready = 1;
+}
+
+/**
+ * Stop recording and write the events in Chrome trace JSON
+ *
+ * @param path Destination .json file
+ * @return true if the file was written
+ */
+bool TimelineTrace::stop(string path)
+{
+	if (!recording)
+	{
+		return false;
+	}
+	recording = false;
+	__sync_synchronize();
+
+	// Let scopes that checked the flag just before we cleared it finish their write
+	ofSleepMillis(10);
+
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file)
+	{
+		ofLogError() << "Could not open timeline file " << path;
+		return false;
+	}
+
+	int pid = getpid();
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	bool first = true;
+	{
+		ofScopedLock lock(threadNamesMutex);
+		for (map<uint32_t, string>::iterator it = threadNames.begin(); it != threadNames.end(); ++it)
+		{
+			fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+					first ? "" : ",\n", pid, it->first, it->second.c_str());
+			first = false;
+		}
+	}
+
+	uint32_t count = min((uint32_t)events.size(), (uint32_t)head);
+	uint32_t written = 0;
+	for (uint32_t i=0; i<count; i++)
+	{
+		const TimelineEvent& event = events[i];
+		if (!event.ready)
+		{
+			continue;
+		}
+		fprintf(file, "%s{\"ph\":\"%c\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":%llu",
+				first ? "" : ",\n", event.phase, event.name, event.category, pid, event.threadId,
+				(unsigned long long)event.startMicros);
+		if (event.phase == 'X')
+		{
+			fprintf(file, ",\"dur\":%llu", (unsigned long long)event.durationMicros);
+		}
+		else
+		{
+			fprintf(file, ",\"s\":\"t\"");
+		}
+		if (event.arg != TIMELINE_NO_ARG)
+		{
+			fprintf(file, ",\"args\":{\"value\":%lld}", (long long)event.arg);
+		}
+		fprintf(file, "}");
+		first = false;
+		written++;
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	// events is kept until the next start() so a straggling writer never touches freed memory
+	ofLogNotice() << "Wrote " << written << " timeline events (" << dropped << " dropped) to " << path;
+	return true;
+}
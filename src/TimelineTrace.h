@@ -0,0 +1,86 @@
+#pragma once
+
+#include "ofMain.h"
+#include "TraceLog.h"
+
+/*
+ Scoped timeline markers written as Chrome trace JSON (chrome://tracing,
+ ui.perfetto.dev). Recording is off by default and toggled at runtime;
+ while off a marker costs one flag check.
+
+	void ofxRaspicam::setup()
+	{
+		TIMELINE_SCOPE("setup");
+		...
+	}
+
+ Names must be string literals, they are stored by pointer.
+ */
+
+#define TIMELINE_DEFAULT_CAPACITY 65536
+
+#define TIMELINE_CONCAT_(a, b) a##b
+#define TIMELINE_CONCAT(a, b) TIMELINE_CONCAT_(a, b)
+#define TIMELINE_SCOPE(name) TimelineScope TIMELINE_CONCAT(timelineScope, __LINE__)(name)
+
+struct TimelineEvent
+{
+	const char* name;
+	const char* category;
+	uint64_t startMicros;
+	uint64_t durationMicros;
+	int64_t arg;					// shown as args.value, TIMELINE_NO_ARG to omit
+	uint32_t threadId;
+	char phase;						// 'X' complete, 'i' instant
+	volatile char ready;
+};
+
+#define TIMELINE_NO_ARG INT64_MIN
+
+class TimelineTrace
+{
+public:
+	static TimelineTrace& getInstance();
+
+	void start(int capacity=TIMELINE_DEFAULT_CAPACITY);
+	bool stop(string path);
+	bool isRecording() { return recording; }
+
+	void nameCurrentThread(const char* threadName);
+	void addComplete(const char* name, const char* category, uint64_t startMicros, uint64_t endMicros, int64_t arg=TIMELINE_NO_ARG);
+	void addInstant(const char* name, const char* category, int64_t arg=TIMELINE_NO_ARG);
+
+private:
+	TimelineTrace();
+	TimelineEvent* claim();
+	volatile bool recording;
+	vector<TimelineEvent> events;
+	volatile uint32_t head;
+	volatile uint32_t dropped;
+	ofMutex threadNamesMutex;
+	map<uint32_t, string> threadNames;
+};
+
+class TimelineScope
+{
+public:
+	TimelineScope(const char* name_, const char* category_="capture")
+	{
+		name = name_;
+		category = category_;
+		arg = TIMELINE_NO_ARG;
+		startMicros = TimelineTrace::getInstance().isRecording() ? traceMonotonicMicros() : 0;
+	}
+	~TimelineScope()
+	{
+		if (startMicros && TimelineTrace::getInstance().isRecording())
+		{
+			TimelineTrace::getInstance().addComplete(name, category, startMicros, traceMonotonicMicros(), arg);
+		}
+	}
+	int64_t arg;					// optional value attached to the event, e.g. bytes in a buffer
+private:
+	const char* name;
+	const char* category;
+	uint64_t startMicros;
+};
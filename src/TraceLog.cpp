@@ -0,0 +1,258 @@
+/*
+ *  TraceLog.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "TraceLog.h"
+
+#include <sys/syscall.h>
+
+uint64_t traceMonotonicMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// gettid is a syscall, so remember it per thread
+static __thread uint32_t traceThreadId = 0;
+
+uint32_t traceCurrentThreadId()
+{
+	if (!traceThreadId)
+	{
+		traceThreadId = (uint32_t)syscall(SYS_gettid);
+	}
+	return traceThreadId;
+}
+
+TraceLog& TraceLog::getInstance()
+{
+	static TraceLog instance;
+	return instance;
+}
+
+TraceLog::TraceLog()
+{
+	head = 0;
+	consoleLevel = TRACE_LEVEL_WARNING;
+	memset(records, 0, sizeof(records));
+}
+
+void TraceLog::log(int level, const char* format)
+{
+	write(level, format, NULL, 0);
+}
+
+void TraceLog::log(int level, const char* format, TraceArg a0)
+{
+	int64_t args[] = {a0.value};
+	write(level, format, args, 1);
+}
+
+void TraceLog::log(int level, const char* format, TraceArg a0, TraceArg a1)
+{
+	int64_t args[] = {a0.value, a1.value};
+	write(level, format, args, 2);
+}
+
+void TraceLog::log(int level, const char* format, TraceArg a0, TraceArg a1, TraceArg a2)
+{
+	int64_t args[] = {a0.value, a1.value, a2.value};
+	write(level, format, args, 3);
+}
+
+void TraceLog::log(int level, const char* format, TraceArg a0, TraceArg a1, TraceArg a2, TraceArg a3)
+{
+	int64_t args[] = {a0.value, a1.value, a2.value, a3.value};
+	write(level, format, args, 4);
+}
+
+/**
+ * Claim the next slot with one atomic add and publish it with a barrier.
+ * Writers never wait on each other or on a dump in progress.
+ */
+void TraceLog::write(int level, const char* format, const int64_t* args, int numArgs)
+{
+	uint64_t index = __sync_fetch_and_add(&head, 1);
+	TraceRecord& record = records[index & (TRACE_LOG_CAPACITY-1)];
+
+	record.sequence = 0;
+	__sync_synchronize();
+	record.timestampMicros = traceMonotonicMicros();
+	record.format = format;
+	for (int i=0; i<numArgs; i++)
+	{
+		record.args[i] = args[i];
+	}
+	record.threadId = traceCurrentThreadId();
+	record.level = level;
+	record.numArgs = numArgs;
+	__sync_synchronize();
+	record.sequence = index + 1;
+
+	if (level >= consoleLevel)
+	{
+		string message = traceFormatMessage(format, args, numArgs, NULL);
+		switch (level)
+		{
+			case TRACE_LEVEL_ERROR:		ofLogError("TraceLog") << message; break;
+			case TRACE_LEVEL_WARNING:	ofLogWarning("TraceLog") << message; break;
+			case TRACE_LEVEL_NOTICE:	ofLogNotice("TraceLog") << message; break;
+			default:					ofLogVerbose("TraceLog") << message; break;
+		}
+	}
+}
+
+/**
+ * Copy out every consistent record, oldest first
+ *
+ * @param dropped Set to the number of records lost to wraparound or caught mid-write
+ * @return The records
+ */
+vector<TraceRecord> TraceLog::snapshot(uint64_t& dropped)
+{
+	vector<TraceRecord> result;
+	uint64_t end = __sync_fetch_and_add(&head, 0);
+	uint64_t start = end > TRACE_LOG_CAPACITY ? end - TRACE_LOG_CAPACITY : 0;
+
+	dropped = start;
+	result.reserve(end - start);
+	for (uint64_t index=start; index<end; index++)
+	{
+		const TraceRecord& slot = records[index & (TRACE_LOG_CAPACITY-1)];
+		uint64_t before = slot.sequence;
+		__sync_synchronize();
+		TraceRecord copy;
+		memcpy(&copy, (const void*)&slot, sizeof(copy));
+		__sync_synchronize();
+		if (before != index + 1 || slot.sequence != before)
+		{
+			dropped++;
+			continue;
+		}
+		result.push_back(copy);
+	}
+	return result;
+}
+
+bool TraceLog::writeText(string path)
+{
+	uint64_t dropped = 0;
+	vector<TraceRecord> entries = snapshot(dropped);
+
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file)
+	{
+		ofLogError() << "Could not open trace file " << path;
+		return false;
+	}
+	fprintf(file, "# %u records, %llu dropped\n", (unsigned)entries.size(), (unsigned long long)dropped);
+	for (size_t i=0; i<entries.size(); i++)
+	{
+		const TraceRecord& record = entries[i];
+		string message = traceFormatMessage(record.format, record.args, record.numArgs, NULL);
+		fprintf(file, "%llu.%06llu [%u] %s: %s\n",
+				(unsigned long long)(record.timestampMicros / 1000000ULL),
+				(unsigned long long)(record.timestampMicros % 1000000ULL),
+				record.threadId, traceLevelName(record.level), message.c_str());
+	}
+	fclose(file);
+	ofLogNotice() << "Wrote " << entries.size() << " trace records to " << path;
+	return true;
+}
+
+/**
+ * Dump the ring in the TraceLogFormat.h layout. Format strings and %s
+ * arguments are interned into a string table since pointers mean nothing
+ * outside this process.
+ *
+ * @param path Destination file
+ * @return true on success
+ */
+bool TraceLog::writeBinary(string path)
+{
+	uint64_t dropped = 0;
+	vector<TraceRecord> entries = snapshot(dropped);
+
+	vector<string> strings;
+	map<const char*, uint32_t> stringIndex;
+	vector<TRACE_FILE_RECORD> fileRecords(entries.size());
+
+	for (size_t i=0; i<entries.size(); i++)
+	{
+		const TraceRecord& record = entries[i];
+		TRACE_FILE_RECORD& out = fileRecords[i];
+		memset(&out, 0, sizeof(out));
+
+		const char* pointers[TRACE_MAX_ARGS+1];
+		int numPointers = 0;
+		bool isString[TRACE_MAX_ARGS];
+		traceStringArguments(record.format, isString);
+
+		pointers[numPointers++] = record.format;
+		for (int a=0; a<record.numArgs; a++)
+		{
+			if (isString[a])
+			{
+				pointers[numPointers++] = (const char*)(intptr_t)record.args[a];
+			}
+		}
+
+		uint32_t indices[TRACE_MAX_ARGS+1];
+		for (int p=0; p<numPointers; p++)
+		{
+			const char* text = pointers[p] ? pointers[p] : "(null)";
+			map<const char*, uint32_t>::iterator it = stringIndex.find(text);
+			if (it == stringIndex.end())
+			{
+				it = stringIndex.insert(make_pair(text, (uint32_t)strings.size())).first;
+				strings.push_back(text);
+			}
+			indices[p] = it->second;
+		}
+
+		out.timestampMicros = record.timestampMicros;
+		out.formatIndex = indices[0];
+		int nextString = 1;
+		for (int a=0; a<record.numArgs; a++)
+		{
+			out.args[a] = isString[a] ? indices[nextString++] : record.args[a];
+		}
+		out.threadId = record.threadId;
+		out.level = record.level;
+		out.numArgs = record.numArgs;
+		out.sequence = record.sequence - 1;
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		ofLogError() << "Could not open trace file " << path;
+		return false;
+	}
+
+	TRACE_FILE_HEADER header;
+	memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+	header.numStrings = strings.size();
+	header.numRecords = fileRecords.size();
+	header.droppedRecords = dropped;
+	fwrite(&header, sizeof(header), 1, file);
+
+	for (size_t i=0; i<strings.size(); i++)
+	{
+		uint32_t length = strings[i].size();
+		fwrite(&length, sizeof(length), 1, file);
+		fwrite(strings[i].data(), 1, length, file);
+	}
+	if (!fileRecords.empty())
+	{
+		fwrite(&fileRecords[0], sizeof(TRACE_FILE_RECORD), fileRecords.size(), file);
+	}
+
+	bool ok = (ferror(file) == 0);
+	fclose(file);
+	ofLogNotice() << "Wrote " << fileRecords.size() << " binary trace records to " << path;
+	return ok;
+}
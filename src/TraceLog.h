@@ -0,0 +1,88 @@
+#pragma once
+
+#include "ofMain.h"
+#include "TraceLogFormat.h"
+
+/*
+ Binary ring-buffer logger for the capture hot path.
+
+ A record is a timestamp, a pointer to a static format string and up to
+ TRACE_MAX_ARGS integer arguments. Nothing is formatted when logging; that
+ happens when the ring is dumped (see writeText/writeBinary and tools/traceDump).
+ %s arguments must point at string literals or other storage that outlives
+ the process, never at a temporary std::string.
+
+ Levels below TRACE_LOG_MIN_LEVEL compile to nothing, so builds can strip
+ verbose tracing with PROJECT_DEFINES = TRACE_LOG_MIN_LEVEL=1
+ */
+
+#ifndef TRACE_LOG_MIN_LEVEL
+#define TRACE_LOG_MIN_LEVEL TRACE_LEVEL_VERBOSE
+#endif
+
+// Must be a power of two
+#define TRACE_LOG_CAPACITY 8192
+
+#define TRACE_LOG(level, format, ...) \
+	do { if ((level) >= TRACE_LOG_MIN_LEVEL) TraceLog::getInstance().log((level), (format), ##__VA_ARGS__); } while (0)
+
+#define TRACE_VERBOSE(format, ...)	TRACE_LOG(TRACE_LEVEL_VERBOSE, format, ##__VA_ARGS__)
+#define TRACE_NOTICE(format, ...)	TRACE_LOG(TRACE_LEVEL_NOTICE, format, ##__VA_ARGS__)
+#define TRACE_WARNING(format, ...)	TRACE_LOG(TRACE_LEVEL_WARNING, format, ##__VA_ARGS__)
+#define TRACE_ERROR(format, ...)	TRACE_LOG(TRACE_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+// Lets integers, enums and string literals be passed without casts
+class TraceArg
+{
+public:
+	TraceArg(int v)					{ value = v; }
+	TraceArg(unsigned int v)		{ value = v; }
+	TraceArg(long v)				{ value = v; }
+	TraceArg(unsigned long v)		{ value = v; }
+	TraceArg(long long v)			{ value = v; }
+	TraceArg(unsigned long long v)	{ value = (int64_t)v; }
+	TraceArg(const char* v)			{ value = (intptr_t)v; }
+	TraceArg(const void* v)			{ value = (intptr_t)v; }
+	int64_t value;
+};
+
+struct TraceRecord
+{
+	volatile uint64_t sequence;		// index+1 once published, 0 while being written
+	uint64_t timestampMicros;
+	const char* format;
+	int64_t args[TRACE_MAX_ARGS];
+	uint32_t threadId;
+	uint16_t level;
+	uint16_t numArgs;
+};
+
+// Kernel thread id of the caller, cached per thread
+uint32_t traceCurrentThreadId();
+
+// CLOCK_MONOTONIC in microseconds, the timebase of every trace record
+uint64_t traceMonotonicMicros();
+
+class TraceLog
+{
+public:
+	static TraceLog& getInstance();
+
+	void log(int level, const char* format);
+	void log(int level, const char* format, TraceArg a0);
+	void log(int level, const char* format, TraceArg a0, TraceArg a1);
+	void log(int level, const char* format, TraceArg a0, TraceArg a1, TraceArg a2);
+	void log(int level, const char* format, TraceArg a0, TraceArg a1, TraceArg a2, TraceArg a3);
+
+	int consoleLevel;				// records at or above this level are also formatted to ofLog immediately
+
+	vector<TraceRecord> snapshot(uint64_t& dropped);
+	bool writeText(string path);
+	bool writeBinary(string path);
+
+private:
+	TraceLog();
+	void write(int level, const char* format, const int64_t* args, int numArgs);
+	TraceRecord records[TRACE_LOG_CAPACITY];
+	volatile uint64_t head;
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+/*
+ On-disk layout of a TraceLog dump and the deferred formatter shared by the
+ app and tools/traceDump. Kept free of openFrameworks so the dump tool can be
+ built on any host with just a C++ compiler.
+
+ File layout (little endian, as written by the Pi):
+	TRACE_FILE_HEADER
+	numStrings x { uint32_t length; char text[length]; }	// formats and %s arguments
+	numRecords x TRACE_FILE_RECORD							// oldest first
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define TRACE_FILE_MAGIC		"MMTRACE1"
+#define TRACE_MAX_ARGS			4
+
+#define TRACE_LEVEL_VERBOSE		0
+#define TRACE_LEVEL_NOTICE		1
+#define TRACE_LEVEL_WARNING		2
+#define TRACE_LEVEL_ERROR		3
+
+struct TRACE_FILE_HEADER
+{
+	char magic[8];
+	uint32_t numStrings;
+	uint32_t numRecords;
+	uint64_t droppedRecords;			// records overwritten before the dump was taken
+};
+
+struct TRACE_FILE_RECORD
+{
+	uint64_t timestampMicros;			// CLOCK_MONOTONIC
+	uint64_t sequence;					// global order of the record
+	int64_t args[TRACE_MAX_ARGS];		// %s arguments hold a string table index
+	uint32_t formatIndex;
+	uint32_t threadId;
+	uint16_t level;
+	uint16_t numArgs;
+	uint32_t reserved;
+};
+
+inline const char* traceLevelName(int level)
+{
+	switch (level)
+	{
+		case TRACE_LEVEL_VERBOSE:	return "verbose";
+		case TRACE_LEVEL_NOTICE:	return "notice";
+		case TRACE_LEVEL_WARNING:	return "warning";
+		case TRACE_LEVEL_ERROR:		return "error";
+		default:					return "?";
+	}
+}
+
+/**
+ * Expand a printf style format against 64 bit integer arguments.
+ * Supported conversions are %d %i %u %x %X %p %c and %s, with flags and width.
+ * Length modifiers in the format are ignored since every argument is 64 bit.
+ *
+ * @param format printf style format
+ * @param args Argument values
+ * @param numArgs Number of values in args
+ * @param strings Resolves %s arguments, NULL if args hold raw const char* pointers
+ * @return The formatted message
+ */
+inline std::string traceFormatMessage(const char* format, const int64_t* args, int numArgs, const std::vector<std::string>* strings)
+{
+	std::string out;
+	int argIndex = 0;
+	const char* p = format;
+
+	while (*p)
+	{
+		if (*p != '%')
+		{
+			out += *p++;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			out += '%';
+			p += 2;
+			continue;
+		}
+
+		// Collect flags and width, skip any length modifiers
+		char spec[16];
+		int specLength = 0;
+		spec[specLength++] = *p++;
+		while (*p && strchr("-+ #0123456789.", *p) && specLength < 10)
+		{
+			spec[specLength++] = *p++;
+		}
+		while (*p && strchr("hljzt", *p))
+		{
+			p++;
+		}
+		char conversion = *p ? *p++ : 'd';
+
+		if (argIndex >= numArgs)
+		{
+			out += "<?>";
+			continue;
+		}
+		int64_t value = args[argIndex++];
+
+		char buffer[64];
+		if (conversion == 's')
+		{
+			spec[specLength++] = 's';
+			spec[specLength] = 0;
+			const char* text = "";
+			if (strings)
+			{
+				if (value >= 0 && value < (int64_t)strings->size())
+					text = (*strings)[value].c_str();
+			}
+			else
+			{
+				text = (const char*)(intptr_t)value;
+			}
+			if (!text)
+			{
+				text = "(null)";
+			}
+			std::vector<char> stringBuffer(strlen(text) + 64);
+			snprintf(&stringBuffer[0], stringBuffer.size(), spec, text);
+			out += &stringBuffer[0];
+			continue;
+		}
+
+		if (conversion == 'c')
+		{
+			spec[specLength++] = 'c';
+			spec[specLength] = 0;
+			snprintf(buffer, sizeof(buffer), spec, (int)value);
+		}
+		else if (conversion == 'p')
+		{
+			snprintf(buffer, sizeof(buffer), "0x%llx", (unsigned long long)value);
+		}
+		else
+		{
+			spec[specLength++] = 'l';
+			spec[specLength++] = 'l';
+			spec[specLength++] = (conversion == 'i') ? 'd' : conversion;
+			spec[specLength] = 0;
+			if (conversion == 'd' || conversion == 'i')
+				snprintf(buffer, sizeof(buffer), spec, (long long)value);
+			else
+				snprintf(buffer, sizeof(buffer), spec, (unsigned long long)value);
+		}
+		out += buffer;
+	}
+	return out;
+}
+
+/**
+ * Count the %s conversions in format and report which argument slots they use
+ *
+ * @param format printf style format
+ * @param isString Set true for each argument slot consumed by %s
+ */
+inline void traceStringArguments(const char* format, bool isString[TRACE_MAX_ARGS])
+{
+	int argIndex = 0;
+	for (int i=0; i<TRACE_MAX_ARGS; i++)
+	{
+		isString[i] = false;
+	}
+	for (const char* p = format; *p; p++)
+	{
+		if (*p != '%') continue;
+		if (p[1] == '%')
+		{
+			p++;
+			continue;
+		}
+		p++;
+		while (*p && strchr("-+ #0123456789.hljzt", *p))
+		{
+			p++;
+		}
+		if (!*p) break;
+		if (argIndex < TRACE_MAX_ARGS)
+		{
+			isString[argIndex] = (*p == 's');
+		}
+		argIndex++;
+	}
+}
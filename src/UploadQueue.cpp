@@ -0,0 +1,1143 @@
+/*
+ *  UploadQueue.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "UploadQueue.h"
+#include "ofxRaspicam.h"
+#include "TraceLog.h"
+#include "AtomicFile.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+// linux/ioprio.h isn't installed on Raspbian
+#define UPLOAD_IOPRIO_WHO_PROCESS	1
+#define UPLOAD_IOPRIO_CLASS_IDLE	3
+#define UPLOAD_IOPRIO_CLASS_SHIFT	13
+
+// Card reads and socket writes are done in these steps, small enough to pause between
+#define UPLOAD_READ_CHUNK			(256*1024)
+#define UPLOAD_SEND_CHUNK			(64*1024)
+#define UPLOAD_SOCKET_TIMEOUT_SECS	15
+#define UPLOAD_MAX_BACKOFF_MILLIS	60000
+// The state file is rewritten once it has twice the lines still needed, and never below this
+#define UPLOAD_STATE_COMPACT_LINES	1024
+
+static unsigned long long monotonicMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+TokenBucket::TokenBucket()
+{
+	bytesPerSecond = 0;
+	burstBytes = 0;
+	tokens = 0;
+	lastMicros = 0;
+}
+
+void TokenBucket::setup(double bytesPerSecond_, double burstBytes_)
+{
+	ofScopedLock lock(bucketMutex);
+	bytesPerSecond = bytesPerSecond_;
+	burstBytes = burstBytes_;
+	tokens = burstBytes;
+	lastMicros = monotonicMicros();
+}
+
+/**
+ * Spend bytes from the bucket. The bucket may go negative; the caller then
+ * sleeps until it is back to zero, so concurrent callers queue up in turn
+ * and the long run rate stays at bytesPerSecond.
+ *
+ * @param bytes About to be sent
+ */
+void TokenBucket::take(uint64_t bytes)
+{
+	double waitSeconds = 0;
+	{
+		ofScopedLock lock(bucketMutex);
+		if (bytesPerSecond <= 0)
+		{
+			return;
+		}
+		unsigned long long now = monotonicMicros();
+		tokens = min(burstBytes, tokens + (now - lastMicros) * bytesPerSecond / 1000000.0);
+		lastMicros = now;
+		tokens -= bytes;
+		if (tokens < 0)
+		{
+			waitSeconds = -tokens / bytesPerSecond;
+		}
+	}
+	if (waitSeconds > 0)
+	{
+		usleep((useconds_t)(waitSeconds * 1000000.0));
+	}
+}
+
+static string lowerCase(string text)
+{
+	for (size_t i=0; i<text.size(); i++)
+	{
+		text[i] = tolower((unsigned char)text[i]);
+	}
+	return text;
+}
+
+struct HttpResponse
+{
+	int status;
+	map<string, string> headers;		// names lower cased
+	string body;
+};
+
+/*
+ Just enough HTTP/1.1 for the S3 object calls: one keep-alive connection,
+ Content-Length bodies out, Content-Length or chunked bodies back.
+ */
+class HttpConnection
+{
+public:
+	HttpConnection()
+	{
+		socketFd = -1;
+		port = 80;
+		bucket = NULL;
+		sentBytes = NULL;
+		cancel = NULL;
+	}
+	~HttpConnection()
+	{
+		disconnect();
+	}
+
+	bool request(const string& method, const string& target, const char* contentType, const char* body, uint64_t length, HttpResponse& response)
+	{
+		// A keep-alive connection the server has since closed fails on first use, so try a fresh one once
+		bool reused = (socketFd >= 0);
+		bool gotResponse = false;
+		if (exchange(method, target, contentType, body, length, response, gotResponse))
+		{
+			return true;
+		}
+		disconnect();
+		if (!reused || gotResponse || (cancel && *cancel))
+		{
+			return false;
+		}
+		return exchange(method, target, contentType, body, length, response, gotResponse);
+	}
+
+	void disconnect()
+	{
+		if (socketFd >= 0)
+		{
+			::close(socketFd);
+			socketFd = -1;
+		}
+	}
+
+	string host;
+	int port;
+	TokenBucket* bucket;				// paces request bodies, NULL for no limit
+	MetricsCounter* sentBytes;			// body bytes sent
+	volatile bool* cancel;				// abandons a request part way when set
+
+private:
+	bool connectToHost()
+	{
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		struct addrinfo* addresses = NULL;
+		if (getaddrinfo(host.c_str(), ofToString(port).c_str(), &hints, &addresses) != 0)
+		{
+			ofLogWarning() << "Could not resolve upload host " << host;
+			return false;
+		}
+		for (struct addrinfo* address = addresses; address && socketFd < 0; address = address->ai_next)
+		{
+			socketFd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if (socketFd < 0)
+			{
+				continue;
+			}
+			struct timeval timeout;
+			timeout.tv_sec = UPLOAD_SOCKET_TIMEOUT_SECS;
+			timeout.tv_usec = 0;
+			setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(socketFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			if (::connect(socketFd, address->ai_addr, address->ai_addrlen) != 0)
+			{
+				::close(socketFd);
+				socketFd = -1;
+			}
+		}
+		freeaddrinfo(addresses);
+		if (socketFd < 0)
+		{
+			ofLogWarning() << "Could not connect to upload host " << host << ":" << port;
+			return false;
+		}
+		int noDelay = 1;
+		setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		return true;
+	}
+
+	bool sendAll(const char* data, size_t length)
+	{
+		while (length > 0)
+		{
+			ssize_t sent = send(socketFd, data, length, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (sent <= 0)
+			{
+				return false;
+			}
+			data += sent;
+			length -= sent;
+		}
+		return true;
+	}
+
+	// Read more of the response into pending, false on error or end of stream
+	bool fill()
+	{
+		char buffer[16*1024];
+		ssize_t received;
+		do
+		{
+			received = recv(socketFd, buffer, sizeof(buffer), 0);
+		} while (received < 0 && errno == EINTR);
+		if (received <= 0)
+		{
+			return false;
+		}
+		pending.append(buffer, received);
+		return true;
+	}
+
+	bool readLine(string& line)
+	{
+		size_t end;
+		while ((end = pending.find("\r\n")) == string::npos)
+		{
+			if (!fill()) return false;
+		}
+		line = pending.substr(0, end);
+		pending.erase(0, end + 2);
+		return true;
+	}
+
+	bool readBytes(size_t length, string& out)
+	{
+		while (pending.size() < length)
+		{
+			if (!fill()) return false;
+		}
+		out.append(pending, 0, length);
+		pending.erase(0, length);
+		return true;
+	}
+
+	bool exchange(const string& method, const string& target, const char* contentType, const char* body, uint64_t length, HttpResponse& response, bool& gotResponse)
+	{
+		if (socketFd < 0 && !connectToHost())
+		{
+			return false;
+		}
+		pending.clear();
+
+		ostringstream head;
+		head << method << " " << target << " HTTP/1.1\r\n";
+		head << "Host: " << host << ":" << port << "\r\n";
+		head << "Content-Length: " << length << "\r\n";
+		if (contentType)
+		{
+			head << "Content-Type: " << contentType << "\r\n";
+		}
+		head << "\r\n";
+		string headText = head.str();
+		if (!sendAll(headText.data(), headText.size()))
+		{
+			return false;
+		}
+		for (uint64_t offset = 0; offset < length; offset += UPLOAD_SEND_CHUNK)
+		{
+			if (cancel && *cancel)
+			{
+				return false;
+			}
+			size_t chunk = (size_t)min((uint64_t)UPLOAD_SEND_CHUNK, length - offset);
+			if (bucket)
+			{
+				bucket->take(chunk);
+			}
+			if (!sendAll(body + offset, chunk))
+			{
+				return false;
+			}
+			if (sentBytes)
+			{
+				sentBytes->add(chunk);
+			}
+		}
+
+		string line;
+		if (!readLine(line))
+		{
+			return false;
+		}
+		gotResponse = true;
+		// HTTP/1.1 200 OK
+		vector<string> statusLine = ofSplitString(line, " ");
+		if (statusLine.size() < 2)
+		{
+			return false;
+		}
+		response.status = ofToInt(statusLine[1]);
+		response.headers.clear();
+		response.body.clear();
+		while (readLine(line) && !line.empty())
+		{
+			size_t colon = line.find(':');
+			if (colon == string::npos) continue;
+			string name = lowerCase(line.substr(0, colon));
+			size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+			response.headers[name] = (valueStart == string::npos) ? "" : line.substr(valueStart, line.find_last_not_of(" \t") + 1 - valueStart);
+		}
+		if (!line.empty())
+		{
+			return false;
+		}
+
+		bool keepAlive = lowerCase(response.headers["connection"]) != "close";
+		if (lowerCase(response.headers["transfer-encoding"]) == "chunked")
+		{
+			while (true)
+			{
+				if (!readLine(line)) return false;
+				size_t size = strtoul(line.c_str(), NULL, 16);
+				if (size == 0)
+				{
+					// Trailers, then the blank line
+					while (readLine(line) && !line.empty()) {}
+					break;
+				}
+				if (!readBytes(size, response.body) || !readLine(line)) return false;
+			}
+		}else if (response.headers.count("content-length"))
+		{
+			if (!readBytes(strtoul(response.headers["content-length"].c_str(), NULL, 10), response.body)) return false;
+		}else if (response.status != 204 && response.status != 304)
+		{
+			// Body runs to the end of the connection
+			response.body = pending;
+			while (fill()) {}
+			response.body = pending;
+			keepAlive = false;
+		}
+		if (!keepAlive)
+		{
+			disconnect();
+		}
+		return true;
+	}
+
+	int socketFd;
+	string pending;						// received but not yet parsed
+};
+
+/**
+ * Percent-encode an object key, keeping / so keys read like paths
+ *
+ * @param key Object key
+ * @return The key as it goes in a request target
+ */
+static string urlEncode(const string& key)
+{
+	string out;
+	char escaped[4];
+	for (size_t i=0; i<key.size(); i++)
+	{
+		unsigned char c = key[i];
+		if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/')
+		{
+			out += c;
+		}else
+		{
+			snprintf(escaped, sizeof(escaped), "%%%02X", c);
+			out += escaped;
+		}
+	}
+	return out;
+}
+
+static string xmlElement(const string& body, const string& name)
+{
+	size_t start = body.find("<" + name + ">");
+	if (start == string::npos)
+	{
+		return "";
+	}
+	start += name.size() + 2;
+	size_t end = body.find("</" + name + ">", start);
+	return end == string::npos ? "" : body.substr(start, end - start);
+}
+
+/**
+ * 2x2 average, the half resolution preview
+ *
+ * @param source Decoded photo
+ * @param target Allocated to half of source's size
+ */
+static void halfSize(const ofPixels& source, ofPixels& target)
+{
+	int channels = source.getNumChannels();
+	int width = source.getWidth() / 2;
+	int height = source.getHeight() / 2;
+	target.allocate(width, height, channels);
+	size_t sourceStride = (size_t)source.getWidth() * channels;
+	const unsigned char* in = source.getPixels();
+	unsigned char* out = target.getPixels();
+	for (int y=0; y<height; y++)
+	{
+		const unsigned char* top = in + (size_t)y * 2 * sourceStride;
+		const unsigned char* bottom = top + sourceStride;
+		unsigned char* row = out + (size_t)y * width * channels;
+		for (int x=0; x<width * channels; x++)
+		{
+			int column = (x / channels) * 2 * channels + x % channels;
+			row[x] = (top[column] + top[column + channels] + bottom[column] + bottom[column + channels] + 2) >> 2;
+		}
+	}
+}
+
+UploadWorker::UploadWorker()
+{
+	queue = NULL;
+}
+
+void UploadWorker::threadedFunction()
+{
+	// Idle class: the kernel only services these reads when nothing else wants the card
+	if (syscall(SYS_ioprio_set, UPLOAD_IOPRIO_WHO_PROCESS, 0, UPLOAD_IOPRIO_CLASS_IDLE << UPLOAD_IOPRIO_CLASS_SHIFT) != 0)
+	{
+		TRACE_WARNING("Could not lower upload I/O priority");
+	}
+	queue->workerLoop();
+}
+
+UploadQueue::UploadQueue()
+{
+	catalog = NULL;
+	numWorkers = 2;
+	maxBytesPerSecond = 0;
+	multipartThreshold = 8*1024*1024;
+	partBytes = 5*1024*1024;
+	uploadPreviews = true;
+	previewQuality = OF_IMAGE_QUALITY_MEDIUM;
+	scanIntervalMillis = 2000;
+	port = 80;
+	catalogCursor = 0;
+	stateLines = 0;
+	compactAtLines = UPLOAD_STATE_COMPACT_LINES;
+	stopping = false;
+	memset(&stats, 0, sizeof(stats));
+	uploadedBytes = NULL;
+	uploadedFiles = NULL;
+	failures = NULL;
+	pendingBytes = NULL;
+	pendingFiles = NULL;
+	fileMillis = NULL;
+
+	pthread_mutex_init(&queueMutex, NULL);
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&queueChanged, &attributes);
+	pthread_condattr_destroy(&attributes);
+}
+
+UploadQueue::~UploadQueue()
+{
+	stop();
+	pthread_cond_destroy(&queueChanged);
+	pthread_mutex_destroy(&queueMutex);
+}
+
+/**
+ * Point the queue at a bucket and load what earlier runs already sent
+ *
+ * @param catalog_ Photos to upload, polled for new entries
+ * @param endpoint http://host[:port] of the S3 compatible service
+ * @param bucket_ Bucket name, addressed path style
+ * @param photosRoot_ Directory keys are made relative to
+ * @param statePath_ Resume state, appended to as uploads progress
+ * @return false if the endpoint can't be used
+ */
+bool UploadQueue::setup(PhotoCatalog* catalog_, string endpoint, string bucket_, string photosRoot_, string statePath_)
+{
+	catalog = catalog_;
+	bucket = bucket_;
+	photosRoot = photosRoot_;
+	statePath = statePath_;
+
+	if (endpoint.compare(0, 7, "http://") != 0)
+	{
+		ofLogError() << "Upload endpoint must be http://host[:port], put TLS in a local proxy: " << endpoint;
+		return false;
+	}
+	string authority = endpoint.substr(7);
+	authority = authority.substr(0, authority.find('/'));
+	size_t colon = authority.rfind(':');
+	if (colon != string::npos && authority.find(']') == string::npos)
+	{
+		host = authority.substr(0, colon);
+		port = ofToInt(authority.substr(colon + 1));
+	}else
+	{
+		host = authority;
+		port = 80;
+	}
+	if (host.empty() || bucket.empty())
+	{
+		ofLogError() << "Upload needs a host and a bucket";
+		return false;
+	}
+
+	loadState();
+
+	MetricsRegistry& registry = MetricsRegistry::getInstance();
+	uploadedBytes = registry.addCounter("upload_bytes_total", "Request body bytes sent to the object store, previews and retries included");
+	uploadedFiles = registry.addCounter("upload_files_total", "Full size photos stored in the object store");
+	failures = registry.addCounter("upload_failures_total", "Uploads that failed and were queued to retry");
+	pendingBytes = registry.addGauge("upload_pending_bytes", "Full size photo bytes waiting to be uploaded");
+	pendingFiles = registry.addGauge("upload_pending_files", "Full size photos waiting to be uploaded");
+	const double millisBounds[] = {100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000, 120000};
+	fileMillis = registry.addHistogram("upload_file_ms", "Time to upload one file, card reads and pauses included", millisBounds, 10);
+	return true;
+}
+
+/**
+ * Start the catalog scanner and the upload workers
+ */
+void UploadQueue::start()
+{
+	if (!catalog || isThreadRunning())
+	{
+		return;
+	}
+	stopping = false;
+	bandwidth.setup(maxBytesPerSecond, max(maxBytesPerSecond, (double)UPLOAD_SEND_CHUNK * 4));
+	for (int i=0; i<max(1, numWorkers); i++)
+	{
+		UploadWorker* worker = new UploadWorker();
+		worker->queue = this;
+		worker->startThread(false, false);
+		workers.push_back(worker);
+	}
+	startThread(false, false);
+}
+
+/**
+ * Stop scanning and abandon uploads in flight, the state file lets the next run pick them up
+ */
+void UploadQueue::stop()
+{
+	pthread_mutex_lock(&queueMutex);
+	stopping = true;
+	pthread_cond_broadcast(&queueChanged);
+	pthread_mutex_unlock(&queueMutex);
+
+	waitForThread(true);
+	for (size_t i=0; i<workers.size(); i++)
+	{
+		workers[i]->waitForThread(true);
+		delete workers[i];
+	}
+	workers.clear();
+}
+
+UploadStats UploadQueue::getStats()
+{
+	pthread_mutex_lock(&queueMutex);
+	UploadStats copy = stats;
+	pthread_mutex_unlock(&queueMutex);
+	copy.uploadedBytes = uploadedBytes ? uploadedBytes->get() : 0;
+	return copy;
+}
+
+/**
+ * Scanner: queue every catalog entry added since the last look
+ */
+void UploadQueue::threadedFunction()
+{
+	while (isThreadRunning() && !stopping)
+	{
+		vector<CatalogEntry> added = catalog->getEntries(catalogCursor);
+		catalogCursor += added.size();
+		for (size_t i=0; i<added.size(); )
+		{
+			// Rotated away before it could be sent
+			struct stat info;
+			if (stat(added[i].path.c_str(), &info) != 0)
+			{
+				added.erase(added.begin() + i);
+			}else
+			{
+				i++;
+			}
+		}
+
+		pthread_mutex_lock(&queueMutex);
+		for (size_t i=0; i<added.size(); i++)
+		{
+			UploadJob job;
+			job.path = added[i].path;
+			job.bytes = added[i].bytes;
+			job.attempts = 0;
+			job.notBeforeMillis = 0;
+			if (done.count(job.path))
+			{
+				continue;
+			}
+			string extension = lowerCase(job.path.substr(job.path.rfind('.') + 1));
+			if (uploadPreviews && (extension == "jpg" || extension == "jpeg") && !done.count(job.path + "#preview"))
+			{
+				job.priority = UPLOAD_PREVIEW;
+				job.key = keyPrefix + "previews/" + keyFor(job.path);
+				previews.push_back(job);
+			}
+			job.priority = UPLOAD_FULL;
+			job.key = keyPrefix + keyFor(job.path);
+			fulls.push_back(job);
+			stats.pendingBytes += job.bytes;
+			stats.pendingFiles++;
+		}
+		pendingBytes->set(stats.pendingBytes);
+		pendingFiles->set(stats.pendingFiles);
+		if (!added.empty())
+		{
+			pthread_cond_broadcast(&queueChanged);
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += scanIntervalMillis / 1000;
+		deadline.tv_nsec += (scanIntervalMillis % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!stopping && pthread_cond_timedwait(&queueChanged, &queueMutex, &deadline) != ETIMEDOUT) {}
+		pthread_mutex_unlock(&queueMutex);
+
+		bool compact;
+		{
+			ofScopedLock lock(stateMutex);
+			compact = stateLines >= compactAtLines;
+		}
+		if (compact)
+		{
+			compactState();
+		}
+	}
+}
+
+/**
+ * Take the next job whose backoff has passed, previews before full size
+ * files, each in catalog order. Blocks until there is one or stop() is called.
+ *
+ * @param job Filled with the job taken
+ * @return false when stopping
+ */
+bool UploadQueue::nextJob(UploadJob& job)
+{
+	pthread_mutex_lock(&queueMutex);
+	while (!stopping)
+	{
+		unsigned long long now = ofGetElapsedTimeMillis();
+		unsigned long long soonest = now + 1000;
+		deque<UploadJob>* lanes[2] = {&previews, &fulls};
+		for (int lane=0; lane<2; lane++)
+		{
+			for (deque<UploadJob>::iterator it = lanes[lane]->begin(); it != lanes[lane]->end(); it++)
+			{
+				if (it->notBeforeMillis <= now)
+				{
+					job = *it;
+					lanes[lane]->erase(it);
+					pthread_mutex_unlock(&queueMutex);
+					return true;
+				}
+				soonest = min(soonest, it->notBeforeMillis);
+			}
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		unsigned long long waitMillis = soonest - now;
+		deadline.tv_sec += waitMillis / 1000;
+		deadline.tv_nsec += (waitMillis % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&queueChanged, &queueMutex, &deadline);
+	}
+	pthread_mutex_unlock(&queueMutex);
+	return false;
+}
+
+void UploadQueue::workerLoop()
+{
+	HttpConnection connection;
+	connection.host = host;
+	connection.port = port;
+	connection.bucket = &bandwidth;
+	connection.sentBytes = uploadedBytes;
+	connection.cancel = &stopping;
+	UploadJob job;
+	while (nextJob(job))
+	{
+		unsigned long long startMillis = ofGetElapsedTimeMillis();
+		bool gone = false;
+		bool uploaded = uploadJob(connection, job, gone);
+		if (uploaded)
+		{
+			fileMillis->observe(ofGetElapsedTimeMillis() - startMillis);
+		}
+		finishJob(job, uploaded, gone);
+	}
+}
+
+/**
+ * Record a job's outcome: done, dropped because storage rotated the file
+ * away, or back in its lane with an exponential backoff
+ */
+void UploadQueue::finishJob(UploadJob& job, bool uploaded, bool gone)
+{
+	pthread_mutex_lock(&queueMutex);
+	if (uploaded || gone)
+	{
+		done.insert(stateName(job));
+		if (job.priority == UPLOAD_FULL)
+		{
+			multipart.erase(job.path);
+			stats.pendingBytes -= min(stats.pendingBytes, job.bytes);
+			stats.pendingFiles -= min(stats.pendingFiles, (uint64_t)1);
+			if (uploaded)
+			{
+				stats.uploadedFiles++;
+				uploadedFiles->increment();
+			}else if (uploadPreviews)
+			{
+				// No point making a preview of a file that is gone
+				for (deque<UploadJob>::iterator it = previews.begin(); it != previews.end(); it++)
+				{
+					if (it->path == job.path)
+					{
+						previews.erase(it);
+						break;
+					}
+				}
+			}
+			pendingBytes->set(stats.pendingBytes);
+			pendingFiles->set(stats.pendingFiles);
+		}
+	}else if (!stopping)
+	{
+		stats.failures++;
+		failures->increment();
+		job.attempts++;
+		job.notBeforeMillis = ofGetElapsedTimeMillis() + min((unsigned long long)UPLOAD_MAX_BACKOFF_MILLIS, 1000ULL << min(job.attempts, 16));
+		(job.priority == UPLOAD_PREVIEW ? previews : fulls).push_back(job);
+		pthread_cond_broadcast(&queueChanged);
+	}
+	pthread_mutex_unlock(&queueMutex);
+
+	// After done is updated, so a compactState() in between can't lose the line
+	if (uploaded || gone)
+	{
+		appendState((uploaded ? "done\t" : "skip\t") + stateName(job));
+	}
+}
+
+/**
+ * Hold off while any camera is writing a photo. Polled between card reads,
+ * so at most one chunk of ours is queued ahead of the encoder's writes.
+ */
+void UploadQueue::waitForCameras()
+{
+	while (!stopping)
+	{
+		bool busy = false;
+		for (size_t i=0; i<cameras.size(); i++)
+		{
+			busy = busy || cameras[i]->isCapturing();
+		}
+		if (!busy)
+		{
+			return;
+		}
+		ofSleepMillis(20);
+	}
+}
+
+/**
+ * Read part of a photo politely: in chunks, pausing for captures, and
+ * dropping the pages again so uploads don't push anything out of the cache
+ *
+ * @param path File to read
+ * @param offset First byte
+ * @param length Bytes wanted, the file must have at least this many from offset
+ * @param out Resized to length and filled
+ * @param gone Set if the file no longer exists
+ * @return true if all length bytes were read
+ */
+bool UploadQueue::readRange(const string& path, uint64_t offset, uint64_t length, vector<char>& out, bool& gone)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		gone = (errno == ENOENT);
+		return false;
+	}
+	posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+	out.resize(length);
+	uint64_t done = 0;
+	while (done < length && !stopping)
+	{
+		waitForCameras();
+		size_t chunk = (size_t)min((uint64_t)UPLOAD_READ_CHUNK, length - done);
+		ssize_t result = pread(fd, &out[done], chunk, offset + done);
+		if (result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (result <= 0)
+		{
+			break;
+		}
+		done += result;
+	}
+	posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+	close(fd);
+	return done == length;
+}
+
+bool UploadQueue::uploadJob(HttpConnection& connection, UploadJob& job, bool& gone)
+{
+	struct stat info;
+	if (stat(job.path.c_str(), &info) != 0)
+	{
+		gone = (errno == ENOENT);
+		return false;
+	}
+	uint64_t length = info.st_size;
+
+	if (job.priority == UPLOAD_FULL && length >= multipartThreshold)
+	{
+		return putMultipart(connection, job.key, job.path, length);
+	}
+
+	vector<char> data;
+	if (!readRange(job.path, 0, length, data, gone))
+	{
+		return false;
+	}
+	if (job.priority == UPLOAD_FULL)
+	{
+		return putObject(connection, job.key, job.path, data.empty() ? NULL : &data[0], data.size(), "image/jpeg");
+	}
+
+	ofBuffer encoded;
+	encoded.set(data.empty() ? NULL : &data[0], data.size());
+	ofPixels full;
+	if (!ofLoadImage(full, encoded))
+	{
+		// Not something we can shrink, the full size upload still goes ahead
+		ofLogWarning() << "Could not decode " << job.path << " for a preview";
+		gone = true;
+		return false;
+	}
+	ofPixels half;
+	halfSize(full, half);
+	ofBuffer preview;
+	ofSaveImage(half, preview, OF_IMAGE_FORMAT_JPEG, (ofImageQualityType)previewQuality);
+	return putObject(connection, job.key, job.path, preview.getBinaryBuffer(), preview.size(), "image/jpeg");
+}
+
+bool UploadQueue::putObject(HttpConnection& connection, const string& key, const string& path, const char* data, uint64_t length, const char* contentType)
+{
+	HttpResponse response;
+	if (!connection.request("PUT", "/" + bucket + "/" + urlEncode(key), contentType, data, length, response))
+	{
+		return false;
+	}
+	if (response.status != 200)
+	{
+		ofLogWarning() << "Upload of " << path << " failed with HTTP " << response.status;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Upload a large file in parts, skipping parts a previous attempt finished
+ * under the same upload id. A store that no longer knows the upload id
+ * (expired or aborted) gets a fresh upload.
+ *
+ * @return true once the store has assembled the object
+ */
+bool UploadQueue::putMultipart(HttpConnection& connection, const string& key, const string& path, uint64_t length)
+{
+	string target = "/" + bucket + "/" + urlEncode(key);
+	HttpResponse response;
+
+	for (int attempt=0; attempt<2; attempt++)
+	{
+		MultipartState state;
+		pthread_mutex_lock(&queueMutex);
+		if (multipart.count(path))
+		{
+			state = multipart[path];
+		}
+		pthread_mutex_unlock(&queueMutex);
+
+		if (state.uploadId.empty() || state.partBytes == 0)
+		{
+			if (!connection.request("POST", target + "?uploads", NULL, NULL, 0, response) || response.status != 200)
+			{
+				ofLogWarning() << "Could not start a multipart upload of " << path;
+				return false;
+			}
+			state.uploadId = xmlElement(response.body, "UploadId");
+			state.partBytes = partBytes;
+			if (state.uploadId.empty())
+			{
+				return false;
+			}
+			pthread_mutex_lock(&queueMutex);
+			multipart[path] = state;
+			pthread_mutex_unlock(&queueMutex);
+			appendState("upload\t" + path + "\t" + state.uploadId + "\t" + ofToString(state.partBytes));
+		}
+		string uploadQuery = "uploadId=" + urlEncode(state.uploadId);
+
+		bool expired = false;
+		int numParts = (int)((length + state.partBytes - 1) / state.partBytes);
+		vector<char> data;
+		for (int part=1; part<=numParts && !expired; part++)
+		{
+			if (state.etags.count(part))
+			{
+				continue;
+			}
+			uint64_t offset = (uint64_t)(part - 1) * state.partBytes;
+			bool gone = false;
+			if (!readRange(path, offset, min(state.partBytes, length - offset), data, gone))
+			{
+				return false;
+			}
+			if (!connection.request("PUT", target + "?partNumber=" + ofToString(part) + "&" + uploadQuery, NULL, &data[0], data.size(), response))
+			{
+				return false;
+			}
+			if (response.status == 404)
+			{
+				expired = true;
+				break;
+			}
+			if (response.status != 200 || response.headers["etag"].empty())
+			{
+				ofLogWarning() << "Part " << part << " of " << path << " failed with HTTP " << response.status;
+				return false;
+			}
+			state.etags[part] = response.headers["etag"];
+			pthread_mutex_lock(&queueMutex);
+			multipart[path].etags[part] = state.etags[part];
+			pthread_mutex_unlock(&queueMutex);
+			appendState("part\t" + path + "\t" + ofToString(part) + "\t" + state.etags[part]);
+		}
+
+		if (!expired)
+		{
+			ostringstream complete;
+			complete << "<CompleteMultipartUpload>";
+			for (map<int, string>::iterator it = state.etags.begin(); it != state.etags.end(); it++)
+			{
+				complete << "<Part><PartNumber>" << it->first << "</PartNumber><ETag>" << it->second << "</ETag></Part>";
+			}
+			complete << "</CompleteMultipartUpload>";
+			string body = complete.str();
+			if (!connection.request("POST", target + "?" + uploadQuery, "application/xml", body.data(), body.size(), response))
+			{
+				return false;
+			}
+			// S3 can report a failed completion with a 200 and an Error document
+			if (response.status == 200 && response.body.find("<Error>") == string::npos)
+			{
+				return true;
+			}
+			expired = (response.status == 404 || xmlElement(response.body, "Code") == "NoSuchUpload");
+			if (!expired)
+			{
+				ofLogWarning() << "Could not complete the upload of " << path << ", HTTP " << response.status;
+				return false;
+			}
+		}
+
+		ofLogWarning() << "Multipart upload of " << path << " expired, starting again";
+		pthread_mutex_lock(&queueMutex);
+		multipart.erase(path);
+		pthread_mutex_unlock(&queueMutex);
+	}
+	return false;
+}
+
+/**
+ * Rebuild what finished and which parts are stored from the state file.
+ * Lines are tab separated:
+ *	done	<path>[#preview]
+ *	skip	<path>[#preview]
+ *	upload	<path>	<upload id>	<part bytes>
+ *	part	<path>	<number>	<etag>
+ */
+void UploadQueue::loadState()
+{
+	ifstream input(statePath.c_str());
+	string line;
+	while (getline(input, line))
+	{
+		vector<string> fields = ofSplitString(line, "\t");
+		if (fields.size() >= 2 && (fields[0] == "done" || fields[0] == "skip"))
+		{
+			done.insert(fields[1]);
+			multipart.erase(fields[1]);
+		}else if (fields.size() >= 4 && fields[0] == "upload")
+		{
+			MultipartState& state = multipart[fields[1]];
+			state.uploadId = fields[2];
+			state.partBytes = strtoull(fields[3].c_str(), NULL, 10);
+			state.etags.clear();
+		}else if (fields.size() >= 4 && fields[0] == "part" && multipart.count(fields[1]))
+		{
+			multipart[fields[1]].etags[ofToInt(fields[2])] = fields[3];
+		}
+		stateLines++;
+	}
+	ofLogVerbose() << "Upload state: " << done.size() << " files done, " << multipart.size() << " multipart uploads to resume";
+}
+
+void UploadQueue::appendState(const string& line)
+{
+	ofScopedLock lock(stateMutex);
+	int fd = open(statePath.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		ofLogWarning() << "Could not write upload state " << statePath;
+		return;
+	}
+	string text = line + "\n";
+	ssize_t written = write(fd, text.data(), text.size());
+	(void)written;
+	close(fd);
+	stateLines++;
+}
+
+/**
+ * Rewrite the state file with only what a restart still needs: finished
+ * files still on the card and the parts of multipart uploads in progress.
+ * Finished files storage has rotated away are forgotten in done as well,
+ * so neither grows with every photo ever taken.
+ */
+void UploadQueue::compactState()
+{
+	ofScopedLock lock(stateMutex);
+	pthread_mutex_lock(&queueMutex);
+	vector<string> finished(done.begin(), done.end());
+	map<string, MultipartState> resuming = multipart;
+	pthread_mutex_unlock(&queueMutex);
+
+	string text;
+	size_t lines = 0;
+	vector<string> rotated;
+	for (size_t i=0; i<finished.size(); i++)
+	{
+		string path = finished[i];
+		if (path.size() > 8 && path.compare(path.size() - 8, 8, "#preview") == 0)
+		{
+			path.erase(path.size() - 8);
+		}
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+		{
+			rotated.push_back(finished[i]);
+			continue;
+		}
+		text += "done\t" + finished[i] + "\n";
+		lines++;
+	}
+	for (map<string, MultipartState>::iterator it = resuming.begin(); it != resuming.end(); it++)
+	{
+		text += "upload\t" + it->first + "\t" + it->second.uploadId + "\t" + ofToString(it->second.partBytes) + "\n";
+		for (map<int, string>::iterator part = it->second.etags.begin(); part != it->second.etags.end(); part++)
+		{
+			text += "part\t" + it->first + "\t" + ofToString(part->first) + "\t" + part->second + "\n";
+		}
+		lines += 1 + it->second.etags.size();
+	}
+	if (!atomicFileWrite(statePath, text.data(), text.size()))
+	{
+		ofLogWarning() << "Could not compact upload state " << statePath;
+		compactAtLines = stateLines * 2;
+		return;
+	}
+
+	pthread_mutex_lock(&queueMutex);
+	for (size_t i=0; i<rotated.size(); i++)
+	{
+		done.erase(rotated[i]);
+	}
+	pthread_mutex_unlock(&queueMutex);
+	ofLogVerbose() << "Upload state compacted from " << stateLines << " to " << lines << " lines";
+	stateLines = lines;
+	compactAtLines = max(lines * 2, (size_t)UPLOAD_STATE_COMPACT_LINES);
+}
+
+string UploadQueue::keyFor(const string& path)
+{
+	string root = photosRoot;
+	if (!root.empty() && root[root.size()-1] != '/')
+	{
+		root += "/";
+	}
+	if (!root.empty() && path.compare(0, root.size(), root) == 0)
+	{
+		return path.substr(root.size());
+	}
+	return ofFilePath::getFileName(path);
+}
+
+string UploadQueue::stateName(const UploadJob& job)
+{
+	return job.priority == UPLOAD_PREVIEW ? job.path + "#preview" : job.path;
+}
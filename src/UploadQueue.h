@@ -0,0 +1,157 @@
+#pragma once
+
+#include "ofMain.h"
+#include "PhotoCatalog.h"
+#include "MetricsRegistry.h"
+
+class ofxRaspicam;
+
+/*
+ Drains the photo catalog to an S3 compatible endpoint over HTTP: PUT
+ object for small files, the multipart upload calls for large ones.
+
+ - A half resolution preview of each photo goes up first. Waiting
+   previews always go ahead of full size files, so a slow link still
+   shows what every camera saw.
+ - Files over multipartThreshold go up in partBytes parts. The upload id
+   and each finished part's ETag are appended to statePath, so after a
+   restart or a dropped link only the missing parts are sent. Finished
+   files are recorded there too and never sent twice. The file is
+   rewritten without the files storage has since rotated away once it
+   holds twice the lines still needed.
+ - numWorkers uploads run at once, all drawing on one token bucket of
+   maxBytesPerSecond.
+ - Workers read the card in the idle I/O class with fadvise, and hold
+   off between chunks while any camera in cameras has a capture in
+   flight, so encoder_buffer_callback's writes never queue behind them.
+
+ Requests are unsigned: use a bucket with an anonymous upload policy, or
+ a local proxy that signs and adds TLS.
+ */
+
+enum UploadPriority
+{
+	UPLOAD_PREVIEW,						// half resolution JPEG, made by the worker
+	UPLOAD_FULL							// the file as captured
+};
+
+struct UploadJob
+{
+	string path;						// file on the card
+	string key;							// object key in the bucket
+	int priority;						// UploadPriority
+	uint64_t bytes;						// catalog size, for the pending totals
+	int attempts;
+	unsigned long long notBeforeMillis;	// retry backoff
+};
+
+struct UploadStats
+{
+	uint64_t uploadedBytes;				// request bodies sent, previews included
+	uint64_t uploadedFiles;				// full size files finished
+	uint64_t pendingBytes;				// full size bytes still to go
+	uint64_t pendingFiles;
+	uint64_t failures;					// requests that failed and were retried
+};
+
+// Shared byte budget; a caller that overdraws sleeps off its debt
+class TokenBucket
+{
+public:
+	TokenBucket();
+	void setup(double bytesPerSecond_, double burstBytes_);
+	void take(uint64_t bytes);
+
+	double bytesPerSecond;				// 0 is unlimited
+	double burstBytes;
+
+private:
+	ofMutex bucketMutex;
+	double tokens;
+	unsigned long long lastMicros;
+};
+
+class UploadQueue;
+class HttpConnection;
+
+class UploadWorker : public ofThread
+{
+public:
+	UploadWorker();
+	void threadedFunction();
+	UploadQueue* queue;
+};
+
+struct MultipartState
+{
+	string uploadId;
+	uint64_t partBytes;
+	map<int, string> etags;				// part number to ETag, as returned
+};
+
+class UploadQueue : public ofThread
+{
+public:
+	UploadQueue();
+	~UploadQueue();
+	bool setup(PhotoCatalog* catalog_, string endpoint, string bucket_, string photosRoot_, string statePath_);
+	void start();
+	void stop();
+	void threadedFunction();
+	UploadStats getStats();
+
+	vector<ofxRaspicam*> cameras;		// optional, reads pause while any of these captures
+	int numWorkers;
+	double maxBytesPerSecond;			// 0 is unlimited
+	uint64_t multipartThreshold;		// files at least this big use multipart
+	uint64_t partBytes;					// S3 needs 5MB or more for all but the last part
+	bool uploadPreviews;
+	int previewQuality;					// OF_IMAGE_QUALITY_*
+	string keyPrefix;					// e.g. "station-1/", put in front of every key
+	int scanIntervalMillis;				// catalog poll period
+
+private:
+	friend class UploadWorker;
+	void workerLoop();
+	bool nextJob(UploadJob& job);
+	void finishJob(UploadJob& job, bool uploaded, bool gone);
+	bool uploadJob(HttpConnection& connection, UploadJob& job, bool& gone);
+	bool putObject(HttpConnection& connection, const string& key, const string& path, const char* data, uint64_t length, const char* contentType);
+	bool putMultipart(HttpConnection& connection, const string& key, const string& path, uint64_t length);
+	bool readRange(const string& path, uint64_t offset, uint64_t length, vector<char>& out, bool& gone);
+	void waitForCameras();
+	void loadState();
+	void appendState(const string& line);
+	void compactState();
+	string keyFor(const string& path);
+	string stateName(const UploadJob& job);
+
+	PhotoCatalog* catalog;
+	string host;
+	int port;
+	string bucket;
+	string photosRoot;
+	string statePath;
+	ofMutex stateMutex;					// appends never land in a file compactState() is replacing
+	size_t stateLines;					// lines in the state file, guarded by stateMutex
+	size_t compactAtLines;
+	size_t catalogCursor;				// entries before this are queued or done
+	TokenBucket bandwidth;
+	vector<UploadWorker*> workers;
+
+	pthread_mutex_t queueMutex;			// guards everything below
+	pthread_cond_t queueChanged;
+	deque<UploadJob> previews;
+	deque<UploadJob> fulls;
+	set<string> done;					// stateName() of finished jobs
+	map<string, MultipartState> multipart;	// by path
+	volatile bool stopping;
+	UploadStats stats;
+
+	MetricsCounter* uploadedBytes;
+	MetricsCounter* uploadedFiles;
+	MetricsCounter* failures;
+	MetricsGauge* pendingBytes;
+	MetricsGauge* pendingFiles;
+	MetricsHistogram* fileMillis;
+};
@@ -0,0 +1,301 @@
+/*
+ *  YUVEncoder.cpp
+ *  openFrameworksLib
+ *
+ */
+
+#include "YUVEncoder.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
+#include "AtomicFile.h"
+#include "Crc32c.h"
+
+static void yuv_encoder_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	// The frame has been consumed, give the header back to its pool
+	mmal_buffer_header_release(buffer);
+}
+
+static void yuv_encoder_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	YUV_ENCODER_USERDATA *pData = (YUV_ENCODER_USERDATA *)port->userdata;
+	int complete = 0;
+
+	if (buffer->length)
+	{
+		mmal_buffer_header_mem_lock(buffer);
+		if (pData->memory)
+		{
+			pData->memory->insert(pData->memory->end(), buffer->data + buffer->offset, buffer->data + buffer->offset + buffer->length);
+		}
+		else if (pData->file_handle)
+		{
+			fwrite(buffer->data + buffer->offset, 1, buffer->length, pData->file_handle);
+		}
+		pData->crc = crc32cUpdate(pData->crc, buffer->data + buffer->offset, buffer->length);
+		mmal_buffer_header_mem_unlock(buffer);
+		pData->bytes += buffer->length;
+	}
+
+	if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)
+	{
+		pData->failed = 1;
+	}
+	if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
+	{
+		complete = 1;
+	}
+
+	mmal_buffer_header_release(buffer);
+
+	if (port->is_enabled)
+	{
+		MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pData->output_pool->queue);
+		if (!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+		{
+			TRACE_ERROR("Unable to return a buffer to the YUV encoder port");
+		}
+	}
+
+	if (complete)
+	{
+		vcos_semaphore_post(&pData->complete_semaphore);
+	}
+}
+
+YUVEncoder::YUVEncoder()
+{
+	encoder = NULL;
+	input_pool = NULL;
+	output_pool = NULL;
+	semaphoreCreated = false;
+	width = height = stride = alignedHeight = 0;
+	quality = 90;
+	lastBytes = 0;
+	lastCrc = 0;
+	userdata.file_handle = NULL;
+	userdata.memory = NULL;
+	userdata.output_pool = NULL;
+	userdata.bytes = 0;
+	userdata.crc = 0;
+	userdata.failed = 0;
+}
+
+YUVEncoder::~YUVEncoder()
+{
+	close();
+}
+
+size_t YUVEncoder::frameSize()
+{
+	return (size_t)stride * alignedHeight * 3 / 2;
+}
+
+/**
+ * Create the encoder for a fixed frame size
+ *
+ * @param width_ Visible width
+ * @param height_ Visible height
+ * @param quality_ JPEG Q factor 1-100
+ * @return true if the component is ready to encode
+ */
+bool YUVEncoder::setup(int width_, int height_, int quality_)
+{
+	TIMELINE_SCOPE("YUVEncoder::setup");
+	close();
+
+	width = width_;
+	height = height_;
+	stride = VCOS_ALIGN_UP(width, 32);
+	alignedHeight = VCOS_ALIGN_UP(height, 16);
+	quality = quality_;
+
+	MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &encoder);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("YUVEncoder create component FAIL error: %d", status);
+		encoder = NULL;
+		return false;
+	}
+
+	MMAL_PORT_T* input = encoder->input[0];
+	MMAL_PORT_T* output = encoder->output[0];
+
+	input->format->encoding = MMAL_ENCODING_I420;
+	input->format->es->video.width = stride;
+	input->format->es->video.height = alignedHeight;
+	input->format->es->video.crop.x = 0;
+	input->format->es->video.crop.y = 0;
+	input->format->es->video.crop.width = width;
+	input->format->es->video.crop.height = height;
+	input->buffer_num = max(input->buffer_num_min, (uint32_t)1);
+	input->buffer_size = max(input->buffer_size_min, (uint32_t)frameSize());
+	status = mmal_port_format_commit(input);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("YUVEncoder input format FAIL error: %d", status);
+		close();
+		return false;
+	}
+
+	mmal_format_copy(output->format, input->format);
+	output->format->encoding = MMAL_ENCODING_JPEG;
+	output->buffer_size = max(output->buffer_size_recommended, output->buffer_size_min);
+	output->buffer_num = max(output->buffer_num_recommended, output->buffer_num_min);
+	status = mmal_port_format_commit(output);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("YUVEncoder output format FAIL error: %d", status);
+		close();
+		return false;
+	}
+
+	mmal_port_parameter_set_uint32(output, MMAL_PARAMETER_JPEG_Q_FACTOR, quality);
+
+	if (mmal_component_enable(encoder) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("YUVEncoder enable FAIL");
+		close();
+		return false;
+	}
+
+	input_pool = mmal_port_pool_create(input, input->buffer_num, input->buffer_size);
+	output_pool = mmal_port_pool_create(output, output->buffer_num, output->buffer_size);
+	if (!input_pool || !output_pool)
+	{
+		TRACE_ERROR("YUVEncoder pool creation FAIL");
+		close();
+		return false;
+	}
+
+	vcos_semaphore_create(&userdata.complete_semaphore, "YUVEncoder-sem", 0);
+	semaphoreCreated = true;
+	userdata.output_pool = output_pool;
+	output->userdata = (struct MMAL_PORT_USERDATA_T *)&userdata;
+
+	if (mmal_port_enable(input, yuv_encoder_input_callback) != MMAL_SUCCESS ||
+		mmal_port_enable(output, yuv_encoder_output_callback) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("YUVEncoder port enable FAIL");
+		close();
+		return false;
+	}
+
+	TRACE_VERBOSE("YUVEncoder ready %dx%d stride %d", width, height, stride);
+	return true;
+}
+
+/**
+ * Change the Q factor between frames without recreating the component
+ *
+ * @param quality_ JPEG Q factor 1-100
+ */
+void YUVEncoder::setQuality(int quality_)
+{
+	quality = quality_;
+	if (encoder)
+	{
+		mmal_port_parameter_set_uint32(encoder->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, quality);
+	}
+}
+
+bool YUVEncoder::encodeFrame(const unsigned char* i420)
+{
+	if (!encoder || !input_pool)
+	{
+		return false;
+	}
+
+	MMAL_PORT_T* output = encoder->output[0];
+	MMAL_BUFFER_HEADER_T* buffer;
+	while ((buffer = mmal_queue_get(output_pool->queue)) != NULL)
+	{
+		mmal_port_send_buffer(output, buffer);
+	}
+
+	MMAL_BUFFER_HEADER_T* frame = mmal_queue_wait(input_pool->queue);
+	mmal_buffer_header_mem_lock(frame);
+	memcpy(frame->data, i420, frameSize());
+	mmal_buffer_header_mem_unlock(frame);
+	frame->length = frameSize();
+	frame->offset = 0;
+	frame->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+
+	userdata.bytes = 0;
+	userdata.crc = 0;
+	userdata.failed = 0;
+	if (mmal_port_send_buffer(encoder->input[0], frame) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("YUVEncoder could not send input frame");
+		mmal_buffer_header_release(frame);
+		return false;
+	}
+
+	{
+		TIMELINE_SCOPE("YUVEncoder_wait");
+		vcos_semaphore_wait(&userdata.complete_semaphore);
+	}
+	lastBytes = userdata.bytes;
+	lastCrc = userdata.crc;
+	return !userdata.failed;
+}
+
+/**
+ * Encode one aligned I420 frame to a JPEG file
+ *
+ * @param i420 frameSize() bytes
+ * @param path Output file
+ * @return true if a complete JPEG was written
+ */
+bool YUVEncoder::encode(const unsigned char* i420, string path)
+{
+	TIMELINE_SCOPE("YUVEncoder::encode");
+	FILE* file = atomicFileOpen(path);
+	if (!file)
+	{
+		ofLogError() << "YUVEncoder could not open " << path;
+		return false;
+	}
+	userdata.memory = NULL;
+	userdata.file_handle = file;
+	bool ok = encodeFrame(i420);
+	userdata.file_handle = NULL;
+	if (!ok)
+	{
+		atomicFileDiscard(file, path);
+		return false;
+	}
+	return atomicFileCommit(file, path, lastBytes);
+}
+
+bool YUVEncoder::encodeToMemory(const unsigned char* i420, vector<unsigned char>& jpeg)
+{
+	TIMELINE_SCOPE("YUVEncoder::encodeToMemory");
+	jpeg.clear();
+	userdata.file_handle = NULL;
+	userdata.memory = &jpeg;
+	bool ok = encodeFrame(i420);
+	userdata.memory = NULL;
+	return ok;
+}
+
+void YUVEncoder::close()
+{
+	if (encoder)
+	{
+		if (encoder->input[0]->is_enabled) mmal_port_disable(encoder->input[0]);
+		if (encoder->output[0]->is_enabled) mmal_port_disable(encoder->output[0]);
+		mmal_component_disable(encoder);
+		if (input_pool) mmal_port_pool_destroy(encoder->input[0], input_pool);
+		if (output_pool) mmal_port_pool_destroy(encoder->output[0], output_pool);
+		mmal_component_destroy(encoder);
+	}
+	if (semaphoreCreated)
+	{
+		vcos_semaphore_delete(&userdata.complete_semaphore);
+		semaphoreCreated = false;
+	}
+	encoder = NULL;
+	input_pool = NULL;
+	output_pool = NULL;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "ofMain.h"
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+#include "interface/mmal/util/mmal_default_components.h"
+
+/*
+ Non-tunnelled MMAL image_encode instance for frames produced on the ARM
+ (stacked, cropped, ...). Input is I420 with the camera's 32x16 alignment;
+ output goes straight to a file (written atomically, see AtomicFile), or
+ to a memory buffer for encodeToMemory.
+ */
+
+struct YUV_ENCODER_USERDATA
+{
+	FILE* file_handle;
+	vector<unsigned char>* memory;			// used instead of file_handle when set
+	VCOS_SEMAPHORE_T complete_semaphore;
+	MMAL_POOL_T* output_pool;
+	uint32_t bytes;
+	uint32_t crc;							// CRC32C of the encoded output so far
+	int failed;
+};
+
+class YUVEncoder
+{
+public:
+	YUVEncoder();
+	~YUVEncoder();
+	bool setup(int width_, int height_, int quality_=90);
+	bool encode(const unsigned char* i420, string path);
+	bool encodeToMemory(const unsigned char* i420, vector<unsigned char>& jpeg);
+	void setQuality(int quality_);
+	void close();
+
+	int width;							// visible size
+	int height;
+	int stride;							// VCOS_ALIGN_UP(width, 32)
+	int alignedHeight;					// VCOS_ALIGN_UP(height, 16)
+	int quality;
+	uint32_t lastBytes;
+	uint32_t lastCrc;					// CRC32C of the last encoded frame
+	size_t frameSize();					// bytes in one aligned I420 frame
+
+private:
+	bool encodeFrame(const unsigned char* i420);
+	MMAL_COMPONENT_T* encoder;
+	MMAL_POOL_T* input_pool;
+	MMAL_POOL_T* output_pool;
+	YUV_ENCODER_USERDATA userdata;
+	bool semaphoreCreated;
+};
@@ -1,11 +1,28 @@
 #include "ofMain.h"
 #include "ofApp.h"
 #include "ofGLProgrammableRenderer.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
 
-int main()
+int main(int argc, char** argv)
 {
+#ifdef CAMERA_APP_VERBOSE_CONSOLE
+	// Console verbose for core troubleshooting; capture tracing goes to TraceLog either way
 	ofSetLogLevel(OF_LOG_VERBOSE);
+	TraceLog::getInstance().consoleLevel = TRACE_LEVEL_VERBOSE;
+#else
+	ofSetLogLevel(OF_LOG_NOTICE);
+#endif
     ofSetLogLevel("ofThread", OF_LOG_SILENT);
+	if (getenv("CAMERA_APP_HEADLESS") || (argc > 1 && string(argv[1]) == "--headless"))
+	{
+		// Capture station: no window, GL context, SlideShow or frame loop
+		ofResetElapsedTimeCounter();
+		TimelineTrace::getInstance().nameCurrentThread("main");
+		CaptureStation* station = new CaptureStation();
+		station->setup();
+		return station->run();
+	}
 	ofSetCurrentRenderer(ofGLProgrammableRenderer::TYPE);
 	ofSetupOpenGL(1280, 720, OF_WINDOW);
 	ofRunApp( new ofApp());
@@ -1,37 +1,168 @@
 #include "ofApp.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
 
 ofImage image;
 void ofApp::onCharacterReceived(SSHKeyListenerEventData& e)
 {
-	keyPressed((int)e.character);
+	// Console thread: the effects keys need GL and wait for update(), captures go to the station's command thread
+	int key = (int)e.character;
+	if (key == 'f' || key == 'g' || key == 'G')
+	{
+		ofScopedLock lock(consoleMutex);
+		consoleKeys.push_back(key);
+	}else if (key != 'q')
+	{
+		station.queueCommand(key);
+	}
 }
 //--------------------------------------------------------------
 void ofApp::setup(){
-	//ofSetLogLevel(OF_LOG_VERBOSE); set in main.cpp for core troubleshooting
-	consoleListener.setup(this);
-	consoleListener.startThread(false, false);
-	cameraController.setup();
+	TimelineTrace::getInstance().nameCurrentThread("main");
+	//ofSetLogLevel(OF_LOG_VERBOSE); set in main.cpp (CAMERA_APP_VERBOSE_CONSOLE) for core troubleshooting
+	// Camera comes up in the background while the window and SlideShow load
+	station.setup(this);
+	
+	slideShow.setup(ofToDataPath("photos", true));
+	
+	effects.setup();
+	effects.setGradeLut(0.3, 1.1, 1.15);
+	effects.lutStrength = 1;
+	effects.sharpenAmount = 0.6;
+	effectsPreview = false;
+}
 
+//--------------------------------------------------------------
+void ofApp::exit(){
+	station.exit();
 }
 
 //--------------------------------------------------------------
 void ofApp::update(){
-	
+	deque<int> keys;
+	{
+		ofScopedLock lock(consoleMutex);
+		keys.swap(consoleKeys);
+	}
+	for (size_t i=0; i<keys.size(); i++)
+	{
+		keyPressed(keys[i]);
+	}
+	// The only part of a capture that has to happen here
+	station.cameraController.updateLastTexture();
+	slideShow.update();
 }
 
 //--------------------------------------------------------------
-void ofApp::draw(){
+void ofApp::gradeLastCapture(bool verify){
+	// The command thread may be finishing the next capture meanwhile
+	CaptureInfo capture = station.cameraController.getLastCapture();
+	string path = capture.path;
+	ofImage source;
+	// Uploaded only once it is known to fit in a texture
+	source.setUseTexture(false);
+	if (path.empty() || !source.loadImage(path))
+	{
+		ofLogError() << "No capture to grade";
+		return;
+	}
+	ofPixels graded;
+	if (!effects.canApply(source.getWidth(), source.getHeight()))
+	{
+		// A full size capture is over the VC4's 2048 texture limit
+		effects.applyCpu(source.getPixelsRef(), graded);
+		ofLogNotice() << "Graded " << path << " on the CPU, too big for a texture: " << effects.lastCpuMillis << "ms";
+	}else
+	{
+		source.setUseTexture(true);
+		source.update();
+		effects.apply(source.getTextureReference());
+		if (!effects.readPixels(graded))
+		{
+			return;
+		}
+		ofLogNotice() << "Graded " << path << " gpu: " << effects.lastApplyMillis << "ms readback: " << effects.lastReadbackMillis << "ms";
+		
+		if (verify)
+		{
+			ofPixels reference;
+			effects.applyCpu(source.getPixelsRef(), reference);
+			int maxDifference = 0;
+			size_t numBytes = (size_t)graded.getWidth() * graded.getHeight() * 3;
+			for (size_t i=0; i<numBytes && reference.getWidth() == graded.getWidth(); i++)
+			{
+				maxDifference = max(maxDifference, abs(graded.getPixels()[i] - reference.getPixels()[i]));
+			}
+			ofLogNotice() << "applyCpu: " << effects.lastCpuMillis << "ms, max difference from GPU: " << maxDifference;
+		}
+	}
 	
+	string outputPath = station.cameraController.nextPhotoPath("-fx");
+	ofBuffer jpeg;
+	ofSaveImage(graded, jpeg, OF_IMAGE_FORMAT_JPEG, OF_IMAGE_QUALITY_BEST);
+	if (atomicFileWrite(outputPath, jpeg.getBinaryBuffer(), jpeg.size()))
+	{
+		station.storage.add(outputPath, jpeg.size());
+		CatalogEntry entry;
+		entry.path = outputPath;
+		entry.cameraNum = station.cameraController.cameraNum;
+		entry.captureTimeMicros = capture.captureTimeMicros;
+		entry.bytes = jpeg.size();
+		entry.crc32c = crc32cUpdate(0, jpeg.getBinaryBuffer(), jpeg.size());
+		station.catalog.add(entry);
+	}
+}
 
+//--------------------------------------------------------------
+void ofApp::draw(){
+	if (effectsPreview)
+	{
+		// Render the preview into fbo, then through the chain; nothing is read back
+		if (!fbo.isAllocated() || fbo.getWidth() != ofGetWidth() || fbo.getHeight() != ofGetHeight())
+		{
+			fbo.allocate(ofGetWidth(), ofGetHeight(), GL_RGBA);
+		}
+		fbo.begin();
+		ofClear(0, 0, 0, 255);
+		slideShow.draw();
+		fbo.end();
+		ofSetColor(255);
+		if (effects.apply(fbo.getTextureReference()))
+		{
+			effects.draw(0, 0, ofGetWidth(), ofGetHeight());
+		}else
+		{
+			fbo.draw(0, 0);
+		}
+	}else
+	{
+		slideShow.draw();
+	}
+	if (!station.cameraReady)
+	{
+		ofDrawBitmapStringHighlight("camera starting", 20, 40, ofColor::black, ofColor::yellow);
+	}
 }
 
 //--------------------------------------------------------------
 void ofApp::keyPressed  (int key){
 
 	ofLogVerbose() << "keyPressed: " << key;
-	if (key == 'e') 
+	if (key == 'f')
+	{
+		// Toggle the sharpen + grade chain on the preview
+		effectsPreview = !effectsPreview;
+		return;
+	}
+	if (key == 'g' || key == 'G')
+	{
+		// Write a graded copy of the last capture, 'G' also compares the GPU result with applyCpu()
+		gradeLastCapture(key == 'G');
+		return;
+	}
+	// Captures take up to seconds, keep them off the GL thread. 'q' would end the command thread, ESC closes the window
+	if (key > 0 && key < 128 && key != 'q')
 	{
-		ofLogVerbose() << "e pressed!";
-		cameraController.takePhoto();
+		station.queueCommand(key);
 	}
-}
\ No newline at end of file
+}
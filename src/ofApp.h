@@ -1,8 +1,9 @@
 #pragma once
 
 #include "ofMain.h"
-#include "ofxRaspicam.h"
-#include "ConsoleListener.h"
+#include "CaptureStation.h"
+#include "SlideShow.h"
+#include "EffectsChain.h"
 
 
 class ofApp : public ofBaseApp, public SSHKeyListener{
@@ -12,15 +13,21 @@ class ofApp : public ofBaseApp, public SSHKeyListener{
 		void setup();
 		void update();
 		void draw();
+		void exit();
 		
 		void keyPressed(int key);
 		
 		ofShader shader;
 		ofFbo fbo;
 	
-		ofxRaspicam cameraController;
-        ConsoleListener consoleListener;
+		CaptureStation station;			// camera and everything that runs without GL
+		SlideShow slideShow;
+		EffectsChain effects;
+		bool effectsPreview;				// draw the slideshow through the effects chain
+		void gradeLastCapture(bool verify);
         void onCharacterReceived(SSHKeyListenerEventData& e);
+		ofMutex consoleMutex;
+		deque<int> consoleKeys;				// GL commands from the console thread, run as key presses in update()
 	
 };
 
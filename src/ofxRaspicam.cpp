@@ -8,11 +8,16 @@
  */
 
 #include "ofxRaspicam.h"
+#include "TraceLog.h"
+#include "TimelineTrace.h"
+
+#include <sys/time.h>
 
 /**
  *  buffer header callback function for camera control
  *
- *  No actions taken in current version
+ *  Copies the exposure time and gains from each MMAL_PARAMETER_CAMERA_SETTINGS
+ *  event into the port userdata and feeds them to the convergence monitor
  *
  * @param port Pointer to port from which callback originated
  * @param buffer mmal buffer header pointer
@@ -21,10 +26,25 @@ static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 {
 	if (buffer->cmd == MMAL_EVENT_PARAMETER_CHANGED)
 	{
+		MMAL_EVENT_PARAMETER_CHANGED_T *param = (MMAL_EVENT_PARAMETER_CHANGED_T *)buffer->data;
+		CONTROL_PORT_USERDATA *pData = (CONTROL_PORT_USERDATA *)port->userdata;
+		if (pData && param->hdr.id == MMAL_PARAMETER_CAMERA_SETTINGS)
+		{
+			MMAL_PARAMETER_CAMERA_SETTINGS_T *settings = (MMAL_PARAMETER_CAMERA_SETTINGS_T *)param;
+			ofScopedLock lock(pData->mutex);
+			pData->settings.exposureMicros = settings->exposure;
+			pData->settings.analogGain = settings->analog_gain.den ? (float)settings->analog_gain.num / settings->analog_gain.den : 0;
+			pData->settings.digitalGain = settings->digital_gain.den ? (float)settings->digital_gain.num / settings->digital_gain.den : 0;
+			pData->settings.awbRedGain = settings->awb_red_gain.den ? (float)settings->awb_red_gain.num / settings->awb_red_gain.den : 0;
+			pData->settings.awbBlueGain = settings->awb_blue_gain.den ? (float)settings->awb_blue_gain.num / settings->awb_blue_gain.den : 0;
+			pData->settings.updates++;
+			if (pData->convergence)
+				pData->convergence->addSample(pData->settings);
+		}
 	}
 	else
 	{
-		ofLog(OF_LOG_VERBOSE, "Received unexpected camera control callback event, 0x%08x", buffer->cmd);
+		TRACE_WARNING("Received unexpected camera control callback event, 0x%08x", buffer->cmd);
 
 	}
 	
@@ -56,6 +76,57 @@ static MMAL_STATUS_T connect_ports(MMAL_PORT_T *output_port, MMAL_PORT_T *input_
 	return status;
 }
 
+/**
+ * Overwrite every copy of a fixed width string in the JPEG header
+ *
+ * @return Number of copies replaced
+ */
+static int replace_in_header(uint8_t *data, uint32_t length, const char *from, const char *to, size_t size, int maxCount)
+{
+	int count = 0;
+	for (uint32_t i=0; size && i+size<=length && count<maxCount; i++)
+	{
+		if (data[i] == (uint8_t)from[0] && memcmp(data+i, from, size) == 0)
+		{
+			memcpy(data+i, to, size);
+			count++;
+			i += size - 1;
+		}
+	}
+	return count;
+}
+
+/**
+ * The EXIF times were sent before the capture was triggered. The first
+ * encoder buffer holds the EXIF block and carries the frame's pts, so put
+ * the real exposure time in before the buffer reaches the file.
+ */
+static void restamp_exif_times(PORT_USERDATA *pData, MMAL_BUFFER_HEADER_T *buffer)
+{
+	if (!pData->clock_valid || buffer->pts == MMAL_TIME_UNKNOWN || !pData->photo->exifDateTime[0])
+	{
+		return;
+	}
+	int64_t realtimeMicros = buffer->pts + pData->stc_to_monotonic + pData->monotonic_to_realtime;
+	struct timeval when;
+	when.tv_sec = realtimeMicros / 1000000;
+	when.tv_usec = realtimeMicros % 1000000;
+	char dateTime[20];
+	char subSec[7];
+	Photo::format_exif_time(when, dateTime, subSec);
+	
+	// Only search the APP1 (EXIF) segment, not compressed data
+	uint32_t length = buffer->length;
+	if (length > 6 && buffer->data[2] == 0xFF && buffer->data[3] == 0xE1)
+	{
+		length = min(length, 4u + ((buffer->data[4] << 8) | buffer->data[5]));
+	}
+	int replaced = replace_in_header(buffer->data, length, pData->photo->exifDateTime, dateTime, 19, 3);
+	// SubSecTimeOriginal includes its terminator so a digit run elsewhere can't match
+	replace_in_header(buffer->data, length, pData->photo->exifSubSec, subSec, 7, 1);
+	pData->exif_restamped = replaced > 0;
+}
+
 /**
  *  buffer header callback function for encoder
  *
@@ -72,15 +143,53 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 	
 	PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
 	
+	TimelineScope timelineScope("encoder_buffer_callback");
+	timelineScope.arg = buffer->length;
+	
 	if (pData)
 	{
+		if (pData->frame_bytes == 0)
+		{
+			// Once per frame rather than per buffer
+			TimelineTrace::getInstance().nameCurrentThread("MMAL encoder callback");
+		}
+		
+		if (pData->frame_pts == MMAL_TIME_UNKNOWN && buffer->pts != MMAL_TIME_UNKNOWN)
+		{
+			pData->frame_pts = buffer->pts;
+		}
+		
 		if (buffer->length && pData->file_handle)
 		{
 			mmal_buffer_header_mem_lock(buffer);
 			
+			if (pData->frame_bytes == 0)
+			{
+				restamp_exif_times(pData, buffer);
+			}
 			fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+			if (pData->publisher)
+			{
+				pData->publisher->append(buffer->data, buffer->length);
+			}
+			// Checksum while the data is hot in cache rather than re-reading the file later
+			pData->frame_crc = crc32cUpdate(pData->frame_crc, buffer->data, buffer->length);
 			
 			mmal_buffer_header_mem_unlock(buffer);
+			
+			pData->frame_bytes += buffer->length;
+			if (pData->metrics)
+				pData->metrics->bytesWritten->add(buffer->length);
+		}
+		
+		if (pData->metrics)
+			pData->metrics->encoderBuffers->increment();
+		
+		if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)
+		{
+			pData->frame_failed = 1;
+			if (pData->metrics)
+				pData->metrics->droppedFrames->increment();
 		}
 		
 		// Now flag if we have completed
@@ -89,7 +198,7 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 	}
 	else
 	{
-		vcos_log_error("Received a encoder buffer callback with no state");
+		TRACE_ERROR("Received a encoder buffer callback with no state");
 	}
 	
 	// release buffer back to the pool
@@ -108,7 +217,11 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 			status = mmal_port_send_buffer(port, new_buffer);
 		}
 		if (!new_buffer || status != MMAL_SUCCESS)
-			vcos_log_error("Unable to return a buffer to the encoder port");
+		{
+			TRACE_ERROR("Unable to return a buffer to the encoder port");
+			if (pData->metrics)
+				pData->metrics->poolStarvation->increment();
+		}
 	}
 	
 	if (complete)
@@ -116,27 +229,419 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 	
 }
 
+/**
+ *  buffer header callback function for the raw video port
+ *
+ *  Filled frames are queued for grabRawFrame(), anything else goes straight back to the port
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void raw_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	RAW_PORT_USERDATA *pData = (RAW_PORT_USERDATA *)port->userdata;
+	
+	if (pData && port->is_enabled && buffer->length)
+	{
+		if (pData->metrics)
+			pData->metrics->rawFrames->increment();
+		if (pData->graph)
+		{
+			FrameInfo info = pData->format;
+			info.ptsMicros = buffer->pts;
+			if (pData->clocks->clock_valid && buffer->pts != MMAL_TIME_UNKNOWN)
+			{
+				info.monotonicMicros = buffer->pts + pData->clocks->stc_to_monotonic;
+				info.realtimeMicros = info.monotonicMicros + pData->clocks->monotonic_to_realtime;
+			}
+			pData->graph->submit(buffer, info);
+			
+			// Nobody may be grabbing while the graph streams, so only the newest frame waits for grabRawFrame()
+			MMAL_BUFFER_HEADER_T *stale;
+			while ((stale = mmal_queue_get(pData->frames)) != NULL)
+			{
+				mmal_buffer_header_release(stale);
+			}
+		}
+		mmal_queue_put(pData->frames, buffer);
+		return;
+	}
+	
+	// raw_pool_callback sends it back to the port
+	mmal_buffer_header_release(buffer);
+}
+
+/**
+ *  Called when the last reference to a raw buffer is released, from whichever
+ *  thread released it: the app, a FrameGraph node or the port callback
+ *
+ * @param pool The raw frame pool
+ * @param buffer Buffer header now unused
+ * @param userdata The camera video port
+ * @return MMAL_TRUE to park the buffer in the pool's queue, MMAL_FALSE if it went straight back to the port
+ */
+static MMAL_BOOL_T raw_pool_callback(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T *buffer, void *userdata)
+{
+	MMAL_PORT_T *port = (MMAL_PORT_T *)userdata;
+	
+	if (port->is_enabled)
+	{
+		if (mmal_port_send_buffer(port, buffer) == MMAL_SUCCESS)
+		{
+			return MMAL_FALSE;
+		}
+		TRACE_ERROR("Unable to return a buffer to the camera video port");
+	}
+	return MMAL_TRUE;
+}
+
+CameraMetrics::CameraMetrics()
+{
+	captures = NULL;
+	captureFailures = NULL;
+	encoderBuffers = NULL;
+	bytesWritten = NULL;
+	poolStarvation = NULL;
+	droppedFrames = NULL;
+	captureLatency = NULL;
+	frameBytes = NULL;
+	rawFrames = NULL;
+	commitLatency = NULL;
+	settleLatency = NULL;
+	settleTimeouts = NULL;
+	focusScore = NULL;
+	blurredFrames = NULL;
+}
+
+/**
+ * Register this camera's counters and histograms with the global MetricsRegistry
+ *
+ * @param labels Prometheus label set identifying the camera, e.g. camera="0"
+ */
+void CameraMetrics::setup(string labels)
+{
+	static const double latencyBoundsMs[] = {50, 100, 250, 500, 750, 1000, 1500, 2500, 5000, 10000};
+	static const double commitBoundsMs[] = {1, 5, 10, 25, 50, 100, 250, 500, 1000};
+	static const double settleBoundsMs[] = {1, 10, 50, 100, 250, 500, 1000, 2500, 5000};
+	static const double focusBounds[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
+	static const double frameBoundsBytes[] = {256*1024, 512*1024, 1024*1024, 2*1024*1024, 3*1024*1024, 4*1024*1024, 6*1024*1024, 8*1024*1024};
+	
+	MetricsRegistry& registry = MetricsRegistry::getInstance();
+	captures		= registry.addCounter("camera_captures_total", "Captures sent to the encoder", labels);
+	captureFailures	= registry.addCounter("camera_capture_failures_total", "Captures that could not open a file or start", labels);
+	encoderBuffers	= registry.addCounter("camera_encoder_buffers_total", "Encoder output buffers received", labels);
+	bytesWritten	= registry.addCounter("camera_bytes_written_total", "Encoded bytes written to disk", labels);
+	poolStarvation	= registry.addCounter("camera_pool_starvation_total", "Times no buffer header was available for the encoder port", labels);
+	droppedFrames	= registry.addCounter("camera_dropped_frames_total", "Frames that ended with a transmission failure", labels);
+	captureLatency	= registry.addHistogram("camera_capture_latency_ms", "Time from capture trigger to frame end", latencyBoundsMs, sizeof(latencyBoundsMs)/sizeof(double), labels);
+	frameBytes		= registry.addHistogram("camera_frame_bytes", "Encoded size of each frame", frameBoundsBytes, sizeof(frameBoundsBytes)/sizeof(double), labels);
+	rawFrames		= registry.addCounter("camera_raw_frames_total", "I420 frames delivered by the video port", labels);
+	commitLatency	= registry.addHistogram("camera_commit_ms", "Time to fsync and rename a finished photo into place", commitBoundsMs, sizeof(commitBoundsMs)/sizeof(double), labels);
+	settleLatency	= registry.addHistogram("camera_settle_ms", "Time spent waiting for exposure and white balance to settle", settleBoundsMs, sizeof(settleBoundsMs)/sizeof(double), labels);
+	settleTimeouts	= registry.addCounter("camera_settle_timeouts_total", "Settles that hit the timeout before exposure converged", labels);
+	focusScore		= registry.addHistogram("camera_focus_score", "Laplacian variance of each scored capture, low means blurred", focusBounds, sizeof(focusBounds)/sizeof(double), labels);
+	blurredFrames	= registry.addCounter("camera_blurred_frames_total", "Captures scoring below the blur threshold", labels);
+}
+
+SensorModeLatency::SensorModeLatency()
+{
+	count = 0;
+	sumMillis = 0;
+	minMillis = 0;
+	maxMillis = 0;
+	lastMillis = 0;
+	histogram = NULL;
+}
+
+void SensorModeLatency::add(double millis)
+{
+	minMillis = count ? min(minMillis, millis) : millis;
+	maxMillis = count ? max(maxMillis, millis) : millis;
+	sumMillis += millis;
+	lastMillis = millis;
+	count++;
+	if (histogram)
+		histogram->observe(millis);
+}
+
+/**
+ * Milliseconds since this process was started, from /proc/self/stat
+ *
+ * @return elapsed ms, 0 if unavailable
+ */
+static unsigned long long process_age_millis()
+{
+	unsigned long long startTicks = 0;
+	double uptime = 0;
+	
+	FILE* stat = fopen("/proc/self/stat", "r");
+	if (stat)
+	{
+		// starttime is field 22; the comm field may contain spaces so skip past its closing paren
+		char line[1024];
+		if (fgets(line, sizeof(line), stat))
+		{
+			char* p = strrchr(line, ')');
+			for (int field = 2; p && field < 22; field++)
+			{
+				p = strchr(p + 1, ' ');
+			}
+			if (p)
+			{
+				startTicks = strtoull(p + 1, NULL, 10);
+			}
+		}
+		fclose(stat);
+	}
+	
+	FILE* uptimeFile = fopen("/proc/uptime", "r");
+	if (uptimeFile)
+	{
+		if (fscanf(uptimeFile, "%lf", &uptime) != 1)
+			uptime = 0;
+		fclose(uptimeFile);
+	}
+	
+	if (!startTicks || !uptime)
+		return 0;
+	
+	double startSeconds = (double)startTicks / sysconf(_SC_CLK_TCK);
+	return (unsigned long long)((uptime - startSeconds) * 1000.0);
+}
+
+ofxRaspicamTask::ofxRaspicamTask()
+{
+	owner = NULL;
+	method = NULL;
+}
+
+void ofxRaspicamTask::run(ofxRaspicam* owner_, void (ofxRaspicam::*method_)())
+{
+	owner = owner_;
+	method = method_;
+	startThread(false, false);
+}
 
+void ofxRaspicamTask::threadedFunction()
+{
+	(owner->*method)();
+}
 
 ofxRaspicam::ofxRaspicam()
 {
 	camera_still_port = NULL;
+	camera_video_port = NULL;
+	raw_pool = NULL;
+	raw_frames = NULL;
+	raw_callback_data.frames = NULL;
+	raw_callback_data.pool = NULL;
+	raw_callback_data.metrics = NULL;
+	raw_callback_data.graph = NULL;
+	raw_callback_data.clocks = &callback_data;
+	frameGraph = NULL;
+	graphStreaming = false;
+	rawWidth = 1296;
+	rawHeight = 972;
+	rawStride = 0;
+	rawAlignedHeight = 0;
 	encoder_input_port = NULL;
 	encoder_output_port = NULL;
 	camera = NULL;
 	encoder = NULL;
-	lastImage.allocate(photo.width, photo.height, OF_IMAGE_COLOR);
+	// lastImage borrows from PixelPool on its first load rather than up front, keeping 15MB off the startup path.
+	// Captures finish off the GL thread, so it never owns a texture; updateLastTexture() copies it to lastTexture
+	lastImage.setUseTexture(false);
+	lastImageChanged = false;
+	ready = false;
+	setupFailed = false;
+	semaphoreCreated = false;
+	output_file = NULL;
+	captureTriggered = false;
+	capturing = 0;
+	parallelInit = true;
+	cameraNum = 0;
+	photo.frameRateNum = STILLS_FRAME_RATE_NUM;
+	photo.frameRateDen = STILLS_FRAME_RATE_DEN;
+	currentMode.index = 0;
+	currentMode.width = 0;
+	currentMode.height = 0;
+	currentMode.minFps = 0;
+	currentMode.maxFps = 0;
+	currentMode.binning = 1;
+	currentMode.fullFieldOfView = true;
+	lastReconfigureMillis = 0;
+	regionOfInterest = ofRectangle(0, 0, 1, 1);
+	fullFrameWidth = photo.width;
+	fullFrameHeight = photo.height;
+	loadLastImage = true;
+	catalog = NULL;
+	storage = NULL;
+	qualityController = NULL;
+	metadataLog = NULL;
+	publisher = NULL;
+	scoreFocus = false;
+	minFocusScore = 0;
+	blurPolicy = BLUR_KEEP;
+	maxBlurRetakes = 2;
+	measureStatistics = false;
+	blurRetakesLeft = 0;
+	frameSequence = 0;
+	rawFrameSequence = 0;
+	memset(&control_callback_data.settings, 0, sizeof(control_callback_data.settings));
+	control_callback_data.convergence = &convergence;
+	lastSettle.converged = false;
+	lastSettle.millis = 0;
+	lastSettle.samples = 0;
+	callback_data.frame_pts = MMAL_TIME_UNKNOWN;
+	callback_data.publisher = NULL;
+	callback_data.clock_valid = 0;
+	callback_data.stc_to_monotonic = 0;
+	callback_data.monotonic_to_realtime = 0;
+	callback_data.exif_restamped = 0;
+	startupReport.success = false;
+	startupReport.setupMillis = 0;
+	startupReport.processMillis = 0;
+	startupReport.uptimeSeconds = 0;
+}
+
+/**
+ * Bring the camera up on a background thread so the caller (GL window,
+ * SlideShow) can keep loading. Listen to readyEvent or poll isReady().
+ */
+void ofxRaspicam::setupAsync()
+{
+	if (ready || startupTask.isThreadRunning())
+	{
+		return;
+	}
+	startupTask.run(this, &ofxRaspicam::setup);
+}
+
+string ofxRaspicam::nextPhotoPath(string suffix)
+{
+	if (storage)
+	{
+		return storage->nextPath(fileSuffix + suffix);
+	}
+	return ofToDataPath("photos/" + ofGetTimestampString() + fileSuffix + suffix + ".jpg", true);
+}
+
+string ofxRaspicam::metricsLabels()
+{
+	return "camera=\"" + ofToString(cameraNum) + "\"";
+}
+
+CameraSettings& ofxRaspicam::getCameraSettings()
+{
+	return photo.cameraSettings;
+}
+
+bool ofxRaspicam::isReady()
+{
+	return ready;
+}
+
+/**
+ * Set from opening a photo's file until it is closed, and while stacked
+ * or region JPEGs are encoded. UploadQueue polls it between reads.
+ *
+ * @return true while a capture is writing to the card
+ */
+bool ofxRaspicam::isCapturing()
+{
+	return __sync_fetch_and_add(&capturing, 0) != 0;
+}
+
+/**
+ * Block until a setupAsync() in progress has finished
+ */
+void ofxRaspicam::waitUntilReady()
+{
+	if (!ready && startupTask.isThreadRunning())
+	{
+		TIMELINE_SCOPE("wait_camera_ready");
+		startupTask.waitForThread(false);
+	}
+}
+
+void ofxRaspicam::report_ready(unsigned long long setupStartMillis)
+{
+	float uptime = 0;
+	FILE* uptimeFile = fopen("/proc/uptime", "r");
+	if (uptimeFile)
+	{
+		if (fscanf(uptimeFile, "%f", &uptime) != 1)
+			uptime = 0;
+		fclose(uptimeFile);
+	}
+	
+	startupReport.success = !setupFailed;
+	startupReport.setupMillis = ofGetElapsedTimeMillis() - setupStartMillis;
+	startupReport.processMillis = process_age_millis();
+	startupReport.uptimeSeconds = uptime;
+	
+	MetricsRegistry::getInstance().addGauge("camera_setup_ms", "Time spent in ofxRaspicam::setup()", metricsLabels())->set(startupReport.setupMillis);
+	MetricsRegistry::getInstance().addGauge("camera_ready_process_ms", "Process age when the camera became ready", metricsLabels())->set(startupReport.processMillis);
+	
+	ofLogNotice() << "Camera " << (startupReport.success ? "ready" : "setup FAILED")
+				<< " setup: " << startupReport.setupMillis << "ms"
+				<< " since launch: " << startupReport.processMillis << "ms"
+				<< " uptime: " << startupReport.uptimeSeconds << "s";
+	
+	ready = startupReport.success;
+	ofNotifyEvent(readyEvent, startupReport, this);
+
+	// Decode buffers for the capture size, still on the startup thread but after the camera is usable:
+	// one for lastImage, the analysis decode at libjpeg's scale for focusNode.scorer.downscale, and dedup's 1/8 scale one
+	if (ready && loadLastImage)
+	{
+		PixelPool::getInstance().reserve(photo.width, photo.height, 3, 1);
+	}
+	if (ready && (scoreFocus || minFocusScore > 0 || measureStatistics))
+	{
+		int scale = 1;
+		while (scale < 8 && scale * 2 <= focusNode.scorer.downscale)
+		{
+			scale *= 2;
+		}
+		PixelPool::getInstance().reserve((photo.width + scale - 1) / scale, (photo.height + scale - 1) / scale, 3, 1);
+	}
+	if (ready && dedup.policy != DEDUP_OFF)
+	{
+		PixelPool::getInstance().reserve((photo.width + 7) / 8, (photo.height + 7) / 8, 3, 1);
+	}
 }
 
 void ofxRaspicam::setup()
 {
+	TIMELINE_SCOPE("setup");
 	
+	unsigned long long setupStartMillis = ofGetElapsedTimeMillis();
 	MMAL_STATUS_T status = MMAL_SUCCESS;
 	
 	bcm_host_init();
-
-	create_camera_component();
-	create_encoder_component();
+	
+	// The encoder does not depend on the camera until the ports are connected,
+	// so build it while the camera and its settings calls are being applied
+	if (parallelInit)
+	{
+		encoderTask.run(this, &ofxRaspicam::create_encoder_component);
+		create_camera_component();
+		encoderTask.waitForThread(false);
+	}
+	else
+	{
+		create_camera_component();
+		create_encoder_component();
+	}
+	
+	if (!photo.camera || !photo.encoder_component || !photo.encoder_pool)
+	{
+		TRACE_ERROR("Camera setup aborted, components missing");
+		setupFailed = true;
+		report_ready(setupStartMillis);
+		return;
+	}
 	
 	camera_still_port   = photo.camera->output[MMAL_CAMERA_CAPTURE_PORT];
 	encoder_input_port  = photo.encoder_component->input[0];
@@ -144,7 +649,7 @@ void ofxRaspicam::setup()
 	
 	VCOS_STATUS_T vcos_status;
 	
-	ofLogVerbose() << "Connecting camera stills port to encoder input port";
+	TRACE_VERBOSE("Connecting camera stills port to encoder input port");
 		
 	
 	// Now connect the camera to the encoder
@@ -152,10 +657,11 @@ void ofxRaspicam::setup()
 	
 	if (status != MMAL_SUCCESS)
 	{
-		ofLogVerbose() << "connect camera video port to encoder input FAIL";
+		TRACE_ERROR("connect camera video port to encoder input FAIL");
+		setupFailed = true;
 	}else 
 	{
-		ofLogVerbose() << "connect camera video port to encoder input PASS";
+		TRACE_VERBOSE("connect camera video port to encoder input PASS");
 
 	}
 
@@ -164,13 +670,23 @@ void ofxRaspicam::setup()
 	// Null until we open our filename
 	callback_data.file_handle = NULL;
 	callback_data.photo = &photo;
+	callback_data.frame_bytes = 0;
+	callback_data.frame_crc = 0;
+	callback_data.frame_failed = 0;
+	metrics.setup(metricsLabels());
+	statisticsNode.setup(metricsLabels());
+	dedup.setup(metricsLabels());
+	dedupDecoder.setup(metricsLabels() + ",user=\"dedup\"");
+	analysisDecoder.setup(metricsLabels() + ",user=\"analysis\"");
+	callback_data.metrics = &metrics;
 	vcos_status = vcos_semaphore_create(&callback_data.complete_semaphore, "RaspiStill-sem", 0);
 	
 	vcos_assert(vcos_status == VCOS_SUCCESS);
+	semaphoreCreated = (vcos_status == VCOS_SUCCESS);
 	
 	encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
 	
-	ofLogVerbose() << "Enabling encoder output port";
+	TRACE_VERBOSE("Enabling encoder output port");
 		
 	
 	// Enable the encoder output port and tell it its callback function
@@ -178,133 +694,1029 @@ void ofxRaspicam::setup()
 	
 	if (status != MMAL_SUCCESS)
 	{
-		ofLogVerbose() << "Setup encoder output FAIL, error: " << status;
+		TRACE_ERROR("Setup encoder output FAIL, error: %d", status);
+		setupFailed = true;
 	}else 
 	{
-		ofLogVerbose() << "Setup encoder output PASS";
+		TRACE_VERBOSE("Setup encoder output PASS");
 	}
 
-	
+	report_ready(setupStartMillis);
 }
 
+/**
+ * Capture one photo to nextPhotoPath(), photos/<timestamp><fileSuffix>.jpg by default
+ * Waits for exposure and white balance to settle first, at most photo.timeout.
+ */
 void ofxRaspicam::takePhoto()
 {
-	ofFile myFile;
-	FILE *output_file = NULL;
-	
-	vcos_sleep(photo.timeout);
-	
-	// Open the file
-	string fileName = ofToDataPath("photos/"+ ofGetTimestampString()+".jpg", true);
-	char *toChar = const_cast<char*> ( fileName.c_str() );
-	photo.filename = toChar;
-	ofLogVerbose() << "Opening output file" << fileName;
-	
-	output_file = fopen(photo.filename, "wb");
+	TIMELINE_SCOPE("takePhoto");
 	
-	if (!output_file)
+	// A capture requested during setupAsync() waits for startup instead of being lost
+	waitUntilReady();
+	if (!ready)
 	{
-		// Notify user, carry on but discarding encoded output buffers
-		ofLogVerbose() << "Error opening output file";
+		TRACE_ERROR("takePhoto called before the camera is ready");
+		return;
 	}
-	photo.add_exif_tags();
 	
-	callback_data.file_handle = output_file;
+	settle();
 	
-	// We only capture if a filename was specified and it opened
-	if (output_file)
+	// finishCapture() throws a blurred shot away while there are retakes left
+	blurRetakesLeft = (blurPolicy == BLUR_RETAKE) ? maxBlurRetakes : 0;
+	while (prepareCapture())
 	{
-		// Send all the buffers to the encoder output port
-		int num = mmal_queue_length(photo.encoder_pool->queue);
-		int q;
-		
-		for (q=0;q<num;q++)
-		{
-			MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(photo.encoder_pool->queue);
-			
-			if (!buffer)
-			{
-				ofLogVerbose() << "Unable to get a required buffer " << q << " from pool queue";
-			}
-			
-			if (mmal_port_send_buffer(encoder_output_port, buffer)!= MMAL_SUCCESS)
-			{
-				ofLogVerbose() << "Unable to send a buffer to encoder output port " << q;
-			}
-		}
-		
-		ofLogVerbose() << "Starting capture";
-		
-		if (mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
+		lastCapture.settleMillis = lastSettle.millis;
+		triggerCapture();
+		if (finishCapture() || !lastCapture.blurred || blurRetakesLeft-- <= 0)
 		{
-			ofLogVerbose() << "Failed to start capture";
+			break;
 		}
-		else
+		TRACE_NOTICE("Retaking blurred photo, %d retakes left", blurRetakesLeft);
+	}
+	blurRetakesLeft = 0;
+}
+
+/**
+ * Change the JPEG Q factor without touching the pipeline. The encoder
+ * reads MMAL_PARAMETER_JPEG_Q_FACTOR per frame, so setting it on the
+ * enabled output port between captures is enough.
+ *
+ * @param quality 1-100
+ * @return true if the encoder accepted it
+ */
+bool ofxRaspicam::setQuality(int quality)
+{
+	quality = ofClamp(quality, 1, 100);
+	if (encoder_output_port)
+	{
+		MMAL_STATUS_T status = mmal_port_parameter_set_uint32(encoder_output_port, MMAL_PARAMETER_JPEG_Q_FACTOR, quality);
+		if (status != MMAL_SUCCESS)
 		{
-			// Wait for capture to complete
-			// For some reason using vcos_semaphore_wait_timeout sometimes returns immediately with bad parameter error
-			// even though it appears to be all correct, so reverting to untimed one until figure out why its erratic
-			vcos_semaphore_wait(&callback_data.complete_semaphore);
-			ofLogVerbose() << "Finished capture " << fileName;
-			lastImage.loadImage(callback_data.photo->filename);
+			TRACE_ERROR("Set JPEG quality %d FAIL, error: %d", quality, status);
+			return false;
 		}
-		
-		// Ensure we don't die if get callback with no open file
-		callback_data.file_handle = NULL;
-		
-		fclose(output_file);
 	}
-	
-	vcos_semaphore_delete(&callback_data.complete_semaphore);
-	
+	TRACE_VERBOSE("JPEG quality %d -> %d", photo.quality, quality);
+	photo.quality = quality;
+	stackEncoder.setQuality(quality);
+	regionCropper.quality = quality;
+	return true;
 }
 
+int ofxRaspicam::getQuality()
+{
+	return photo.quality;
+}
 
-void ofxRaspicam::create_camera_component()
+/**
+ * Wait until the camera reports stable exposure, gains and AWB. Only reports
+ * that arrive during the wait count, see ExposureConvergenceMonitor.
+ *
+ * @param maxMillis Timeout, Photo::timeout if negative
+ * @return How long it waited and whether AE converged
+ */
+SettleReport ofxRaspicam::settle(int maxMillis)
 {
-	
-	MMAL_ES_FORMAT_T *format;
-	MMAL_STATUS_T status;
-	
-	/* Create the component */
-	status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
-	
-	if (status != MMAL_SUCCESS)
+	lastSettle = convergence.waitForConvergence(maxMillis < 0 ? photo.timeout : maxMillis);
+	metrics.settleLatency->observe(lastSettle.millis);
+	if (!lastSettle.converged)
 	{
-		ofLogVerbose() << "Failed to create camera component";
-		
-	}
-	
-	if (!camera->output_num)
+		metrics.settleTimeouts->increment();
+		TRACE_WARNING("Exposure did not settle within %d ms (%d reports)", (int)lastSettle.millis, lastSettle.samples);
+	}else
 	{
-		ofLogVerbose() << "Camera doesn't have output ports";
-		
-	}else {
-		ofLogVerbose() << "camera->output_num: " << camera->output_num;
+		TRACE_VERBOSE("Exposure settled in %d ms", (int)lastSettle.millis);
 	}
+	return lastSettle;
+}
 
-	
-	camera_still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
-	
-	// Enable the camera, and tell it its control callback function
-	status = mmal_port_enable(camera->control, camera_control_callback);
-	
-	if (status)
+/**
+ * Sample the VideoCore STC and the host clocks back to back so pts values
+ * can be mapped onto CLOCK_MONOTONIC and CLOCK_REALTIME. Done per capture,
+ * the clocks drift apart over hours.
+ *
+ * @return false if the firmware wouldn't report MMAL_PARAMETER_SYSTEM_TIME
+ */
+bool ofxRaspicam::sample_clocks()
+{
+	struct timespec before, after, realtime;
+	uint64_t stc = 0;
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	MMAL_STATUS_T status = mmal_port_parameter_get_uint64(camera->control, MMAL_PARAMETER_SYSTEM_TIME, &stc);
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	if (status != MMAL_SUCCESS)
 	{
-		ofLogVerbose() << "Enable control port FAIL: error" <<  status;
+		TRACE_WARNING("Could not read the camera system time, error: %d", status);
+		callback_data.clock_valid = 0;
+		return false;
 	}
-	else 
+	int64_t beforeMicros = (int64_t)before.tv_sec * 1000000 + before.tv_nsec / 1000;
+	int64_t afterMicros = (int64_t)after.tv_sec * 1000000 + after.tv_nsec / 1000;
+	int64_t realtimeMicros = (int64_t)realtime.tv_sec * 1000000 + realtime.tv_nsec / 1000;
+	// The STC was read somewhere between the two monotonic samples
+	callback_data.stc_to_monotonic = (beforeMicros + afterMicros) / 2 - (int64_t)stc;
+	callback_data.monotonic_to_realtime = realtimeMicros - afterMicros;
+	callback_data.clock_valid = 1;
+	return true;
+}
+
+/**
+ * Decode the capture for focus scoring and statistics while it is still a
+ * .tmp file, so a blurred one can be thrown away with it. libjpeg scales in
+ * the IDCT, so the decode is only as large as focusNode.scorer.downscale needs;
+ * lastImage takes it afterwards if that is full size.
+ *
+ * @param decoded Receives the decode
+ * @return The pixels, NULL if the file couldn't be decoded
+ */
+const ofPixels* ofxRaspicam::capture_pixels(ofPixels& decoded)
+{
+	TIMELINE_SCOPE("decodeForAnalysis");
+	// The callback's writes are still in the FILE buffer
+	fflush(output_file);
+	int factor = max(focusNode.scorer.downscale, 1);
+	if (!analysisDecoder.decode(atomicFileTempPath(currentFileName), decoded, (photo.width + factor - 1) / factor, (photo.height + factor - 1) / factor))
 	{
-		ofLogVerbose() << "Enable control port : PASS " <<  status;
+		ofLogWarning() << "Could not decode " << currentFileName << " for analysis";
+		return NULL;
+	}
+	return &decoded;
+}
+
+/**
+ * Hash the capture while it is still a .tmp file and let dedup decide
+ * whether it is kept. A 9x8 dHash only needs a 1/8 scale libjpeg decode,
+ * DC coefficients and no IDCT, a fraction of a full decode.
+ *
+ * @param hashed Set if the capture was hashed, for dedup.remember() once it is kept
+ * @return false if the capture is a near duplicate to discard
+ */
+bool ofxRaspicam::dedup_capture(bool& hashed)
+{
+	TIMELINE_SCOPE("dedupCapture");
+	// The callback's writes are still in the FILE buffer
+	fflush(output_file);
+	PooledPixels decoded;
+	hashed = dedupDecoder.decode(atomicFileTempPath(currentFileName), decoded.pixels, DHASH_COLUMNS, DHASH_ROWS);
+	if (!hashed)
+	{
+		ofLogWarning() << "Could not decode " << currentFileName << " to hash it, keeping it";
+		return true;
+	}
+	lastCapture.perceptualHash = dedup.hash(decoded.pixels);
+	lastCapture.duplicate = !dedup.check(lastCapture.perceptualHash);
+	if (lastCapture.duplicate)
+	{
+		TRACE_VERBOSE("Dropped near duplicate capture %d, %d bits from a kept photo", (int)lastCapture.sequence, dedup.lastDistance);
+	}
+	return !lastCapture.duplicate;
+}
+
+/**
+ * Measure what the sensor sees right now from one raw video frame, into
+ * statisticsNode.statistics.last and the camera_frame_* gauges. Nothing is encoded or written.
+ *
+ * @return false if no frame arrived
+ */
+bool ofxRaspicam::measureExposure()
+{
+	TIMELINE_SCOPE("measureExposure");
+	bool wasStreaming = (raw_pool != NULL);
+	if (!startRawFrames())
+	{
+		return false;
+	}
+	MMAL_BUFFER_HEADER_T *frame = grabRawFrame();
+	if (frame)
+	{
+		if (frame->length >= (uint32_t)(rawStride * rawHeight))
+		{
+			mmal_buffer_header_mem_lock(frame);
+			statisticsNode.processLuma(frame->data + frame->offset, rawWidth, rawHeight, rawStride);
+			mmal_buffer_header_mem_unlock(frame);
+		}
+		releaseRawFrame(frame);
+	}
+	if (!wasStreaming)
+	{
+		stopRawFrames();
+	}
+	return frame != NULL;
+}
+
+CameraFrameSettings ofxRaspicam::getFrameSettings()
+{
+	ofScopedLock lock(control_callback_data.mutex);
+	return control_callback_data.settings;
+}
+
+bool ofxRaspicam::prepareCapture()
+{
+	TIMELINE_SCOPE("prepareCapture");
+	
+	lastCapture = CaptureInfo();
+	lastCapture.success = false;
+	lastCapture.bytes = 0;
+	lastCapture.triggerMicros = 0;
+	lastCapture.completeMicros = 0;
+	lastCapture.closedMicros = 0;
+	lastCapture.crc32c = 0;
+	lastCapture.captureTimeMicros = 0;
+	lastCapture.quality = photo.quality;
+	lastCapture.sequence = 0;
+	lastCapture.ptsMicros = MMAL_TIME_UNKNOWN;
+	lastCapture.monotonicMicros = 0;
+	lastCapture.timestampFromPts = false;
+	lastCapture.settleMillis = 0;
+	lastCapture.focusScore = -1;
+	lastCapture.blurred = false;
+	lastCapture.perceptualHash = 0;
+	lastCapture.duplicate = false;
+	memset(&lastCapture.settings, 0, sizeof(lastCapture.settings));
+	captureTriggered = false;
+	
+	if (!ready)
+	{
+		TRACE_ERROR("prepareCapture called before the camera is ready");
+		return false;
+	}
+	
+	// Open the file
+	currentFileName = nextPhotoPath();
+	photo.filename = const_cast<char*> ( currentFileName.c_str() );
+	ofLogVerbose() << "Opening output file" << currentFileName;
+	
+	// Written to <path>.tmp and renamed once complete, so a power cut never leaves a truncated JPEG
+	output_file = storage ? storage->open(currentFileName) : atomicFileOpen(currentFileName);
+	
+	if (!output_file)
+	{
+		// Notify user, carry on but discarding encoded output buffers
+		TRACE_ERROR("Error opening output file");
+		metrics.captureFailures->increment();
+		return false;
+	}
+	__sync_lock_test_and_set(&capturing, 1);
+	lastCapture.sequence = ++frameSequence;
+	sample_clocks();
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	char uniqueId[33];
+	snprintf(uniqueId, sizeof(uniqueId), "%08x%08x%016llx", cameraNum, (unsigned int)lastCapture.sequence, (unsigned long long)now.tv_sec * 1000000ULL + now.tv_usec);
+	photo.add_exif_tags(now, uniqueId);
+	
+	callback_data.file_handle = output_file;
+	callback_data.frame_bytes = 0;
+	callback_data.frame_crc = 0;
+	callback_data.frame_failed = 0;
+	callback_data.frame_pts = MMAL_TIME_UNKNOWN;
+	callback_data.exif_restamped = 0;
+	callback_data.publisher = publisher;
+	if (publisher)
+	{
+		publisher->begin();
+	}
+	
+	// Send all the buffers to the encoder output port
+	int num = mmal_queue_length(photo.encoder_pool->queue);
+	int q;
+	
+	TimelineScope submitScope("submit_encoder_buffers");
+	submitScope.arg = num;
+	for (q=0;q<num;q++)
+	{
+		MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(photo.encoder_pool->queue);
+		
+		if (!buffer)
+		{
+			TRACE_ERROR("Unable to get a required buffer %d from pool queue", q);
+			metrics.poolStarvation->increment();
+			continue;
+		}
+		
+		if (mmal_port_send_buffer(encoder_output_port, buffer)!= MMAL_SUCCESS)
+		{
+			TRACE_ERROR("Unable to send a buffer to encoder output port %d", q);
+		}
+	}
+	lastCapture.path = currentFileName;
+	return true;
+}
+
+bool ofxRaspicam::triggerCapture()
+{
+	if (!output_file)
+	{
+		return false;
+	}
+	
+	TRACE_VERBOSE("Starting capture");
+	
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	lastCapture.captureTimeMicros = (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
+	lastCapture.triggerMicros = ofGetElapsedTimeMicros();
+	
+	if (mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Failed to start capture");
+		metrics.captureFailures->increment();
+		return false;
+	}
+	captureTriggered = true;
+	return true;
+}
+
+/**
+ * Wait for the triggered frame, close its file and record it
+ *
+ * @param groupId Shared id for frames from one synchronized trigger, 0 if none
+ * @return true if a complete frame was written
+ */
+bool ofxRaspicam::finishCapture(uint64_t groupId)
+{
+	if (!output_file)
+	{
+		return false;
+	}
+	
+	if (captureTriggered)
+	{
+		// Wait for capture to complete
+		// For some reason using vcos_semaphore_wait_timeout sometimes returns immediately with bad parameter error
+		// even though it appears to be all correct, so reverting to untimed one until figure out why its erratic
+		{
+			TIMELINE_SCOPE("wait_capture_complete");
+			vcos_semaphore_wait(&callback_data.complete_semaphore);
+		}
+		lastCapture.completeMicros = ofGetElapsedTimeMicros();
+		
+		// The semaphore orders us after the callback's writes to frame_bytes
+		lastCapture.bytes = callback_data.frame_bytes;
+		lastCapture.success = !callback_data.frame_failed;
+		lastCapture.settings = getFrameSettings();
+		lastCapture.ptsMicros = callback_data.frame_pts;
+		if (callback_data.clock_valid && callback_data.frame_pts != MMAL_TIME_UNKNOWN)
+		{
+			// Start of the frame on the host clocks rather than when we asked for it
+			lastCapture.monotonicMicros = callback_data.frame_pts + callback_data.stc_to_monotonic;
+			lastCapture.captureTimeMicros = lastCapture.monotonicMicros + callback_data.monotonic_to_realtime;
+			lastCapture.timestampFromPts = true;
+		}
+		metrics.captures->increment();
+		metrics.captureLatency->observe((lastCapture.completeMicros - lastCapture.triggerMicros) / 1000.0);
+		metrics.frameBytes->observe(lastCapture.bytes);
+	}
+	
+	// Ensure we don't die if get callback with no open file
+	callback_data.file_handle = NULL;
+	callback_data.publisher = NULL;
+	
+	lastCapture.crc32c = callback_data.frame_crc;
+	
+	// A near duplicate goes with its .tmp file, so it never appears in photos/
+	bool hashed = false;
+	bool duplicate = false;
+	if (dedup.policy != DEDUP_OFF && captureTriggered && lastCapture.success)
+	{
+		duplicate = !dedup_capture(hashed);
+	}
+	
+	// Scored before the commit too, so a blurred shot that is thrown away never reaches photos/ or the quota
+	PooledPixels decoded;
+	bool scoring = scoreFocus || minFocusScore > 0;
+	bool discardBlurred = false;
+	if ((scoring || measureStatistics) && captureTriggered && lastCapture.success && !duplicate)
+	{
+		const ofPixels* pixels = capture_pixels(decoded.pixels);
+		if (pixels && measureStatistics)
+		{
+			statisticsNode.processStill(*pixels);
+		}
+		if (scoring)
+		{
+			lastCapture.focusScore = pixels ? focusNode.processStill(*pixels, (photo.width + pixels->getWidth() / 2) / pixels->getWidth()) : -1;
+			lastCapture.blurred = minFocusScore > 0 && lastCapture.focusScore >= 0 && lastCapture.focusScore < minFocusScore;
+			if (lastCapture.focusScore >= 0)
+			{
+				metrics.focusScore->observe(lastCapture.focusScore);
+			}
+		}
+		if (lastCapture.blurred)
+		{
+			metrics.blurredFrames->increment();
+			discardBlurred = blurPolicy == BLUR_DISCARD || (blurPolicy == BLUR_RETAKE && blurRetakesLeft > 0);
+			if (discardBlurred)
+			{
+				TRACE_WARNING("Discarding blurred capture, focus %d below %d", (int)lastCapture.focusScore, (int)minFocusScore);
+			}
+		}
+	}
+	
+	// An untriggered, failed, duplicate or discarded blurred frame is thrown away rather than left in photos/
+	unsigned long long commitStartMicros = ofGetElapsedTimeMicros();
+	bool keep = captureTriggered && lastCapture.success && !duplicate && !discardBlurred;
+	if (storage)
+	{
+		keep = storage->close(output_file, currentFileName, callback_data.frame_bytes, keep);
+	}else if (keep)
+	{
+		keep = atomicFileCommit(output_file, currentFileName, callback_data.frame_bytes);
+	}else
+	{
+		atomicFileDiscard(output_file, currentFileName);
+	}
+	output_file = NULL;
+	__sync_lock_release(&capturing);
+	lastCapture.success = keep;
+	if (publisher && !keep)
+	{
+		publisher->abort();
+	}
+	if (keep)
+	{
+		metrics.commitLatency->observe((ofGetElapsedTimeMicros() - commitStartMicros) / 1000.0);
+	}
+	lastCapture.closedMicros = ofGetElapsedTimeMicros();
+	
+	if (!lastCapture.success)
+	{
+		return false;
+	}
+	
+	SensorModeLatency& latency = modeLatency[currentMode.index];
+	if (!latency.histogram)
+	{
+		static const double latencyBoundsMs[] = {50, 100, 250, 500, 750, 1000, 1500, 2500, 5000, 10000};
+		latency.histogram = MetricsRegistry::getInstance().addHistogram("camera_mode_capture_latency_ms", "Time from capture trigger to the file being closed, per sensor mode",
+																		latencyBoundsMs, sizeof(latencyBoundsMs)/sizeof(double),
+																		metricsLabels() + ",mode=\"" + ofToString(currentMode.index) + "\"");
+	}
+	latency.add((lastCapture.closedMicros - lastCapture.triggerMicros) / 1000.0);
+	
+	ofLogVerbose() << "Finished capture " << currentFileName;
+	
+	if (qualityController)
+	{
+		int nextQuality = qualityController->update(lastCapture.bytes, lastCapture.quality, lastCapture.triggerMicros);
+		if (nextQuality != photo.quality)
+		{
+			setQuality(nextQuality);
+		}
+	}
+	
+	// Only now is the photo known to be kept, so consumers, lastImage and dedup never see a discarded one
+	if (hashed)
+	{
+		dedup.remember(lastCapture.perceptualHash);
+	}
+	if (publisher)
+	{
+		FRAME_RING_SLOT info;
+		memset(&info, 0, sizeof(info));
+		info.frameSequence = lastCapture.sequence;
+		info.ptsMicros = lastCapture.ptsMicros;
+		info.monotonicMicros = lastCapture.monotonicMicros;
+		info.realtimeMicros = lastCapture.captureTimeMicros;
+		info.fourcc = FRAME_RING_JPEG;
+		info.width = photo.width;
+		info.height = photo.height;
+		info.cameraNum = cameraNum;
+		publisher->commit(info);
+	}
+	
+	if (loadLastImage)
+	{
+		TIMELINE_SCOPE("loadImage");
+		// Both decodes reuse pool buffers, lastImage's goes back when it takes the next one
+		ofScopedLock lock(lastImageMutex);
+		if (decoded.pixels.getWidth() == photo.width && decoded.pixels.getHeight() == photo.height)
+		{
+			PixelPool::getInstance().transfer(decoded.pixels, lastImage.getPixelsRef());
+			lastImage.update();
+			lastImageChanged = true;
+		}else if (PixelPool::getInstance().loadImage(lastImage, currentFileName))
+		{
+			lastImageChanged = true;
+		}
+	}
+	
+	if (catalog)
+	{
+		CatalogEntry entry;
+		entry.path = lastCapture.path;
+		entry.cameraNum = cameraNum;
+		entry.captureTimeMicros = lastCapture.captureTimeMicros;
+		entry.bytes = lastCapture.bytes;
+		entry.groupId = groupId;
+		entry.crc32c = lastCapture.crc32c;
+		entry.focusScore = lastCapture.focusScore;
+		entry.perceptualHash = lastCapture.perceptualHash;
+		catalog->add(entry);
+	}
+	
+	if (metadataLog)
+	{
+		FRAME_METADATA_RECORD record;
+		memset(&record, 0, sizeof(record));
+		record.sequence = lastCapture.sequence;
+		record.ptsMicros = lastCapture.ptsMicros;
+		record.monotonicMicros = lastCapture.monotonicMicros;
+		record.realtimeMicros = lastCapture.captureTimeMicros;
+		record.exposureMicros = lastCapture.settings.exposureMicros;
+		record.analogGain = lastCapture.settings.analogGain;
+		record.digitalGain = lastCapture.settings.digitalGain;
+		record.awbRedGain = lastCapture.settings.awbRedGain;
+		record.awbBlueGain = lastCapture.settings.awbBlueGain;
+		record.bytes = lastCapture.bytes;
+		record.crc32c = lastCapture.crc32c;
+		record.cameraNum = cameraNum;
+		record.sensorMode = currentMode.index;
+		record.quality = lastCapture.quality;
+		record.flags = (lastCapture.timestampFromPts ? FRAME_METADATA_PTS_VALID : 0) | (lastCapture.settings.updates ? FRAME_METADATA_SETTINGS_VALID : 0);
+		strncpy(record.fileName, ofFilePath::getFileName(lastCapture.path, false).c_str(), sizeof(record.fileName) - 1);
+		metadataLog->append(record);
+	}
+	publish_last_capture();
+	return true;
+}
+
+void ofxRaspicam::publish_last_capture()
+{
+	ofScopedLock lock(lastCaptureMutex);
+	keptCapture = lastCapture;
+}
+
+/**
+ * The last capture that was kept, copied under a lock so the thread taking
+ * the next one can't change it halfway through
+ *
+ * @return Its path, timestamps and scores; an empty path before the first one
+ */
+CaptureInfo ofxRaspicam::getLastCapture()
+{
+	ofScopedLock lock(lastCaptureMutex);
+	return keptCapture;
+}
+
+/**
+ * Upload lastImage to lastTexture if a capture has changed it since. Call on
+ * the GL thread, e.g. from ofApp::update(). Never waits: while a capture is
+ * decoding into lastImage it returns and the next frame tries again.
+ *
+ * @return true if lastTexture was updated
+ */
+bool ofxRaspicam::updateLastTexture()
+{
+	if (!lastImageMutex.tryLock())
+	{
+		return false;
+	}
+	bool changed = lastImageChanged;
+	lastImageChanged = false;
+	const ofPixels& pixels = lastImage.getPixelsRef();
+	if (changed)
+	{
+		GLint maxTextureSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+		// A full size capture is over the VC4's 2048 texture limit
+		changed = pixels.getWidth() <= maxTextureSize && pixels.getHeight() <= maxTextureSize;
+	}
+	if (changed)
+	{
+		TIMELINE_SCOPE("uploadLastImage");
+		if (!lastTexture.isAllocated() || lastTexture.getWidth() != pixels.getWidth() || lastTexture.getHeight() != pixels.getHeight())
+		{
+			lastTexture.allocate(pixels.getWidth(), pixels.getHeight(), GL_RGB);
+		}
+		lastTexture.loadData(pixels);
+	}
+	lastImageMutex.unlock();
+	return changed;
+}
+
+
+/**
+ * Start streaming I420 frames from the video port at rawWidth x rawHeight.
+ * The port is configured here rather than at setup so the still path pays nothing for it.
+ *
+ * @param numBuffers Frames in flight; grabRawFrame() holds one of them
+ * @return true if frames are flowing
+ */
+bool ofxRaspicam::startRawFrames(int numBuffers)
+{
+	TIMELINE_SCOPE("startRawFrames");
+	
+	if (raw_pool)
+	{
+		return true;
+	}
+	if (!ready || !camera)
+	{
+		TRACE_ERROR("startRawFrames called before the camera is ready");
+		return false;
+	}
+	
+	camera_video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
+	
+	MMAL_ES_FORMAT_T *format = camera_video_port->format;
+	format->encoding = MMAL_ENCODING_I420;
+	format->encoding_variant = MMAL_ENCODING_I420;
+	format->es->video.width = VCOS_ALIGN_UP(rawWidth, 32);
+	format->es->video.height = VCOS_ALIGN_UP(rawHeight, 16);
+	format->es->video.crop.x = 0;
+	format->es->video.crop.y = 0;
+	format->es->video.crop.width = rawWidth;
+	format->es->video.crop.height = rawHeight;
+	format->es->video.frame_rate.num = RAW_FRAME_RATE_NUM;
+	format->es->video.frame_rate.den = RAW_FRAME_RATE_DEN;
+	if (currentMode.index && (float)RAW_FRAME_RATE_NUM / RAW_FRAME_RATE_DEN < currentMode.minFps)
+	{
+		// The high speed modes can't run as slowly as the stacking default
+		format->es->video.frame_rate.num = (int)(currentMode.minFps * 256 + 0.5f);
+		format->es->video.frame_rate.den = 256;
+	}
+	
+	MMAL_STATUS_T status = mmal_port_format_commit(camera_video_port);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("camera video format couldn't be set, error: %d", status);
+		return false;
+	}
+	
+	rawStride = format->es->video.width;
+	rawAlignedHeight = format->es->video.height;
+	
+	camera_video_port->buffer_num = max((uint32_t)numBuffers, camera_video_port->buffer_num_min);
+	camera_video_port->buffer_size = max(camera_video_port->buffer_size_recommended, camera_video_port->buffer_size_min);
+	
+	raw_pool = mmal_port_pool_create(camera_video_port, camera_video_port->buffer_num, camera_video_port->buffer_size);
+	if (!raw_pool)
+	{
+		TRACE_ERROR("Failed to create buffer header pool for camera video port");
+		return false;
+	}
+	raw_frames = mmal_queue_create();
+	// Buffers go back to the port as soon as their last reference is released, wherever that happens
+	mmal_pool_callback_set(raw_pool, raw_pool_callback, camera_video_port);
+	
+	raw_callback_data.frames = raw_frames;
+	raw_callback_data.pool = raw_pool;
+	raw_callback_data.metrics = &metrics;
+	raw_callback_data.format.fourcc = FRAME_RING_I420;
+	raw_callback_data.format.width = rawWidth;
+	raw_callback_data.format.height = rawHeight;
+	raw_callback_data.format.stride = rawStride;
+	raw_callback_data.format.alignedHeight = rawAlignedHeight;
+	raw_callback_data.format.cameraNum = cameraNum;
+	raw_callback_data.format.sequence = 0;
+	raw_callback_data.format.ptsMicros = MMAL_TIME_UNKNOWN;
+	raw_callback_data.format.monotonicMicros = 0;
+	raw_callback_data.format.realtimeMicros = 0;
+	raw_callback_data.graph = graphStreaming ? frameGraph : NULL;
+	camera_video_port->userdata = (struct MMAL_PORT_USERDATA_T *)&raw_callback_data;
+	
+	status = mmal_port_enable(camera_video_port, raw_buffer_callback);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Enable camera video port FAIL, error: %d", status);
+		stopRawFrames();
+		return false;
+	}
+	
+	MMAL_BUFFER_HEADER_T *buffer;
+	while ((buffer = mmal_queue_get(raw_pool->queue)) != NULL)
+	{
+		if (mmal_port_send_buffer(camera_video_port, buffer) != MMAL_SUCCESS)
+		{
+			TRACE_ERROR("Unable to send a buffer to camera video port");
+		}
+	}
+	
+	if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Failed to start raw frames");
+		stopRawFrames();
+		return false;
+	}
+	
+	if (publisher || raw_callback_data.graph)
+	{
+		// Maps raw pts onto the host clocks for the ring and the graph
+		sample_clocks();
+	}
+	TRACE_VERBOSE("Raw frames started %dx%d stride %d", rawWidth, rawHeight, rawStride);
+	return true;
+}
+
+/**
+ * Take the newest frame from the video port. Frames that queued up behind it
+ * are handed straight back so a slow consumer never works on stale images.
+ *
+ * @param timeoutMillis How long to wait for a frame
+ * @return Buffer header now owned by the caller, NULL on timeout. Pass it to releaseRawFrame()
+ */
+MMAL_BUFFER_HEADER_T* ofxRaspicam::grabRawFrame(int timeoutMillis)
+{
+	if (!raw_frames)
+	{
+		return NULL;
+	}
+	
+	MMAL_BUFFER_HEADER_T *frame = mmal_queue_timedwait(raw_frames, timeoutMillis);
+	if (!frame)
+	{
+		TRACE_WARNING("No raw frame within %d ms", timeoutMillis);
+		return NULL;
+	}
+	
+	MMAL_BUFFER_HEADER_T *newer;
+	while ((newer = mmal_queue_get(raw_frames)) != NULL)
+	{
+		releaseRawFrame(frame);
+		frame = newer;
+	}
+	publish_raw_frame(frame);
+	return frame;
+}
+
+/**
+ * Copy a grabbed I420 frame into the shared memory ring, if there is one.
+ * Only frames the app actually takes are published, so the ring runs at
+ * the consumer's pace rather than the port's.
+ *
+ * @param frame Buffer from the video port
+ */
+void ofxRaspicam::publish_raw_frame(MMAL_BUFFER_HEADER_T* frame)
+{
+	if (!publisher || !frame->length)
+	{
+		return;
+	}
+	TIMELINE_SCOPE("publish_raw_frame");
+	
+	FRAME_RING_SLOT info;
+	memset(&info, 0, sizeof(info));
+	info.frameSequence = ++rawFrameSequence;
+	info.ptsMicros = frame->pts;
+	if (callback_data.clock_valid && frame->pts != MMAL_TIME_UNKNOWN)
+	{
+		info.monotonicMicros = frame->pts + callback_data.stc_to_monotonic;
+		info.realtimeMicros = info.monotonicMicros + callback_data.monotonic_to_realtime;
+	}
+	info.fourcc = FRAME_RING_I420;
+	info.width = rawWidth;
+	info.height = rawHeight;
+	info.stride = rawStride;
+	info.alignedHeight = rawAlignedHeight;
+	info.cameraNum = cameraNum;
+	
+	mmal_buffer_header_mem_lock(frame);
+	publisher->publish(frame->data + frame->offset, frame->length, info);
+	mmal_buffer_header_mem_unlock(frame);
+}
+
+void ofxRaspicam::releaseRawFrame(MMAL_BUFFER_HEADER_T* frame)
+{
+	if (!frame)
+	{
+		return;
+	}
+	// Back to the port through raw_pool_callback, unless a graph node still holds it
+	mmal_buffer_header_release(frame);
+}
+
+/**
+ * Stream raw frames to every node of frameGraph until stopFrameGraph().
+ * The port gets enough buffers for every lease the nodes can hold at once
+ * on top of its own, so a busy node drops frames from its queue rather
+ * than starving the camera. Stills, stacking and grabRawFrame() carry on
+ * as usual alongside.
+ *
+ * @return true if frames are flowing to the graph
+ */
+bool ofxRaspicam::startFrameGraph()
+{
+	if (!frameGraph || frameGraph->empty())
+	{
+		return false;
+	}
+	if (graphStreaming)
+	{
+		return true;
+	}
+	// Restarted with more buffers if something was already streaming
+	stopRawFrames();
+	frameGraph->start();
+	graphStreaming = true;
+	if (!startRawFrames(RAW_BUFFERS_NUM + frameGraph->maxLeasedBuffers()))
+	{
+		graphStreaming = false;
+		frameGraph->stop();
+		return false;
+	}
+	TRACE_NOTICE("Frame graph streaming %dx%d", rawWidth, rawHeight);
+	return true;
+}
+
+void ofxRaspicam::stopFrameGraph()
+{
+	if (!graphStreaming)
+	{
+		return;
+	}
+	graphStreaming = false;
+	stopRawFrames();
+	frameGraph->stop();
+}
+
+void ofxRaspicam::stopRawFrames()
+{
+	if (!raw_pool)
+	{
+		return;
+	}
+	TIMELINE_SCOPE("stopRawFrames");
+	
+	mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 0);
+	if (camera_video_port->is_enabled)
+	{
+		mmal_port_disable(camera_video_port);
+	}
+	
+	// Disabling returns every buffer still owned by the port through the callback
+	if (raw_callback_data.graph)
+	{
+		// The pool can't go while nodes hold leases on its buffers
+		raw_callback_data.graph->drain();
+		raw_callback_data.graph = NULL;
+	}
+	MMAL_BUFFER_HEADER_T *frame;
+	while ((frame = mmal_queue_get(raw_frames)) != NULL)
+	{
+		mmal_buffer_header_release(frame);
+	}
+	mmal_queue_destroy(raw_frames);
+	mmal_port_pool_destroy(camera_video_port, raw_pool);
+	raw_frames = NULL;
+	raw_pool = NULL;
+	raw_callback_data.frames = NULL;
+	raw_callback_data.pool = NULL;
+}
+
+/**
+ * Capture numFrames raw frames, align and merge them with the stacker and
+ * encode the result to nextPhotoPath("-stack")
+ *
+ * @param numFrames Frames to merge, noise drops roughly with the square root
+ * @param mode STACK_MEAN, or STACK_MEDIAN when things move through the scene
+ * @return true if the merged JPEG was written
+ */
+bool ofxRaspicam::takeStackedPhoto(int numFrames, FrameStacker::Mode mode)
+{
+	TIMELINE_SCOPE("takeStackedPhoto");
+	
+	waitUntilReady();
+	lastCapture = CaptureInfo();
+	lastCapture.success = false;
+	lastCapture.bytes = 0;
+	lastCapture.completeMicros = 0;
+	lastCapture.closedMicros = 0;
+	lastCapture.crc32c = 0;
+	lastCapture.quality = photo.quality;
+	lastCapture.focusScore = -1;
+	lastCapture.blurred = false;
+	
+	bool wasStreaming = (raw_pool != NULL);
+	if (!startRawFrames())
+	{
+		metrics.captureFailures->increment();
+		return false;
+	}
+	
+	settle();
+	lastCapture.settleMillis = lastSettle.millis;
+	
+	if (stacker.width != rawWidth || stacker.height != rawHeight || stacker.stride != rawStride)
+	{
+		stacker.setup(rawWidth, rawHeight, rawStride, rawAlignedHeight);
+	}
+	stacker.begin(mode);
+	
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	lastCapture.captureTimeMicros = (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
+	lastCapture.triggerMicros = ofGetElapsedTimeMicros();
+	
+	for (int i=0; i<numFrames; i++)
+	{
+		MMAL_BUFFER_HEADER_T *frame = grabRawFrame();
+		if (!frame)
+		{
+			break;
+		}
+		if (frame->length >= stacker.frameSize())
+		{
+			mmal_buffer_header_mem_lock(frame);
+			stacker.add(frame->data + frame->offset);
+			mmal_buffer_header_mem_unlock(frame);
+		}
+		releaseRawFrame(frame);
+	}
+	if (!wasStreaming)
+	{
+		stopRawFrames();
+	}
+	
+	TRACE_NOTICE("Stacked %d frames, %d rejected", stacker.numFrames, stacker.rejectedFrames);
+	
+	const unsigned char* merged = stacker.finish();
+	if (!merged)
+	{
+		metrics.captureFailures->increment();
+		return false;
+	}
+	
+	if (stackEncoder.width != rawWidth || stackEncoder.height != rawHeight)
+	{
+		if (!stackEncoder.setup(rawWidth, rawHeight, photo.quality))
+		{
+			metrics.captureFailures->increment();
+			return false;
+		}
+	}
+	
+	currentFileName = nextPhotoPath("-stack");
+	lastCapture.path = currentFileName;
+	__sync_lock_test_and_set(&capturing, 1);
+	lastCapture.success = stackEncoder.encode(merged, currentFileName);
+	__sync_lock_release(&capturing);
+	lastCapture.completeMicros = ofGetElapsedTimeMicros();
+	lastCapture.bytes = stackEncoder.lastBytes;
+	lastCapture.crc32c = stackEncoder.lastCrc;
+	
+	if (!lastCapture.success)
+	{
+		metrics.captureFailures->increment();
+		return false;
+	}
+	if (storage)
+	{
+		storage->add(currentFileName, lastCapture.bytes);
+	}
+	metrics.captures->increment();
+	metrics.captureLatency->observe((lastCapture.completeMicros - lastCapture.triggerMicros) / 1000.0);
+	metrics.frameBytes->observe(lastCapture.bytes);
+	
+	if (scoreFocus || minFocusScore > 0)
+	{
+		// The merged luma is at hand, no decode needed; alignment already rejected shaken frames
+		lastCapture.focusScore = focusNode.processLuma(merged, rawWidth, rawHeight, rawStride);
+		lastCapture.blurred = minFocusScore > 0 && lastCapture.focusScore >= 0 && lastCapture.focusScore < minFocusScore;
+		metrics.focusScore->observe(lastCapture.focusScore);
+	}
+	if (measureStatistics)
+	{
+		statisticsNode.processLuma(merged, rawWidth, rawHeight, rawStride);
 	}
 	
-	//raspicamcontrol_set_all_parameters(camera, &photo.camera_parameters);
-	
-	// Now set up the port formats
-	
-	
+	if (catalog)
+	{
+		CatalogEntry entry;
+		entry.path = lastCapture.path;
+		entry.cameraNum = cameraNum;
+		entry.captureTimeMicros = lastCapture.captureTimeMicros;
+		entry.bytes = lastCapture.bytes;
+		entry.groupId = 0;
+		entry.crc32c = lastCapture.crc32c;
+		entry.focusScore = lastCapture.focusScore;
+		catalog->add(entry);
+	}
 	
-	format = camera_still_port->format;
+	if (loadLastImage)
+	{
+		TIMELINE_SCOPE("loadImage");
+		ofScopedLock lock(lastImageMutex);
+		if (PixelPool::getInstance().loadImage(lastImage, currentFileName))
+		{
+			lastImageChanged = true;
+		}
+	}
+	publish_last_capture();
+	return true;
+}
+
+
+/**
+ * Apply photo.width/height and the frame rate to the stills port
+ *
+ * @return Result of the format commit
+ */
+MMAL_STATUS_T ofxRaspicam::commit_still_format()
+{
+	MMAL_ES_FORMAT_T *format = camera_still_port->format;
 	
 	// Set our stills format on the stills (for encoder) port
 	format->encoding = MMAL_ENCODING_OPAQUE;
@@ -314,14 +1726,381 @@ void ofxRaspicam::create_camera_component()
 	format->es->video.crop.y = 0;
 	format->es->video.crop.width = photo.width;
 	format->es->video.crop.height = photo.height;
-	format->es->video.frame_rate.num = STILLS_FRAME_RATE_NUM;
-	format->es->video.frame_rate.den = STILLS_FRAME_RATE_DEN;
+	format->es->video.frame_rate.num = photo.frameRateNum;
+	format->es->video.frame_rate.den = photo.frameRateDen;
 	
-	status = mmal_port_format_commit(camera_still_port);
+	return mmal_port_format_commit(camera_still_port);
+}
+
+/**
+ * Switch output resolution and frame rate, picking the sensor readout mode
+ * with chooseSensorMode(). An active region of interest keeps its place and
+ * the output shrinks with it.
+ *
+ * @param width Still width for the full field of view
+ * @param height Still height for the full field of view
+ * @param fps Frame rate, also caps the exposure time; <= 0 keeps the current rate
+ * @return true if the camera is capturing in the new mode
+ */
+bool ofxRaspicam::setSensorMode(int width, int height, float fps)
+{
+	TIMELINE_SCOPE("setSensorMode");
+	
+	waitUntilReady();
+	if (!ready)
+	{
+		TRACE_ERROR("setSensorMode called before the camera is ready");
+		return false;
+	}
+	
+	if (fps <= 0)
+	{
+		fps = (float)photo.frameRateNum / photo.frameRateDen;
+	}
+	fullFrameWidth = width;
+	fullFrameHeight = height;
+	return reconfigure_pipeline(chooseSensorMode(width, height, fps), fps);
+}
+
+/**
+ * Capture only part of the field of view. The crop is done by the ISP
+ * (MMAL_PARAMETER_INPUT_CROP) and the still size shrinks by the same factor,
+ * so the encoder sees, and the file holds, just the region at full detail.
+ *
+ * @param region Normalized rectangle, (0, 0, 1, 1) is the whole frame
+ * @return true if the camera is capturing the region
+ */
+bool ofxRaspicam::setRegionOfInterest(ofRectangle region)
+{
+	TIMELINE_SCOPE("setRegionOfInterest");
+	
+	waitUntilReady();
+	if (!ready)
+	{
+		TRACE_ERROR("setRegionOfInterest called before the camera is ready");
+		return false;
+	}
+	
+	region.x = ofClamp(region.x, 0, 1);
+	region.y = ofClamp(region.y, 0, 1);
+	region.width = ofClamp(region.width, 0.01f, 1 - region.x);
+	region.height = ofClamp(region.height, 0.01f, 1 - region.y);
+	regionOfInterest = region;
+	
+	// The ISP takes the crop in 16.16 fixed point fractions of the sensor
+	MMAL_PARAMETER_INPUT_CROP_T crop = {{MMAL_PARAMETER_INPUT_CROP, sizeof(crop)}};
+	crop.rect.x = (int32_t)(region.x * 65536);
+	crop.rect.y = (int32_t)(region.y * 65536);
+	crop.rect.width = (int32_t)(region.width * 65536);
+	crop.rect.height = (int32_t)(region.height * 65536);
+	
+	MMAL_STATUS_T status = mmal_port_parameter_set(camera->control, &crop.hdr);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Could not set input crop, error: %d", status);
+		return false;
+	}
+	
+	return reconfigure_pipeline(currentMode, (float)photo.frameRateNum / photo.frameRateDen);
+}
+
+ofRectangle ofxRaspicam::getRegionOfInterest()
+{
+	return regionOfInterest;
+}
+
+/**
+ * Grab one raw frame and encode several normalized regions of it
+ *
+ * @param regions Normalized rectangles within the raw frame
+ * @return Number of region files written
+ */
+int ofxRaspicam::takeRegionPhotos(const vector<ofRectangle>& regions)
+{
+	TIMELINE_SCOPE("takeRegionPhotos");
+	
+	waitUntilReady();
+	bool wasStreaming = (raw_pool != NULL);
+	if (regions.empty() || !startRawFrames())
+	{
+		return 0;
+	}
+	
+	settle();
+	
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	uint64_t captureTimeMicros = (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
+	unsigned long long triggerMicros = ofGetElapsedTimeMicros();
+	
+	vector<string> paths;
+	for (size_t r=0; r<regions.size(); r++)
+	{
+		paths.push_back(nextPhotoPath("-roi" + ofToString(r)));
+	}
+	
+	int written = 0;
+	regionCropper.lastBytes.assign(regions.size(), 0);
+	regionCropper.lastCrcs.assign(regions.size(), 0);
+	MMAL_BUFFER_HEADER_T *frame = grabRawFrame();
+	if (frame && frame->length >= (uint32_t)rawStride * rawAlignedHeight * 3 / 2)
+	{
+		regionCropper.quality = photo.quality;
+		mmal_buffer_header_mem_lock(frame);
+		__sync_lock_test_and_set(&capturing, 1);
+		written = regionCropper.encodeRegions(frame->data + frame->offset, rawWidth, rawHeight, rawStride, rawAlignedHeight, regions, paths);
+		__sync_lock_release(&capturing);
+		mmal_buffer_header_mem_unlock(frame);
+	}
+	releaseRawFrame(frame);
+	if (!wasStreaming)
+	{
+		stopRawFrames();
+	}
+	
+	unsigned long long completeMicros = ofGetElapsedTimeMicros();
+	for (size_t r=0; r<paths.size(); r++)
+	{
+		if (!regionCropper.lastBytes[r])
+		{
+			metrics.captureFailures->increment();
+			continue;
+		}
+		if (storage)
+		{
+			storage->add(paths[r], regionCropper.lastBytes[r]);
+		}
+		metrics.captures->increment();
+		metrics.frameBytes->observe(regionCropper.lastBytes[r]);
+		if (catalog)
+		{
+			// Regions cut from the same frame share a group
+			CatalogEntry entry;
+			entry.path = paths[r];
+			entry.cameraNum = cameraNum;
+			entry.captureTimeMicros = captureTimeMicros;
+			entry.bytes = regionCropper.lastBytes[r];
+			entry.groupId = captureTimeMicros;
+			entry.crc32c = regionCropper.lastCrcs[r];
+			catalog->add(entry);
+		}
+	}
+	metrics.captureLatency->observe((completeMicros - triggerMicros) / 1000.0);
+	
+	TRACE_NOTICE("Wrote %d of %d regions in %d ms", written, (int)regions.size(), (int)regionCropper.lastMillis);
+	return written;
+}
+
+/**
+ * Apply a sensor mode and the still size for the current region of interest.
+ * The camera is disabled and the tunnel to the encoder rebuilt so the new
+ * formats propagate, but both components and the encoder pool (resized) are
+ * kept, which takes a fraction of a full setup().
+ *
+ * @param mode Readout mode, index 0 lets the firmware choose
+ * @param fps Stills frame rate
+ * @return true if the camera is capturing again
+ */
+bool ofxRaspicam::reconfigure_pipeline(SensorMode mode, float fps)
+{
+	unsigned long long startMicros = ofGetElapsedTimeMicros();
+	
+	// Output keeps the full frame's pixel density inside the region, even sizes for the chroma planes
+	int width = max(16, (int)(fullFrameWidth * regionOfInterest.width) & ~1);
+	int height = max(16, (int)(fullFrameHeight * regionOfInterest.height) & ~1);
+	
+	stopRawFrames();
+	// AE has to find its feet again in the new mode or crop
+	convergence.reset();
+	
+	// Take the pipeline apart, components stay allocated
+	if (photo.encoder_connection)
+	{
+		mmal_connection_disable(photo.encoder_connection);
+		mmal_connection_destroy(photo.encoder_connection);
+		photo.encoder_connection = NULL;
+	}
+	if (encoder_output_port->is_enabled)
+	{
+		mmal_port_disable(encoder_output_port);
+	}
+	mmal_component_disable(camera);
+	
+	photo.sensorMode = mode.index;
+	photo.width = width;
+	photo.height = height;
+	photo.frameRateNum = (int)(fps * 256 + 0.5f);
+	photo.frameRateDen = 256;
+	
+	bool success = true;
+	MMAL_STATUS_T status = mmal_port_parameter_set_uint32(camera->control, MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG, mode.index);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Could not select sensor mode %d, error: %d", mode.index, status);
+		success = false;
+	}
+	
+	if (commit_still_format() != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("camera still format couldn't be set");
+		success = false;
+	}
+	
+	if (mmal_component_enable(camera) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("camera component enable FAIL");
+		success = false;
+	}
+	
+	// Connecting copies the new still format onto the encoder input
+	if (connect_ports(camera_still_port, encoder_input_port, &photo.encoder_connection) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("connect camera still port to encoder input FAIL");
+		photo.encoder_connection = NULL;
+		success = false;
+	}
+	
+	// JPEG output buffers are sized from the input resolution
+	encoder_output_port->buffer_size = max(encoder_output_port->buffer_size_recommended, encoder_output_port->buffer_size_min);
+	encoder_output_port->buffer_num = max(encoder_output_port->buffer_num_recommended, encoder_output_port->buffer_num_min);
+	if (mmal_port_format_commit(encoder_output_port) != MMAL_SUCCESS ||
+		mmal_pool_resize(photo.encoder_pool, encoder_output_port->buffer_num, encoder_output_port->buffer_size) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Could not resize encoder output buffers");
+		success = false;
+	}
+	
+	if (mmal_port_enable(encoder_output_port, encoder_buffer_callback) != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Setup encoder output FAIL");
+		success = false;
+	}
+	
+	currentMode = mode;
+	lastReconfigureMillis = (ofGetElapsedTimeMicros() - startMicros) / 1000.0f;
+	
+	ofLogNotice() << "Camera " << cameraNum << " now " << width << "x" << height << " @ " << fps << "fps using sensor " << mode.description()
+				<< " region " << regionOfInterest.x << "," << regionOfInterest.y << " " << regionOfInterest.width << "x" << regionOfInterest.height
+				<< (success ? "" : " (FAILED)") << " in " << lastReconfigureMillis << "ms";
+	ready = success;
+	// The video port was torn down with the rest, pick the graph's stream up again in the new format
+	if (success && graphStreaming && !startRawFrames(RAW_BUFFERS_NUM + frameGraph->maxLeasedBuffers()))
+	{
+		TRACE_ERROR("Could not restart raw frames for the frame graph");
+	}
+	return success;
+}
+
+SensorMode ofxRaspicam::getSensorMode()
+{
+	return currentMode;
+}
+
+/**
+ * One line per sensor mode used so far with its shutter to file latency
+ *
+ * @return Human readable table
+ */
+string ofxRaspicam::sensorModeReport()
+{
+	ostringstream out;
+	const vector<SensorMode>& modes = getSensorModes();
+	for (map<int, SensorModeLatency>::iterator it = modeLatency.begin(); it != modeLatency.end(); ++it)
+	{
+		const SensorModeLatency& latency = it->second;
+		string name = "mode 0 (automatic)";
+		for (size_t i=0; i<modes.size(); i++)
+		{
+			if (modes[i].index == it->first)
+				name = modes[i].description();
+		}
+		
+		out << name << ": " << latency.count << " captures"
+			<< " mean " << (latency.count ? latency.sumMillis / latency.count : 0) << "ms"
+			<< " min " << latency.minMillis << "ms"
+			<< " max " << latency.maxMillis << "ms"
+			<< " last " << latency.lastMillis << "ms\n";
+	}
+	return out.str();
+}
+
+void ofxRaspicam::create_camera_component()
+{
+	TIMELINE_SCOPE("create_camera_component");
+	
+	MMAL_STATUS_T status;
+	
+	/* Create the component */
+	status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
+	
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Failed to create camera component");
+		camera = NULL;
+		return;
+	}
+	
+	// Select which sensor this component drives before anything else is configured
+	MMAL_PARAMETER_INT32_T camera_num = {{MMAL_PARAMETER_CAMERA_NUM, sizeof(camera_num)}, cameraNum};
+	status = mmal_port_parameter_set(camera->control, &camera_num.hdr);
+	
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_ERROR("Could not select camera %d, error: %d", cameraNum, status);
+	}
+	
+	if (!camera->output_num)
+	{
+		TRACE_ERROR("Camera doesn't have output ports");
+		
+	}else {
+		TRACE_VERBOSE("camera->output_num: %u", camera->output_num);
+	}
+
+	
+	camera_still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
+	
+	// Ask for the exposure, gains and AWB of every frame, recorded with each capture
+	MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request = {{MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)}, MMAL_PARAMETER_CAMERA_SETTINGS, 1};
+	status = mmal_port_parameter_set(camera->control, &change_event_request.hdr);
+	if (status != MMAL_SUCCESS)
+	{
+		TRACE_WARNING("No camera settings events, error: %d", status);
+	}
+	camera->control->userdata = (struct MMAL_PORT_USERDATA_T *)&control_callback_data;
+	
+	// Enable the camera, and tell it its control callback function
+	status = mmal_port_enable(camera->control, camera_control_callback);
+	
+	if (status)
+	{
+		TRACE_ERROR("Enable control port FAIL: error %d", status);
+	}
+	else 
+	{
+		TRACE_VERBOSE("Enable control port : PASS %d", status);
+	}
+	
+	//raspicamcontrol_set_all_parameters(camera, &photo.camera_parameters);
+	
+	// Now set up the port formats
+	
+	
+	
+	if (photo.sensorMode)
+	{
+		status = mmal_port_parameter_set_uint32(camera->control, MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG, photo.sensorMode);
+		if (status != MMAL_SUCCESS)
+		{
+			TRACE_ERROR("Could not select sensor mode %d, error: %d", photo.sensorMode, status);
+		}
+	}
+	
+	status = commit_still_format();
 	
 	if (status)
 	{
-		ofLogVerbose() << "camera still format couldn't be set";
+		TRACE_ERROR("camera still format couldn't be set");
 		
 	}
 	
@@ -336,10 +2115,10 @@ void ofxRaspicam::create_camera_component()
 	
 	if (status)
 	{
-		ofLogVerbose() << "camera component enable FAIL";
+		TRACE_ERROR("camera component enable FAIL");
 	}else 
 	{
-		ofLogVerbose() << "camera component enable PASS";
+		TRACE_VERBOSE("camera component enable PASS");
 	}
 
 	
@@ -347,7 +2126,7 @@ void ofxRaspicam::create_camera_component()
 	{
 		if (mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_ENABLE_RAW_CAPTURE, 1) != MMAL_SUCCESS)
 		{
-			ofLogVerbose() << "RAW was requested, but failed to enable";
+			TRACE_ERROR("RAW was requested, but failed to enable");
 			
 			// Continue on and take picture without.
 		}
@@ -355,27 +2134,34 @@ void ofxRaspicam::create_camera_component()
 	
 	photo.setup(camera);
 	
-	ofLogVerbose() << "Camera component done";
+	TRACE_VERBOSE("Camera component done");
 }
 
 ofxRaspicam::~ofxRaspicam()
 {
-	ofLogVerbose() << "~ofxRaspicam";
+	TRACE_VERBOSE("~ofxRaspicam");
+	stopRawFrames();
+	stackEncoder.close();
+	if (semaphoreCreated)
+	{
+		vcos_semaphore_delete(&callback_data.complete_semaphore);
+	}
 	if (camera)
 	{
 		mmal_component_destroy(camera);
-		ofLogVerbose() << "camera DESTROYED";
+		TRACE_VERBOSE("camera DESTROYED");
 	}
 	if (encoder)
 	{
 		mmal_component_destroy(encoder);
-		ofLogVerbose() << "encoder DESTROYED";
+		TRACE_VERBOSE("encoder DESTROYED");
 	}
 }
 
 void ofxRaspicam::create_encoder_component()
 {
-	ofLogVerbose() << "create_encoder_component START";
+	TIMELINE_SCOPE("create_encoder_component");
+	TRACE_VERBOSE("create_encoder_component START");
 	MMAL_STATUS_T status;
 	MMAL_POOL_T *pool;
 	
@@ -383,16 +2169,18 @@ void ofxRaspicam::create_encoder_component()
 	
 	if (status != MMAL_SUCCESS)
 	{
-		ofLogVerbose() << "create JPEG encoder component FAIL error: " << status;
+		TRACE_ERROR("create JPEG encoder component FAIL error: %d", status);
+		encoder = NULL;
+		return;
 	}else 
 	{
-		ofLogVerbose() << "create JPEG encoder component PASS";
+		TRACE_VERBOSE("create JPEG encoder component PASS");
 	}
 
 	
 	if (!encoder->input_num || !encoder->output_num)
 	{
-		ofLogVerbose() << "JPEG encoder doesn't have input/output ports";
+		TRACE_ERROR("JPEG encoder doesn't have input/output ports");
 	}
 	
 	encoder_input_port = encoder->input[0];
@@ -423,10 +2211,10 @@ void ofxRaspicam::create_encoder_component()
 	
 	if (status != MMAL_SUCCESS)
 	{
-		ofLogVerbose() << "set format on video encoder output port FAIL, error: " << status;
+		TRACE_ERROR("set format on video encoder output port FAIL, error: %d", status);
 	}else 
 	{
-		ofLogVerbose() << "set format on video encoder output port PASS";
+		TRACE_VERBOSE("set format on video encoder output port PASS");
 
 	}
 
@@ -436,10 +2224,10 @@ void ofxRaspicam::create_encoder_component()
 	
 	if (status != MMAL_SUCCESS)
 	{
-		ofLogVerbose() << "Set JPEG quality FAIL, error: " << status;
+		TRACE_ERROR("Set JPEG quality FAIL, error: %d", status);
 	}else 
 	{
-		ofLogVerbose() << "Set JPEG quality PASS";
+		TRACE_VERBOSE("Set JPEG quality PASS");
 
 	}
 
@@ -448,10 +2236,10 @@ void ofxRaspicam::create_encoder_component()
 	
 	if (status)
 	{
-		ofLogVerbose() << "Enable video encoder component FAIL, error: " << status;
+		TRACE_ERROR("Enable video encoder component FAIL, error: %d", status);
 	}else 
 	{
-		ofLogVerbose() << "Enable video encoder component PASS";
+		TRACE_VERBOSE("Enable video encoder component PASS");
 	}
 
 	
@@ -460,16 +2248,16 @@ void ofxRaspicam::create_encoder_component()
 	
 	if (!pool)
 	{
-		ofLogVerbose() << "Failed to create buffer header pool for encoder output port " << encoder_output_port->name;
+		TRACE_ERROR("Failed to create buffer header pool for encoder output port");
 	}else 
 	{
-		ofLogVerbose() << "pool creation PASS";
+		TRACE_VERBOSE("pool creation PASS");
 	}
 
 	
 	photo.encoder_pool = pool;
 	photo.encoder_component = encoder;
 	
-	ofLogVerbose() << "Encoder component done";
+	TRACE_VERBOSE("Encoder component done");
 
 }
@@ -6,6 +6,7 @@
 
 
 // Standard port setting for the camera component
+#define MMAL_CAMERA_VIDEO_PORT 1
 #define MMAL_CAMERA_CAPTURE_PORT 2
 
 
@@ -16,15 +17,146 @@
 
 #define OUTPUT_BUFFERS_NUM 3
 
+// Uncompressed frames from the video port, slow enough to allow long exposures
+#define RAW_FRAME_RATE_NUM 10
+#define RAW_FRAME_RATE_DEN 1
+#define RAW_BUFFERS_NUM 3
+
 
 #include "CameraSettings.h"
 #include "Photo.h"
+#include "MetricsRegistry.h"
+#include "PhotoCatalog.h"
+#include "FrameStacker.h"
+#include "YUVEncoder.h"
+#include "SensorMode.h"
+#include "RegionCropper.h"
+#include "StorageManager.h"
+#include "AtomicFile.h"
+#include "Crc32c.h"
+#include "QualityController.h"
+#include "FrameMetadataLog.h"
+#include "ExposureConvergenceMonitor.h"
+#include "FramePublisher.h"
+#include "FrameProcessors.h"
+#include "PerceptualDedup.h"
+#include "FrameGraph.h"
+#include "PixelPool.h"
+#include "ImageDecoder.h"
+
+// One camera's counters and histograms in the global MetricsRegistry, NULL until setup()
+struct CameraMetrics
+{
+	MetricsCounter* captures;				// takePhoto() calls that reached the encoder
+	MetricsCounter* captureFailures;		// takePhoto() calls that could not open a file or start capture
+	MetricsCounter* encoderBuffers;			// encoder output buffers received in the callback
+	MetricsCounter* bytesWritten;			// encoded bytes written to disk
+	MetricsCounter* poolStarvation;			// times no buffer header was available to hand back to the port
+	MetricsCounter* droppedFrames;			// frames ended with MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED
+	MetricsHistogram* captureLatency;		// ms from MMAL_PARAMETER_CAPTURE to frame end
+	MetricsHistogram* frameBytes;			// encoded size of each frame
+	MetricsCounter* rawFrames;				// I420 frames delivered by the video port
+	MetricsHistogram* commitLatency;		// ms to fsync and rename a finished photo into place
+	MetricsHistogram* settleLatency;		// ms spent waiting for AE/AWB before a capture
+	MetricsCounter* settleTimeouts;			// settles that gave up at the timeout instead of converging
+	MetricsHistogram* focusScore;			// FocusScorer result of each scored capture
+	MetricsCounter* blurredFrames;			// captures scored below minFocusScore, kept or not
+	
+	CameraMetrics();
+	void setup(string labels);
+};
 
 struct PORT_USERDATA
 {
 	FILE *file_handle;						// File handle to write buffer data to.
 	VCOS_SEMAPHORE_T complete_semaphore;	// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
 	Photo *photo;							// pointer to our state in case required in callback
+	CameraMetrics *metrics;					// counters updated from the callback, NULL to disable
+	uint32_t frame_bytes;					// bytes written for the current frame, only touched by the callback until complete_semaphore is posted
+	uint32_t frame_crc;						// CRC32C of those bytes, updated as each buffer is written
+	int frame_failed;						// set by the callback if the frame ended with a transmission failure
+	int64_t frame_pts;						// first known pts of the frame, MMAL_TIME_UNKNOWN until one arrives
+	int clock_valid;						// the two offsets below were sampled for this capture
+	int64_t stc_to_monotonic;				// add to a pts (VideoCore STC) to get CLOCK_MONOTONIC micros
+	int64_t monotonic_to_realtime;			// add to CLOCK_MONOTONIC micros to get CLOCK_REALTIME micros
+	int exif_restamped;						// the EXIF times were replaced with the frame's own
+	FramePublisher *publisher;				// the frame is also streamed into this ring, NULL to disable
+};
+
+struct CONTROL_PORT_USERDATA
+{
+	ofMutex mutex;							// guards settings against the control callback
+	CameraFrameSettings settings;
+	ExposureConvergenceMonitor *convergence;	// fed every settings report
+};
+
+struct RAW_PORT_USERDATA
+{
+	MMAL_QUEUE_T *frames;					// filled frames waiting for grabRawFrame()
+	MMAL_POOL_T *pool;						// empty buffers to hand back to the port
+	CameraMetrics *metrics;
+	FrameGraph *graph;						// every filled frame is leased to it as well, NULL when not streaming to one
+	FrameInfo format;						// layout of the frames for the graph
+	PORT_USERDATA *clocks;					// pts to host clock offsets from sample_clocks()
+};
+
+class CameraReadyEventData
+{
+public:
+	bool success;							// false if any MMAL step failed
+	unsigned long long setupMillis;			// time spent inside setup()
+	unsigned long long processMillis;		// time since the process was launched
+	float uptimeSeconds;					// system uptime when the camera became ready
+};
+
+struct CaptureInfo
+{
+	string path;							// file written, empty if the capture never opened one
+	bool success;
+	uint32_t bytes;
+	unsigned long long triggerMicros;		// ofGetElapsedTimeMicros() when MMAL_PARAMETER_CAPTURE was set
+	unsigned long long completeMicros;		// ofGetElapsedTimeMicros() when the frame ended
+	unsigned long long closedMicros;		// ofGetElapsedTimeMicros() when the file was closed
+	uint64_t captureTimeMicros;				// realtime (epoch) at trigger, for the catalog
+	uint32_t crc32c;						// checksum of the file as written
+	int quality;							// JPEG Q factor it was encoded with
+	uint64_t sequence;						// per camera capture number, also in EXIF.ImageUniqueID
+	int64_t ptsMicros;						// encoder pts of the frame, MMAL_TIME_UNKNOWN if none
+	int64_t monotonicMicros;				// pts on CLOCK_MONOTONIC, 0 if unknown
+	bool timestampFromPts;					// captureTimeMicros is the frame's own time, not the trigger's
+	CameraFrameSettings settings;
+	float settleMillis;						// AE/AWB wait before this capture, 0 if there was none
+	float focusScore;						// Laplacian variance from FocusScorer, -1 if not scored
+	bool blurred;							// scored below minFocusScore
+	uint64_t perceptualHash;				// dHash of the photo, 0 if dedup is off
+	bool duplicate;							// near duplicate discarded by dedup.policy
+};
+
+// Shutter to file latency of the captures taken in one sensor mode
+struct SensorModeLatency
+{
+	SensorModeLatency();
+	void add(double millis);
+	int count;
+	double sumMillis;
+	double minMillis;
+	double maxMillis;
+	double lastMillis;
+	MetricsHistogram* histogram;			// camera_mode_capture_latency_ms{mode="n"}
+};
+
+class ofxRaspicam;
+
+// Runs one ofxRaspicam method on its own thread, used for startup
+class ofxRaspicamTask : public ofThread
+{
+public:
+	ofxRaspicamTask();
+	void run(ofxRaspicam* owner_, void (ofxRaspicam::*method_)());
+	void threadedFunction();
+private:
+	ofxRaspicam* owner;
+	void (ofxRaspicam::*method)();
 };
 
 class ofxRaspicam
@@ -33,13 +165,143 @@ public:
 	ofxRaspicam();
 	~ofxRaspicam();
 	void setup();
+	void setupAsync();						// setup() on a background thread, readyEvent fires when done
+	bool isReady();
+	void waitUntilReady();
+	bool isCapturing();						// a photo is being written to the card, bulk readers should hold off
 	void takePhoto();
-	ofImage lastImage;
+	
+	// takePhoto() split into its phases so several cameras can be fired together
+	bool prepareCapture();					// open the file, set EXIF, hand buffers to the encoder
+	bool triggerCapture();					// start the exposure
+	bool finishCapture(uint64_t groupId=0);	// wait for the frame, close the file and record it
+	
+	// Wait for AE/AWB to settle, at most maxMillis (Photo::timeout if negative)
+	SettleReport settle(int maxMillis=-1);
+	SettleReport lastSettle;
+	ExposureConvergenceMonitor convergence;
+	
+	// JPEG Q factor, applied to the running encoder from the next capture on
+	bool setQuality(int quality);
+	int getQuality();
+	
+	// Change output size and frame rate, choosing the best sensor readout mode for them.
+	// Ports are reconfigured in place, components stay alive
+	bool setSensorMode(int width, int height, float fps=0);
+	SensorMode getSensorMode();
+	string sensorModeReport();				// latency per mode used so far
+	map<int, SensorModeLatency> modeLatency;	// keyed by SensorMode::index
+	float lastReconfigureMillis;
+	
+	// Digital zoom: only this normalized part of the sensor is processed and encoded
+	bool setRegionOfInterest(ofRectangle region);
+	ofRectangle getRegionOfInterest();
+	// Several regions of one raw frame, each written to nextPhotoPath("-roi<n>")
+	int takeRegionPhotos(const vector<ofRectangle>& regions);
+	RegionCropper regionCropper;
+	
+	// Uncompressed I420 frames from the video port for processing on the ARM
+	bool startRawFrames(int numBuffers=RAW_BUFFERS_NUM);
+	MMAL_BUFFER_HEADER_T* grabRawFrame(int timeoutMillis=1000);	// newest frame, older ones are recycled; NULL on timeout
+	void releaseRawFrame(MMAL_BUFFER_HEADER_T* frame);
+	void stopRawFrames();
+	int rawWidth;							// visible size of raw frames, applied by startRawFrames()
+	int rawHeight;
+	int rawStride;							// layout of the frames in flight
+	int rawAlignedHeight;
+	
+	// Keep raw frames flowing to the nodes of frameGraph in the background; grabRawFrame() still works alongside
+	bool startFrameGraph();
+	void stopFrameGraph();
+	FrameGraph* frameGraph;					// optional, set up with its nodes before startFrameGraph()
+	
+	// Low light: align and merge numFrames raw frames, then JPEG encode the result
+	bool takeStackedPhoto(int numFrames, FrameStacker::Mode mode=FrameStacker::STACK_MEAN);
+	FrameStacker stacker;
+	
+	ofImage lastImage;						// pixels only, a capture may finish on any thread; lastTexture holds them on the GPU
+	ofTexture lastTexture;
+	bool updateLastTexture();				// GL thread: upload lastImage if a capture changed it
+	CaptureInfo lastCapture;				// the capture in progress, only for the thread taking it
+	CaptureInfo getLastCapture();			// copy of the last kept capture, from any thread
+	CameraMetrics metrics;
+	
+	int cameraNum;							// MMAL_PARAMETER_CAMERA_NUM, 0 or 1 on compute module boards
+	string fileSuffix;						// appended to the timestamp so simultaneous cameras don't collide
+	bool loadLastImage;						// decode each kept capture into lastImage
+	PhotoCatalog* catalog;					// optional, every finished capture is added
+	StorageManager* storage;				// optional, owns photo paths, quota and preallocation
+	QualityController* qualityController;	// optional, picks the Q factor of each capture from the size of the last
+	FrameMetadataLog* metadataLog;			// optional, every finished capture gets a record
+	FramePublisher* publisher;				// optional, JPEGs and grabbed raw frames go to a shared memory ring
+	
+	enum BlurPolicy
+	{
+		BLUR_KEEP,							// only record the score
+		BLUR_DISCARD,						// delete photos scoring below minFocusScore
+		BLUR_RETAKE							// delete and shoot again, up to maxBlurRetakes times, then keep the last
+	};
+	FocusProcessor focusNode;				// scores stills and stacks the way the stream's FrameGraph node scores frames
+	LibJpegDecoder analysisDecoder;			// stills decoded at 1/focusNode.scorer.downscale for scoring and statistics
+	bool scoreFocus;						// score every capture; stills are decoded for it
+	float minFocusScore;					// blur threshold, 0 disables blurPolicy
+	BlurPolicy blurPolicy;
+	int maxBlurRetakes;						// BLUR_RETAKE: extra shots takePhoto() may take
+	
+	PerceptualDedup dedup;					// set dedup.policy to hash takePhoto() captures and drop or thin out near duplicates
+	LibJpegDecoder dedupDecoder;			// 1/8 scale decodes of each capture for dedup
+	
+	StatisticsProcessor statisticsNode;		// statisticsNode.statistics holds the histograms, means and clipping of the last measured frame
+	bool measureStatistics;					// measure every capture, stills share the scoring decode
+	bool measureExposure();					// measure one raw video frame without taking a photo
+	CameraFrameSettings getFrameSettings();	// latest exposure, gains and AWB reported by the camera
+	string nextPhotoPath(string suffix="");	// <timestamp><fileSuffix><suffix>.jpg under storage or data/photos
+	string metricsLabels();
+	CameraSettings& getCameraSettings();
+	
+	bool parallelInit;						// create the encoder on a second thread while the camera is configured
+	ofEvent<CameraReadyEventData> readyEvent;	// notified from the thread that ran setup()
+	CameraReadyEventData startupReport;
 private:
 	Photo photo;
 	void create_camera_component();
 	void create_encoder_component();
+	MMAL_STATUS_T commit_still_format();
+	bool reconfigure_pipeline(SensorMode mode, float fps);
+	SensorMode currentMode;
+	ofRectangle regionOfInterest;
+	int fullFrameWidth;						// still size when the region of interest is the whole frame
+	int fullFrameHeight;
+	void report_ready(unsigned long long setupStartMillis);
+	volatile bool ready;
+	bool setupFailed;
+	bool semaphoreCreated;
+	FILE* output_file;
+	string currentFileName;
+	bool captureTriggered;
+	volatile int capturing;
+	uint64_t frameSequence;
+	uint64_t rawFrameSequence;
+	bool sample_clocks();
+	void publish_raw_frame(MMAL_BUFFER_HEADER_T* frame);
+	const ofPixels* capture_pixels(ofPixels& decoded);
+	bool dedup_capture(bool& hashed);
+	int blurRetakesLeft;
+	void publish_last_capture();
+	ofMutex lastImageMutex;					// lastImage and lastImageChanged, held while a capture decodes into it
+	bool lastImageChanged;
+	ofMutex lastCaptureMutex;
+	CaptureInfo keptCapture;				// what getLastCapture() returns
+	CONTROL_PORT_USERDATA control_callback_data;
+	ofxRaspicamTask startupTask;
+	ofxRaspicamTask encoderTask;
 	MMAL_PORT_T* camera_still_port;
+	MMAL_PORT_T* camera_video_port;
+	MMAL_POOL_T* raw_pool;
+	MMAL_QUEUE_T* raw_frames;
+	RAW_PORT_USERDATA raw_callback_data;
+	bool graphStreaming;					// between startFrameGraph() and stopFrameGraph(), raw frames outlive single captures
+	YUVEncoder stackEncoder;
 	MMAL_PORT_T* encoder_input_port;
 	MMAL_PORT_T* encoder_output_port;
 	MMAL_COMPONENT_T* camera;
@@ -0,0 +1,103 @@
+/*
+ *  frameSubscriber.cpp
+ *
+ *  Follows the shared memory frame ring the app publishes with
+ *  CAMERA_APP_PUBLISH and prints a line per frame. Frames are read in place;
+ *  with a directory argument each JPEG is also saved there. A starting point
+ *  for other local consumers (streaming, analysis) of the camera.
+ *  Not part of the app build; compile on the Pi with:
+ *
+ *		g++ -O2 -I../../src -o frameSubscriber frameSubscriber.cpp -lrt
+ *
+ *  Usage: frameSubscriber /mmalCameraApp-cam0 [saveDirectory]
+ */
+
+#include "FrameRingFormat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+static void fourccName(uint32_t fourcc, char name[5])
+{
+	for (int i=0; i<4; i++)
+	{
+		name[i] = (char)((fourcc >> (8 * i)) & 0xff);
+	}
+	name[4] = 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s /ringName [saveDirectory]\n", argv[0]);
+		return 1;
+	}
+	const char* saveDirectory = argc > 2 ? argv[2] : NULL;
+
+	FrameSubscriber subscriber;
+	uint64_t reportedSkips = 0;
+	std::vector<unsigned char> copy;
+
+	while (true)
+	{
+		if (subscriber.isClosed())
+		{
+			// Camera not running yet, or restarted and made a new ring
+			if (!subscriber.open(argv[1]))
+			{
+				usleep(500000);
+				continue;
+			}
+			fprintf(stderr, "following %s\n", argv[1]);
+			reportedSkips = subscriber.skippedFrames;
+		}
+
+		FrameView view;
+		if (!subscriber.next(view))
+		{
+			usleep(5000);
+			continue;
+		}
+
+		bool save = saveDirectory && view.info.fourcc == FRAME_RING_JPEG;
+		if (save)
+		{
+			// Copy out before writing so a lapped frame never reaches the disk
+			copy.assign(view.data, view.data + view.info.bytes);
+		}
+		if (!subscriber.isValid(view))
+		{
+			fprintf(stderr, "frame %llu overwritten while reading\n", (unsigned long long)view.frameIndex);
+			continue;
+		}
+
+		char name[5];
+		fourccName(view.info.fourcc, name);
+		printf("%llu camera %u seq %llu %s %ux%u %u bytes realtime %lld\n", (unsigned long long)view.frameIndex, view.info.cameraNum,
+			   (unsigned long long)view.info.frameSequence, name, view.info.width, view.info.height, view.info.bytes, (long long)view.info.realtimeMicros);
+		if (subscriber.skippedFrames != reportedSkips)
+		{
+			fprintf(stderr, "fell behind, %llu frames skipped so far\n", (unsigned long long)subscriber.skippedFrames);
+			reportedSkips = subscriber.skippedFrames;
+		}
+
+		if (save)
+		{
+			char path[1024];
+			snprintf(path, sizeof(path), "%s/cam%u-%06llu.jpg", saveDirectory, view.info.cameraNum, (unsigned long long)view.info.frameSequence);
+			FILE* file = fopen(path, "wb");
+			if (!file || fwrite(&copy[0], 1, copy.size(), file) != copy.size())
+			{
+				fprintf(stderr, "could not write %s\n", path);
+			}
+			if (file)
+			{
+				fclose(file);
+			}
+		}
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ *  traceDump.cpp
+ *
+ *  Prints a binary TraceLog dump (data/trace.bin) as text.
+ *  Not part of the app build; compile on the Pi or any host with:
+ *
+ *		g++ -O2 -I../../src -o traceDump traceDump.cpp
+ *
+ *  Usage: traceDump trace.bin [minLevel] [threadId]
+ */
+
+#include "TraceLogFormat.h"
+
+#include <stdlib.h>
+
+static bool readExactly(FILE* file, void* destination, size_t size)
+{
+	return fread(destination, 1, size, file) == size;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s trace.bin [minLevel 0-3] [threadId]\n", argv[0]);
+		return 1;
+	}
+
+	int minLevel = argc > 2 ? atoi(argv[2]) : TRACE_LEVEL_VERBOSE;
+	uint32_t onlyThread = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 0;
+
+	FILE* file = fopen(argv[1], "rb");
+	if (!file)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	TRACE_FILE_HEADER header;
+	if (!readExactly(file, &header, sizeof(header)) || memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+		fclose(file);
+		return 1;
+	}
+
+	std::vector<std::string> strings(header.numStrings);
+	for (uint32_t i=0; i<header.numStrings; i++)
+	{
+		uint32_t length = 0;
+		if (!readExactly(file, &length, sizeof(length)))
+		{
+			fprintf(stderr, "%s: truncated string table\n", argv[1]);
+			fclose(file);
+			return 1;
+		}
+		strings[i].resize(length);
+		if (length && !readExactly(file, &strings[i][0], length))
+		{
+			fprintf(stderr, "%s: truncated string table\n", argv[1]);
+			fclose(file);
+			return 1;
+		}
+	}
+
+	printf("# %u records, %llu dropped\n", header.numRecords, (unsigned long long)header.droppedRecords);
+
+	uint64_t firstTimestamp = 0;
+	for (uint32_t i=0; i<header.numRecords; i++)
+	{
+		TRACE_FILE_RECORD record;
+		if (!readExactly(file, &record, sizeof(record)))
+		{
+			fprintf(stderr, "%s: truncated after %u records\n", argv[1], i);
+			break;
+		}
+		if (i == 0)
+		{
+			firstTimestamp = record.timestampMicros;
+		}
+		if (record.level < minLevel || (onlyThread && record.threadId != onlyThread))
+		{
+			continue;
+		}
+
+		const char* format = record.formatIndex < strings.size() ? strings[record.formatIndex].c_str() : "<bad format>";
+		int numArgs = record.numArgs > TRACE_MAX_ARGS ? TRACE_MAX_ARGS : record.numArgs;
+		std::string message = traceFormatMessage(format, record.args, numArgs, &strings);
+
+		// Absolute monotonic time plus the offset from the first record
+		printf("%llu.%06llu +%10.3fms [%u] %-7s %s\n",
+			   (unsigned long long)(record.timestampMicros / 1000000ULL),
+			   (unsigned long long)(record.timestampMicros % 1000000ULL),
+			   (record.timestampMicros - firstTimestamp) / 1000.0,
+			   record.threadId, traceLevelName(record.level), message.c_str());
+	}
+
+	fclose(file);
+	return 0;
+}
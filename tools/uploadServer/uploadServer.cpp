@@ -0,0 +1,450 @@
+/*
+ *  uploadServer.cpp
+ *
+ *  Stand-in for the S3 compatible store UploadQueue talks to, for trying
+ *  uploads on a bench without a real bucket. Speaks just the calls the app
+ *  makes: PUT object, and the multipart initiate, part PUT and complete.
+ *  Objects land under saveDirectory/<bucket>/<key>.
+ *
+ *  - Upload ids live only in memory, so restarting the server mid upload
+ *    makes the app's saved id stale: the next part or the completion gets
+ *    404 NoSuchUpload and the app starts the file again.
+ *  - With failEvery, every Nth part PUT answers 500 and drops the
+ *    connection, so the app has to retry and resume from its state file.
+ *  - Every 5s it prints the rate requests arrive at, to check
+ *    CAMERA_APP_UPLOAD_BANDWIDTH.
+ *
+ *  Not part of the app build; compile on the Pi or any host with:
+ *
+ *		g++ -O2 -o uploadServer uploadServer.cpp -lpthread
+ *
+ *  Usage: uploadServer port saveDirectory [failEvery]
+ *  then run the app with CAMERA_APP_UPLOAD_ENDPOINT=http://<host>:<port>
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Upload
+{
+	string path;							// object file once complete
+	map<int, string> parts;					// part number to the file holding it
+};
+
+static string saveDirectory;
+static int failEvery = 0;
+static pthread_mutex_t stateMutex = PTHREAD_MUTEX_INITIALIZER;
+static map<string, Upload> uploads;
+static int nextUploadId = 1;
+static int partsReceived = 0;
+static uint64_t bodyBytes = 0;				// received since the last rate report, headers included
+
+static unsigned long long nowMillis()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static string urlDecode(const string& text)
+{
+	string out;
+	for (size_t i=0; i<text.size(); i++)
+	{
+		if (text[i] == '%' && i + 2 < text.size())
+		{
+			out += (char)strtol(text.substr(i + 1, 2).c_str(), NULL, 16);
+			i += 2;
+		}else
+		{
+			out += text[i];
+		}
+	}
+	return out;
+}
+
+static string queryValue(const string& query, const string& name)
+{
+	size_t start = 0;
+	while (start <= query.size())
+	{
+		size_t end = query.find('&', start);
+		if (end == string::npos) end = query.size();
+		string pair = query.substr(start, end - start);
+		size_t equals = pair.find('=');
+		if (pair.substr(0, equals) == name)
+		{
+			return equals == string::npos ? "" : urlDecode(pair.substr(equals + 1));
+		}
+		start = end + 1;
+	}
+	return "";
+}
+
+static bool hasQuery(const string& query, const string& name)
+{
+	return ("&" + query + "&").find("&" + name + "&") != string::npos || ("&" + query).find("&" + name + "=") != string::npos;
+}
+
+// Creates every directory above path
+static void makeParents(const string& path)
+{
+	for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1))
+	{
+		mkdir(path.substr(0, slash).c_str(), 0755);
+	}
+}
+
+static bool writeFile(const string& path, const string& data)
+{
+	makeParents(path);
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+	bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+	return fclose(file) == 0 && written;
+}
+
+static bool readFile(const string& path, string& data)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+	char buffer[64*1024];
+	size_t count;
+	while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		data.append(buffer, count);
+	}
+	fclose(file);
+	return true;
+}
+
+// FNV-1a, only has to differ between parts
+static string etagOf(const string& data)
+{
+	uint64_t hash = 1469598103934665603ULL;
+	for (size_t i=0; i<data.size(); i++)
+	{
+		hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+	}
+	char text[24];
+	snprintf(text, sizeof(text), "\"%016llx\"", (unsigned long long)hash);
+	return text;
+}
+
+static bool sendAll(int socketFd, const string& data)
+{
+	size_t offset = 0;
+	while (offset < data.size())
+	{
+		ssize_t sent = send(socketFd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		offset += sent;
+	}
+	return true;
+}
+
+static bool reply(int socketFd, int status, const string& body, const string& extraHeaders="", bool close=false)
+{
+	const char* reason = status == 200 ? "OK" : status == 404 ? "Not Found" : status == 400 ? "Bad Request" : "Internal Server Error";
+	char head[256];
+	snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Length: %d\r\n%s", status, reason, (int)body.size(), close ? "Connection: close\r\n" : "");
+	return sendAll(socketFd, string(head) + extraHeaders + "\r\n" + body);
+}
+
+static string errorDocument(const char* code)
+{
+	return string("<Error><Code>") + code + "</Code></Error>";
+}
+
+/**
+ * Answer one request
+ *
+ * @return false to drop the connection
+ */
+static bool handle(int socketFd, const string& method, const string& target, const string& body)
+{
+	size_t question = target.find('?');
+	string key = urlDecode(target.substr(0, question));
+	string query = question == string::npos ? "" : target.substr(question + 1);
+	// Keys stay inside saveDirectory and off .uploads
+	if (key.size() < 2 || key[0] != '/' || key.find("/.") != string::npos)
+	{
+		return reply(socketFd, 400, errorDocument("InvalidURI"));
+	}
+	string objectPath = saveDirectory + key;
+	string uploadId = queryValue(query, "uploadId");
+
+	if (method == "PUT" && !uploadId.empty())
+	{
+		int part = atoi(queryValue(query, "partNumber").c_str());
+		pthread_mutex_lock(&stateMutex);
+		bool known = uploads.count(uploadId) != 0;
+		bool fail = failEvery > 0 && ++partsReceived % failEvery == 0;
+		pthread_mutex_unlock(&stateMutex);
+		printf("PUT part %d of %s (%s), %d bytes%s\n", part, key.c_str(), uploadId.c_str(), (int)body.size(),
+			   !known ? ": no such upload" : fail ? ": failing it" : "");
+		if (!known)
+		{
+			return reply(socketFd, 404, errorDocument("NoSuchUpload"));
+		}
+		if (fail)
+		{
+			reply(socketFd, 500, errorDocument("InternalError"), "", true);
+			return false;
+		}
+		char partName[16];
+		snprintf(partName, sizeof(partName), "/%d", part);
+		string partPath = saveDirectory + "/.uploads/" + uploadId + partName;
+		if (!writeFile(partPath, body))
+		{
+			return reply(socketFd, 500, errorDocument("InternalError"));
+		}
+		pthread_mutex_lock(&stateMutex);
+		uploads[uploadId].parts[part] = partPath;
+		pthread_mutex_unlock(&stateMutex);
+		return reply(socketFd, 200, "", "ETag: " + etagOf(body) + "\r\n");
+	}
+
+	if (method == "PUT")
+	{
+		printf("PUT %s, %d bytes\n", key.c_str(), (int)body.size());
+		if (!writeFile(objectPath, body))
+		{
+			return reply(socketFd, 500, errorDocument("InternalError"));
+		}
+		return reply(socketFd, 200, "", "ETag: " + etagOf(body) + "\r\n");
+	}
+
+	if (method == "POST" && hasQuery(query, "uploads"))
+	{
+		char id[32];
+		pthread_mutex_lock(&stateMutex);
+		snprintf(id, sizeof(id), "%d-%d", (int)getpid(), nextUploadId++);
+		uploads[id].path = objectPath;
+		pthread_mutex_unlock(&stateMutex);
+		printf("POST %s: started upload %s\n", key.c_str(), id);
+		return reply(socketFd, 200, string("<InitiateMultipartUploadResult><UploadId>") + id + "</UploadId></InitiateMultipartUploadResult>");
+	}
+
+	if (method == "POST" && !uploadId.empty())
+	{
+		pthread_mutex_lock(&stateMutex);
+		bool known = uploads.count(uploadId) != 0;
+		Upload upload;
+		if (known)
+		{
+			upload = uploads[uploadId];
+		}
+		pthread_mutex_unlock(&stateMutex);
+		if (!known)
+		{
+			printf("POST %s: complete of unknown upload %s\n", key.c_str(), uploadId.c_str());
+			return reply(socketFd, 404, errorDocument("NoSuchUpload"));
+		}
+
+		// The parts the client lists, in its order
+		string assembled;
+		int numParts = 0;
+		for (size_t start = body.find("<PartNumber>"); start != string::npos; start = body.find("<PartNumber>", start + 1))
+		{
+			int part = atoi(body.c_str() + start + strlen("<PartNumber>"));
+			if (!upload.parts.count(part) || !readFile(upload.parts[part], assembled))
+			{
+				printf("POST %s: complete names missing part %d\n", key.c_str(), part);
+				return reply(socketFd, 400, errorDocument("InvalidPart"));
+			}
+			numParts++;
+		}
+		if (!writeFile(upload.path, assembled))
+		{
+			return reply(socketFd, 500, errorDocument("InternalError"));
+		}
+		for (map<int, string>::iterator it = upload.parts.begin(); it != upload.parts.end(); ++it)
+		{
+			unlink(it->second.c_str());
+		}
+		rmdir((saveDirectory + "/.uploads/" + uploadId).c_str());
+		pthread_mutex_lock(&stateMutex);
+		uploads.erase(uploadId);
+		pthread_mutex_unlock(&stateMutex);
+		printf("POST %s: completed upload %s, %d parts, %d bytes\n", key.c_str(), uploadId.c_str(), numParts, (int)assembled.size());
+		return reply(socketFd, 200, "<CompleteMultipartUploadResult><Key>" + key + "</Key></CompleteMultipartUploadResult>");
+	}
+
+	printf("%s %s: not supported\n", method.c_str(), target.c_str());
+	return reply(socketFd, 400, errorDocument("NotImplemented"));
+}
+
+// Counted as it arrives, so the rate isn't lumpy with whole parts
+static ssize_t receive(int socketFd, char* buffer, size_t size)
+{
+	ssize_t received = recv(socketFd, buffer, size, 0);
+	if (received > 0)
+	{
+		pthread_mutex_lock(&stateMutex);
+		bodyBytes += received;
+		pthread_mutex_unlock(&stateMutex);
+	}
+	return received;
+}
+
+static void* serveConnection(void* arg)
+{
+	int socketFd = (int)(intptr_t)arg;
+	string pending;
+	char buffer[64*1024];
+	bool open = true;
+	while (open)
+	{
+		size_t headEnd;
+		while ((headEnd = pending.find("\r\n\r\n")) == string::npos)
+		{
+			ssize_t received = receive(socketFd, buffer, sizeof(buffer));
+			if (received <= 0)
+			{
+				close(socketFd);
+				return NULL;
+			}
+			pending.append(buffer, received);
+		}
+
+		// Request line, then the headers this needs
+		string head = pending.substr(0, headEnd);
+		pending.erase(0, headEnd + 4);
+		string requestLine = head.substr(0, head.find("\r\n"));
+		size_t space1 = requestLine.find(' ');
+		size_t space2 = requestLine.find(' ', space1 + 1);
+		if (space1 == string::npos || space2 == string::npos)
+		{
+			break;
+		}
+		string method = requestLine.substr(0, space1);
+		string target = requestLine.substr(space1 + 1, space2 - space1 - 1);
+		size_t length = 0;
+		bool closeAfter = false;
+		for (size_t start = head.find("\r\n"); start != string::npos; start = head.find("\r\n", start + 2))
+		{
+			string line = head.substr(start + 2, head.find("\r\n", start + 2) - start - 2);
+			for (size_t i=0; i<line.size() && line[i] != ':'; i++)
+			{
+				line[i] = tolower(line[i]);
+			}
+			if (line.compare(0, 15, "content-length:") == 0)
+			{
+				length = strtoul(line.c_str() + 15, NULL, 10);
+			}else if (line.compare(0, 11, "connection:") == 0 && line.find("close") != string::npos)
+			{
+				closeAfter = true;
+			}
+		}
+
+		while (pending.size() < length)
+		{
+			ssize_t received = receive(socketFd, buffer, sizeof(buffer));
+			if (received <= 0)
+			{
+				close(socketFd);
+				return NULL;
+			}
+			pending.append(buffer, received);
+		}
+		string body = pending.substr(0, length);
+		pending.erase(0, length);
+		open = handle(socketFd, method, target, body) && !closeAfter;
+		fflush(stdout);
+	}
+	close(socketFd);
+	return NULL;
+}
+
+static void* reportRate(void* arg)
+{
+	unsigned long long lastMillis = nowMillis();
+	while (true)
+	{
+		sleep(5);
+		pthread_mutex_lock(&stateMutex);
+		uint64_t bytes = bodyBytes;
+		bodyBytes = 0;
+		pthread_mutex_unlock(&stateMutex);
+		unsigned long long now = nowMillis();
+		if (bytes)
+		{
+			printf("received %.1f KB/s over %.1fs\n", bytes / 1024.0 * 1000.0 / (now - lastMillis), (now - lastMillis) / 1000.0);
+			fflush(stdout);
+		}
+		lastMillis = now;
+	}
+	return NULL;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: %s port saveDirectory [failEvery]\n", argv[0]);
+		return 1;
+	}
+	saveDirectory = argv[2];
+	failEvery = argc > 3 ? atoi(argv[3]) : 0;
+	mkdir(saveDirectory.c_str(), 0755);
+
+	int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(atoi(argv[1]));
+	if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 16) != 0)
+	{
+		perror("listen");
+		return 1;
+	}
+	printf("uploadServer on port %s saving to %s%s\n", argv[1], argv[2], failEvery ? ", failing some parts" : "");
+	fflush(stdout);
+
+	pthread_t reporter;
+	pthread_create(&reporter, NULL, reportRate, NULL);
+	pthread_detach(reporter);
+
+	while (true)
+	{
+		int socketFd = accept(listenFd, NULL, NULL);
+		if (socketFd < 0)
+		{
+			if (errno == EINTR) continue;
+			perror("accept");
+			return 1;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, serveConnection, (void*)(intptr_t)socketFd) != 0)
+		{
+			close(socketFd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return 0;
+}